@@ -19,6 +19,7 @@
 #ifndef __CAPTURE_H
 #define __CAPTURE_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -26,7 +27,9 @@
  * Prototypes.
  */
 void init_capture(void);
-size_t get_packet(uint8_t *buff, size_t size);
+size_t get_packet(uint8_t *buff, size_t size, bool *inbound);
 void inject_packet(uint8_t *buff, size_t size);
+void inject_reply(uint8_t *buff, size_t size);
+void capture_dns_replies(bool enable);
 
 #endif      /* __CAPTURE_H */
@@ -39,6 +39,7 @@
 #define CKTP_MAX_RETRIES         5    /* Maximum request retries         */
 #define CKTP_REPLY_WAIT          2    /* Reply wait time factor          */
 #define CKTP_MAX_PACKET_SIZE     8192 /* Maximum allowed packet size     */
+#define CKTP_MIN_PACKET_SIZE     2    /* Smallest CKTP header (reflect)  */
 #define CKTP_MAX_REQUESTS        32   /* Maximum requests per message    */
 #define CKTP_NO_AUTH_ID          0    /* No authentication ID            */
 
@@ -54,6 +55,7 @@
 #define CKTP_TYPE_IPv4           4 /* Payload is an IPv4 packet              */
 #define CKTP_TYPE_MESSAGE        5 /* Payload is a CKTP protocol message     */
 #define CKTP_TYPE_IPv6           6 /* Payload is an IPv6 packet              */
+#define CKTP_TYPE_BUNDLE         7 /* Payload is several IP packets          */
 
 /*
  * MESSAGE enumerates the different message types.
@@ -71,6 +73,7 @@
 #define CKTP_FLAG_SUPPORTS_IPv4     0x00000001  /* IPv4 is supported. */
 #define CKTP_FLAG_SUPPORTS_IPv6     0x00000002  /* IPv6 is supported. */
 #define CKTP_FLAG_SUPPORTS_TUNNEL   0x00000004  /* Tunneling is supported. */
+#define CKTP_FLAG_SUPPORTS_BUNDLE   0x00000008  /* Bundles are supported. */
 
 /*
  * FILTERS for CKTP_MESSAGE_GET_FILTER
@@ -128,6 +131,25 @@ struct cktp_msg_hdr_req_s
 } __attribute__((__packed__));
 #define CKTP_SIZE(size)     ((size)-1)
 
+/*
+ *  0                   1                   2                   3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * | Type  | Rsvd  |     Size      |           Reserved            |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * Followed by Size+1 IP packets.  Each packet's length is given by its own
+ * IP header, and each packet is padded to a 32-bit boundary.
+ */
+struct cktp_bndl_hdr_s
+{
+    uint8_t  reserved1:4;   /* Reserved, must be 0                    */
+    uint8_t  type:4;        /* Type, must be CKTP_TYPE_BUNDLE         */
+    uint8_t  size;          /* Number of packets - 1                  */
+    uint16_t reserved2;     /* Reserved, must be 0                    */
+} __attribute__((__packed__));
+#define CKTP_BUNDLE_ALIGN(size)     (((size) + 3) & ~(size_t)3)
+
 /*
  *  0                   1                   2                   3
  *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
@@ -39,6 +39,16 @@
 
 #include "cktp_client.h"
 
+/*
+ * Small packets are coalesced into bundles (if the server supports them).
+ * A bundle is sent once it is full, or when it is flushed (see
+ * cktp_tunnel_flush()).  A bundle never exceeds IP_MSS bytes, so always
+ * fits within the tunnel MTU.
+ */
+#define CKTP_BUNDLE_SMALL       256         /* Max bundled packet size     */
+#define CKTP_BUNDLE_MAX_SIZE    IP_MSS      /* Max bundle size             */
+#define CKTP_BUNDLE_MAX_PACKETS 16          /* Max packets per bundle      */
+
 /*
  * Holds all relevant information regarding an open CKTP tunnel.
  */
@@ -46,7 +56,7 @@ struct cktp_tunnel_s
 {
     socket_t          socket;                          /* Tunnel's socket.    */
     int               transport;                       /* Transport protocol. */
-    struct cktp_enc_s encodings[CKTP_MAX_ENCODINGS+1]; /* Encodings.          */
+    struct cktp_enc_s *encodings;                      /* Encodings.          */
     uint8_t           open_encodings;                  /* Number of encodings.*/
     size_t            overhead;                        /* Encoding overhead.  */
     bool              error;                           /* In error state?     */
@@ -58,11 +68,14 @@ struct cktp_tunnel_s
     uint32_t          server_addr[4];                  /* Server's IP addr    */
     uint16_t          server_port;                     /* Server's port       */
     uint32_t          client_addr[4];                  /* Client's IP addr    */
-    char              server_name[CKTP_MAX_URL_LENGTH+1];
-                                                       /* Server's name.      */
-    char              server_url[CKTP_MAX_URL_LENGTH+1];
-                                                       /* Server's URL.       */
+    char             *server_name;                     /* Server's name.      */
+    char             *server_url;                      /* Server's URL.       */
+    size_t            alloc_size;                      /* Allocated size.     */
     random_state_t    rng;                             /* Random numbers      */
+    uint8_t          *bundle_buff;                     /* Bundle buffer.      */
+    uint8_t          *bundle;                          /* Pending bundle.     */
+    size_t            bundle_size;                     /* Bundle size.        */
+    unsigned          bundle_count;                    /* Bundle packets.     */
 };
 
 typedef bool (*cktp_reply_handler_t)(cktp_tunnel_t tunnel, uint8_t *packet,
@@ -93,6 +106,8 @@ static bool cktp_strip_transport_header(cktp_tunnel_t tunnel,
     uint8_t **packet, size_t *length);
 static bool cktp_send_packet(cktp_tunnel_t tunnel, uint8_t *packet,
     size_t length);
+static bool cktp_bundle_packet(cktp_tunnel_t tunnel, const uint8_t *packet,
+    size_t packet_size);
 static bool cktp_recv_packet(cktp_tunnel_t tunnel, uint8_t **packet,
     size_t *length);
 static void log_packet(const uint8_t *packet);
@@ -102,22 +117,48 @@ static void log_packet(const uint8_t *packet);
  */
 extern cktp_tunnel_t cktp_open_tunnel(const char *url)
 {
-    cktp_tunnel_t tunnel = (cktp_tunnel_t)malloc(sizeof(struct cktp_tunnel_s));
+    // Parse the URL.
+    int transport;
+    uint16_t server_port;
+    char server_name[CKTP_MAX_URL_LENGTH+1];
+    struct cktp_enc_s encodings[CKTP_MAX_ENCODINGS+1];
+    memset(encodings, 0x0, sizeof(encodings));
+    if (!cktp_parse_url(url, &transport, server_name, &server_port,
+            encodings))
+    {
+        return (cktp_tunnel_t)NULL;
+    }
+
+    // The encodings and names are stored (right-sized) after the tunnel
+    // structure itself, so each tunnel is a single allocation.
+    size_t num_encodings = 0;
+    while (encodings[num_encodings].info != NULL)
+    {
+        num_encodings++;
+    }
+    size_t encodings_size = (num_encodings+1) * sizeof(struct cktp_enc_s);
+    size_t server_name_len = strlen(server_name);
+    size_t server_url_len = strnlen(url, CKTP_MAX_URL_LENGTH);
+    size_t alloc_size = sizeof(struct cktp_tunnel_s) + encodings_size +
+        server_name_len + 1 + server_url_len + 1;
+    cktp_tunnel_t tunnel = (cktp_tunnel_t)malloc(alloc_size);
     if (tunnel == NULL)
     {
         error("unable to allocate " SIZE_T_FMT " bytes for tunnel",
-            sizeof(struct cktp_tunnel_s));
+            alloc_size);
     }
     memset(tunnel, 0x0, sizeof(struct cktp_tunnel_s));
-    tunnel->socket = INVALID_SOCKET;
-    
-    // Parse the URL.
-    strncpy(tunnel->server_url, url, CKTP_MAX_URL_LENGTH);
-    if (!cktp_parse_url(tunnel->server_url, &tunnel->transport,
-        tunnel->server_name, &tunnel->server_port, tunnel->encodings))
-    {
-        goto open_tunnel_error;
-    }
+    tunnel->socket      = INVALID_SOCKET;
+    tunnel->transport   = transport;
+    tunnel->server_port = server_port;
+    tunnel->alloc_size  = alloc_size;
+    tunnel->encodings   = (struct cktp_enc_s *)(tunnel + 1);
+    memmove(tunnel->encodings, encodings, encodings_size);
+    tunnel->server_name = (char *)(tunnel->encodings + num_encodings + 1);
+    memmove(tunnel->server_name, server_name, server_name_len + 1);
+    tunnel->server_url  = tunnel->server_name + server_name_len + 1;
+    memmove(tunnel->server_url, url, server_url_len);
+    tunnel->server_url[server_url_len] = '\0';
 
     // Lookup the server, and copy the address to 'tunnel'.
     trace("looking up IP address of host %s for tunnel %s",
@@ -162,6 +203,16 @@ extern cktp_tunnel_t cktp_open_tunnel(const char *url)
                     tunnel->server_url);
                 goto open_tunnel_error;
             }
+#ifdef LINUX
+            if (tunnel->addrtype == AF_INET &&
+                !cktp_attach_filter(tunnel->socket, CKTP_PROTO_IP,
+                    cktp_encoding_min_size(tunnel->encodings, num_encodings),
+                    0, 0))
+            {
+                warning("unable to attach socket filter for tunnel %s",
+                    tunnel->server_url);
+            }
+#endif      /* LINUX */
             break;
         }
         case CKTP_PROTO_UDP:
@@ -205,6 +256,17 @@ extern cktp_tunnel_t cktp_open_tunnel(const char *url)
                     tunnel->server_url);
                 goto open_tunnel_error;
             }
+#ifdef LINUX
+            if (tunnel->addrtype == AF_INET &&
+                !cktp_attach_filter(tunnel->socket, CKTP_PROTO_PING,
+                    sizeof(struct icmphdr) + cktp_encoding_min_size(
+                        tunnel->encodings, num_encodings),
+                    ICMP_ECHOREPLY, tunnel->server_port))
+            {
+                warning("unable to attach socket filter for tunnel %s",
+                    tunnel->server_url);
+            }
+#endif      /* LINUX */
 
             tunnel->overhead += sizeof(struct icmphdr);
             break;
@@ -427,15 +489,31 @@ static bool cktp_connect(cktp_tunnel_t tunnel)
         return false;
     }
 
+    // Bundle small packets if the server supports it:
+    if (tunnel->flags & CKTP_FLAG_SUPPORTS_BUNDLE)
+    {
+        size_t bundle_buff_size = CKTP_ENCODING_BUFF_SIZE(
+            CKTP_BUNDLE_MAX_SIZE, tunnel->overhead);
+        tunnel->bundle_buff = (uint8_t *)malloc(bundle_buff_size);
+        if (tunnel->bundle_buff == NULL)
+        {
+            error("unable to allocate " SIZE_T_FMT " bytes for tunnel "
+                "bundle buffer", bundle_buff_size);
+        }
+        tunnel->bundle = CKTP_ENCODING_BUFF_INIT(tunnel->bundle_buff,
+            tunnel->overhead);
+    }
+
     return true;
 }
 
 /*
- * Tests whether we need to reconnect to the server.
+ * Gets the time (in microseconds, see gettime()) at which we need to
+ * reconnect to the server, or UINT64_MAX if never.
  */
-bool cktp_tunnel_timeout(cktp_tunnel_t tunnel, uint64_t currtime)
+uint64_t cktp_tunnel_deadline(cktp_tunnel_t tunnel)
 {
-    currtime /= MILLISECONDS;
+    uint64_t deadline = UINT64_MAX;     // ms
     for (size_t i = 0; tunnel->encodings[i].info != NULL; i++)
     {
         cktp_enc_info_t enc_info = tunnel->encodings[i].info;
@@ -443,13 +521,10 @@ bool cktp_tunnel_timeout(cktp_tunnel_t tunnel, uint64_t currtime)
         {
             cktp_enc_state_t state = tunnel->encodings[i].state;
             uint64_t timeout = enc_info->timeout(state);
-            if (timeout < currtime)
-            {
-                return true;
-            }
+            deadline = (timeout < deadline? timeout: deadline);
         }
     }
-    return false;
+    return (deadline == UINT64_MAX? UINT64_MAX: deadline * MILLISECONDS);
 }
 
 /*
@@ -914,16 +989,6 @@ packet_too_big_error:
             panic("IPv6 not implemented yet");
     }
 
-    // Encode the packet:
-    if (!cktp_encode_packet(tunnel, &buff, &buff_size))
-    {
-        return;
-    }
-    if (buff_size > CKTP_MAX_PACKET_SIZE)
-    {
-        goto packet_too_big_error;
-    }
-
     // Track some stats:
     {
         static size_t total_packets = 0;
@@ -941,6 +1006,95 @@ packet_too_big_error:
         }
     }
 
+    // Bundle the packet (if small), otherwise send any pending bundle
+    // first to preserve the packet order:
+    if (tunnel->bundle != NULL)
+    {
+        if (cktp_bundle_packet(tunnel, buff, buff_size))
+        {
+            return;
+        }
+        cktp_tunnel_flush(tunnel);
+    }
+
+    // Encode the packet:
+    if (!cktp_encode_packet(tunnel, &buff, &buff_size))
+    {
+        return;
+    }
+    if (buff_size > CKTP_MAX_PACKET_SIZE)
+    {
+        goto packet_too_big_error;
+    }
+
+    cktp_send_packet(tunnel, buff, buff_size);
+}
+
+/*
+ * Add a (NAT adjusted) packet to the tunnel's pending bundle.  Returns
+ * false if the packet is too big to be bundled.
+ */
+static bool cktp_bundle_packet(cktp_tunnel_t tunnel, const uint8_t *packet,
+    size_t packet_size)
+{
+    if (packet_size > CKTP_BUNDLE_SMALL)
+    {
+        return false;
+    }
+    size_t padded_size = CKTP_BUNDLE_ALIGN(packet_size);
+    if (tunnel->bundle_size + padded_size > CKTP_BUNDLE_MAX_SIZE)
+    {
+        cktp_tunnel_flush(tunnel);
+    }
+    if (tunnel->bundle_count == 0)
+    {
+        struct cktp_bndl_hdr_s *header =
+            (struct cktp_bndl_hdr_s *)tunnel->bundle;
+        memset(header, 0x0, sizeof(struct cktp_bndl_hdr_s));
+        header->type = CKTP_TYPE_BUNDLE;
+        tunnel->bundle_size = sizeof(struct cktp_bndl_hdr_s);
+    }
+    uint8_t *ptr = tunnel->bundle + tunnel->bundle_size;
+    memmove(ptr, packet, packet_size);
+    memset(ptr + packet_size, 0x0, padded_size - packet_size);
+    tunnel->bundle_size += padded_size;
+    tunnel->bundle_count++;
+    if (tunnel->bundle_count >= CKTP_BUNDLE_MAX_PACKETS)
+    {
+        cktp_tunnel_flush(tunnel);
+    }
+    return true;
+}
+
+/*
+ * Send the tunnel's pending bundle (if any).  A bundle of one packet is sent
+ * as a plain packet.
+ */
+extern void cktp_tunnel_flush(cktp_tunnel_t tunnel)
+{
+    if (tunnel == NULL || tunnel->bundle_count == 0)
+    {
+        return;
+    }
+    uint8_t *buff = tunnel->bundle;
+    size_t buff_size = tunnel->bundle_size;
+    if (tunnel->bundle_count == 1)
+    {
+        buff += sizeof(struct cktp_bndl_hdr_s);
+        buff_size = ntohs(((struct iphdr *)buff)->tot_len);
+    }
+    else
+    {
+        struct cktp_bndl_hdr_s *header = (struct cktp_bndl_hdr_s *)buff;
+        header->size = CKTP_SIZE(tunnel->bundle_count);
+    }
+    tunnel->bundle_size  = 0;
+    tunnel->bundle_count = 0;
+
+    if (!cktp_encode_packet(tunnel, &buff, &buff_size))
+    {
+        return;
+    }
     cktp_send_packet(tunnel, buff, buff_size);
 }
 
@@ -1253,6 +1407,7 @@ extern void cktp_close_tunnel(cktp_tunnel_t tunnel)
     {
         return;
     }
+    cktp_tunnel_flush(tunnel);
     if (tunnel->socket != INVALID_SOCKET && close_socket(tunnel->socket) != 0)
     {
         warning("unable to close socket to tunnel %s", tunnel->server_url);
@@ -1261,6 +1416,7 @@ extern void cktp_close_tunnel(cktp_tunnel_t tunnel)
     {
         random_free(tunnel->rng);
     }
+    free(tunnel->bundle_buff);
     for (size_t i = 0; i < tunnel->open_encodings; i++)
     {
         cktp_enc_info_t info = tunnel->encodings[i].info;
@@ -1273,3 +1429,22 @@ extern void cktp_close_tunnel(cktp_tunnel_t tunnel)
     free(tunnel);
 }
 
+/*
+ * Return the number of bytes allocated for a tunnel (excluding the encodings'
+ * own state).
+ */
+extern size_t cktp_tunnel_memory(cktp_tunnel_t tunnel)
+{
+    if (tunnel == NULL)
+    {
+        return 0;
+    }
+    size_t size = tunnel->alloc_size;
+    if (tunnel->bundle_buff != NULL)
+    {
+        size += CKTP_ENCODING_BUFF_SIZE(CKTP_BUNDLE_MAX_SIZE,
+            tunnel->overhead);
+    }
+    return size;
+}
+
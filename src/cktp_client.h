@@ -33,9 +33,11 @@ typedef struct cktp_tunnel_s *cktp_tunnel_t;
  */
 cktp_tunnel_t cktp_open_tunnel(const char *url);
 void cktp_close_tunnel(cktp_tunnel_t tunnel);
+size_t cktp_tunnel_memory(cktp_tunnel_t tunnel);
 uint16_t cktp_tunnel_get_mtu(cktp_tunnel_t tunnel, uint16_t mtu);
-bool cktp_tunnel_timeout(cktp_tunnel_t tunnel, uint64_t currtime);
+uint64_t cktp_tunnel_deadline(cktp_tunnel_t tunnel);
 void cktp_tunnel_packet(cktp_tunnel_t tunnel, const uint8_t *packet);
+void cktp_tunnel_flush(cktp_tunnel_t tunnel);
 void cktp_fragmentation_required(cktp_tunnel_t tunnel, uint16_t mtu,
     const uint8_t *packet);
 
@@ -18,6 +18,11 @@
 
 #include "cktp.h"
 #include "cktp_common.h"
+#include "cktp_url.h"
+
+#ifdef LINUX
+#include <linux/filter.h>
+#endif      /* LINUX */
 
 /*
  * Table for CRC16 0x1021
@@ -91,3 +96,59 @@ const char *cktp_error_to_string(uint8_t err)
     }
 }
 
+
+/*
+ * Attach a classic BPF socket filter to an IPv4 RAW tunnel socket, so that
+ * the kernel drops packets that cannot belong to the tunnel before they are
+ * copied to user space: packets with less than min_size bytes after the IP
+ * header, and (for CKTP_PROTO_PING) ICMP messages other than echo_type with
+ * echo id echo_id (network byte order).  Returns false if no filter was
+ * attached; the packets are then only checked in user space.
+ */
+bool cktp_attach_filter(int s, uint8_t transport, size_t min_size,
+    uint8_t echo_type, uint16_t echo_id)
+{
+#ifdef LINUX
+    // Raw socket filters see the packet from the IP header.
+    struct sock_filter ip_code[] =
+    {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),     // X = IP header size
+        BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_X, 0),     // A = payload size
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_size, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    struct sock_filter ping_code[] =
+    {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),     // X = IP header size
+        BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_X, 0),     // A = ICMP size
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, min_size, 0, 5),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 0),      // A = ICMP type, code
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)echo_type << 8, 0, 3),
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),      // A = ICMP echo id
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohs(echo_id), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    struct sock_fprog prog;
+    switch (transport)
+    {
+        case CKTP_PROTO_IP:
+            prog.len    = sizeof(ip_code) / sizeof(struct sock_filter);
+            prog.filter = ip_code;
+            break;
+        case CKTP_PROTO_PING:
+            prog.len    = sizeof(ping_code) / sizeof(struct sock_filter);
+            prog.filter = ping_code;
+            break;
+        default:
+            return false;
+    }
+    return (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+        sizeof(prog)) == 0);
+#else       /* LINUX */
+    return false;
+#endif      /* LINUX */
+}
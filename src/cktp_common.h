@@ -19,6 +19,8 @@
 #ifndef __CKTP_COMMON_H
 #define __CKTP_COMMON_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /*
@@ -26,6 +28,8 @@
  */
 uint16_t cktp_calculate_checksum(uint8_t *data, uint16_t length);
 const char *cktp_error_to_string(uint8_t err);
+bool cktp_attach_filter(int s, uint8_t transport, size_t min_size,
+    uint8_t echo_type, uint16_t echo_id);
 
 #define cktp_checksum(message, length)                                        \
     cktp_calculate_checksum((uint8_t *)(&((message)->checksum) + 1),          \
@@ -236,3 +236,21 @@ static void enc_sleeptime(uint64_t ms)
     sleeptime(ms * MILLISECONDS);
 }
 
+/*
+ * The minimum size of a received packet, i.e. the smallest CKTP header
+ * (or handshake message) after all encodings are applied (innermost first).
+ */
+size_t cktp_encoding_min_size(const struct cktp_enc_s *encodings,
+    size_t num_encodings)
+{
+    size_t size = CKTP_MIN_PACKET_SIZE;
+    for (size_t i = num_encodings; i-- > 0; )
+    {
+        cktp_enc_info_t info = encodings[i].info;
+        if (info->min_size != NULL)
+        {
+            size = info->min_size(encodings[i].state, size);
+        }
+    }
+    return size;
+}
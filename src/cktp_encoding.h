@@ -93,6 +93,31 @@ typedef struct cktp_enc_lib_s *cktp_enc_lib_t;
 
 extern struct cktp_enc_lib_s encoding_lib;
 
+/*
+ * Server decode result: the packet is an expensive handshake request that
+ * should be retried off the fast path.  The packet is left unmodified.
+ */
+#define CKTP_ENCODING_DEFER             1
+
+/*
+ * Handshake deferral modes (see encoding_defer_t).
+ */
+#define CKTP_DEFER_NONE                 0   // Service handshakes inline
+#define CKTP_DEFER_QUEUE                1   // Defer expensive handshakes
+#define CKTP_DEFER_WORKER               2   // Service deferred handshakes
+
+/*
+ * Server overload shedding levels.  New-session handshakes are shed in the
+ * order they arrive in a handshake, so clients that are further along (and
+ * have already cost the server more) are served longest.  Established
+ * session data is never shed.
+ */
+#define CKTP_SHED_NONE                  0   // Serve everything
+#define CKTP_SHED_COOKIE                1   // Shed cookie requests
+#define CKTP_SHED_CERTIFICATE           2   // ... and certificate requests
+#define CKTP_SHED_KEY                   3   // ... and key requests
+#define CKTP_SHED_MAX                   CKTP_SHED_KEY
+
 /*
  * Encoding protocol's state.
  */
@@ -108,6 +133,7 @@ typedef int (*encoding_clone_t)(cktp_enc_state_t state,
     cktp_enc_state_t *stateptr);
 typedef void (*encoding_free_t)(cktp_enc_state_t state);
 typedef size_t (*encoding_overhead_t)(cktp_enc_state_t state);
+typedef size_t (*encoding_min_size_t)(cktp_enc_state_t state, size_t size);
 typedef uint64_t (*encoding_timeout_t)(cktp_enc_state_t state);
 typedef int (*encoding_handshake_request_t)(cktp_enc_state_t state,
     uint8_t *data, size_t *size);
@@ -120,6 +146,18 @@ typedef int (*encoding_decode_t)(cktp_enc_state_t state, uint8_t **dataptr,
 typedef int (*encoding_server_decode_t)(cktp_enc_state_t state,
     uint32_t *source_addr, size_t source_size, uint8_t **dataptr,
     size_t *sizeptr, uint8_t **replyptr, size_t *replysizeptr);
+typedef void (*encoding_defer_t)(cktp_enc_state_t state, unsigned mode);
+typedef void (*encoding_quota_t)(cktp_enc_state_t state, unsigned cookie_rate,
+    unsigned key_rate);
+typedef bool (*encoding_keypool_t)(cktp_enc_state_t state, unsigned depth,
+    unsigned rate);
+typedef bool (*encoding_cluster_t)(cktp_enc_state_t state,
+    const uint8_t *secret, size_t secret_size);
+typedef void (*encoding_shed_t)(cktp_enc_state_t state, unsigned level);
+typedef size_t (*encoding_save_t)(cktp_enc_state_t state, uint8_t *data,
+    size_t size);
+typedef bool (*encoding_restore_t)(cktp_enc_state_t state,
+    const uint8_t *data, size_t size);
 typedef const char *(*encoding_error_string_t)(cktp_enc_state_t state,
     int err);
 
@@ -132,6 +170,7 @@ struct cktp_enc_info_s
     encoding_init_t init;
     encoding_free_t free;
     encoding_overhead_t overhead;
+    encoding_min_size_t min_size;       // NULL = size is unchanged
     encoding_error_string_t error_string;
 
 #ifdef CLIENT
@@ -147,6 +186,13 @@ struct cktp_enc_info_s
     encoding_clone_t clone;
     encoding_encode_t encode;
     encoding_server_decode_t decode;
+    encoding_defer_t defer;
+    encoding_quota_t quota;
+    encoding_keypool_t keypool;
+    encoding_cluster_t cluster;
+    encoding_shed_t shed;
+    encoding_save_t save;
+    encoding_restore_t restore;
 #endif      /* SERVER */
 };
 typedef struct cktp_enc_info_s *cktp_enc_info_t;
@@ -169,5 +215,7 @@ struct cktp_enc_s
 bool cktp_encoding_verify(cktp_enc_info_t info, size_t overhead,
     const uint8_t *oldptr, const uint8_t *newptr, size_t oldsize,
     size_t newsize);
+size_t cktp_encoding_min_size(const struct cktp_enc_s *encodings,
+    size_t num_encodings);
 
 #endif      /* __ENCODING_H */
@@ -16,8 +16,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE             // For recvmmsg(), sendmmsg() and CPU sets
+
 #include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +34,10 @@
 #include <netinet/ip_icmp.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "checksum.h"
@@ -35,26 +46,139 @@
 #include "cktp_encoding.h"
 #include "cktp_server.h"
 #include "cktp_url.h"
+#include "stats.h"
 #include "cookie.h"
+#include "misc.h"
+#include "policy.h"
 #include "thread.h"
+#include "txring.h"
+#include "uring.h"
+
+#define CKTP_LISTEN_THREADS_MAX     64
+#define CKTP_LISTEN_BATCH_MAX       32
+#define CKTP_URING_BUFFERS          256             // Power of 2
+#define CKTP_URING_ENTRIES          (2*CKTP_URING_BUFFERS)
+#define CKTP_URING_GROUP            0
+#define CKTP_URING_RECV             UINT64_MAX      // user_data for recvs
+#define CKTP_URING_MAX_ERRORS       16              // Before giving up
+#define CKTP_HANDSHAKE_THREADS_MAX  16
+#define CKTP_HANDSHAKE_QUEUE_MAX    65536
+#define CKTP_GROUP_MAX              256             // Tunnels per group
+#define CKTP_GROUP_EVENTS           64              // epoll events per wait
+#define CKTP_HANDOVER_MAGIC         0x52454C44      // "RELD"
+#define CKTP_HANDOVER_STATE_MAX     4096
+#define CKTP_HANDOVER_READY         'R'
+
+/*
+ * Group threads wait on the same sockets (unless SO_REUSEPORT gives each
+ * thread its own), so only wake one thread per event.
+ */
+#ifdef EPOLLEXCLUSIVE
+#define CKTP_GROUP_EPOLL_EVENTS     (EPOLLIN | EPOLLEXCLUSIVE)
+#else
+#define CKTP_GROUP_EPOLL_EVENTS     EPOLLIN
+#endif
+
+/*
+ * Overload controller.  Backlog is the fullest listen socket receive buffer
+ * (per mille of its size); lag is the age of the oldest queued handshake.
+ * The shedding level rises by one every tick the server is overloaded, and
+ * falls by one after CKTP_OVERLOAD_CALM quiet ticks.
+ */
+#define CKTP_OVERLOAD_TICK          (50*MILLISECONDS)
+#define CKTP_OVERLOAD_BACKLOG_HIGH  500
+#define CKTP_OVERLOAD_BACKLOG_LOW   125
+#define CKTP_OVERLOAD_LAG_HIGH      (100*MILLISECONDS)
+#define CKTP_OVERLOAD_LAG_LOW       (25*MILLISECONDS)
+#define CKTP_OVERLOAD_CALM          20
 
-#define CKTP_LISTEN_THREADS_MAX     4
+/*
+ * Actions for a received packet.
+ */
+#define CKTP_ACTION_DROP            0   // Nothing to send
+#define CKTP_ACTION_REPLY           1   // Send a reply to the client
+#define CKTP_ACTION_FORWARD         2   // Forward a packet via socket_out
+#define CKTP_ACTION_BUNDLE          3   // Forward each packet of a bundle
+
+/*
+ * cktp_decode_packet() result for a packet deferred by an encoding.
+ */
+#define CKTP_DECODE_DEFER           (-2)
 
 /*
  * Prototypes.
  */
+struct cktp_listen_s;
+typedef struct cktp_handshake_pool_s *cktp_handshake_pool_t;
+static cktp_tunnel_t cktp_tunnel_open(const char *url, int s);
+static int cktp_open_socket(cktp_tunnel_t tunnel, bool reuseport);
+static int cktp_open_raw_socket(void);
+static void cktp_attach_cpu_steering(cktp_tunnel_t tunnel, int s,
+    unsigned cpu, unsigned threads);
+static cktp_listener_t cktp_listener_open(cktp_tunnel_t tunnel,
+    const struct cktp_listen_config_s *config, cktp_group_t group,
+    unsigned idx);
+static void cktp_listener_free(cktp_listener_t listener, bool shared);
 static cktp_tunnel_t cktp_clone_tunnel(cktp_tunnel_t tunnel);
+static int cktp_handover_open(const char *path);
+static void *cktp_handover_server(void *ptr);
+static bool cktp_handover(cktp_group_t group, int conn);
+static size_t cktp_save_state(cktp_tunnel_t tunnel, uint8_t *state,
+    size_t state_size);
+static void cktp_restore_state(cktp_tunnel_t tunnel, const uint8_t *state,
+    size_t state_size);
 static bool cktp_encode_packet(cktp_tunnel_t tunnel, uint8_t **buffptr,
     size_t *sizeptr, unsigned idx);
 static int cktp_decode_packet(cktp_tunnel_t tunnel, uint32_t source_addr,
-    uint8_t **buffptr, size_t *sizeptr, uint8_t **reply, size_t *replysizeptr);
+    unsigned *layerptr, uint8_t **buffptr, size_t *sizeptr, uint8_t **reply,
+    size_t *replysizeptr);
+static cktp_handshake_pool_t cktp_handshake_pool_open(
+    cktp_tunnel_t *tunnels, unsigned num_tunnels,
+    const struct cktp_listen_config_s *config);
+static void cktp_handshake_pool_start(cktp_handshake_pool_t pool);
+static void cktp_handshake_pool_free(cktp_handshake_pool_t pool);
+static void cktp_handshake_submit(cktp_handshake_pool_t pool, unsigned idx,
+    const uint8_t *payload, size_t payload_size, unsigned layer, int64_t info,
+    const struct sockaddr_in *from_addr);
+static void *cktp_handshake_worker(void *ptr);
+static void cktp_group_start(cktp_group_t group);
+static void cktp_group_free(cktp_group_t group);
+static void *cktp_group_loop(void *ptr);
+static void *cktp_overload_controller(void *ptr);
+static unsigned cktp_overload_tick(cktp_listener_t listener);
+static void cktp_overload_shed(cktp_tunnel_t tunnel, unsigned level);
+static void cktp_listen_pin(struct cktp_listen_s *params);
+static size_t cktp_listen_packet_size(cktp_tunnel_t tunnel);
 static void *cktp_listen_loop(void *ptr);
+static void *cktp_listen_loop_uring(void *ptr);
+static struct cktp_batch_s *cktp_batch_open(size_t packet_size,
+    size_t reply_buff_size);
+static void cktp_listen_batch(struct cktp_listen_s *params,
+    struct cktp_batch_s *batch, int flags);
+static bool cktp_uring_recv(uring_t ring, cktp_tunnel_t tunnel,
+    struct msghdr *msg);
+static int cktp_handle_packet(cktp_tunnel_t tunnel, int socket_icmp,
+    cktp_handshake_pool_t handshakes, uint8_t *packet, size_t packet_size,
+    struct sockaddr_in *from_addr, uint8_t *reply, uint8_t **outptr,
+    size_t *outsizeptr, uint32_t *daddrptr);
+static int cktp_handle_payload(cktp_tunnel_t tunnel, int socket_icmp,
+    cktp_handshake_pool_t handshakes, unsigned layer, int64_t info,
+    uint8_t *payload, size_t payload_size, struct sockaddr_in *from_addr,
+    uint8_t *reply, uint8_t **outptr, size_t *outsizeptr, uint32_t *daddrptr);
+static bool cktp_bundle_next(cktp_tunnel_t tunnel, uint32_t source_addr,
+    uint8_t **bundleptr, size_t *bundlesizeptr, uint8_t **outptr,
+    size_t *outsizeptr, uint32_t *daddrptr);
+static void cktp_batch_add(struct mmsghdr *msgs, struct iovec *iovs,
+    unsigned idx, uint8_t *data, size_t size, struct sockaddr_in *addr);
+static void cktp_batch_forward(struct cktp_listen_s *params,
+    struct cktp_batch_s *batch, uint8_t *data, size_t size, uint32_t daddr);
+static void cktp_batch_flush(int socket, struct mmsghdr *msgs, unsigned num);
 static int64_t cktp_strip_transport_header(cktp_tunnel_t tunnel,
     uint8_t **payload, size_t *payload_size);
 static void cktp_add_transport_header(cktp_tunnel_t tunnel, uint8_t **payload,
     size_t *payload_size, int64_t info);
-static bool cktp_is_valid_packet(struct iphdr *payload, size_t payload_size,
-    uint32_t source_addr);
+static bool cktp_is_valid_packet(policy_t policy, struct iphdr *payload,
+    size_t payload_size, uint32_t source_addr);
 static bool cktp_request(cktp_tunnel_t tunnel,
     const struct cktp_msg_hdr_req_s *request, size_t request_size,
     uint32_t source_addr, uint8_t *reply, size_t *reply_size);
@@ -74,6 +198,11 @@ struct cktp_tunnel_s
     uint8_t open_encodings;                             // #Encodings.
     size_t overhead;                                    // Enc. Overhead.
     struct cookie_gen_s cookie_gen;                     // Cookie generator.
+    policy_t policy;                                    // Egress policy.
+    unsigned idx;                                       // Index in group.
+    int *sockets;                                       // Taken over sockets.
+    unsigned num_sockets;                               // #Sockets.
+    int takeover;                                       // Takeover conn.
     char url[CKTP_MAX_URL_LENGTH+1];                    // URL.
 };
 
@@ -82,15 +211,168 @@ struct cktp_tunnel_s
  */
 struct cktp_listen_s
 {
-    cktp_tunnel_t tunnel;
-    int socket_out;
-    int socket_icmp;
+    cktp_tunnel_t tunnel;                               // Tunnel (clone).
+    int socket_out;                                     // Forwarding socket.
+    txring_t txring;                                    // TX ring (or NULL).
+    int socket_icmp;                                    // Reflect socket.
+    cktp_handshake_pool_t handshakes;                   // Handshake pool.
+    int cpu;                                            // CPU or NO_CPU.
+    unsigned engine;                                    // I/O engine.
+};
+
+/*
+ * An in-flight io_uring send.
+ */
+struct cktp_uring_send_s
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_in addr;
+};
+
+/*
+ * A handshake packet deferred to the handshake workers.  The payload is
+ * partially decoded (up to the deferring encoding layer).
+ */
+struct cktp_handshake_s
+{
+    uint8_t *buff;                                      // Payload buffer.
+    size_t size;                                        // Payload size.
+    unsigned layer;                                     // Encoding layer.
+    int64_t info;                                       // Transport info.
+    struct sockaddr_in from_addr;                       // Source address.
+    uint64_t time;                                      // Time queued (us).
+    unsigned idx;                                       // Tunnel index.
+};
+
+/*
+ * A handshake worker thread.
+ */
+struct cktp_handshake_worker_s
+{
+    cktp_handshake_pool_t pool;                         // Pool.
+    cktp_tunnel_t *tunnels;                             // Tunnels (clones).
+};
+
+/*
+ * A pool of handshake worker threads with a bounded queue.  Expensive
+ * handshake packets are handled here so that they never stall the listen
+ * threads.  If the queue is full, new handshake packets are dropped (the
+ * client will retry).  The pool may serve several tunnels (a group).
+ */
+struct cktp_handshake_pool_s
+{
+    mutex_t lock;                                       // Queue lock.
+    cond_t cond;                                        // Queue not empty.
+    struct cktp_handshake_s *queue;                     // Queue (ring).
+    unsigned depth;                                     // Queue size.
+    unsigned head;                                      // Queue head.
+    unsigned count;                                     // #Queued.
+    uint64_t queued;                                    // Total queued.
+    uint64_t dropped;                                   // Total dropped.
+    cktp_tunnel_t *tunnels;                             // Tunnels.
+    unsigned num_tunnels;                               // #Tunnels.
+    size_t overhead;                                    // Max. overhead.
+    unsigned threads;                                   // #Workers.
+    struct cktp_handshake_worker_s workers[];           // Workers.
+};
+
+/*
+ * Overload controller state.
+ */
+struct cktp_overload_s
+{
+    unsigned level;                                     // CKTP_SHED_*.
+    unsigned calm;                                      // #Quiet ticks.
+    uint64_t drops;                                     // Socket drops.
+};
+
+/*
+ * All listen threads for a tunnel.
+ */
+struct cktp_listener_s
+{
+    cktp_tunnel_t tunnel;                               // Tunnel.
+    cktp_handshake_pool_t handshakes;                   // Handshake pool.
+    struct cktp_overload_s overload;                    // Overload state.
+    int handover;                                       // Handover socket.
+    unsigned threads;                                   // #Threads.
+    struct cktp_listen_s params[];                      // Per-thread params.
+};
+
+/*
+ * Tunnels sharing the listen threads, handshake pool and overload
+ * controller.  Listen thread i serves every tunnel with params[i] of the
+ * tunnel's listener.  A single listener is run as a group of one.
+ */
+struct cktp_group_s
+{
+    cktp_handshake_pool_t handshakes;                   // Handshake pool.
+    unsigned threads;                                   // #Threads.
+    unsigned num_listeners;                             // #Tunnels.
+    cktp_listener_t listeners[];                        // Per-tunnel.
+};
+
+/*
+ * A listen thread of a group.
+ */
+struct cktp_group_thread_s
+{
+    cktp_group_t group;                                 // Group.
+    unsigned idx;                                       // Thread index.
+};
+
+/*
+ * Handover message (one per tunnel) sent to a reloaded server.  The tunnel's
+ * per-thread listen sockets are passed with SCM_RIGHTS.  The state holds the
+ * saved state of each encoding, each prefixed by its (uint32_t) size.
+ */
+struct cktp_handover_msg_s
+{
+    uint32_t magic;                                     // HANDOVER_MAGIC.
+    uint32_t idx;                                       // Tunnel index.
+    uint32_t num_tunnels;                               // #Tunnels.
+    uint32_t num_sockets;                               // #Sockets.
+    uint32_t state_size;                                // State size.
+    struct cookie_gen_s cookie_gen;                     // Cookie generator.
+    char url[CKTP_MAX_URL_LENGTH+1];                    // URL.
+    uint8_t state[CKTP_HANDOVER_STATE_MAX];             // Encoding states.
+};
+#define CKTP_HANDOVER_HDR_SIZE      offsetof(struct cktp_handover_msg_s, state)
+
+/*
+ * Batched I/O state for a listen thread.
+ */
+struct cktp_batch_s
+{
+    uint8_t *packets;                                   // Receive buffers
+    size_t packet_size;
+    uint8_t *reply_buffs;                               // Reply buffers
+    size_t reply_buff_size;
+    struct mmsghdr recv_msgs[CKTP_LISTEN_BATCH_MAX];    // Received packets
+    struct iovec recv_iovs[CKTP_LISTEN_BATCH_MAX];
+    struct sockaddr_in from_addrs[CKTP_LISTEN_BATCH_MAX];
+    struct mmsghdr reply_msgs[CKTP_LISTEN_BATCH_MAX];   // Queued replies
+    struct iovec reply_iovs[CKTP_LISTEN_BATCH_MAX];
+    unsigned num_replies;
+    struct mmsghdr forward_msgs[CKTP_LISTEN_BATCH_MAX]; // Queued forwards
+    struct iovec forward_iovs[CKTP_LISTEN_BATCH_MAX];
+    struct sockaddr_in to_addrs[CKTP_LISTEN_BATCH_MAX];
+    unsigned num_forwards;
 };
 
 /*
  * Opens a CKTP tunnel end-point.
  */
 extern cktp_tunnel_t cktp_open_tunnel(const char *url)
+{
+    return cktp_tunnel_open(url, -1);
+}
+
+/*
+ * Open a tunnel using the given socket (or a new socket if s < 0).
+ */
+static cktp_tunnel_t cktp_tunnel_open(const char *url, int s)
 {
     if (strlen(url) >= CKTP_MAX_URL_LENGTH)
     {
@@ -108,6 +390,7 @@ extern cktp_tunnel_t cktp_open_tunnel(const char *url)
     }
     memset(tunnel, 0x0, sizeof(struct cktp_tunnel_s));
     tunnel->socket = -1;
+    tunnel->takeover = -1;
 
     // Parse the URL:
     strcpy(tunnel->url, url);
@@ -131,69 +414,117 @@ extern cktp_tunnel_t cktp_open_tunnel(const char *url)
         tunnel->overhead += overhead;
     }
 
-    // Open a socket for the server:
+    // Open a socket for the server (unless it was taken over):
+    tunnel->socket = (s >= 0? s: cktp_open_socket(tunnel, false));
+    if (tunnel->socket < 0)
+    {
+        goto open_tunnel_error;
+    }
+    if (tunnel->transport == CKTP_PROTO_PING)
+    {
+        tunnel->overhead += sizeof(struct icmphdr);
+    }
+
+    // Initialise cookie generation:
+    cookie_gen_init(&tunnel->cookie_gen);
+
+    return tunnel;
+
+open_tunnel_error:
+
+    cktp_close_tunnel(tunnel);
+    return (cktp_tunnel_t)NULL;
+}
+
+/*
+ * Open and bind a socket for the given tunnel.  Returns the socket, or -1 on
+ * error.
+ */
+static int cktp_open_socket(cktp_tunnel_t tunnel, bool reuseport)
+{
+    int s;
     switch (tunnel->transport)
     {
         case CKTP_PROTO_IP:
         {
-            tunnel->socket = socket(AF_INET, SOCK_RAW, ntohs(tunnel->port));
-            if (tunnel->socket < 0)
+            s = socket(AF_INET, SOCK_RAW, ntohs(tunnel->port));
+            if (s < 0)
             {
                 error("unable to open RAW socket with protocol %u for "
-                    "server %s", ntohs(tunnel->port), url);
-                goto open_tunnel_error;
+                    "server %s", ntohs(tunnel->port), tunnel->url);
+                return -1;
             }
             int on = 0;
-            if (setsockopt(tunnel->socket, IPPROTO_IP, IP_HDRINCL, &on,
-                sizeof(on)) != 0)
+            if (setsockopt(s, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on)) != 0)
             {       
                 error("unable to disable IP header inclusion for server %s",
-                    url);
-                goto open_tunnel_error;
+                    tunnel->url);
+                goto open_socket_error;
+            }
+            if (!cktp_attach_filter(s, CKTP_PROTO_IP,
+                    cktp_encoding_min_size(tunnel->encodings,
+                        tunnel->open_encodings), 0, 0))
+            {
+                error("unable to attach socket filter for server %s; short "
+                    "packets will be dropped in user space", tunnel->url);
             }
             break;
         }
         case CKTP_PROTO_UDP:
         {
-            tunnel->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-            if (tunnel->socket < 0)
+            s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (s < 0)
             {
-                error("unable to open UDP socket for server %s", url);
-                goto open_tunnel_error;
+                error("unable to open UDP socket for server %s", tunnel->url);
+                return -1;
             }
             int on = 1;
-            if (setsockopt(tunnel->socket, SOL_SOCKET, SO_NO_CHECK, &on,
-                sizeof(on)) != 0)
+            if (setsockopt(s, SOL_SOCKET, SO_NO_CHECK, &on, sizeof(on)) != 0)
+            {
+                error("unable to disable UDP checksums for server %s",
+                    tunnel->url);
+                goto open_socket_error;
+            }
+            if (reuseport &&
+                setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
             {
-                error("unable to disable UDP checksums for server %s", url);
-                goto open_tunnel_error;
+                error("unable to enable port reuse for server %s",
+                    tunnel->url);
+                goto open_socket_error;
             }
             break;
         }
         case CKTP_PROTO_PING:
         {
-            tunnel->socket = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-            if (tunnel->socket < 0)
+            s = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+            if (s < 0)
             {
-                error("unable to open PING socket for server %s", url);
-                goto open_tunnel_error;
+                error("unable to open PING socket for server %s",
+                    tunnel->url);
+                return -1;
             }
             int on = 0;
-            if (setsockopt(tunnel->socket, IPPROTO_IP, IP_HDRINCL, &on,
-                sizeof(on)) != 0)
+            if (setsockopt(s, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on)) != 0)
             {
                 error("unable to disable IP header inclusion for server %s",
-                    url);
-                goto open_tunnel_error;
+                    tunnel->url);
+                goto open_socket_error;
+            }
+            if (!cktp_attach_filter(s, CKTP_PROTO_PING,
+                    sizeof(struct icmphdr) + cktp_encoding_min_size(
+                        tunnel->encodings, tunnel->open_encodings),
+                    ICMP_ECHO, tunnel->port))
+            {
+                error("unable to attach socket filter for server %s; foreign "
+                    "ICMP packets will be dropped in user space",
+                    tunnel->url);
             }
-
-            tunnel->overhead += sizeof(struct icmphdr);
             break;
         }
         default:
             error("unable to open socket; unsupported transport protocol "
-                "%d for server %s", tunnel->transport, url);
-            goto open_tunnel_error;
+                "%d for server %s", tunnel->transport, tunnel->url);
+            return -1;
     }
 
     // Bind socket:
@@ -202,374 +533,2252 @@ extern cktp_tunnel_t cktp_open_tunnel(const char *url)
     from_addr.sin_family      = AF_INET;
     from_addr.sin_port        = tunnel->port;
     from_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(tunnel->socket, (struct sockaddr *)&from_addr, sizeof(from_addr))
-        != 0)
+    if (bind(s, (struct sockaddr *)&from_addr, sizeof(from_addr)) != 0)
     {
-        error("unable to bind socket for server %s", url);
-        goto open_tunnel_error;
+        error("unable to bind socket for server %s", tunnel->url);
+        goto open_socket_error;
     }
+    return s;
 
-    // Initialise cookie generation:
-    cookie_gen_init(&tunnel->cookie_gen);
+open_socket_error:
+    close(s);
+    return -1;
+}
 
-    return tunnel;
+/*
+ * Open a RAW socket for packet forwarding.
+ */
+static int cktp_open_raw_socket(void)
+{
+    int s = socket(PF_INET, SOCK_RAW, IPPROTO_RAW);
+    if (s < 0)
+    {
+        error("unable to create RAW socket for packet forwarding");
+        return -1;
+    }
+    int on = 1;
+    if (setsockopt(s, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on)) != 0)
+    {
+        error("unable to enable header inclusion RAW socket option for "
+            "packet forwarding");
+        close(s);
+        return -1;
+    }
+    return s;
+}
 
-open_tunnel_error:
+/*
+ * Steer packets to the socket whose thread is pinned to the receiving CPU.
+ * Socket i of the reuseport group is served by the thread pinned to CPU
+ * (cpu + i).  Packets received on any other CPU are spread by CPU id
+ * (modulo the number of threads).
+ */
+static void cktp_attach_cpu_steering(cktp_tunnel_t tunnel, int s,
+    unsigned cpu, unsigned threads)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] =
+    {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, cpu, 0, 3),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, cpu + threads, 2, 0),
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, cpu),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, threads),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog prog;
+    prog.len    = sizeof(code) / sizeof(struct sock_filter);
+    prog.filter = code;
+    if (setsockopt(s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+            sizeof(prog)) != 0)
+    {
+        error("unable to attach CPU steering program for server %s; using "
+            "default load balancing", tunnel->url);
+    }
+#endif      /* SO_ATTACH_REUSEPORT_CBPF */
+}
 
-    cktp_close_tunnel(tunnel);
-    return (cktp_tunnel_t)NULL;
+/*
+ * Open the sockets and per-thread state for listening on a tunnel.  This
+ * must be called before dropping privileges.
+ */
+extern cktp_listener_t cktp_open_listener(cktp_tunnel_t tunnel,
+    const struct cktp_listen_config_s *config)
+{
+    return cktp_listener_open(tunnel, config, NULL, 0);
 }
 
 /*
- * Clones a tunnel.
+ * Open a group of tunnels served by one shared pool of listen threads.
+ * Each thread multiplexes its sockets for all the tunnels with epoll, and
+ * the tunnels share the handshake workers, forwarding sockets and TX rings.
+ * This must be called before dropping privileges.
  */
-static cktp_tunnel_t cktp_clone_tunnel(cktp_tunnel_t tunnel)
+extern cktp_group_t cktp_open_group(cktp_tunnel_t *tunnels,
+    unsigned num_tunnels, const struct cktp_listen_config_s *config)
 {
-    cktp_tunnel_t newtunnel =
-        (cktp_tunnel_t)malloc(sizeof(struct cktp_tunnel_s));
-    if (tunnel == NULL)
+    if (num_tunnels == 0 || num_tunnels > CKTP_GROUP_MAX)
     {
-        error("unable to allocate %zu bytes for tunnel",
-            sizeof(struct cktp_tunnel_s));
-        exit(EXIT_FAILURE);
+        error("unable to open a group of %u tunnels; a group must have "
+            "between 1 and %u tunnels", num_tunnels, CKTP_GROUP_MAX);
+        return NULL;
+    }
+    size_t group_size = sizeof(struct cktp_group_s) +
+        num_tunnels*sizeof(cktp_listener_t);
+    cktp_group_t group = (cktp_group_t)malloc(group_size);
+    if (group == NULL)
+    {
+        error("unable to allocate %zu bytes for tunnel group", group_size);
+        return NULL;
+    }
+    group->handshakes = NULL;
+    group->num_listeners = 0;
+    struct cktp_listen_config_s group_config = *config;
+    if (config->engine == CKTP_LISTEN_ENGINE_URING)
+    {
+        error("unable to use io_uring for a tunnel group; using epoll and "
+            "recvmmsg() instead");
+        group_config.engine = CKTP_LISTEN_ENGINE_MMSG;
     }
-    memmove(newtunnel, tunnel, sizeof(struct cktp_tunnel_s));
-    tunnel = newtunnel;
 
-    for (size_t i = 0; i < newtunnel->open_encodings; i++)
+    // Handshake workers (if any encoding can defer handshakes):
+    for (unsigned i = 0; config->handshake_threads != 0 &&
+            group->handshakes == NULL && i < num_tunnels; i++)
     {
-        cktp_enc_info_t enc_info = newtunnel->encodings[i].info;
-        if (enc_info->clone != NULL)
+        for (unsigned j = 0; j < tunnels[i]->open_encodings; j++)
         {
-            cktp_enc_state_t enc_state = newtunnel->encodings[i].state;
-            int err = enc_info->clone(enc_state,
-                &newtunnel->encodings[i].state);
-            if (err != 0)
+            if (tunnels[i]->encodings[j].info->defer != NULL)
             {
-                error("unable to clone state for encoding %s (%s)",
-                    enc_info->protocol,
-                    enc_info->error_string(enc_state, err));
-                exit(EXIT_FAILURE);
+                group->handshakes = cktp_handshake_pool_open(tunnels,
+                    num_tunnels, config);
+                break;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < num_tunnels; i++)
+    {
+        cktp_listener_t listener = cktp_listener_open(tunnels[i],
+            &group_config, group, i);
+        if (listener == NULL)
+        {
+            cktp_group_free(group);
+            return NULL;
+        }
+        group->listeners[i] = listener;
+        group->num_listeners++;
+        if (listener->threads != group->listeners[0]->threads)
+        {
+            error("unable to open tunnel %s in group; tunnel has %u "
+                "threads but the group has %u", tunnels[i]->url,
+                listener->threads, group->listeners[0]->threads);
+            cktp_group_free(group);
+            return NULL;
+        }
+    }
+    group->threads = group->listeners[0]->threads;
+    return group;
+}
+
+/*
+ * Free a (possibly partially) opened group.  The listeners that share the
+ * first listener's sockets are freed before it.
+ */
+static void cktp_group_free(cktp_group_t group)
+{
+    for (unsigned i = group->num_listeners; i > 0; i--)
+    {
+        cktp_listener_free(group->listeners[i-1], i > 1);
+    }
+    cktp_handshake_pool_free(group->handshakes);
+    free(group);
+}
+
+/*
+ * Open a listener.  If group is non-NULL, the listener is tunnel idx of the
+ * group: it uses the group's handshake pool, and shares the forwarding
+ * sockets of the group's first listener.
+ */
+static cktp_listener_t cktp_listener_open(cktp_tunnel_t tunnel,
+    const struct cktp_listen_config_s *config, cktp_group_t group,
+    unsigned idx)
+{
+    cktp_listener_t share = (group != NULL && idx > 0?
+        group->listeners[0]: NULL);
+    unsigned threads = config->threads;
+    threads = (threads == 0? 1: threads);
+    threads = (threads > CKTP_LISTEN_THREADS_MAX? CKTP_LISTEN_THREADS_MAX:
+        threads);
+    if (tunnel->sockets != NULL)
+    {
+        // Taken over; keep one thread per socket of the old server:
+        threads = tunnel->num_sockets;
+    }
+    size_t listener_size = sizeof(struct cktp_listener_s) +
+        threads*sizeof(struct cktp_listen_s);
+    cktp_listener_t listener = (cktp_listener_t)malloc(listener_size);
+    if (listener == NULL)
+    {
+        error("unable to allocate %zu bytes for listener for tunnel %s",
+            listener_size, tunnel->url);
+        return NULL;
+    }
+    listener->tunnel = tunnel;
+    listener->threads = threads;
+    listener->handshakes = NULL;
+    listener->handover = -1;
+    memset(&listener->overload, 0x0, sizeof(listener->overload));
+    for (unsigned i = 0; i < threads; i++)
+    {
+        listener->params[i].tunnel      = NULL;
+        listener->params[i].socket_out  = -1;
+        listener->params[i].txring      = NULL;
+        listener->params[i].socket_icmp = -1;
+    }
+
+    // UDP tunnels get one SO_REUSEPORT socket per thread.  The socket opened
+    // by cktp_open_tunnel() is exclusive, so a successful open also means no
+    // other server owns the port.  Replace it with a reuseport group.
+    bool reuseport = (tunnel->transport == CKTP_PROTO_UDP && threads > 1);
+    if (reuseport && tunnel->sockets == NULL)
+    {
+        close(tunnel->socket);
+        tunnel->socket = cktp_open_socket(tunnel, true);
+        if (tunnel->socket < 0)
+        {
+            goto open_listener_error;
+        }
+    }
+    if (!reuseport && tunnel->sockets != NULL)
+    {
+        // Taken over copies of the one (shared) socket; keep only the first:
+        for (unsigned i = 1; i < tunnel->num_sockets; i++)
+        {
+            close(tunnel->sockets[i]);
+        }
+        tunnel->num_sockets = 1;
+    }
+
+    // Egress policy (shared by all clones):
+    tunnel->policy = config->policy;
+    if (tunnel->policy == NULL)
+    {
+        tunnel->policy = policy_open(NULL);
+        if (tunnel->policy == NULL)
+        {
+            goto open_listener_error;
+        }
+    }
+
+    // ICMP socket for packet reflection (shared):
+    int socket_icmp = (share != NULL? share->params[0].socket_icmp:
+        socket(PF_INET, SOCK_RAW, IPPROTO_ICMP));
+    if (socket_icmp < 0)
+    {
+        error("unable to create RAW ICMP socket for packet reflection");
+        goto open_listener_error;
+    }
+    listener->params[0].socket_icmp = socket_icmp;
+
+    // Per-source handshake rate limits (shared by all clones):
+    for (unsigned i = 0; i < tunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        if (enc_info->quota != NULL)
+        {
+            enc_info->quota(tunnel->encodings[i].state, config->cookie_rate,
+                config->key_rate);
+        }
+    }
+
+    // Pre-computed DH key pairs (shared by all clones):
+    for (unsigned i = 0; i < tunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        if (enc_info->keypool != NULL &&
+            !enc_info->keypool(tunnel->encodings[i].state, config->key_pool,
+                config->key_pool_rate))
+        {
+            error("unable to allocate a pool of %u key pairs for tunnel %s",
+                config->key_pool, tunnel->url);
+            goto open_listener_error;
+        }
+    }
+
+    // Cluster mode (generators derived from a secret shared by all nodes):
+    for (unsigned i = 0; config->cluster_secret != NULL &&
+            i < tunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        if (enc_info->cluster != NULL &&
+            !enc_info->cluster(tunnel->encodings[i].state,
+                config->cluster_secret, config->cluster_secret_size))
+        {
+            error("unable to enable cluster mode for tunnel %s; cluster "
+                "secret is too short", tunnel->url);
+            goto open_listener_error;
+        }
+    }
+
+    // Handshake workers (if any encoding can defer handshakes):
+    tunnel->idx = idx;
+    if (group != NULL)
+    {
+        listener->handshakes = group->handshakes;
+    }
+    else if (config->handshake_threads != 0)
+    {
+        for (unsigned i = 0; i < tunnel->open_encodings; i++)
+        {
+            if (tunnel->encodings[i].info->defer != NULL)
+            {
+                listener->handshakes = cktp_handshake_pool_open(
+                    &listener->tunnel, 1, config);
+                break;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < threads; i++)
+    {
+        struct cktp_listen_s *params = listener->params + i;
+        params->tunnel = cktp_clone_tunnel(tunnel);
+        params->handshakes = listener->handshakes;
+        for (unsigned j = 0; params->handshakes != NULL &&
+                j < params->tunnel->open_encodings; j++)
+        {
+            cktp_enc_info_t enc_info = params->tunnel->encodings[j].info;
+            if (enc_info->defer != NULL)
+            {
+                enc_info->defer(params->tunnel->encodings[j].state,
+                    CKTP_DEFER_QUEUE);
+            }
+        }
+        if (reuseport && i > 0)
+        {
+            params->tunnel->socket = (tunnel->sockets != NULL?
+                tunnel->sockets[i]: cktp_open_socket(tunnel, true));
+            if (params->tunnel->socket < 0)
+            {
+                goto open_listener_error;
+            }
+        }
+        params->socket_icmp = socket_icmp;
+        if (share != NULL)
+        {
+            // Forward via the group's sockets (and TX rings):
+            params->socket_out = share->params[i].socket_out;
+            params->txring = share->params[i].txring;
+        }
+        else
+        {
+            params->socket_out = cktp_open_raw_socket();
+            if (params->socket_out < 0)
+            {
+                goto open_listener_error;
+            }
+            params->txring = NULL;
+            if (config->tx_ring != NULL)
+            {
+                params->txring = txring_open(config->tx_ring);
+                if (params->txring == NULL)
+                {
+                    error("unable to open TX ring on interface %s for "
+                        "server %s; forwarding via the kernel instead",
+                        config->tx_ring, tunnel->url);
+                }
+            }
+        }
+        params->cpu = (config->cpu < 0? CKTP_LISTEN_NO_CPU:
+            config->cpu + (int)i);
+        params->engine = config->engine;
+
+        if (config->busy_poll != 0)
+        {
+#ifdef SO_BUSY_POLL
+            int busy_poll = (int)config->busy_poll;
+            if (setsockopt(params->tunnel->socket, SOL_SOCKET, SO_BUSY_POLL,
+                    &busy_poll, sizeof(busy_poll)) != 0)
+            {
+                error("unable to enable busy polling for server %s",
+                    tunnel->url);
+            }
+#else
+            error("unable to enable busy polling for server %s; not "
+                "supported", tunnel->url);
+#endif      /* SO_BUSY_POLL */
+        }
+    }
+
+    if (reuseport && config->cpu >= 0 && tunnel->sockets == NULL)
+    {
+        cktp_attach_cpu_steering(tunnel, tunnel->socket,
+            (unsigned)config->cpu, threads);
+    }
+
+    // Handover socket (for reloads; opened now while still root):
+    if (share == NULL && config->handover != NULL)
+    {
+        listener->handover = cktp_handover_open(config->handover);
+    }
+
+    return listener;
+
+open_listener_error:
+    if (group == NULL)
+    {
+        cktp_handshake_pool_free(listener->handshakes);
+    }
+    cktp_listener_free(listener, share != NULL);
+    return NULL;
+}
+
+/*
+ * Free a (possibly partially) opened listener: close the sockets it opened
+ * and free the tunnel clones.  If shared, the forwarding and reflection
+ * sockets belong to the group's first listener and are left open.
+ */
+static void cktp_listener_free(cktp_listener_t listener, bool shared)
+{
+    cktp_tunnel_t tunnel = listener->tunnel;
+    for (unsigned i = 0; i < listener->threads; i++)
+    {
+        struct cktp_listen_s *params = listener->params + i;
+        if (!shared)
+        {
+            if (params->socket_out >= 0)
+            {
+                close(params->socket_out);
+            }
+            if (params->txring != NULL)
+            {
+                txring_close(params->txring);
+            }
+        }
+        cktp_tunnel_t clone = params->tunnel;
+        if (clone == NULL)
+        {
+            continue;
+        }
+
+        // Only the reuseport sockets opened for clones are their own:
+        if (clone->socket >= 0 && clone->socket != tunnel->socket &&
+            tunnel->sockets == NULL)
+        {
+            close(clone->socket);
+        }
+        for (size_t j = 0; j < clone->open_encodings; j++)
+        {
+            cktp_enc_state_t state = clone->encodings[j].state;
+            if (state != NULL && state != tunnel->encodings[j].state)
+            {
+                clone->encodings[j].info->free(state);
+            }
+        }
+        free(clone);
+    }
+    if (!shared && listener->threads != 0 &&
+        listener->params[0].socket_icmp >= 0)
+    {
+        close(listener->params[0].socket_icmp);
+    }
+    if (listener->handover >= 0)
+    {
+        close(listener->handover);
+    }
+    free(listener);
+}
+
+/*
+ * Take over the tunnels of a running server (that has a handover socket).
+ * The new tunnels use the old server's listen sockets and encoding states,
+ * so no packets are lost and existing sessions remain valid.  The old server
+ * keeps serving until the new one starts listening.  If urls is non-NULL,
+ * only the tunnels for those URLs are kept; the others are closed.
+ */
+extern cktp_tunnel_t *cktp_takeover(const char *path, const char **urls,
+    unsigned num_urls, unsigned *num_tunnels)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        error("unable to take over from server at \"%s\"; path is too long",
+            path);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn < 0 || connect(conn, (struct sockaddr *)&addr,
+            sizeof(addr)) != 0)
+    {
+        error("unable to connect to handover socket \"%s\"", path);
+        if (conn >= 0)
+        {
+            close(conn);
+        }
+        return NULL;
+    }
+    unlink(path);       // The old server is no longer root.
+
+    struct cktp_handover_msg_s *msg = (struct cktp_handover_msg_s *)
+        malloc(sizeof(struct cktp_handover_msg_s));
+    cktp_tunnel_t *tunnels = NULL;
+    unsigned num = 0, total = 1;
+    if (msg == NULL)
+    {
+        error("unable to allocate memory for handover message");
+        goto takeover_error;
+    }
+    while (num < total)
+    {
+        union
+        {
+            struct cmsghdr hdr;
+            uint8_t buff[CMSG_SPACE(CKTP_LISTEN_THREADS_MAX*sizeof(int))];
+        } control;
+        struct iovec iov;
+        iov.iov_base = msg;
+        iov.iov_len  = sizeof(struct cktp_handover_msg_s);
+        struct msghdr hdr;
+        memset(&hdr, 0x0, sizeof(hdr));
+        hdr.msg_iov        = &iov;
+        hdr.msg_iovlen     = 1;
+        hdr.msg_control    = control.buff;
+        hdr.msg_controllen = sizeof(control.buff);
+        ssize_t size = recvmsg(conn, &hdr, MSG_CMSG_CLOEXEC);
+
+        int fds[CKTP_LISTEN_THREADS_MAX];
+        unsigned num_fds = 0;
+        struct cmsghdr *cmsg = (size < 0? NULL: CMSG_FIRSTHDR(&hdr));
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memmove(fds, CMSG_DATA(cmsg), num_fds*sizeof(int));
+        }
+        if (size < (ssize_t)CKTP_HANDOVER_HDR_SIZE ||
+            (hdr.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0 ||
+            msg->magic != CKTP_HANDOVER_MAGIC || msg->idx != num ||
+            msg->num_tunnels == 0 || msg->num_tunnels > CKTP_GROUP_MAX ||
+            (num != 0 && msg->num_tunnels != total) || num_fds == 0 ||
+            msg->num_sockets != num_fds ||
+            msg->state_size > CKTP_HANDOVER_STATE_MAX ||
+            (size_t)size != CKTP_HANDOVER_HDR_SIZE + msg->state_size)
+        {
+            error("unable to take over from server at \"%s\"; bad handover "
+                "message", path);
+            for (unsigned i = 0; i < num_fds; i++)
+            {
+                close(fds[i]);
+            }
+            goto takeover_error;
+        }
+        if (num == 0)
+        {
+            total = msg->num_tunnels;
+            tunnels = (cktp_tunnel_t *)malloc(total*sizeof(cktp_tunnel_t));
+            if (tunnels == NULL)
+            {
+                error("unable to allocate memory for %u tunnels", total);
+                goto takeover_error;
+            }
+        }
+
+        msg->url[CKTP_MAX_URL_LENGTH] = '\0';
+        cktp_tunnel_t tunnel = cktp_tunnel_open(msg->url, fds[0]);
+        int *sockets = (int *)malloc(num_fds*sizeof(int));
+        if (tunnel == NULL || sockets == NULL)
+        {
+            for (unsigned i = (tunnel == NULL? 0: 1); i < num_fds; i++)
+            {
+                close(fds[i]);
+            }
+            cktp_close_tunnel(tunnel);
+            free(sockets);
+            goto takeover_error;
+        }
+        memmove(sockets, fds, num_fds*sizeof(int));
+        tunnel->sockets     = sockets;
+        tunnel->num_sockets = num_fds;
+        tunnel->takeover    = conn;
+        memmove(&tunnel->cookie_gen, &msg->cookie_gen,
+            sizeof(tunnel->cookie_gen));
+        cktp_restore_state(tunnel, msg->state, msg->state_size);
+        tunnels[num++] = tunnel;
+    }
+
+    // Keep only the requested tunnels:
+    unsigned kept = 0;
+    for (unsigned i = 0; i < total; i++)
+    {
+        bool keep = (urls == NULL);
+        for (unsigned j = 0; !keep && j < num_urls; j++)
+        {
+            keep = (strcmp(tunnels[i]->url, urls[j]) == 0);
+        }
+        if (keep)
+        {
+            tunnels[kept++] = tunnels[i];
+        }
+        else
+        {
+            cktp_close_tunnel(tunnels[i]);
+        }
+    }
+    num = kept;
+    if (num == 0)
+    {
+        error("unable to take over from server at \"%s\"; the server has "
+            "none of the requested tunnels", path);
+        goto takeover_error;
+    }
+
+    free(msg);
+    *num_tunnels = num;
+    return tunnels;
+
+takeover_error:
+    for (unsigned i = 0; i < num; i++)
+    {
+        cktp_close_tunnel(tunnels[i]);
+    }
+    free(tunnels);
+    free(msg);
+    close(conn);
+    return NULL;
+}
+
+/*
+ * Open the handover socket (on which a reloaded server takes over this one).
+ */
+static int cktp_handover_open(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        error("unable to open handover socket \"%s\"; path is too long",
+            path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s < 0)
+    {
+        error("unable to create handover socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(path, S_IRUSR | S_IWUSR) != 0 ||
+        listen(s, 1) != 0)
+    {
+        error("unable to open handover socket \"%s\"; the server cannot be "
+            "reloaded", path);
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/*
+ * Handover thread.  Hands the group's tunnels over to each new server that
+ * connects, and exits once a new server has started listening.  If the new
+ * server fails, this server continues as if nothing happened.
+ */
+static void *cktp_handover_server(void *ptr)
+{
+    cktp_group_t group = (cktp_group_t)ptr;
+    int s = group->listeners[0]->handover;
+
+    while (true)
+    {
+        int conn = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+            continue;
+        }
+        if (cktp_handover(group, conn))
+        {
+            error("handed over to a reloaded server; exiting");
+            exit(EXIT_SUCCESS);
+        }
+        error("unable to hand over to a reloaded server; continuing");
+        close(conn);
+    }
+
+    return NULL;
+}
+
+/*
+ * Send all tunnels of a group to a new server, and wait until it is ready.
+ */
+static bool cktp_handover(cktp_group_t group, int conn)
+{
+    struct cktp_handover_msg_s *msg = (struct cktp_handover_msg_s *)
+        malloc(sizeof(struct cktp_handover_msg_s));
+    if (msg == NULL)
+    {
+        return false;
+    }
+    for (unsigned i = 0; i < group->num_listeners; i++)
+    {
+        cktp_listener_t listener = group->listeners[i];
+        cktp_tunnel_t tunnel = listener->tunnel;
+        memset(msg, 0x0, CKTP_HANDOVER_HDR_SIZE);
+        msg->magic       = CKTP_HANDOVER_MAGIC;
+        msg->idx         = i;
+        msg->num_tunnels = group->num_listeners;
+        msg->num_sockets = listener->threads;
+        msg->state_size  = cktp_save_state(tunnel, msg->state,
+            sizeof(msg->state));
+        memmove(&msg->cookie_gen, &tunnel->cookie_gen,
+            sizeof(msg->cookie_gen));
+        strcpy(msg->url, tunnel->url);
+
+        union
+        {
+            struct cmsghdr hdr;
+            uint8_t buff[CMSG_SPACE(CKTP_LISTEN_THREADS_MAX*sizeof(int))];
+        } control;
+        memset(&control, 0x0, sizeof(control));
+        size_t fds_size = listener->threads*sizeof(int);
+        struct iovec iov;
+        iov.iov_base = msg;
+        iov.iov_len  = CKTP_HANDOVER_HDR_SIZE + msg->state_size;
+        struct msghdr hdr;
+        memset(&hdr, 0x0, sizeof(hdr));
+        hdr.msg_iov        = &iov;
+        hdr.msg_iovlen     = 1;
+        hdr.msg_control    = control.buff;
+        hdr.msg_controllen = CMSG_SPACE(fds_size);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(fds_size);
+        int *fds = (int *)CMSG_DATA(cmsg);
+        for (unsigned j = 0; j < listener->threads; j++)
+        {
+            fds[j] = listener->params[j].tunnel->socket;
+        }
+        if (sendmsg(conn, &hdr, MSG_NOSIGNAL) != (ssize_t)iov.iov_len)
+        {
+            free(msg);
+            return false;
+        }
+    }
+    free(msg);
+
+    // Keep serving until the new server is listening:
+    uint8_t ready;
+    return (recv(conn, &ready, sizeof(ready), 0) == sizeof(ready) &&
+        ready == CKTP_HANDOVER_READY);
+}
+
+/*
+ * Save the state of each encoding (for a handover).  Returns the total size.
+ */
+static size_t cktp_save_state(cktp_tunnel_t tunnel, uint8_t *state,
+    size_t state_size)
+{
+    size_t total = 0;
+    for (unsigned i = 0; i < tunnel->open_encodings; i++)
+    {
+        uint32_t size = 0;
+        if (state_size - total < sizeof(size))
+        {
+            break;
+        }
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        if (enc_info->save != NULL)
+        {
+            size = (uint32_t)enc_info->save(tunnel->encodings[i].state,
+                state + total + sizeof(size),
+                state_size - total - sizeof(size));
+        }
+        memmove(state + total, &size, sizeof(size));
+        total += sizeof(size) + size;
+    }
+    return total;
+}
+
+/*
+ * Restore the encoding states saved by cktp_save_state().  If an encoding's
+ * state cannot be restored (e.g. the new server has a different version), it
+ * keeps its fresh state and clients must reconnect.
+ */
+static void cktp_restore_state(cktp_tunnel_t tunnel, const uint8_t *state,
+    size_t state_size)
+{
+    for (unsigned i = 0; i < tunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        uint32_t size;
+        if (state_size < sizeof(size))
+        {
+            error("unable to restore state of encoding %s for tunnel %s; "
+                "state is missing", enc_info->protocol, tunnel->url);
+            return;
+        }
+        memmove(&size, state, sizeof(size));
+        state += sizeof(size);
+        state_size -= sizeof(size);
+        if (size > state_size)
+        {
+            error("unable to restore state of encoding %s for tunnel %s; "
+                "state is truncated", enc_info->protocol, tunnel->url);
+            return;
+        }
+        if (size != 0 && (enc_info->restore == NULL ||
+            !enc_info->restore(tunnel->encodings[i].state, state, size)))
+        {
+            error("unable to restore state of encoding %s for tunnel %s; "
+                "clients must reconnect", enc_info->protocol, tunnel->url);
+        }
+        state += size;
+        state_size -= size;
+    }
+}
+
+/*
+ * Clones a tunnel.
+ */
+static cktp_tunnel_t cktp_clone_tunnel(cktp_tunnel_t tunnel)
+{
+    cktp_tunnel_t newtunnel =
+        (cktp_tunnel_t)malloc(sizeof(struct cktp_tunnel_s));
+    if (newtunnel == NULL)
+    {
+        error("unable to allocate %zu bytes for tunnel",
+            sizeof(struct cktp_tunnel_s));
+        exit(EXIT_FAILURE);
+    }
+    memmove(newtunnel, tunnel, sizeof(struct cktp_tunnel_s));
+    tunnel = newtunnel;
+
+    for (size_t i = 0; i < newtunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t enc_info = newtunnel->encodings[i].info;
+        if (enc_info->clone != NULL)
+        {
+            cktp_enc_state_t enc_state = newtunnel->encodings[i].state;
+            int err = enc_info->clone(enc_state,
+                &newtunnel->encodings[i].state);
+            if (err != 0)
+            {
+                error("unable to clone state for encoding %s (%s)",
+                    enc_info->protocol,
+                    enc_info->error_string(enc_state, err));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    return newtunnel;
+}
+
+/*
+ * Close a tunnel.
+ */
+extern void cktp_close_tunnel(cktp_tunnel_t tunnel)
+{
+    if (tunnel == NULL)
+    {
+        return;
+    }
+    if (tunnel->socket > 0 && close(tunnel->socket) != 0)
+    {
+        error("unable to close socket");
+    }
+    for (unsigned i = 1; tunnel->sockets != NULL && i < tunnel->num_sockets;
+            i++)
+    {
+        close(tunnel->sockets[i]);
+    }
+    free(tunnel->sockets);
+    for (size_t i = 0; i < tunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t info = tunnel->encodings[i].info;
+        cktp_enc_state_t state = tunnel->encodings[i].state;
+        if (state != NULL)
+        {
+            info->free(state);
+        }
+    }
+    free(tunnel);
+}
+
+/*
+ * Encode a packet.
+ */
+static bool cktp_encode_packet(cktp_tunnel_t tunnel, uint8_t **buffptr,
+    size_t *sizeptr, unsigned idx)
+{
+    idx = (idx > tunnel->open_encodings? tunnel->open_encodings: idx);
+    for (int i = idx-1; i >= 0; i--)
+    {
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        cktp_enc_state_t enc_state = tunnel->encodings[i].state;
+        size_t overhead = tunnel->encodings[i].overhead;
+        size_t size0 = *sizeptr;
+        uint8_t *buff0 = *buffptr;
+
+        int result = enc_info->encode(enc_state, buffptr, sizeptr);
+        
+        if (result != 0)
+        {
+            return false;
+        }
+        if (!cktp_encoding_verify(enc_info, overhead, buff0, *buffptr, size0,
+                *sizeptr))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Decode a packet, starting from the encoding layer *layerptr.
+ */
+static int cktp_decode_packet(cktp_tunnel_t tunnel, uint32_t source_addr,
+    unsigned *layerptr, uint8_t **buffptr, size_t *sizeptr,
+    uint8_t **replyptr, size_t *replysizeptr)
+{
+    uint8_t *reply = *replyptr;
+    for (unsigned i = *layerptr; i < tunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        cktp_enc_state_t enc_state = tunnel->encodings[i].state;
+        size_t overhead = tunnel->encodings[i].overhead;
+        *replyptr = reply;
+        *replysizeptr = CKTP_MAX_PACKET_SIZE;
+        size_t size0 = *sizeptr, replysize0 = *replysizeptr;
+        uint8_t *buff0 = *buffptr, *reply0 = *replyptr;
+        
+        int result = enc_info->decode(enc_state, &source_addr, 1, buffptr,
+            sizeptr, replyptr, replysizeptr);
+        
+        if (result == CKTP_ENCODING_DEFER)
+        {
+            *layerptr = i;
+            return CKTP_DECODE_DEFER;
+        }
+        if (result != 0)
+        {
+            return -1;
+        }
+        if (!cktp_encoding_verify(enc_info, overhead, buff0, *buffptr, size0,
+                *sizeptr))
+        {
+            // No decoded packet -- check for a reply packet:
+            if (!cktp_encoding_verify(enc_info, overhead, reply0, *replyptr,
+                    replysize0, *replysizeptr))
+            {
+                return -1;
+            }
+
+            // Got a reply packet:
+            return i+1;
+        }
+        // Got a decoded packet, continue:
+    }
+    return 0;
+}
+
+/*
+ * Listen for messages.
+ */
+extern void cktp_listen(cktp_listener_t listener)
+{
+    cktp_tunnel_t tunnel = listener->tunnel;
+    cktp_group_t group = (cktp_group_t)malloc(sizeof(struct cktp_group_s) +
+        sizeof(cktp_listener_t));
+    if (group == NULL)
+    {
+        error("unable to allocate memory for tunnel %s", tunnel->url);
+        exit(EXIT_FAILURE);
+    }
+    group->handshakes = listener->handshakes;
+    group->threads = listener->threads;
+    group->num_listeners = 1;
+    group->listeners[0] = listener;
+    cktp_group_start(group);
+
+    // Spawn threads:
+    void *(*loop)(void *) = (listener->params[0].engine ==
+        CKTP_LISTEN_ENGINE_URING? cktp_listen_loop_uring: cktp_listen_loop);
+    for (unsigned i = 1; i < listener->threads; i++)
+    {
+        thread_t thread;
+        if (thread_create(&thread, loop, listener->params + i) != 0)
+        {
+            error("unable to create listen thread for tunnel %s",
+                tunnel->url);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    loop(listener->params);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Listen for messages on all tunnels of a group.
+ */
+extern void cktp_listen_group(cktp_group_t group)
+{
+    cktp_group_start(group);
+
+    // Spawn threads:
+    struct cktp_group_thread_s *threads = (struct cktp_group_thread_s *)
+        malloc(group->threads*sizeof(struct cktp_group_thread_s));
+    if (threads == NULL)
+    {
+        error("unable to allocate memory for tunnel group threads");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < group->threads; i++)
+    {
+        threads[i].group = group;
+        threads[i].idx = i;
+    }
+    for (unsigned i = 1; i < group->threads; i++)
+    {
+        thread_t thread;
+        if (thread_create(&thread, cktp_group_loop, threads + i) != 0)
+        {
+            error("unable to create listen thread for tunnel group");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    cktp_group_loop(threads);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Start the threads shared by a group (handshake workers and the overload
+ * controller) and activate all encodings.
+ */
+static void cktp_group_start(cktp_group_t group)
+{
+    if (group->handshakes != NULL)
+    {
+        cktp_handshake_pool_start(group->handshakes);
+    }
+
+    // Activate all encodings:
+    bool shed = false;
+    for (unsigned i = 0; i < group->num_listeners; i++)
+    {
+        cktp_tunnel_t tunnel = group->listeners[i]->tunnel;
+        for (size_t j = 0; j < tunnel->open_encodings; j++)
+        {
+            cktp_enc_info_t enc_info = tunnel->encodings[j].info;
+            cktp_enc_state_t enc_state = tunnel->encodings[j].state;
+            shed = shed || (enc_info->shed != NULL);
+            if (enc_info->activate != NULL)
+            {
+                int err = enc_info->activate(enc_state);
+                if (err != 0)
+                {
+                    error("unable to activate encoding %s for tunnel %s "
+                        "(%s)", enc_info->protocol, tunnel->url,
+                        enc_info->error_string(enc_state, err));
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+
+    if (shed)
+    {
+        thread_t thread;
+        if (thread_create(&thread, cktp_overload_controller, group) != 0)
+        {
+            error("unable to create overload controller thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (group->listeners[0]->handover >= 0)
+    {
+        thread_t thread;
+        if (thread_create(&thread, cktp_handover_server, group) != 0)
+        {
+            error("unable to create handover thread; the server cannot be "
+                "reloaded");
+        }
+    }
+
+    // If taken over, the old server can now exit:
+    int takeover = group->listeners[0]->tunnel->takeover;
+    if (takeover >= 0)
+    {
+        uint8_t ready = CKTP_HANDOVER_READY;
+        if (send(takeover, &ready, sizeof(ready), MSG_NOSIGNAL) !=
+                sizeof(ready))
+        {
+            error("unable to notify the old server of takeover");
+        }
+        close(takeover);
+    }
+}
+
+/*
+ * Main server loop for a group listen thread.  Waits on the thread's
+ * sockets for all tunnels with epoll, and handles one batch from each ready
+ * socket in turn (so a busy tunnel cannot starve the others).
+ */
+static void *cktp_group_loop(void *ptr)
+{
+    struct cktp_group_thread_s *thread = (struct cktp_group_thread_s *)ptr;
+    cktp_group_t group = thread->group;
+    unsigned idx = thread->idx;
+
+    cktp_listen_pin(group->listeners[0]->params + idx);
+    stats_register("listen");
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        error("unable to create epoll instance for tunnel group");
+        exit(EXIT_FAILURE);
+    }
+    size_t packet_size = 0, reply_buff_size = 0;
+    for (unsigned i = 0; i < group->num_listeners; i++)
+    {
+        cktp_tunnel_t tunnel = group->listeners[i]->params[idx].tunnel;
+        struct epoll_event event;
+        memset(&event, 0x0, sizeof(event));
+        event.events = CKTP_GROUP_EPOLL_EVENTS;
+        event.data.u32 = i;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tunnel->socket, &event) != 0)
+        {
+            error("unable to add tunnel %s to epoll instance", tunnel->url);
+            exit(EXIT_FAILURE);
+        }
+        size_t size = cktp_listen_packet_size(tunnel);
+        packet_size = (size > packet_size? size: packet_size);
+        size = CKTP_ENCODING_BUFF_SIZE(CKTP_MAX_PACKET_SIZE,
+            tunnel->overhead);
+        reply_buff_size = (size > reply_buff_size? size: reply_buff_size);
+    }
+    struct cktp_batch_s *batch = cktp_batch_open(packet_size,
+        reply_buff_size);
+
+    // Main server loop:
+    struct epoll_event events[CKTP_GROUP_EVENTS];
+    while (true)
+    {
+        int num_events = epoll_wait(epoll_fd, events, CKTP_GROUP_EVENTS, -1);
+        for (int i = 0; i < num_events; i++)
+        {
+            cktp_listener_t listener = group->listeners[events[i].data.u32];
+            cktp_listen_batch(listener->params + idx, batch, MSG_DONTWAIT);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Pin the calling listen thread to its CPU (if required).
+ */
+static void cktp_listen_pin(struct cktp_listen_s *params)
+{
+    if (params->cpu == CKTP_LISTEN_NO_CPU)
+    {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(params->cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+    {
+        error("unable to pin listen thread for tunnel %s to CPU %d",
+            params->tunnel->url, params->cpu);
+    }
+}
+
+/*
+ * Size of a receive buffer (including any transport header).  Packets that
+ * do not leave 2*overhead bytes spare are dropped, so encodings can grow a
+ * packet in place when decoding (see cktp_encoding_verify()).
+ */
+static size_t cktp_listen_packet_size(cktp_tunnel_t tunnel)
+{
+    size_t trans_hdr_size;
+    switch (tunnel->transport)
+    {
+        case CKTP_PROTO_IP:
+            trans_hdr_size = 0xF*sizeof(uint32_t);
+            break;
+        case CKTP_PROTO_PING:
+            trans_hdr_size = 0xF*sizeof(uint32_t) + sizeof(struct icmphdr);
+            break;
+        default:
+            trans_hdr_size = 0;
+            break;
+    }
+    return CKTP_ENCODING_BUFF_SIZE(CKTP_MAX_PACKET_SIZE + trans_hdr_size,
+        tunnel->overhead);
+}
+
+/*
+ * Main server loop.
+ */
+static void *cktp_listen_loop(void *ptr)
+{
+    struct cktp_listen_s *params = (struct cktp_listen_s *)ptr;
+    cktp_tunnel_t tunnel = params->tunnel;
+
+    cktp_listen_pin(params);
+    stats_register("listen");
+
+    struct cktp_batch_s *batch = cktp_batch_open(
+        cktp_listen_packet_size(tunnel),
+        CKTP_ENCODING_BUFF_SIZE(CKTP_MAX_PACKET_SIZE, tunnel->overhead));
+
+    // Main server loop (block until at least one packet arrives):
+    while (true)
+    {
+        cktp_listen_batch(params, batch, MSG_WAITFORONE);
+    }
+
+    return NULL;
+}
+
+/*
+ * Allocate the batched I/O state for a listen thread.
+ */
+static struct cktp_batch_s *cktp_batch_open(size_t packet_size,
+    size_t reply_buff_size)
+{
+    // Use malloc instead of allocating from the stack -- probably safer.
+    uint8_t *packets = (uint8_t *)malloc(CKTP_LISTEN_BATCH_MAX*packet_size);
+    uint8_t *reply_buffs =
+        (uint8_t *)malloc(CKTP_LISTEN_BATCH_MAX*reply_buff_size);
+    struct cktp_batch_s *batch =
+        (struct cktp_batch_s *)malloc(sizeof(struct cktp_batch_s));
+    if (packets == NULL || reply_buffs == NULL || batch == NULL)
+    {
+        error("unable to allocate memory for packet buffers");
+        exit(EXIT_FAILURE);
+    }
+    memset(batch, 0x0, sizeof(struct cktp_batch_s));
+    batch->packets         = packets;
+    batch->packet_size     = packet_size;
+    batch->reply_buffs     = reply_buffs;
+    batch->reply_buff_size = reply_buff_size;
+    for (unsigned i = 0; i < CKTP_LISTEN_BATCH_MAX; i++)
+    {
+        batch->recv_iovs[i].iov_base = packets + i*packet_size;
+        batch->recv_iovs[i].iov_len  = packet_size;
+        batch->recv_msgs[i].msg_hdr.msg_iov     = batch->recv_iovs + i;
+        batch->recv_msgs[i].msg_hdr.msg_iovlen  = 1;
+        batch->recv_msgs[i].msg_hdr.msg_name    = batch->from_addrs + i;
+        batch->to_addrs[i].sin_family = AF_INET;
+    }
+    return batch;
+}
+
+/*
+ * Receive a batch of packets from a tunnel (recvmmsg() flags), handle each
+ * packet, and send all output.
+ */
+static void cktp_listen_batch(struct cktp_listen_s *params,
+    struct cktp_batch_s *batch, int flags)
+{
+    cktp_tunnel_t tunnel = params->tunnel;
+    int socket_out  = params->socket_out;
+    int socket_icmp = params->socket_icmp;
+    txring_t txring = params->txring;
+    uint8_t *packets = batch->packets;
+    size_t packet_size = batch->packet_size;
+    uint8_t *reply_buffs = batch->reply_buffs;
+    size_t reply_buff_size = batch->reply_buff_size;
+
+    // Receive a batch of packets:
+    for (unsigned i = 0; i < CKTP_LISTEN_BATCH_MAX; i++)
+    {
+        batch->recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    int num_recv = recvmmsg(tunnel->socket, batch->recv_msgs,
+        CKTP_LISTEN_BATCH_MAX, flags, NULL);
+    if (num_recv <= 0)
+    {
+        return;
+    }
+
+    // Handle each packet, queueing any output:
+    batch->num_replies = 0;
+    batch->num_forwards = 0;
+    for (unsigned i = 0; i < (unsigned)num_recv; i++)
+    {
+        size_t size = (size_t)batch->recv_msgs[i].msg_len;
+        if (size == 0 || size + 2*tunnel->overhead > packet_size)
+        {
+            continue;
+        }
+        uint8_t *reply =
+            CKTP_ENCODING_BUFF_INIT(reply_buffs + i*reply_buff_size,
+                tunnel->overhead);
+        uint8_t *out;
+        size_t out_size;
+        uint32_t daddr;
+        switch (cktp_handle_packet(tunnel, socket_icmp, params->handshakes,
+            packets + i*packet_size, size, batch->from_addrs + i, reply,
+            &out, &out_size, &daddr))
+        {
+            case CKTP_ACTION_REPLY:
+                cktp_batch_add(batch->reply_msgs, batch->reply_iovs,
+                    batch->num_replies, out, out_size,
+                    batch->from_addrs + i);
+                batch->num_replies++;
+                break;
+            case CKTP_ACTION_FORWARD:
+                cktp_batch_forward(params, batch, out, out_size, daddr);
+                break;
+            case CKTP_ACTION_BUNDLE:
+            {
+                uint8_t *bundle = out;
+                size_t bundle_size = out_size;
+                uint32_t saddr = batch->from_addrs[i].sin_addr.s_addr;
+                while (cktp_bundle_next(tunnel, saddr, &bundle, &bundle_size,
+                        &out, &out_size, &daddr))
+                {
+                    cktp_batch_forward(params, batch, out, out_size, daddr);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // Flush all output:
+    if (txring != NULL)
+    {
+        txring_flush(txring);
+    }
+    cktp_batch_flush(socket_out, batch->forward_msgs, batch->num_forwards);
+    cktp_batch_flush(tunnel->socket, batch->reply_msgs, batch->num_replies);
+}
+
+/*
+ * Main server loop (io_uring engine).  A multishot receive stays posted on
+ * the tunnel socket using a ring of provided buffers.  Each buffer is held
+ * until the reply or forwarded packet it produced has been sent.
+ */
+static void *cktp_listen_loop_uring(void *ptr)
+{
+    struct cktp_listen_s *params = (struct cktp_listen_s *)ptr;
+    cktp_tunnel_t tunnel = params->tunnel;
+    int socket_out  = params->socket_out;
+    int socket_icmp = params->socket_icmp;
+    txring_t txring = params->txring;
+
+    uring_t ring = uring_init(CKTP_URING_ENTRIES);
+    uring_buf_ring_t buf_ring = NULL;
+    if (ring != NULL)
+    {
+        buf_ring = uring_buf_ring_init(ring, CKTP_URING_GROUP,
+            CKTP_URING_BUFFERS);
+        if (buf_ring == NULL)
+        {
+            uring_free(ring);
+        }
+    }
+    if (buf_ring == NULL)
+    {
+        error("unable to create io_uring for tunnel %s; using recvmmsg() "
+            "instead", tunnel->url);
+        return cktp_listen_loop(ptr);
+    }
+
+    cktp_listen_pin(params);
+    stats_register("listen");
+
+    // Each buffer holds the recvmsg header, source address and packet:
+    size_t packet_size = cktp_listen_packet_size(tunnel);
+    size_t buff_size = sizeof(struct io_uring_recvmsg_out) +
+        sizeof(struct sockaddr_in) + packet_size;
+    size_t reply_buff_size =
+        CKTP_ENCODING_BUFF_SIZE(CKTP_MAX_PACKET_SIZE, tunnel->overhead);
+    uint8_t *buffs = (uint8_t *)malloc(CKTP_URING_BUFFERS*buff_size);
+    uint8_t *reply_buffs =
+        (uint8_t *)malloc(CKTP_URING_BUFFERS*reply_buff_size);
+    struct cktp_uring_send_s *sends = (struct cktp_uring_send_s *)
+        malloc(CKTP_URING_BUFFERS*sizeof(struct cktp_uring_send_s));
+    if (buffs == NULL || reply_buffs == NULL || sends == NULL)
+    {
+        error("unable to allocate memory for packet buffers");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned bid = 0; bid < CKTP_URING_BUFFERS; bid++)
+    {
+        uring_buf_ring_add(buf_ring, buffs + bid*buff_size, buff_size, bid);
+    }
+    uring_buf_ring_commit(buf_ring);
+
+    struct msghdr recv_msg;
+    memset(&recv_msg, 0x0, sizeof(recv_msg));
+    recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+    bool rearm = true;
+    bool received = false;          // A receive has succeeded.
+    bool unsupported = false;       // Receives cannot work; fall back.
+    unsigned errors = 0;            // Consecutive receive errors.
+    unsigned submit_errors = 0;     // Consecutive submit errors.
+    unsigned inflight = 0;          // Sends in flight.
+
+    // Main server loop:
+    while (!unsupported)
+    {
+        if (rearm)
+        {
+            rearm = !cktp_uring_recv(ring, tunnel, &recv_msg);
+        }
+        if (uring_submit(ring, 1) >= 0 || errno == EBUSY)
+        {
+            submit_errors = 0;
+        }
+        else if (++submit_errors >= CKTP_URING_MAX_ERRORS)
+        {
+            // EINTR is retried by uring_submit(), so repeated errors are
+            // persistent (e.g. EAGAIN, ENOMEM, or a broken ring).
+            unsupported = true;
+            continue;
+        }
+
+        // Reap all available completions:
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(ring)) != NULL)
+        {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(ring);
+
+            if (user_data != CKTP_URING_RECV)
+            {
+                // A send has completed; the buffer is free again:
+                uint16_t bid = (uint16_t)user_data;
+                uring_buf_ring_add(buf_ring, buffs + bid*buff_size,
+                    buff_size, bid);
+                inflight--;
+                continue;
+            }
+
+            if ((flags & IORING_CQE_F_MORE) == 0)
+            {
+                rearm = true;
+            }
+            if (res < 0)
+            {
+                // -ENOBUFS just means all buffers are in use.  Any other
+                // error on the first receive (e.g. -EINVAL: the kernel has
+                // provided buffer rings but no multishot recvmsg(), as
+                // before Linux 6.0), or repeated errors, mean this socket
+                // cannot be served with io_uring.
+                if (res != -ENOBUFS &&
+                    (!received || ++errors >= CKTP_URING_MAX_ERRORS))
+                {
+                    unsupported = true;
+                }
+                continue;
+            }
+            received = true;
+            errors = 0;
+            if ((flags & IORING_CQE_F_BUFFER) == 0)
+            {
+                continue;
+            }
+            uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            uint8_t *buff = buffs + bid*buff_size;
+            struct io_uring_recvmsg_out *recv_out =
+                (struct io_uring_recvmsg_out *)buff;
+            struct sockaddr_in *from_addr =
+                (struct sockaddr_in *)(recv_out + 1);
+            uint8_t *packet = (uint8_t *)(from_addr + 1);
+            size_t size = recv_out->payloadlen;
+            if (recv_out->namelen != sizeof(struct sockaddr_in) ||
+                (recv_out->flags & MSG_TRUNC) != 0 || size == 0 ||
+                size + 2*tunnel->overhead > packet_size)
+            {
+                uring_buf_ring_add(buf_ring, buff, buff_size, bid);
+                continue;
+            }
+
+            uint8_t *reply =
+                CKTP_ENCODING_BUFF_INIT(reply_buffs + bid*reply_buff_size,
+                    tunnel->overhead);
+            uint8_t *out;
+            size_t out_size;
+            uint32_t daddr;
+            struct cktp_uring_send_s *send = sends + bid;
+            int send_socket;
+            switch (cktp_handle_packet(tunnel, socket_icmp,
+                params->handshakes, packet, size, from_addr, reply, &out,
+                &out_size, &daddr))
+            {
+                case CKTP_ACTION_REPLY:
+                    send_socket = tunnel->socket;
+                    memmove(&send->addr, from_addr, sizeof(send->addr));
+                    break;
+                case CKTP_ACTION_FORWARD:
+                    if (txring != NULL &&
+                        txring_send(txring, out, out_size, daddr))
+                    {
+                        // Copied into the ring; the buffer is free again.
+                        uring_buf_ring_add(buf_ring, buff, buff_size, bid);
+                        continue;
+                    }
+                    send_socket = socket_out;
+                    memset(&send->addr, 0x0, sizeof(send->addr));
+                    send->addr.sin_family = AF_INET;
+                    send->addr.sin_addr.s_addr = daddr;
+                    break;
+                case CKTP_ACTION_BUNDLE:
+                {
+                    // Bundled packets share one buffer, so are forwarded
+                    // synchronously:
+                    uint8_t *bundle = out;
+                    size_t bundle_size = out_size;
+                    struct sockaddr_in to_addr;
+                    memset(&to_addr, 0x0, sizeof(to_addr));
+                    to_addr.sin_family = AF_INET;
+                    while (cktp_bundle_next(tunnel,
+                            from_addr->sin_addr.s_addr, &bundle,
+                            &bundle_size, &out, &out_size, &daddr))
+                    {
+                        if (txring != NULL &&
+                            txring_send(txring, out, out_size, daddr))
+                        {
+                            continue;
+                        }
+                        to_addr.sin_addr.s_addr = daddr;
+                        sendto(socket_out, out, out_size, 0,
+                            (struct sockaddr *)&to_addr, sizeof(to_addr));
+                    }
+                    uring_buf_ring_add(buf_ring, buff, buff_size, bid);
+                    continue;
+                }
+                default:
+                    uring_buf_ring_add(buf_ring, buff, buff_size, bid);
+                    continue;
+            }
+
+            send->iov.iov_base = out;
+            send->iov.iov_len  = out_size;
+            memset(&send->msg, 0x0, sizeof(send->msg));
+            send->msg.msg_name    = &send->addr;
+            send->msg.msg_namelen = sizeof(send->addr);
+            send->msg.msg_iov     = &send->iov;
+            send->msg.msg_iovlen  = 1;
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            if (sqe == NULL)
+            {
+                // SQ full; send synchronously instead.
+                sendmsg(send_socket, &send->msg, 0);
+                uring_buf_ring_add(buf_ring, buff, buff_size, bid);
+                continue;
+            }
+            sqe->opcode    = IORING_OP_SENDMSG;
+            sqe->fd        = send_socket;
+            sqe->addr      = (uint64_t)(uintptr_t)&send->msg;
+            sqe->len       = 1;
+            sqe->user_data = bid;
+            inflight++;
+        }
+
+        // Return all recycled buffers to the kernel:
+        uring_buf_ring_commit(buf_ring);
+        if (txring != NULL)
+        {
+            txring_flush(txring);
+        }
+    }
+
+    // Receives or submits are not working; wait for the sends (which still
+    // use the buffers) then use recvmmsg() instead:
+    error("unable to receive via io_uring for tunnel %s; using recvmmsg() "
+        "instead", tunnel->url);
+    while (inflight > 0 && uring_submit(ring, 1) >= 0)
+    {
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(ring)) != NULL)
+        {
+            inflight -= (cqe->user_data != CKTP_URING_RECV);
+            uring_cqe_seen(ring);
+        }
+    }
+    uring_free(ring);
+    uring_buf_ring_free(buf_ring);
+    if (inflight == 0)
+    {
+        // Else the kernel may still use the buffers; leak them.
+        free(buffs);
+        free(reply_buffs);
+        free(sends);
+    }
+    return cktp_listen_loop(ptr);
+}
+
+/*
+ * Post a multishot receive on the tunnel socket.
+ */
+static bool cktp_uring_recv(uring_t ring, cktp_tunnel_t tunnel,
+    struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL)
+    {
+        return false;
+    }
+    sqe->opcode    = IORING_OP_RECVMSG;
+    sqe->fd        = tunnel->socket;
+    sqe->addr      = (uint64_t)(uintptr_t)msg;
+    sqe->len       = 1;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = CKTP_URING_GROUP;
+    sqe->user_data = CKTP_URING_RECV;
+    return true;
+}
+
+/*
+ * Create the handshake worker pool for one or more tunnels.
+ */
+static cktp_handshake_pool_t cktp_handshake_pool_open(
+    cktp_tunnel_t *tunnels, unsigned num_tunnels,
+    const struct cktp_listen_config_s *config)
+{
+    unsigned threads = config->handshake_threads;
+    threads = (threads > CKTP_HANDSHAKE_THREADS_MAX?
+        CKTP_HANDSHAKE_THREADS_MAX: threads);
+    unsigned depth = config->handshake_queue;
+    depth = (depth == 0? 1: depth);
+    depth = (depth > CKTP_HANDSHAKE_QUEUE_MAX? CKTP_HANDSHAKE_QUEUE_MAX:
+        depth);
+    size_t overhead = 0;
+    for (unsigned i = 0; i < num_tunnels; i++)
+    {
+        overhead = (tunnels[i]->overhead > overhead? tunnels[i]->overhead:
+            overhead);
+    }
+    size_t pool_size = sizeof(struct cktp_handshake_pool_s) +
+        threads*sizeof(struct cktp_handshake_worker_s);
+    size_t buff_size =
+        CKTP_ENCODING_BUFF_SIZE(CKTP_MAX_PACKET_SIZE, overhead);
+    cktp_handshake_pool_t pool = (cktp_handshake_pool_t)malloc(pool_size);
+    struct cktp_handshake_s *queue = (struct cktp_handshake_s *)
+        malloc(depth*sizeof(struct cktp_handshake_s));
+    uint8_t *buffs = (uint8_t *)malloc(depth*buff_size);
+    cktp_tunnel_t *pool_tunnels =
+        (cktp_tunnel_t *)malloc(num_tunnels*sizeof(cktp_tunnel_t));
+    if (pool == NULL || queue == NULL || buffs == NULL ||
+        pool_tunnels == NULL || thread_lock_init(&pool->lock) != 0 ||
+        thread_cond_init(&pool->cond) != 0)
+    {
+        error("unable to create handshake pool for tunnel %s; handling "
+            "handshakes inline", tunnels[0]->url);
+        free(pool);
+        free(queue);
+        free(buffs);
+        free(pool_tunnels);
+        return NULL;
+    }
+    memmove(pool_tunnels, tunnels, num_tunnels*sizeof(cktp_tunnel_t));
+    for (unsigned i = 0; i < depth; i++)
+    {
+        queue[i].buff = buffs + i*buff_size;
+    }
+    pool->queue   = queue;
+    pool->depth   = depth;
+    pool->head    = 0;
+    pool->count   = 0;
+    pool->queued  = 0;
+    pool->dropped = 0;
+    pool->tunnels     = pool_tunnels;
+    pool->num_tunnels = num_tunnels;
+    pool->overhead    = overhead;
+    pool->threads     = threads;
+    for (unsigned i = 0; i < threads; i++)
+    {
+        pool->workers[i].pool    = pool;
+        pool->workers[i].tunnels = NULL;
+    }
+    return pool;
+}
+
+/*
+ * Free a handshake pool that was never started.
+ */
+static void cktp_handshake_pool_free(cktp_handshake_pool_t pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+    free(pool->queue[0].buff);
+    free(pool->queue);
+    free(pool->tunnels);
+    free(pool);
+}
+
+/*
+ * Start the handshake worker threads.  Each worker gets its own clone of
+ * every tunnel served by the pool.
+ */
+static void cktp_handshake_pool_start(cktp_handshake_pool_t pool)
+{
+    for (unsigned i = 0; i < pool->threads; i++)
+    {
+        struct cktp_handshake_worker_s *worker = pool->workers + i;
+        worker->tunnels =
+            (cktp_tunnel_t *)malloc(pool->num_tunnels*sizeof(cktp_tunnel_t));
+        if (worker->tunnels == NULL)
+        {
+            error("unable to allocate memory for handshake thread");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned j = 0; j < pool->num_tunnels; j++)
+        {
+            cktp_tunnel_t tunnel = cktp_clone_tunnel(pool->tunnels[j]);
+            for (unsigned k = 0; k < tunnel->open_encodings; k++)
+            {
+                cktp_enc_info_t enc_info = tunnel->encodings[k].info;
+                if (enc_info->defer != NULL)
+                {
+                    enc_info->defer(tunnel->encodings[k].state,
+                        CKTP_DEFER_WORKER);
+                }
             }
+            worker->tunnels[j] = tunnel;
+        }
+        thread_t thread;
+        if (thread_create(&thread, cktp_handshake_worker, worker) != 0)
+        {
+            error("unable to create handshake thread for tunnel %s",
+                pool->tunnels[0]->url);
+            exit(EXIT_FAILURE);
         }
     }
-
-    return newtunnel;
 }
 
 /*
- * Close a tunnel.
+ * Queue a deferred handshake packet.  Never blocks; if the queue is full the
+ * packet is dropped.
  */
-extern void cktp_close_tunnel(cktp_tunnel_t tunnel)
+static void cktp_handshake_submit(cktp_handshake_pool_t pool, unsigned idx,
+    const uint8_t *payload, size_t payload_size, unsigned layer, int64_t info,
+    const struct sockaddr_in *from_addr)
 {
-    if (tunnel == NULL)
+    if (payload_size > CKTP_MAX_PACKET_SIZE)
     {
         return;
     }
-    if (tunnel->socket > 0 && close(tunnel->socket) != 0)
-    {
-        error("unable to close socket");
-    }
-    for (size_t i = 0; i < tunnel->open_encodings; i++)
+    thread_lock(&pool->lock);
+    if (pool->count >= pool->depth)
     {
-        cktp_enc_info_t info = tunnel->encodings[i].info;
-        cktp_enc_state_t state = tunnel->encodings[i].state;
-        if (state != NULL)
+        uint64_t dropped = ++pool->dropped;
+        thread_unlock(&pool->lock);
+        stats_add(STATS_HANDSHAKE_DROPPED, 1);
+        if ((dropped & (dropped - 1)) == 0)
         {
-            info->free(state);
+            error("handshake queue for tunnel %s is full; %llu handshake "
+                "packets dropped so far", pool->tunnels[idx]->url,
+                (unsigned long long)dropped);
         }
+        return;
     }
-    free(tunnel);
+    struct cktp_handshake_s *handshake =
+        pool->queue + (pool->head + pool->count) % pool->depth;
+    memmove(CKTP_ENCODING_BUFF_INIT(handshake->buff, pool->overhead),
+        payload, payload_size);
+    handshake->idx   = idx;
+    handshake->size  = payload_size;
+    handshake->layer = layer;
+    handshake->info  = info;
+    memmove(&handshake->from_addr, from_addr, sizeof(handshake->from_addr));
+    handshake->time = stats_time();
+    pool->count++;
+    pool->queued++;
+    thread_cond_signal(&pool->cond);
+    thread_unlock(&pool->lock);
+    stats_add(STATS_HANDSHAKE_QUEUED, 1);
 }
 
 /*
- * Encode a packet.
+ * Handshake worker loop.
  */
-static bool cktp_encode_packet(cktp_tunnel_t tunnel, uint8_t **buffptr,
-    size_t *sizeptr, unsigned idx)
+static void *cktp_handshake_worker(void *ptr)
 {
-    idx = (idx > tunnel->open_encodings? tunnel->open_encodings: idx);
-    for (int i = idx-1; i >= 0; i--)
+    struct cktp_handshake_worker_s *worker =
+        (struct cktp_handshake_worker_s *)ptr;
+    cktp_handshake_pool_t pool = worker->pool;
+
+    stats_register("handshake");
+
+    size_t buff_size =
+        CKTP_ENCODING_BUFF_SIZE(CKTP_MAX_PACKET_SIZE, pool->overhead);
+    uint8_t *buff = (uint8_t *)malloc(buff_size);
+    uint8_t *reply_buff = (uint8_t *)malloc(buff_size);
+    if (buff == NULL || reply_buff == NULL)
     {
-        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
-        cktp_enc_state_t enc_state = tunnel->encodings[i].state;
-        size_t overhead = tunnel->encodings[i].overhead;
-        size_t size0 = *sizeptr;
-        uint8_t *buff0 = *buffptr;
+        error("unable to allocate memory for handshake buffers");
+        exit(EXIT_FAILURE);
+    }
 
-        int result = enc_info->encode(enc_state, buffptr, sizeptr);
-        
-        if (result != 0)
+    while (true)
+    {
+        // Take the next handshake (copy it out to free the queue slot):
+        thread_lock(&pool->lock);
+        while (pool->count == 0)
         {
-            return false;
+            thread_cond_wait(&pool->cond, &pool->lock);
         }
-        if (!cktp_encoding_verify(enc_info, overhead, buff0, *buffptr, size0,
-                *sizeptr))
+        struct cktp_handshake_s *handshake = pool->queue + pool->head;
+        cktp_tunnel_t tunnel = worker->tunnels[handshake->idx];
+        uint8_t *payload = CKTP_ENCODING_BUFF_INIT(buff, tunnel->overhead);
+        size_t payload_size = handshake->size;
+        memmove(payload,
+            CKTP_ENCODING_BUFF_INIT(handshake->buff, pool->overhead),
+            payload_size);
+        unsigned layer = handshake->layer;
+        int64_t info = handshake->info;
+        struct sockaddr_in from_addr;
+        memmove(&from_addr, &handshake->from_addr, sizeof(from_addr));
+        uint64_t queued_time = handshake->time;
+        pool->head = (pool->head + 1) % pool->depth;
+        pool->count--;
+        thread_unlock(&pool->lock);
+        stats_hist_add(STATS_HIST_QUEUE, stats_time() - queued_time);
+
+        uint8_t *reply = CKTP_ENCODING_BUFF_INIT(reply_buff,
+            tunnel->overhead);
+        uint8_t *out;
+        size_t out_size;
+        uint32_t daddr;
+        if (cktp_handle_payload(tunnel, -1, NULL, layer, info, payload,
+                payload_size, &from_addr, reply, &out, &out_size, &daddr) ==
+                CKTP_ACTION_REPLY)
         {
-            return false;
+            sendto(tunnel->socket, out, out_size, 0,
+                (struct sockaddr *)&from_addr, sizeof(from_addr));
+            stats_add(STATS_PACKETS_REPLY, 1);
+            stats_add(STATS_BYTES_REPLY, out_size);
         }
     }
-    return true;
 }
 
 /*
- * Decode a packet.
+ * Overload controller loop.  Measures the listen socket backlog (and kernel
+ * drops) and the handshake queue lag, and sheds new-session handshakes in
+ * stages while the server is saturated.  Established session data is never
+ * shed, so existing users are not starved by a wave of new clients.
  */
-static int cktp_decode_packet(cktp_tunnel_t tunnel, uint32_t source_addr,
-    uint8_t **buffptr, size_t *sizeptr, uint8_t **replyptr,
-    size_t *replysizeptr)
+static void *cktp_overload_controller(void *ptr)
 {
-    uint8_t *reply = *replyptr;
-    for (unsigned i = 0; i < tunnel->open_encodings; i++)
+    cktp_group_t group = (cktp_group_t)ptr;
+
+    stats_register("overload");
+
+    while (true)
     {
-        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
-        cktp_enc_state_t enc_state = tunnel->encodings[i].state;
-        size_t overhead = tunnel->encodings[i].overhead;
-        *replyptr = reply;
-        *replysizeptr = CKTP_MAX_PACKET_SIZE;
-        size_t size0 = *sizeptr, replysize0 = *replysizeptr;
-        uint8_t *buff0 = *buffptr, *reply0 = *replyptr;
-        
-        int result = enc_info->decode(enc_state, &source_addr, 1, buffptr,
-            sizeptr, replyptr, replysizeptr);
-        
-        if (result != 0)
-        {
-            return -1;
-        }
-        if (!cktp_encoding_verify(enc_info, overhead, buff0, *buffptr, size0,
-                *sizeptr))
+        sleeptime(CKTP_OVERLOAD_TICK);
+        unsigned level = CKTP_SHED_NONE;
+        for (unsigned i = 0; i < group->num_listeners; i++)
         {
-            // No decoded packet -- check for a reply packet:
-            if (!cktp_encoding_verify(enc_info, overhead, reply0, *replyptr,
-                    replysize0, *replysizeptr))
-            {
-                return -1;
-            }
-
-            // Got a reply packet:
-            return i+1;
+            unsigned listener_level =
+                cktp_overload_tick(group->listeners[i]);
+            level = (listener_level > level? listener_level: level);
         }
-        // Got a decoded packet, continue:
+        stats_set(STATS_OVERLOAD_LEVEL, level);
     }
-    return 0;
+
+    return NULL;
 }
 
 /*
- * Listen for messages.
+ * A single overload controller tick for a listener.  Returns the new
+ * shedding level.
  */
-extern void cktp_listen(cktp_tunnel_t tunnel, int socket_out, int socket_icmp,
-    unsigned threads)
+static unsigned cktp_overload_tick(cktp_listener_t listener)
 {
-    // Activate all encodings:
-    for (size_t i = 0; i < tunnel->open_encodings; i++)
+    struct cktp_overload_s *overload = &listener->overload;
+    cktp_handshake_pool_t pool = listener->handshakes;
+
+    // Socket backlog:
+    unsigned backlog = 0;
+    uint64_t drops = 0;
+    for (unsigned i = 0; i < listener->threads; i++)
     {
-        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
-        cktp_enc_state_t enc_state = tunnel->encodings[i].state;
-        if (enc_info->activate != NULL)
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t meminfo_size = sizeof(meminfo);
+        if (getsockopt(listener->params[i].tunnel->socket, SOL_SOCKET,
+                SO_MEMINFO, meminfo, &meminfo_size) != 0 ||
+            meminfo_size < sizeof(meminfo) ||
+            meminfo[SK_MEMINFO_RCVBUF] == 0)
         {
-            int err = enc_info->activate(enc_state);
-            if (err != 0)
-            {
-                error("unable to activate encoding %s for tunnel %s (%s)",
-                    enc_info->protocol, tunnel->url,
-                    enc_info->error_string(enc_state, err));
-                exit(EXIT_FAILURE);
-            }
+            continue;
         }
+        unsigned used = (unsigned)(((uint64_t)1000 *
+            meminfo[SK_MEMINFO_RMEM_ALLOC]) / meminfo[SK_MEMINFO_RCVBUF]);
+        backlog = (used > backlog? used: backlog);
+        drops += meminfo[SK_MEMINFO_DROPS];
     }
+    bool dropping = (drops > overload->drops);
+    overload->drops = drops;
 
-    // Spawn threads:
-    for (unsigned i = 0; i < CKTP_LISTEN_THREADS_MAX-1 && i < threads-1; i++)
+    // Handshake queue lag:
+    uint64_t lag = 0;
+    unsigned queued = 0, depth = 1;
+    if (pool != NULL)
     {
-        thread_t thread;
-        struct cktp_listen_s *params = (struct cktp_listen_s *)
-            malloc(sizeof(struct cktp_listen_s));
-        if (params == NULL)
+        uint64_t now = stats_time();
+        thread_lock(&pool->lock);
+        if (pool->count != 0)
         {
-            goto params_alloc_error;
+            uint64_t time = pool->queue[pool->head].time;
+            lag = (now > time? now - time: 0);
         }
-        params->tunnel = cktp_clone_tunnel(tunnel);
-        params->socket_out = socket_out;
-        params->socket_icmp = socket_icmp;
-        if (thread_create(&thread, cktp_listen_loop, params) != 0)
+        queued = pool->count;
+        depth = pool->depth;
+        thread_unlock(&pool->lock);
+    }
+
+    // Adjust the shedding level:
+    unsigned level = overload->level;
+    if (dropping || backlog >= CKTP_OVERLOAD_BACKLOG_HIGH ||
+        lag >= CKTP_OVERLOAD_LAG_HIGH || 4*queued >= 3*depth)
+    {
+        overload->calm = 0;
+        if (level < CKTP_SHED_MAX)
         {
-            error("unable to create listen thread for tunnel %s",
-                tunnel->url);
-            exit(EXIT_FAILURE);
+            level++;
+            stats_add(STATS_OVERLOAD_RAISED, 1);
         }
     }
-
-    struct cktp_listen_s *params = (struct cktp_listen_s *)
-        malloc(sizeof(struct cktp_listen_s));
-    if (params == NULL)
+    else if (backlog < CKTP_OVERLOAD_BACKLOG_LOW &&
+        lag < CKTP_OVERLOAD_LAG_LOW && 4*queued < depth)
+    {
+        overload->calm++;
+        if (level > CKTP_SHED_NONE &&
+            overload->calm >= CKTP_OVERLOAD_CALM)
+        {
+            overload->calm = 0;
+            level--;
+        }
+    }
+    else
     {
-        goto params_alloc_error;
+        overload->calm = 0;
     }
-    params->tunnel = cktp_clone_tunnel(tunnel);
-    params->socket_out = socket_out;
-    params->socket_icmp = socket_icmp;
-    cktp_listen_loop(params);
-    exit(EXIT_SUCCESS);
+    if (level > overload->level)
+    {
+        error("tunnel %s is overloaded (backlog %u.%u%%, handshake lag "
+            "%llums%s); shedding handshakes at level %u",
+            listener->tunnel->url, backlog / 10, backlog % 10,
+            (unsigned long long)(lag / MILLISECONDS),
+            (dropping? ", dropping packets": ""), level);
+    }
+    else if (level < overload->level)
+    {
+        error("tunnel %s overload easing; shedding handshakes at level "
+            "%u", listener->tunnel->url, level);
+    }
+    if (level != overload->level)
+    {
+        overload->level = level;
+        cktp_overload_shed(listener->tunnel, level);
+    }
+    return level;
+}
 
-params_alloc_error:
-    
-    error("unable to allocate %zu bytes for listen thread parameters for "
-        "tunnel %s", sizeof(struct cktp_listen_s), tunnel->url);
-    exit(EXIT_FAILURE);
+/*
+ * Set the shedding level of all encodings (the shedding state is shared by
+ * all clones of a tunnel).
+ */
+static void cktp_overload_shed(cktp_tunnel_t tunnel, unsigned level)
+{
+    for (unsigned i = 0; i < tunnel->open_encodings; i++)
+    {
+        cktp_enc_info_t enc_info = tunnel->encodings[i].info;
+        if (enc_info->shed != NULL)
+        {
+            enc_info->shed(tunnel->encodings[i].state, level);
+        }
+    }
 }
 
 /*
- * Main server loop.
+ * Handle a single received packet.  Returns the action the caller should
+ * take with the output packet (if any).
  */
-static void *cktp_listen_loop(void *ptr)
+static int cktp_handle_packet(cktp_tunnel_t tunnel, int socket_icmp,
+    cktp_handshake_pool_t handshakes, uint8_t *packet, size_t packet_size,
+    struct sockaddr_in *from_addr, uint8_t *reply, uint8_t **outptr,
+    size_t *outsizeptr, uint32_t *daddrptr)
 {
-    struct cktp_listen_s *params = (struct cktp_listen_s *)ptr;
-    cktp_tunnel_t tunnel = params->tunnel;
-    int socket_out  = params->socket_out;
-    int socket_icmp = params->socket_icmp;
-    free(params);
+    uint8_t *payload = packet;
+    size_t payload_size = packet_size;
+    stats_add(STATS_PACKETS_RECV, 1);
+    stats_add(STATS_BYTES_RECV, packet_size);
 
-    struct sockaddr_in from_addr;
-    struct sockaddr_in to_addr;
-    memset(&to_addr, 0x0, sizeof(to_addr));
-    to_addr.sin_family = AF_INET;
+    // Strip the transport header:
+    int64_t info = cktp_strip_transport_header(tunnel, &payload,
+        &payload_size);
+    if (info < 0)
+    {
+        return CKTP_ACTION_DROP;
+    }
 
-    // Use malloc instead of allocating from the stack -- probably safer.
-    size_t trans_hdr_size;
-    switch (tunnel->transport)
+    int action = cktp_handle_payload(tunnel, socket_icmp, handshakes, 0,
+        info, payload, payload_size, from_addr, reply, outptr, outsizeptr,
+        daddrptr);
+    switch (action)
     {
-        case CKTP_PROTO_IP:
-            trans_hdr_size = 0xF*sizeof(uint32_t);
-            break;
-        case CKTP_PROTO_PING:
-            trans_hdr_size = 0xF*sizeof(uint32_t) + sizeof(struct icmphdr);
+        case CKTP_ACTION_REPLY:
+            stats_add(STATS_PACKETS_REPLY, 1);
+            stats_add(STATS_BYTES_REPLY, *outsizeptr);
             break;
-        default:
-            trans_hdr_size = 0;
+        case CKTP_ACTION_FORWARD:
+            stats_add(STATS_PACKETS_FORWARD, 1);
+            stats_add(STATS_BYTES_FORWARD, *outsizeptr);
             break;
     }
-    size_t packet_size = CKTP_MAX_PACKET_SIZE + trans_hdr_size;
-    uint8_t *packet = (uint8_t *)malloc(packet_size);
-    uint8_t *reply_buff = (uint8_t *)malloc(
-        CKTP_ENCODING_BUFF_SIZE(CKTP_MAX_PACKET_SIZE, tunnel->overhead));
-    if (packet == NULL || reply_buff == NULL)
-    {
-        error("unable to allocate memory for packet buffers");
-        exit(EXIT_FAILURE);
-    }
-    uint8_t *reply = CKTP_ENCODING_BUFF_INIT(reply_buff, tunnel->overhead);
+    return action;
+}
 
-    // Main server loop:
-    while (true)
+/*
+ * Handle a packet payload (transport header removed), decoding from the
+ * given encoding layer.
+ */
+static int cktp_handle_payload(cktp_tunnel_t tunnel, int socket_icmp,
+    cktp_handshake_pool_t handshakes, unsigned layer, int64_t info,
+    uint8_t *payload, size_t payload_size, struct sockaddr_in *from_addr,
+    uint8_t *reply, uint8_t **outptr, size_t *outsizeptr, uint32_t *daddrptr)
+{
+    // Decode the packet (if required):
+    if (tunnel->open_encodings > 0)
     {
-        // Receive a packet:
-        socklen_t from_addr_len = sizeof(struct sockaddr_in);
-        int result = recvfrom(tunnel->socket, packet, packet_size, 0,
-            (struct sockaddr *)&from_addr, &from_addr_len);
-        if (result <= 0)
+        size_t reply_size;
+        uint8_t *reply_ptr = reply;
+
+        int result = cktp_decode_packet(tunnel, from_addr->sin_addr.s_addr,
+            &layer, &payload, &payload_size, &reply_ptr, &reply_size);
+        if (result == CKTP_DECODE_DEFER)
         {
-            continue;
+            // Expensive handshake; hand off to the handshake workers:
+            if (handshakes != NULL)
+            {
+                cktp_handshake_submit(handshakes, tunnel->idx, payload,
+                    payload_size, layer, info, from_addr);
+            }
+            return CKTP_ACTION_DROP;
+        }
+        if (result < 0)
+        {
+            // Decoding error:
+            stats_add(STATS_DECODE_ERROR, 1);
+            return CKTP_ACTION_DROP;
         }
 
-        uint8_t *payload = packet;
-        size_t payload_size = (size_t)result;
-
-        // Strip the transport header:
-        int64_t info = cktp_strip_transport_header(tunnel, &payload,
-            &payload_size);
-        if (info < 0)
+        if (result > 0)
         {
-            continue;
+            // Got a reply packet:
+            unsigned idx = result-1;
+            if (!cktp_encode_packet(tunnel, &reply_ptr, &reply_size, idx))
+            {
+                return CKTP_ACTION_DROP;
+            }
+            cktp_add_transport_header(tunnel, &reply_ptr, &reply_size, info);
+            *outptr = reply_ptr;
+            *outsizeptr = reply_size;
+            return CKTP_ACTION_REPLY;
         }
 
-        // Decode the packet (if required):
-        if (tunnel->open_encodings > 0)
+        // Otherwise, packet decoded successfully:
+    }
+
+    // Handle the packet:
+    struct cktp_msg_hdr_req_s *request = (struct cktp_msg_hdr_req_s *)payload;
+    switch (request->type)
+    {
+        case CKTP_TYPE_REFLECT:
         {
-            size_t reply_size;
-            uint8_t *reply_ptr = reply;
+            struct cktp_rflt_hdr_s *reflect =
+                (struct cktp_rflt_hdr_s *)request;
+            cktp_reflect(reflect, payload_size, from_addr, socket_icmp);
+            stats_add(STATS_PACKETS_REFLECT, 1);
+            return CKTP_ACTION_DROP;
+        }
+        case CKTP_TYPE_IPv4:
+        {
+            struct iphdr *ip_header = (struct iphdr *)request;
 
-            int result = cktp_decode_packet(tunnel, from_addr.sin_addr.s_addr,
-                &payload, &payload_size, &reply_ptr, &reply_size);
-            if (result < 0)
+            if (!cktp_is_valid_packet(tunnel->policy, ip_header,
+                payload_size, from_addr->sin_addr.s_addr))
             {
-                // Decoding error:
-                continue;
+                stats_add(STATS_PACKETS_INVALID, 1);
+                return CKTP_ACTION_DROP;
             }
 
-            if (result > 0)
+            *outptr = payload;
+            *outsizeptr = payload_size;
+            *daddrptr = ip_header->daddr;
+            return CKTP_ACTION_FORWARD;
+        }
+        case CKTP_TYPE_IPv6:
+            // NYI: IPv6
+            return CKTP_ACTION_DROP;
+        case CKTP_TYPE_BUNDLE:
+            // The packets are checked one by one by cktp_bundle_next():
+            if (payload_size < sizeof(struct cktp_bndl_hdr_s))
+            {
+                return CKTP_ACTION_DROP;
+            }
+            stats_add(STATS_PACKETS_BUNDLE, 1);
+            *outptr = payload + sizeof(struct cktp_bndl_hdr_s);
+            *outsizeptr = payload_size - sizeof(struct cktp_bndl_hdr_s);
+            return CKTP_ACTION_BUNDLE;
+        case CKTP_TYPE_MESSAGE:
+        {
+            size_t reply_size;
+            if (!cktp_request(tunnel, request, payload_size,
+                from_addr->sin_addr.s_addr, reply, &reply_size))
+            {
+                return CKTP_ACTION_DROP;
+            }
+            uint8_t *reply_ptr = reply;
+            if (tunnel->open_encodings > 0)
             {
-                // Got a reply packet:
-                unsigned idx = result-1;
-                if (cktp_encode_packet(tunnel, &reply, &reply_size, idx))
+                if (!cktp_encode_packet(tunnel, &reply_ptr, &reply_size,
+                    INT32_MAX))
                 {
-                    cktp_add_transport_header(tunnel, &reply, &reply_size,
-                        info);
-                    sendto(tunnel->socket, reply, reply_size, 0,
-                        (struct sockaddr *)&from_addr, sizeof(from_addr));
+                    return CKTP_ACTION_DROP;
                 }
-                continue;
             }
+            cktp_add_transport_header(tunnel, &reply_ptr, &reply_size, info);
+            *outptr = reply_ptr;
+            *outsizeptr = reply_size;
+            return CKTP_ACTION_REPLY;
+        }
+        default:
+            return CKTP_ACTION_DROP;
+    }
+}
 
-            // Otherwise, packet decoded successfully:
+/*
+ * Get the next packet from a bundle (the packets of a CKTP_ACTION_BUNDLE
+ * output).  Invalid packets are skipped.  Returns false once the bundle is
+ * exhausted.
+ */
+static bool cktp_bundle_next(cktp_tunnel_t tunnel, uint32_t source_addr,
+    uint8_t **bundleptr, size_t *bundlesizeptr, uint8_t **outptr,
+    size_t *outsizeptr, uint32_t *daddrptr)
+{
+    while (*bundlesizeptr >= sizeof(struct iphdr))
+    {
+        struct iphdr *ip_header = (struct iphdr *)*bundleptr;
+        size_t size = ntohs(ip_header->tot_len);
+        if (size < sizeof(struct iphdr) || size > *bundlesizeptr)
+        {
+            // Truncated; the rest of the bundle cannot be parsed.
+            stats_add(STATS_PACKETS_INVALID, 1);
+            break;
         }
+        size_t padded_size = CKTP_BUNDLE_ALIGN(size);
+        padded_size = (padded_size > *bundlesizeptr? *bundlesizeptr:
+            padded_size);
+        *bundleptr += padded_size;
+        *bundlesizeptr -= padded_size;
 
-        // Handle the packet:
-        struct cktp_msg_hdr_req_s *request =
-            (struct cktp_msg_hdr_req_s *)payload;
-        switch (request->type)
+        if (!cktp_is_valid_packet(tunnel->policy, ip_header, size,
+                source_addr))
         {
-            case CKTP_TYPE_REFLECT:
-            {
-                struct cktp_rflt_hdr_s *reflect =
-                    (struct cktp_rflt_hdr_s *)request;
-                cktp_reflect(reflect, payload_size, &from_addr, socket_icmp);
-                break;
-            }
-            case CKTP_TYPE_IPv4:
-            {
-                struct iphdr *ip_header = (struct iphdr *)request;
+            stats_add(STATS_PACKETS_INVALID, 1);
+            continue;
+        }
+        stats_add(STATS_PACKETS_FORWARD, 1);
+        stats_add(STATS_BYTES_FORWARD, size);
+        *outptr = (uint8_t *)ip_header;
+        *outsizeptr = size;
+        *daddrptr = ip_header->daddr;
+        return true;
+    }
+    *bundlesizeptr = 0;
+    return false;
+}
 
-                if (!cktp_is_valid_packet(ip_header, payload_size,
-                    from_addr.sin_addr.s_addr))
-                {
-                    continue;
-                }
+/*
+ * Queue an output packet in a batch.
+ */
+static void cktp_batch_add(struct mmsghdr *msgs, struct iovec *iovs,
+    unsigned idx, uint8_t *data, size_t size, struct sockaddr_in *addr)
+{
+    iovs[idx].iov_base = data;
+    iovs[idx].iov_len  = size;
+    memset(&msgs[idx].msg_hdr, 0x0, sizeof(msgs[idx].msg_hdr));
+    msgs[idx].msg_hdr.msg_iov     = iovs + idx;
+    msgs[idx].msg_hdr.msg_iovlen  = 1;
+    msgs[idx].msg_hdr.msg_name    = addr;
+    msgs[idx].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+}
 
-                to_addr.sin_addr.s_addr = ip_header->daddr;
-                sendto(socket_out, payload, payload_size, 0,
-                    (struct sockaddr *)&to_addr, sizeof(to_addr));
-                break;
-            }
-            case CKTP_TYPE_IPv6:
-                // NYI: IPv6
-                continue;
-            case CKTP_TYPE_MESSAGE:
+/*
+ * Forward a packet via the TX ring (if any), or queue it in a batch.  The
+ * queue is flushed early if it is full (a bundle can yield more forwards
+ * than the batch has received packets).
+ */
+static void cktp_batch_forward(struct cktp_listen_s *params,
+    struct cktp_batch_s *batch, uint8_t *data, size_t size, uint32_t daddr)
+{
+    if (params->txring != NULL &&
+        txring_send(params->txring, data, size, daddr))
+    {
+        return;
+    }
+    if (batch->num_forwards == CKTP_LISTEN_BATCH_MAX)
+    {
+        cktp_batch_flush(params->socket_out, batch->forward_msgs,
+            batch->num_forwards);
+        batch->num_forwards = 0;
+    }
+    batch->to_addrs[batch->num_forwards].sin_addr.s_addr = daddr;
+    cktp_batch_add(batch->forward_msgs, batch->forward_iovs,
+        batch->num_forwards, data, size,
+        batch->to_addrs + batch->num_forwards);
+    batch->num_forwards++;
+}
+
+/*
+ * Send all queued packets in a batch.  A packet that cannot be sent is
+ * dropped (as with sendto()).
+ */
+static void cktp_batch_flush(int socket, struct mmsghdr *msgs, unsigned num)
+{
+    unsigned sent = 0;
+    while (sent < num)
+    {
+        int result = sendmmsg(socket, msgs + sent, num - sent, 0);
+        if (result <= 0)
+        {
+            if (result < 0 && errno == EINTR)
             {
-                size_t reply_size;
-                if (!cktp_request(tunnel, request, payload_size,
-                    from_addr.sin_addr.s_addr, reply, &reply_size))
-                {
-                    continue;
-                }
-                uint8_t *reply_ptr = reply;
-                if (tunnel->open_encodings > 0)
-                {
-                    if (!cktp_encode_packet(tunnel, &reply_ptr, &reply_size,
-                        INT32_MAX))
-                    {
-                        continue;
-                    }
-                }
-                cktp_add_transport_header(tunnel, &reply_ptr, &reply_size,
-                    info);
-                sendto(tunnel->socket, reply_ptr, reply_size, 0,
-                    (struct sockaddr *)&from_addr, sizeof(from_addr));
-                break;
-            }
-            default:
                 continue;
+            }
+            sent++;         // Skip the failed packet.
+            continue;
         }
+        sent += (unsigned)result;
     }
 }
 
@@ -667,10 +2876,11 @@ static void cktp_add_transport_header(cktp_tunnel_t tunnel, uint8_t **payload,
 }
 
 /*
- * Check if the given IPv4 packet can be forwarded or not. 
+ * Check if the given IPv4 packet can be forwarded or not (according to the
+ * tunnel's egress policy).
  */
-static bool cktp_is_valid_packet(struct iphdr *payload, size_t payload_size,
-    uint32_t source_addr)
+static bool cktp_is_valid_packet(policy_t policy, struct iphdr *payload,
+    size_t payload_size, uint32_t source_addr)
 {
     // Preliminary checks:
     if ((uint16_t)payload_size != ntohs(payload->tot_len) ||
@@ -682,6 +2892,7 @@ static bool cktp_is_valid_packet(struct iphdr *payload, size_t payload_size,
 
     // Protocol checks:
     uint8_t *next_header = (uint8_t *)payload + payload->ihl*sizeof(uint32_t);
+    uint16_t port;
     switch (payload->protocol)
     {
         case IPPROTO_TCP:
@@ -691,10 +2902,7 @@ static bool cktp_is_valid_packet(struct iphdr *payload, size_t payload_size,
                 return false;
             }
             struct tcphdr *tcp_header = (struct tcphdr *)next_header;
-            if (tcp_header->dest != htons(80))
-            {
-                return false;
-            }
+            port = tcp_header->dest;
             break;
         case IPPROTO_UDP:
             if (payload_size < payload->ihl*sizeof(uint32_t) +
@@ -703,16 +2911,24 @@ static bool cktp_is_valid_packet(struct iphdr *payload, size_t payload_size,
                 return false;
             }
             struct udphdr *udp_header = (struct udphdr *)next_header;
-            if (udp_header->dest != htons(53))
-            {
-                return false;
-            }
+            port = udp_header->dest;
             break;
         default:
             return false;
     }
 
-    return cktp_is_ipv4_addr_public(payload->daddr);
+    switch (policy_check(policy, payload->daddr, payload->protocol,
+        ntohs(port)))
+    {
+        case POLICY_ALLOW:
+            return true;
+        case POLICY_RATE:
+            stats_add(STATS_POLICY_RATE, 1);
+            return false;
+        default:
+            stats_add(STATS_POLICY_DENIED, 1);
+            return false;
+    }
 }
 
 /*
@@ -813,7 +3029,8 @@ static bool cktp_request(cktp_tunnel_t tunnel,
                     cktp_stream_get_ptr(rep, uint32_t, uint32_ptr,
                         stream_error);
                     *uint32_ptr = CKTP_FLAG_SUPPORTS_IPv4 |
-                                  CKTP_FLAG_SUPPORTS_TUNNEL;
+                                  CKTP_FLAG_SUPPORTS_TUNNEL |
+                                  CKTP_FLAG_SUPPORTS_BUNDLE;
                     break;
                 case CKTP_MESSAGE_GET_IPv4_ADDR:
                     rep_bdy->error = CKTP_OK;
@@ -20,20 +20,65 @@
 #define __CKTP_SERVER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "policy.h"
 
 /*
  * An open CKTP tunnel.
  */
 typedef struct cktp_tunnel_s *cktp_tunnel_t;
 
+/*
+ * A set of listen threads (and their sockets) for an open CKTP tunnel.
+ */
+typedef struct cktp_listener_s *cktp_listener_t;
+
+/*
+ * Several CKTP tunnels served by one shared pool of listen threads.
+ */
+typedef struct cktp_group_s *cktp_group_t;
+
+/*
+ * Listen configuration.
+ */
+#define CKTP_LISTEN_NO_CPU          (-1)
+#define CKTP_LISTEN_ENGINE_MMSG     0   // recvmmsg()/sendmmsg()
+#define CKTP_LISTEN_ENGINE_URING    1   // io_uring
+struct cktp_listen_config_s
+{
+    unsigned threads;           // Number of listen threads.
+    int cpu;                    // First CPU to pin threads to (or NO_CPU).
+    unsigned busy_poll;         // SO_BUSY_POLL time in us (or 0).
+    unsigned engine;            // I/O engine.
+    const char *tx_ring;        // Forward via a TX ring on this interface.
+    unsigned handshake_threads; // Handshake worker threads (0 = inline).
+    unsigned handshake_queue;   // Handshake queue depth.
+    unsigned cookie_rate;       // Cookie requests/s per source (0 = any).
+    unsigned key_rate;          // Key requests/s per source (0 = any).
+    unsigned key_pool;          // Pre-computed DH key pairs (0 = none).
+    unsigned key_pool_rate;     // Key pairs computed per second.
+    const uint8_t *cluster_secret;  // Cluster shared secret (or NULL).
+    size_t cluster_secret_size; // Cluster shared secret size.
+    policy_t policy;            // Egress policy (or NULL = built-in).
+    const char *handover;       // Handover socket for reloads (or NULL).
+};
+
 /*
  * Prototypes.
  */
 bool cktp_init(void);
 cktp_tunnel_t cktp_open_tunnel(const char *url);
+cktp_tunnel_t *cktp_takeover(const char *path, const char **urls,
+    unsigned num_urls, unsigned *num_tunnels);
 void cktp_close_tunnel(cktp_tunnel_t tunnel);
-void cktp_listen(cktp_tunnel_t tunnel, int socket_out, int socket_icmp,
-    unsigned threads);
+cktp_listener_t cktp_open_listener(cktp_tunnel_t tunnel,
+    const struct cktp_listen_config_s *config);
+void cktp_listen(cktp_listener_t listener);
+cktp_group_t cktp_open_group(cktp_tunnel_t *tunnels, unsigned num_tunnels,
+    const struct cktp_listen_config_s *config);
+void cktp_listen_group(cktp_group_t group);
 bool cktp_is_ipv4_addr_public(uint32_t addr);
 
 #endif      /* __CKTP_SERVER_H */
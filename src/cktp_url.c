@@ -28,6 +28,7 @@
 #include "socket.h"
 
 #include "encodings/crypt.h"
+#include "encodings/hc.h"
 #include "encodings/pad.h"
 
 #define MAX_TRANSPORT_NAME  16
@@ -71,6 +72,7 @@ struct encoding_s
 struct encoding_s enc_data[] =
 {
     {"crypt", &crypt_encoding},
+    {"hc",    &hc_encoding},
     {"pad",   &pad_encoding}
 };
 
@@ -185,6 +187,7 @@ bool cktp_parse_url(const char *url, int *transport, char *server,
     }
     i++;
 
+    bool innermost = false;
     for (j = 0; j < CKTP_MAX_ENCODINGS; j++)
     {
         struct encoding_s enc_key;
@@ -210,6 +213,13 @@ bool cktp_parse_url(const char *url, int *transport, char *server,
                 "encoding \"%s\"", url, enc_key.name);
             return false;
         }
+        if (innermost)
+        {
+            warning("unable to parse url \"%s\"; encoding \"hc\" must be "
+                "the last encoding", url);
+            return false;
+        }
+        innermost = (enc_info->info == &hc_encoding);
 
         // Parse comma seperated set of encoding options
         char enc_options[CKTP_MAX_ENCODING_OPTIONS+1];
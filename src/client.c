@@ -25,6 +25,8 @@
 #include "capture.h"
 #include "cfg.h"
 #include "config.h"
+#include "dns_cache.h"
+#include "domain.h"
 #include "http_server.h"
 #include "install.h"
 #include "log.h"
@@ -35,7 +37,9 @@
 #include "packet_filter.h"
 #include "packet_track.h"
 #include "random.h"
+#include "route.h"
 #include "thread.h"
+#include "timer.h"
 #include "tunnel.h"
 
 #define NUM_THREADS_DEFAULT     3
@@ -46,7 +50,15 @@
  */
 static void *configuration_thread(void *arg);
 static void *worker_thread(void *arg);
-static bool user_exit(http_buffer_t buff);
+static bool user_exit(const struct http_user_vars_s *query,
+    http_buffer_t buff);
+static bool memory_report(const struct http_user_vars_s *query,
+    http_buffer_t buff);
+
+/*
+ * Number of worker threads.
+ */
+static int num_threads;
 
 /*
  * Global configuration.
@@ -79,6 +91,14 @@ int MAIN(int argc, char **argv)
     install_files();
     trace("initialising user configuration");
     config_init();
+    trace("initialising domain set");
+    domain_init();
+    trace("initialising routes");
+    route_init();
+    trace("initialising timers");
+    timer_init();
+    trace("initialising DNS cache");
+    dns_cache_init();
     trace("initialising tunnel management");
     tunnel_init();
 
@@ -87,7 +107,7 @@ int MAIN(int argc, char **argv)
     init_sockets();
 
     // Get number of threads.
-    int num_threads =
+    num_threads =
         (options_get()->seen_num_threads?  options_get()->val_num_threads:
             NUM_THREADS_DEFAULT);
     if (num_threads < 1 || num_threads > NUM_THREADS_MAX)
@@ -154,11 +174,22 @@ static void *worker_thread(void *arg)
     {
         uint8_t packet[CKTP_MAX_PACKET_SIZE + sizeof(struct ethhdr)];
         uint8_t packet_buff[PACKET_BUFF_SIZE];
-        size_t packet_len = get_packet(packet, sizeof(packet));
+        bool inbound;
+        size_t packet_len = get_packet(packet, sizeof(packet), &inbound);
 
         struct config_s config;
         config_get(&config);
 
+        // Inbound packets are DNS replies (already passed on) for the cache.
+        if (inbound)
+        {
+            if (config.dns_cache)
+            {
+                dns_cache_reply(packet, packet_len);
+            }
+            continue;
+        }
+
         // Do we need to tunnel this packet?
         if (!packet_filter(&config, packet, packet_len))
         {
@@ -166,6 +197,18 @@ static void *worker_thread(void *arg)
             continue;
         }
 
+        // Can this DNS query be answered from the cache?
+        if (config.dns_cache)
+        {
+            size_t reply_len = dns_cache_query(packet, packet_len,
+                packet_buff, sizeof(packet_buff));
+            if (reply_len != 0)
+            {
+                inject_reply(packet_buff, reply_len);
+                continue;
+            }
+        }
+
         // Is there a tunnel available for use?
         if (!tunnel_ready())
         {
@@ -226,6 +269,7 @@ static void *configuration_thread(void *arg)
 
     // Register an exit handler.
     http_register_callback("exit", user_exit);
+    http_register_callback("memory.txt", memory_report);
 
     log("starting %s user interface http://localhost:%u/", PROGRAM_NAME, port);
     http_server(port, config_callback, launch);
@@ -235,8 +279,40 @@ static void *configuration_thread(void *arg)
 /*
  * User interface exit handler.
  */
-static bool user_exit(http_buffer_t buff)
+static bool user_exit(const struct http_user_vars_s *query,
+    http_buffer_t buff)
 {
     quit(EXIT_SUCCESS);
 }
 
+/*
+ * User interface memory accounting report.
+ */
+static bool memory_report(const struct http_user_vars_s *query,
+    http_buffer_t buff)
+{
+    size_t num_tunnels, tunnel_bytes, num_urls, url_bytes;
+    tunnel_memory(&num_tunnels, &tunnel_bytes, &num_urls, &url_bytes);
+    size_t num_dns_entries, dns_bytes;
+    dns_cache_memory(&num_dns_entries, &dns_bytes);
+    size_t worker_bytes = CKTP_MAX_PACKET_SIZE + sizeof(struct ethhdr) +
+        PACKET_BUFF_SIZE;
+
+    char line[128];
+    snprintf(line, sizeof(line), "tunnels: " SIZE_T_FMT " (" SIZE_T_FMT
+        " bytes)\n", num_tunnels, tunnel_bytes);
+    http_buffer_puts(buff, line);
+    snprintf(line, sizeof(line), "tunnel URLs: " SIZE_T_FMT " (" SIZE_T_FMT
+        " bytes)\n", num_urls, url_bytes);
+    http_buffer_puts(buff, line);
+    snprintf(line, sizeof(line), "DNS cache entries: " SIZE_T_FMT " ("
+        SIZE_T_FMT " bytes)\n", num_dns_entries, dns_bytes);
+    http_buffer_puts(buff, line);
+    snprintf(line, sizeof(line), "worker threads: %d (" SIZE_T_FMT " bytes "
+        "of packet buffers)\n", num_threads, num_threads * worker_bytes);
+    http_buffer_puts(buff, line);
+    snprintf(line, sizeof(line), "thread stack size: %u bytes\n",
+        (unsigned)THREAD_STACK_SIZE);
+    http_buffer_puts(buff, line);
+    return true;
+}
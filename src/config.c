@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "capture.h"
 #include "config.h"
 #include "http_server.h"
 #include "log.h"
@@ -46,6 +47,8 @@
 #define VAR_HIDE_TCP_FIN        "HIDE_TCP_FIN"
 #define VAR_HIDE_TCP_RST        "HIDE_TCP_RST"
 #define VAR_HIDE_UDP            "HIDE_UDP"
+#define VAR_SELECTIVE           "SELECTIVE"
+#define VAR_DNS_CACHE           "DNS_CACHE"
 #define VAR_SPLIT_MODE          "SPLIT_MODE"
 #define VAR_LOG_LEVEL           "LOG_LEVEL"
 #define VAR_GHOST_MODE          "GHOST_MODE"
@@ -96,6 +99,8 @@ const struct config_s config_default =
     FLAG_SET,
     FLAG_SET,
     false,
+    false,
+    false,
     SPLIT_NONE,
     GHOST_NAT,
     true,
@@ -244,6 +249,10 @@ void config_callback(struct http_user_vars_s *vars)
             DEF_SIZE(log_level_def)));
         http_user_var_insert(vars, VAR_HIDE_UDP,
             bool_to_string(config.hide_udp));
+        http_user_var_insert(vars, VAR_SELECTIVE,
+            bool_to_string(config.selective));
+        http_user_var_insert(vars, VAR_DNS_CACHE,
+            bool_to_string(config.dns_cache));
         http_user_var_insert(vars, VAR_GHOST_MODE,
             enum_to_string(config.ghost, ghost_def, DEF_SIZE(ghost_def)));
         http_user_var_insert(vars, VAR_GHOST_CHECK,
@@ -274,12 +283,19 @@ void config_callback(struct http_user_vars_s *vars)
         struct config_s config_temp;
         memmove(&config_temp, &config, sizeof(struct config_s));
         load_config(vars, &config_temp);
+        bool dns_cache_changed = (config_temp.dns_cache != config.dns_cache);
 
         // Copy to the global configuration state.
         thread_lock(&config_lock);
         memmove(&config, &config_temp, sizeof(struct config_s));
         thread_unlock(&config_lock);
 
+        // Inbound DNS replies are only captured for the DNS cache.
+        if (dns_cache_changed)
+        {
+            capture_dns_replies(config_temp.dns_cache);
+        }
+
         // Save the new configuration to disk.
         write_config(&config_temp);
 
@@ -324,6 +340,8 @@ static void load_config(struct http_user_vars_s *vars, struct config_s *config)
         log_set_level(log_level);
     }
     http_get_bool_var(vars, VAR_HIDE_UDP, &config->hide_udp);
+    http_get_bool_var(vars, VAR_SELECTIVE, &config->selective);
+    http_get_bool_var(vars, VAR_DNS_CACHE, &config->dns_cache);
     http_get_enum_var(vars, VAR_GHOST_MODE, ghost_def, DEF_SIZE(ghost_def),
         &config->ghost);
     http_get_bool_var(vars, VAR_GHOST_CHECK, &config->ghost_check);
@@ -394,6 +412,10 @@ static void write_config(struct config_s *config)
         enum_to_string(config->hide_tcp_rst, flag_def, DEF_SIZE(flag_def)));
     fprintf(file, "%s = \"%s\"\n", VAR_HIDE_UDP,
         bool_to_string(config->hide_udp));
+    fprintf(file, "%s = \"%s\"\n", VAR_SELECTIVE,
+        bool_to_string(config->selective));
+    fprintf(file, "%s = \"%s\"\n", VAR_DNS_CACHE,
+        bool_to_string(config->dns_cache));
     fprintf(file, "%s = \"%s\"\n", VAR_SPLIT_MODE,
         enum_to_string(config->split, split_def, DEF_SIZE(split_def)));
     fprintf(file, "%s = \"%s\"\n", VAR_LOG_LEVEL,
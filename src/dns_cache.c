@@ -0,0 +1,576 @@
+/*
+ * dns_cache.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Local cache of DNS answers for tunneled queries.
+ *
+ * A query that is about to be tunneled is first looked up by (QNAME, QTYPE,
+ * QCLASS, resolver, EDNS and DO bit).  A hit must also fit within the UDP
+ * payload size the query allows (512 bytes without EDNS), so a query
+ * without an OPT record is never answered with one.  On a miss the query is
+ * remembered as pending, and when the resolver's reply is captured it is
+ * cached until its smallest TTL expires.  Only a reply that matches a
+ * pending query (resolver, client address and port, ID and question) is
+ * cached, so unsolicited replies cannot poison the cache.  A repeat query is
+ * answered with a copy of the cached reply carrying the query's ID, question
+ * (i.e. QNAME case) and RD flag, with every TTL reduced by the time spent in
+ * the cache.
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "dns_cache.h"
+#include "domain.h"
+#include "log.h"
+#include "misc.h"
+#include "packet_protocol.h"
+#include "socket.h"
+#include "thread.h"
+
+#define DNS_CACHE_SIZE          1024        // Cache slots (direct mapped)
+#define DNS_PENDING_SIZE        256         // Pending query slots
+#define DNS_PENDING_TIMEOUT     (10 * SECONDS)
+#define DNS_MAX_TTL             3600        // Seconds
+#define DNS_MAX_REPLY_SIZE      1232        // Largest cached reply
+#define DNS_MIN_UDP_SIZE        512         // UDP payload limit without EDNS
+#define DNS_PORT                53
+#define DNS_QR                  0x8000
+#define DNS_OPCODE              0x7800
+#define DNS_TC                  0x0200
+#define DNS_RD                  0x0100
+#define DNS_RCODE               0x000F
+#define DNS_RCODE_NOERROR       0
+#define DNS_RCODE_NXDOMAIN      3
+#define DNS_TYPE_OPT            41
+#define DNS_OPT_DO              0x8000      // DNSSEC OK (in OPT TTL)
+#define DNS_EDNS                0x01        // Query has an OPT record
+#define DNS_EDNS_DO             0x02        // Query has the DO bit set
+#define DNS_HASH_INIT           0xCBF29CE484222325ull
+#define DNS_HASH_PRIME          0x00000100000001B3ull
+
+/*
+ * A cached reply.
+ */
+struct dns_entry_s
+{
+    uint64_t hash;                  // Key hash
+    uint32_t resolver;              // Resolver address
+    uint64_t time;                  // Time cached
+    uint64_t expiry;                // Time expires
+    size_t   qname_len;             // QNAME length (wire format)
+    size_t   size;                  // Reply size
+    uint8_t  edns;                  // Query's DNS_EDNS* flags
+    uint8_t  reply[];               // DNS reply
+};
+
+/*
+ * A tunneled query awaiting its reply.
+ */
+struct dns_pending_s
+{
+    uint64_t hash;                  // Key hash (0 = unused)
+    uint64_t time;                  // Time of query
+    uint32_t resolver;              // Resolver address
+    uint32_t client;                // Client address
+    uint16_t port;                  // Client port
+    uint16_t id;                    // Query ID
+    uint8_t  edns;                  // Query's DNS_EDNS* flags
+};
+
+/*
+ * The cache.
+ */
+static struct dns_entry_s *dns_cache[DNS_CACHE_SIZE];
+static struct dns_pending_s dns_pending[DNS_PENDING_SIZE];
+static mutex_t dns_cache_lock;
+static const struct proto_s *dns_protocol;
+
+/*
+ * Prototypes.
+ */
+static bool dns_parse(const uint8_t *packet, size_t packet_len,
+    struct iphdr **ip_header_ptr, struct udphdr **udp_header_ptr,
+    uint8_t **data_ptr, size_t *data_len_ptr, size_t *qname_len_ptr);
+static bool dns_edns(const uint8_t *data, size_t data_len, size_t qname_len,
+    uint8_t *edns_ptr, size_t *limit_ptr);
+static uint64_t dns_key(const uint8_t *data, size_t qname_len,
+    uint32_t resolver, uint8_t edns);
+static bool dns_question_equal(const uint8_t *data1, const uint8_t *data2,
+    size_t qname_len);
+static bool dns_skip_name(const uint8_t *data, size_t data_len, size_t *i_ptr);
+static bool dns_ttls(uint8_t *data, size_t data_len, size_t qname_len,
+    uint32_t age, uint32_t *min_ttl_ptr);
+static struct dns_pending_s *dns_pending_slot(uint32_t resolver,
+    uint32_t client, uint16_t port, uint16_t id);
+
+/*
+ * Initialise the DNS cache.
+ */
+void dns_cache_init(void)
+{
+    if (thread_lock_init(&dns_cache_lock))
+    {
+        error("unable to initialise DNS cache lock");
+    }
+    dns_protocol = protocol_get_def(protocol_get("dns"));
+}
+
+/*
+ * Look up a (to be tunneled) DNS query in the cache.  On a hit, writes a
+ * reply packet (with the query's link header) to reply and returns its
+ * size; otherwise remembers the query and returns 0.
+ */
+size_t dns_cache_query(const uint8_t *packet, size_t packet_len,
+    uint8_t *reply, size_t reply_size)
+{
+    struct iphdr *ip_header;
+    struct udphdr *udp_header;
+    uint8_t *data;
+    size_t data_len, qname_len;
+    if (!dns_parse(packet, packet_len, &ip_header, &udp_header, &data,
+            &data_len, &qname_len))
+    {
+        return 0;
+    }
+    struct dnshdr *dns_header = (struct dnshdr *)data;
+    if (udp_header->dest != htons(DNS_PORT) ||
+        (ntohs(dns_header->option) & (DNS_QR | DNS_OPCODE)) != 0)
+    {
+        return 0;
+    }
+
+    uint8_t edns;
+    size_t limit;
+    if (!dns_edns(data, data_len, qname_len, &edns, &limit))
+    {
+        return 0;
+    }
+    uint64_t hash = dns_key(data, qname_len, ip_header->daddr, edns);
+    uint64_t now = gettime_coarse();
+    thread_lock(&dns_cache_lock);
+    struct dns_entry_s **slot = dns_cache + hash % DNS_CACHE_SIZE;
+    struct dns_entry_s *entry = *slot;
+    if (entry != NULL && now >= entry->expiry)
+    {
+        free(entry);
+        *slot = entry = NULL;
+    }
+    size_t header_size = sizeof(struct ethhdr) + sizeof(struct iphdr) +
+        sizeof(struct udphdr);
+    if (entry == NULL || entry->hash != hash ||
+        entry->resolver != ip_header->daddr ||
+        entry->qname_len != qname_len || entry->edns != edns ||
+        !dns_question_equal(entry->reply, data, qname_len) ||
+        entry->size > limit || header_size + entry->size > reply_size)
+    {
+        // Miss: remember the query so that its reply can be cached.
+        struct dns_pending_s *pending = dns_pending_slot(ip_header->daddr,
+            ip_header->saddr, udp_header->source, dns_header->id);
+        pending->hash     = hash;
+        pending->time     = now;
+        pending->resolver = ip_header->daddr;
+        pending->client   = ip_header->saddr;
+        pending->port     = udp_header->source;
+        pending->id       = dns_header->id;
+        pending->edns     = edns;
+        thread_unlock(&dns_cache_lock);
+        return 0;
+    }
+
+    // Hit: the cached reply with the query's ID, question and RD flag.
+    memmove(reply, packet, sizeof(struct ethhdr));
+    struct iphdr *reply_ip_header =
+        (struct iphdr *)(reply + sizeof(struct ethhdr));
+    struct udphdr *reply_udp_header = (struct udphdr *)(reply_ip_header + 1);
+    uint8_t *reply_data = (uint8_t *)(reply_udp_header + 1);
+    memmove(reply_data, entry->reply, entry->size);
+    memmove(reply_data + sizeof(struct dnshdr), data + sizeof(struct dnshdr),
+        qname_len);
+    struct dnshdr *reply_dns_header = (struct dnshdr *)reply_data;
+    reply_dns_header->id = dns_header->id;
+    reply_dns_header->option = (reply_dns_header->option & ~htons(DNS_RD)) |
+        (dns_header->option & htons(DNS_RD));
+    uint32_t min_ttl;
+    dns_ttls(reply_data, entry->size, qname_len,
+        (uint32_t)((now - entry->time) / SECONDS), &min_ttl);
+    size_t size = entry->size;
+    thread_unlock(&dns_cache_lock);
+
+    reply_ip_header->version  = 4;
+    reply_ip_header->ihl      = sizeof(struct iphdr) / sizeof(uint32_t);
+    reply_ip_header->tos      = 0;
+    reply_ip_header->tot_len  = htons(sizeof(struct iphdr) +
+        sizeof(struct udphdr) + size);
+    reply_ip_header->id       = ip_header->id;
+    reply_ip_header->frag_off = htons(IP_DF);
+    reply_ip_header->ttl      = 64;
+    reply_ip_header->protocol = IPPROTO_UDP;
+    reply_ip_header->saddr    = ip_header->daddr;
+    reply_ip_header->daddr    = ip_header->saddr;
+    reply_ip_header->check    = 0;
+    reply_ip_header->check    = ip_checksum(reply_ip_header);
+    reply_udp_header->source  = udp_header->dest;
+    reply_udp_header->dest    = udp_header->source;
+    reply_udp_header->len     = htons(sizeof(struct udphdr) + size);
+    reply_udp_header->check   = 0;      // None (IPv4 only).
+
+    if (log_enabled(LOG_MESSAGE_PACKET))
+    {
+        char name[DOMAIN_MAX_LENGTH + 1];
+        size_t name_len;
+        if (dns_protocol->domain((uint8_t *)ip_header, name, &name_len))
+        {
+            name[name_len] = '\0';
+            packet("answered DNS query for %s from the cache", name);
+        }
+    }
+    return header_size + size;
+}
+
+/*
+ * Offer a captured DNS reply to the cache.
+ */
+void dns_cache_reply(const uint8_t *packet, size_t packet_len)
+{
+    struct iphdr *ip_header;
+    struct udphdr *udp_header;
+    uint8_t *data;
+    size_t data_len, qname_len;
+    if (!dns_parse(packet, packet_len, &ip_header, &udp_header, &data,
+            &data_len, &qname_len))
+    {
+        return;
+    }
+    struct dnshdr *dns_header = (struct dnshdr *)data;
+    uint16_t option = ntohs(dns_header->option);
+    if (udp_header->source != htons(DNS_PORT) ||
+        (option & (DNS_QR | DNS_OPCODE | DNS_TC)) != DNS_QR ||
+        ((option & DNS_RCODE) != DNS_RCODE_NOERROR &&
+         (option & DNS_RCODE) != DNS_RCODE_NXDOMAIN) ||
+        data_len > DNS_MAX_REPLY_SIZE)
+    {
+        return;
+    }
+
+    // Only cache the replies to our queries (keyed by the query's EDNS):
+    uint64_t now = gettime_coarse();
+    thread_lock(&dns_cache_lock);
+    struct dns_pending_s *pending = dns_pending_slot(ip_header->saddr,
+        ip_header->daddr, udp_header->dest, dns_header->id);
+    uint8_t edns = pending->edns;
+    uint64_t hash = dns_key(data, qname_len, ip_header->saddr, edns);
+    bool match = (pending->hash == hash &&
+        pending->resolver == ip_header->saddr &&
+        pending->client == ip_header->daddr &&
+        pending->port == udp_header->dest &&
+        pending->id == dns_header->id &&
+        now - pending->time < DNS_PENDING_TIMEOUT);
+    if (match)
+    {
+        pending->hash = 0;
+    }
+    thread_unlock(&dns_cache_lock);
+    if (!match)
+    {
+        return;
+    }
+
+    struct dns_entry_s *entry = (struct dns_entry_s *)malloc(
+        sizeof(struct dns_entry_s) + data_len);
+    if (entry == NULL)
+    {
+        return;
+    }
+    memmove(entry->reply, data, data_len);
+    uint32_t min_ttl;
+    if (!dns_ttls(entry->reply, data_len, qname_len, 0, &min_ttl) ||
+        min_ttl == 0 || min_ttl == UINT32_MAX)
+    {
+        // Malformed, or nothing to say how long the answer is valid.
+        free(entry);
+        return;
+    }
+    min_ttl = (min_ttl > DNS_MAX_TTL? DNS_MAX_TTL: min_ttl);
+    entry->hash      = hash;
+    entry->resolver  = ip_header->saddr;
+    entry->time      = now;
+    entry->expiry    = now + (uint64_t)min_ttl * SECONDS;
+    entry->qname_len = qname_len;
+    entry->size      = data_len;
+    entry->edns      = edns;
+
+    thread_lock(&dns_cache_lock);
+    struct dns_entry_s **slot = dns_cache + hash % DNS_CACHE_SIZE;
+    struct dns_entry_s *old_entry = *slot;
+    *slot = entry;
+    thread_unlock(&dns_cache_lock);
+    free(old_entry);
+}
+
+/*
+ * Report the memory used by the DNS cache.
+ */
+void dns_cache_memory(size_t *num_entries, size_t *bytes)
+{
+    *num_entries = 0;
+    *bytes = sizeof(dns_cache) + sizeof(dns_pending);
+    thread_lock(&dns_cache_lock);
+    for (size_t i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        if (dns_cache[i] != NULL)
+        {
+            (*num_entries)++;
+            *bytes += sizeof(struct dns_entry_s) + dns_cache[i]->size;
+        }
+    }
+    thread_unlock(&dns_cache_lock);
+}
+
+/*
+ * Parse an IPv4/UDP DNS packet (with link header) with exactly one question.
+ */
+static bool dns_parse(const uint8_t *packet, size_t packet_len,
+    struct iphdr **ip_header_ptr, struct udphdr **udp_header_ptr,
+    uint8_t **data_ptr, size_t *data_len_ptr, size_t *qname_len_ptr)
+{
+    if (packet_len < sizeof(struct ethhdr) + sizeof(struct iphdr))
+    {
+        return false;
+    }
+    struct iphdr *ip_header = (struct iphdr *)(packet + sizeof(struct ethhdr));
+    size_t ip_header_size = ip_header->ihl*sizeof(uint32_t);
+    size_t ip_len = ntohs(ip_header->tot_len);
+    if (ip_header->version != 4 || ip_header->protocol != IPPROTO_UDP ||
+        ip_header_size < sizeof(struct iphdr) ||
+        ip_len > packet_len - sizeof(struct ethhdr) ||
+        ip_len < ip_header_size + sizeof(struct udphdr) ||
+        (ntohs(ip_header->frag_off) & ~IP_DF) != 0)
+    {
+        return false;
+    }
+    struct udphdr *udp_header =
+        (struct udphdr *)((uint8_t *)ip_header + ip_header_size);
+    size_t udp_len = ntohs(udp_header->len);
+    if (udp_len < sizeof(struct udphdr) + sizeof(struct dnshdr) ||
+        udp_len != ip_len - ip_header_size)
+    {
+        return false;
+    }
+    uint8_t *data = (uint8_t *)(udp_header + 1);
+    size_t data_len = udp_len - sizeof(struct udphdr);
+
+    // The question (the QNAME extent is found by the protocol's matcher):
+    struct dnshdr *dns_header = (struct dnshdr *)data;
+    size_t start, end;
+    if (ntohs(dns_header->qdcount) != 1 ||
+        !dns_protocol->match((uint8_t *)ip_header, &start, &end) ||
+        end + 2*sizeof(uint16_t) > data_len)
+    {
+        return false;
+    }
+
+    *ip_header_ptr  = ip_header;
+    *udp_header_ptr = udp_header;
+    *data_ptr       = data;
+    *data_len_ptr   = data_len;
+    *qname_len_ptr  = end - start;
+    return true;
+}
+
+/*
+ * Find a query's EDNS OPT record (if any), returning its DNS_EDNS* flags and
+ * the largest reply (UDP payload) the query allows.  Returns false if the
+ * query is malformed.
+ */
+static bool dns_edns(const uint8_t *data, size_t data_len, size_t qname_len,
+    uint8_t *edns_ptr, size_t *limit_ptr)
+{
+    struct dnshdr *dns_header = (struct dnshdr *)data;
+    size_t count = (size_t)ntohs(dns_header->ancount) +
+        ntohs(dns_header->nscount) + ntohs(dns_header->arcount);
+    size_t i = sizeof(struct dnshdr) + qname_len + 2*sizeof(uint16_t);
+    uint8_t edns = 0;
+    size_t limit = DNS_MIN_UDP_SIZE;
+    for (size_t j = 0; j < count; j++)
+    {
+        if (!dns_skip_name(data, data_len, &i) ||
+            i + 3*sizeof(uint16_t) + sizeof(uint32_t) > data_len)
+        {
+            return false;
+        }
+        uint16_t type = ((uint16_t)data[i] << 8) | data[i+1];
+        if (type == DNS_TYPE_OPT)
+        {
+            // CLASS = UDP payload size; TTL = EXTENDED-RCODE, VERSION, DO, Z
+            size_t udp_size = ((size_t)data[i+2] << 8) | data[i+3];
+            uint16_t flags = ((uint16_t)data[i+6] << 8) | data[i+7];
+            edns = DNS_EDNS | ((flags & DNS_OPT_DO) != 0? DNS_EDNS_DO: 0);
+            limit = (udp_size > DNS_MIN_UDP_SIZE? udp_size:
+                DNS_MIN_UDP_SIZE);
+        }
+        size_t rdlength = ((size_t)data[i+8] << 8) | data[i+9];
+        i += 3*sizeof(uint16_t) + sizeof(uint32_t) + rdlength;
+        if (i > data_len)
+        {
+            return false;
+        }
+    }
+    *edns_ptr  = edns;
+    *limit_ptr = limit;
+    return true;
+}
+
+/*
+ * The cache key: the question (QNAME ignoring case, QTYPE, QCLASS), the
+ * resolver, and the query's EDNS flags.  Never returns 0.
+ */
+static uint64_t dns_key(const uint8_t *data, size_t qname_len,
+    uint32_t resolver, uint8_t edns)
+{
+    const uint8_t *question = data + sizeof(struct dnshdr);
+    uint64_t hash = DNS_HASH_INIT;
+    for (size_t i = 0; i < qname_len + 2*sizeof(uint16_t); i++)
+    {
+        uint8_t c = (i < qname_len? (uint8_t)tolower(question[i]):
+            question[i]);
+        hash = (hash ^ c) * DNS_HASH_PRIME;
+    }
+    const uint8_t *addr = (const uint8_t *)&resolver;
+    for (size_t i = 0; i < sizeof(resolver); i++)
+    {
+        hash = (hash ^ addr[i]) * DNS_HASH_PRIME;
+    }
+    hash = (hash ^ edns) * DNS_HASH_PRIME;
+    hash ^= hash >> 29;
+    return (hash == 0? 1: hash);
+}
+
+/*
+ * Compare two questions (QNAME ignoring case, QTYPE, QCLASS).
+ */
+static bool dns_question_equal(const uint8_t *data1, const uint8_t *data2,
+    size_t qname_len)
+{
+    const uint8_t *question1 = data1 + sizeof(struct dnshdr);
+    const uint8_t *question2 = data2 + sizeof(struct dnshdr);
+    for (size_t i = 0; i < qname_len; i++)
+    {
+        if (tolower(question1[i]) != tolower(question2[i]))
+        {
+            return false;
+        }
+    }
+    return (memcmp(question1 + qname_len, question2 + qname_len,
+        2*sizeof(uint16_t)) == 0);
+}
+
+/*
+ * Walk the resource records of a reply, reducing each TTL by age (the EDNS
+ * OPT pseudo-record has no TTL), and find the smallest resulting TTL
+ * (UINT32_MAX if there is none).  Returns false if the reply is malformed.
+ */
+static bool dns_ttls(uint8_t *data, size_t data_len, size_t qname_len,
+    uint32_t age, uint32_t *min_ttl_ptr)
+{
+    struct dnshdr *dns_header = (struct dnshdr *)data;
+    size_t count = (size_t)ntohs(dns_header->ancount) +
+        ntohs(dns_header->nscount) + ntohs(dns_header->arcount);
+    size_t i = sizeof(struct dnshdr) + qname_len + 2*sizeof(uint16_t);
+    uint32_t min_ttl = UINT32_MAX;
+    for (size_t j = 0; j < count; j++)
+    {
+        // NAME, TYPE, CLASS, TTL, RDLENGTH, RDATA:
+        if (!dns_skip_name(data, data_len, &i) ||
+            i + 3*sizeof(uint16_t) + sizeof(uint32_t) > data_len)
+        {
+            return false;
+        }
+        uint16_t type = ((uint16_t)data[i] << 8) | data[i+1];
+        if (type != DNS_TYPE_OPT)
+        {
+            uint8_t *ttl_ptr = data + i + 2*sizeof(uint16_t);
+            uint32_t ttl = ((uint32_t)ttl_ptr[0] << 24) |
+                ((uint32_t)ttl_ptr[1] << 16) | ((uint32_t)ttl_ptr[2] << 8) |
+                (uint32_t)ttl_ptr[3];
+            ttl = (ttl > age? ttl - age: 0);
+            ttl_ptr[0] = (uint8_t)(ttl >> 24);
+            ttl_ptr[1] = (uint8_t)(ttl >> 16);
+            ttl_ptr[2] = (uint8_t)(ttl >> 8);
+            ttl_ptr[3] = (uint8_t)ttl;
+            min_ttl = (ttl < min_ttl? ttl: min_ttl);
+        }
+        size_t rdlength = ((size_t)data[i+8] << 8) | data[i+9];
+        i += 3*sizeof(uint16_t) + sizeof(uint32_t) + rdlength;
+        if (i > data_len)
+        {
+            return false;
+        }
+    }
+    *min_ttl_ptr = min_ttl;
+    return true;
+}
+
+/*
+ * Skip a resource record's NAME: labels ending with a zero label or a
+ * compression pointer.  Returns false if the NAME is malformed.
+ */
+static bool dns_skip_name(const uint8_t *data, size_t data_len, size_t *i_ptr)
+{
+    size_t i = *i_ptr;
+    while (true)
+    {
+        if (i >= data_len)
+        {
+            return false;
+        }
+        uint8_t label_len = data[i];
+        if (label_len == 0)
+        {
+            i++;
+            break;
+        }
+        if ((label_len & 0xC0) == 0xC0)
+        {
+            i += sizeof(uint16_t);
+            break;
+        }
+        if ((label_len & 0xC0) != 0)
+        {
+            return false;
+        }
+        i += label_len + 1;
+    }
+    *i_ptr = i;
+    return true;
+}
+
+/*
+ * The pending slot for a query.
+ */
+static struct dns_pending_s *dns_pending_slot(uint32_t resolver,
+    uint32_t client, uint16_t port, uint16_t id)
+{
+    uint32_t hash = resolver ^ client ^ (((uint32_t)port << 16) | id);
+    hash *= 0x9E3779B1;
+    return dns_pending + (hash >> 16) % DNS_PENDING_SIZE;
+}
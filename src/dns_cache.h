@@ -0,0 +1,32 @@
+/*
+ * dns_cache.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DNS_CACHE_H
+#define __DNS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+void dns_cache_init(void);
+size_t dns_cache_query(const uint8_t *packet, size_t packet_len,
+    uint8_t *reply, size_t reply_size);
+void dns_cache_reply(const uint8_t *packet, size_t packet_len);
+void dns_cache_memory(size_t *num_entries, size_t *bytes);
+
+#endif      /* __DNS_CACHE_H */
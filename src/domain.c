@@ -0,0 +1,282 @@
+/*
+ * domain.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The domain set used by selective tunneling.
+ *
+ * The DOMAINS_FILENAME file lists one domain suffix per line, e.g.
+ * "example.com" matches "example.com" and "www.example.com" but not
+ * "badexample.com".  The list is compiled into an open-addressed table of
+ * 64-bit hashes of each suffix read backwards (i.e. the reversed labels), so
+ * matching a name costs one probe per label and the table costs at most 32
+ * bytes per entry regardless of the suffix lengths.  Only the hashes are
+ * kept, so a (very unlikely) collision merely tunnels an unlisted domain.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "domain.h"
+#include "log.h"
+
+#define DOMAIN_HASH_INIT        0xCBF29CE484222325ull
+#define DOMAIN_HASH_PRIME       0x00000100000001B3ull
+#define DOMAIN_HASH_EMPTY       0
+#define DOMAIN_MIN_TABLE_SIZE   64
+
+/*
+ * The compiled domain set.  Written once by domain_init() before any worker
+ * thread starts; read-only afterwards.
+ */
+static uint64_t *domain_table = NULL;
+static size_t domain_table_mask = 0;
+
+/*
+ * Prototypes.
+ */
+static bool domain_read(FILE *file, char *name, size_t *name_len);
+static uint64_t domain_hash(const char *name, size_t name_len);
+static void domain_insert(uint64_t *table, size_t mask, uint64_t hash);
+static bool domain_lookup(uint64_t hash);
+
+/*
+ * Hash step; the name is hashed from its last character to its first.
+ */
+static inline uint64_t domain_hash_step(uint64_t hash, char c)
+{
+    return (hash ^ (uint8_t)tolower(c)) * DOMAIN_HASH_PRIME;
+}
+
+/*
+ * Finalise a hash.  Never returns DOMAIN_HASH_EMPTY.
+ */
+static inline uint64_t domain_hash_final(uint64_t hash)
+{
+    hash ^= hash >> 29;
+    return (hash == DOMAIN_HASH_EMPTY? 1: hash);
+}
+
+/*
+ * Load and compile the domain set.
+ */
+void domain_init(void)
+{
+    FILE *file = fopen(DOMAINS_FILENAME, "r");
+    if (file == NULL)
+    {
+        warning("unable to open domain file \"%s\" for reading; selective "
+            "tunneling will not match any domain", DOMAINS_FILENAME);
+        return;
+    }
+
+    // Pass 1: hash each suffix.
+    size_t hashes_size = 1024, num_hashes = 0;
+    uint64_t *hashes = (uint64_t *)malloc(hashes_size * sizeof(uint64_t));
+    if (hashes == NULL)
+    {
+        error("unable to allocate " SIZE_T_FMT " bytes for domain hashes",
+            hashes_size * sizeof(uint64_t));
+    }
+    char name[DOMAIN_MAX_LENGTH+1];
+    size_t name_len;
+    while (domain_read(file, name, &name_len))
+    {
+        if (name_len == 0)
+        {
+            continue;
+        }
+        if (num_hashes == hashes_size)
+        {
+            hashes_size *= 2;
+            hashes = (uint64_t *)realloc(hashes,
+                hashes_size * sizeof(uint64_t));
+            if (hashes == NULL)
+            {
+                error("unable to reallocate " SIZE_T_FMT " bytes for domain "
+                    "hashes", hashes_size * sizeof(uint64_t));
+            }
+        }
+        hashes[num_hashes++] = domain_hash(name, name_len);
+    }
+    fclose(file);
+
+    // Pass 2: build a table with a load factor of at most 1/2.
+    size_t table_size = DOMAIN_MIN_TABLE_SIZE;
+    while (table_size < 2 * num_hashes)
+    {
+        table_size *= 2;
+    }
+    uint64_t *table = (uint64_t *)calloc(table_size, sizeof(uint64_t));
+    if (table == NULL)
+    {
+        error("unable to allocate " SIZE_T_FMT " bytes for domain table",
+            table_size * sizeof(uint64_t));
+    }
+    for (size_t i = 0; i < num_hashes; i++)
+    {
+        domain_insert(table, table_size - 1, hashes[i]);
+    }
+    free(hashes);
+
+    domain_table = table;
+    domain_table_mask = table_size - 1;
+    log("loaded " SIZE_T_FMT " domains from \"%s\"",
+        num_hashes, DOMAINS_FILENAME);
+}
+
+/*
+ * Returns true if the name (or a parent domain of the name) is in the domain
+ * set.  The name is not NUL-terminated, and may end with a '.'.
+ */
+bool domain_match(const char *name, size_t name_len)
+{
+    if (domain_table == NULL)
+    {
+        return false;
+    }
+    if (name_len > 0 && name[name_len-1] == '.')
+    {
+        name_len--;
+    }
+    if (name_len == 0 || name_len > DOMAIN_MAX_LENGTH)
+    {
+        return false;
+    }
+
+    // Walk the name backwards, probing at each label boundary:
+    uint64_t hash = DOMAIN_HASH_INIT;
+    for (size_t i = name_len; i > 0; i--)
+    {
+        char c = name[i-1];
+        if (c == '.' && domain_lookup(domain_hash_final(hash)))
+        {
+            return true;
+        }
+        hash = domain_hash_step(hash, c);
+    }
+    return domain_lookup(domain_hash_final(hash));
+}
+
+/*
+ * Read the next domain suffix from the domain file.  Blank lines and
+ * comments yield an empty name.  Returns false at end-of-file.
+ */
+static bool domain_read(FILE *file, char *name, size_t *name_len)
+{
+    char line[DOMAIN_MAX_LENGTH+16];
+    if (fgets(line, sizeof(line), file) == NULL)
+    {
+        return false;
+    }
+    size_t len = strlen(line);
+    if (len > 0 && line[len-1] != '\n' && !feof(file))
+    {
+        // Too long -- skip the rest of the line.
+        warning("ignoring overlong entry in domain file \"%s\"",
+            DOMAINS_FILENAME);
+        int c;
+        while ((c = getc(file)) != EOF && c != '\n')
+            ;
+        *name_len = 0;
+        return true;
+    }
+
+    char *start = line, *end;
+    while (isspace(*start))
+    {
+        start++;
+    }
+    for (end = start; *end != '\0' && *end != '#' && !isspace(*end); end++)
+        ;
+
+    // Accept "example.com", ".example.com", "*.example.com" or "example.com."
+    if (start[0] == '*' && start[1] == '.')
+    {
+        start++;
+    }
+    while (start < end && *start == '.')
+    {
+        start++;
+    }
+    while (end > start && end[-1] == '.')
+    {
+        end--;
+    }
+    len = end - start;
+    if (len > DOMAIN_MAX_LENGTH)
+    {
+        len = 0;
+    }
+    memcpy(name, start, len);
+    *name_len = len;
+    return true;
+}
+
+/*
+ * Hash a whole name.
+ */
+static uint64_t domain_hash(const char *name, size_t name_len)
+{
+    uint64_t hash = DOMAIN_HASH_INIT;
+    for (size_t i = name_len; i > 0; i--)
+    {
+        hash = domain_hash_step(hash, name[i-1]);
+    }
+    return domain_hash_final(hash);
+}
+
+/*
+ * Insert a hash into a table (duplicates are dropped).
+ */
+static void domain_insert(uint64_t *table, size_t mask, uint64_t hash)
+{
+    for (size_t i = (size_t)hash & mask; ; i = (i + 1) & mask)
+    {
+        if (table[i] == hash)
+        {
+            return;
+        }
+        if (table[i] == DOMAIN_HASH_EMPTY)
+        {
+            table[i] = hash;
+            return;
+        }
+    }
+}
+
+/*
+ * Look up a hash in the domain table.
+ */
+static bool domain_lookup(uint64_t hash)
+{
+    for (size_t i = (size_t)hash & domain_table_mask; ;
+            i = (i + 1) & domain_table_mask)
+    {
+        if (domain_table[i] == hash)
+        {
+            return true;
+        }
+        if (domain_table[i] == DOMAIN_HASH_EMPTY)
+        {
+            return false;
+        }
+    }
+}
@@ -0,0 +1,33 @@
+/*
+ * domain.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DOMAIN_H
+#define __DOMAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cfg.h"
+
+#define DOMAINS_FILENAME        PROGRAM_NAME ".domains"
+#define DOMAIN_MAX_LENGTH       255
+
+void domain_init(void);
+bool domain_match(const char *name, size_t name_len);
+
+#endif      /* __DOMAIN_H */
@@ -0,0 +1,436 @@
+/*
+ * aes_bitslice.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * AES software (bitsliced, constant-time) encryption.
+ *
+ * The state of two blocks is held in eight 32-bit words, word k holding bit
+ * k of every byte.  Within a word, byte (row, col) of block b is bit
+ * (row * 8 + col * 2 + b), so SubBytes is a boolean circuit evaluated on the
+ * eight words (the Boyar-Peralta S-box circuit), and ShiftRows/MixColumns
+ * are shifts and rotations.  There are no table lookups or branches that
+ * depend on the key or data, so unlike a T-table implementation this does
+ * not leak through the cache.
+ *
+ * Both blocks cost the same as one, so aes_bitslice_encrypt2() is used where
+ * the caller has two independent blocks (e.g. the MAC block and the next CTR
+ * block).  This is slower than the T-table code in aes.c, so it is only used
+ * for the "aesct" cipher (when neither AES-NI nor SSSE3, see aes_vperm.c, is
+ * available).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "aes.h"
+#include "aes_bitslice.h"
+
+#define AES_WORDS       8       // Words per bitsliced state/round key
+
+/*
+ * Prototypes.
+ */
+static uint32_t aes_load32(const uint8_t *v);
+static void aes_store32(uint8_t *o, uint32_t x);
+static void aes_ortho(uint32_t *q);
+static void aes_sub_bytes(uint32_t *q);
+static void aes_shift_rows(uint32_t *q);
+static void aes_mix_columns(uint32_t *q);
+static void aes_add_round_key(uint32_t *q, const uint32_t *rk);
+static uint32_t aes_sub_word(uint32_t x);
+static void aes_encrypt_state(uint32_t *q, const uint32_t *rk);
+
+/*
+ * Little-endian load/store.
+ */
+static uint32_t aes_load32(const uint8_t *v)
+{
+    return (uint32_t)v[0] | ((uint32_t)v[1] << 8) | ((uint32_t)v[2] << 16) |
+        ((uint32_t)v[3] << 24);
+}
+static void aes_store32(uint8_t *o, uint32_t x)
+{
+    o[0] = (uint8_t)x;
+    o[1] = (uint8_t)(x >> 8);
+    o[2] = (uint8_t)(x >> 16);
+    o[3] = (uint8_t)(x >> 24);
+}
+
+/*
+ * Convert between 8 words of bytes and 8 words of bit planes.  Bit k of
+ * byte p of word j becomes bit (p * 8 + j) of word k (this is an
+ * involution).  Loading word (col * 2 + b) with column col of block b thus
+ * gives the bitsliced layout described above.
+ */
+#define AES_SWAP(cl, ch, s, x, y)                                           \
+    do {                                                                    \
+        uint32_t a = (x), b = (y);                                          \
+        (x) = (a & (uint32_t)(cl)) | ((b & (uint32_t)(cl)) << (s));         \
+        (y) = ((a & (uint32_t)(ch)) >> (s)) | (b & (uint32_t)(ch));         \
+    } while (false)
+#define AES_SWAP2(x, y)     AES_SWAP(0x55555555, 0xAAAAAAAA, 1, x, y)
+#define AES_SWAP4(x, y)     AES_SWAP(0x33333333, 0xCCCCCCCC, 2, x, y)
+#define AES_SWAP8(x, y)     AES_SWAP(0x0F0F0F0F, 0xF0F0F0F0, 4, x, y)
+static void aes_ortho(uint32_t *q)
+{
+    AES_SWAP2(q[0], q[1]);
+    AES_SWAP2(q[2], q[3]);
+    AES_SWAP2(q[4], q[5]);
+    AES_SWAP2(q[6], q[7]);
+
+    AES_SWAP4(q[0], q[2]);
+    AES_SWAP4(q[1], q[3]);
+    AES_SWAP4(q[4], q[6]);
+    AES_SWAP4(q[5], q[7]);
+
+    AES_SWAP8(q[0], q[4]);
+    AES_SWAP8(q[1], q[5]);
+    AES_SWAP8(q[2], q[6]);
+    AES_SWAP8(q[3], q[7]);
+}
+
+/*
+ * SubBytes: the S-box circuit of Boyar and Peralta ("A depth-16 circuit
+ * for the AES S-box"), 113 gates.
+ */
+static void aes_sub_bytes(uint32_t *q)
+{
+    uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    uint32_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    uint32_t y20, y21;
+    uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    uint32_t z10, z11, z12, z13, z14, z15, z16, z17;
+    uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint32_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint32_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint32_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+
+    // Top linear transformation:
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9  = x0 ^ x3;
+    y8  = x0 ^ x5;
+    t0  = x1 ^ x2;
+    y1  = t0 ^ x7;
+    y4  = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2  = y1 ^ x0;
+    y5  = y1 ^ x6;
+    y3  = y5 ^ y8;
+    t1  = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6  = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7  = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // Non-linear section:
+    t2  = y12 & y15;
+    t3  = y3 & y6;
+    t4  = t3 ^ t2;
+    t5  = y4 & x7;
+    t6  = t5 ^ t2;
+    t7  = y13 & y16;
+    t8  = y5 & y1;
+    t9  = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0  = t44 & y15;
+    z1  = t37 & y6;
+    z2  = t33 & x7;
+    z3  = t43 & y16;
+    z4  = t40 & y1;
+    z5  = t29 & y7;
+    z6  = t42 & y11;
+    z7  = t45 & y17;
+    z8  = t41 & y10;
+    z9  = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // Bottom linear transformation:
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0  = t59 ^ t63;
+    s6  = t56 ^ ~t62;
+    s7  = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3  = t53 ^ t66;
+    s4  = t51 ^ t66;
+    s5  = t47 ^ t65;
+    s1  = t64 ^ ~s3;
+    s2  = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+/*
+ * ShiftRows: rotate row r (bits r * 8 .. r * 8 + 7) by r columns.
+ */
+static void aes_shift_rows(uint32_t *q)
+{
+    for (size_t i = 0; i < AES_WORDS; i++)
+    {
+        uint32_t x = q[i];
+        q[i] = (x & 0x000000FF) |
+            ((x & 0x0000FC00) >> 2) | ((x & 0x00000300) << 6) |
+            ((x & 0x00F00000) >> 4) | ((x & 0x000F0000) << 4) |
+            ((x & 0xC0000000) >> 6) | ((x & 0x3F000000) << 2);
+    }
+}
+
+/*
+ * MixColumns: out[r] = 2.(a[r] ^ a[r+1]) ^ a[r+1] ^ a[r+2] ^ a[r+3], where
+ * rotating a word right by 8 bits moves row r+1 into row r.
+ */
+#define AES_ROTR(x, n)      (((x) >> (n)) | ((x) << (32 - (n))))
+static void aes_mix_columns(uint32_t *q)
+{
+    uint32_t a[AES_WORDS], t[AES_WORDS];
+    for (size_t i = 0; i < AES_WORDS; i++)
+    {
+        a[i] = AES_ROTR(q[i], 8);
+        t[i] = q[i] ^ a[i];
+    }
+    q[0] = t[7] ^ a[0] ^ AES_ROTR(t[0], 16);
+    q[1] = t[0] ^ t[7] ^ a[1] ^ AES_ROTR(t[1], 16);
+    q[2] = t[1] ^ a[2] ^ AES_ROTR(t[2], 16);
+    q[3] = t[2] ^ t[7] ^ a[3] ^ AES_ROTR(t[3], 16);
+    q[4] = t[3] ^ t[7] ^ a[4] ^ AES_ROTR(t[4], 16);
+    q[5] = t[4] ^ a[5] ^ AES_ROTR(t[5], 16);
+    q[6] = t[5] ^ a[6] ^ AES_ROTR(t[6], 16);
+    q[7] = t[6] ^ a[7] ^ AES_ROTR(t[7], 16);
+}
+
+/*
+ * AddRoundKey.
+ */
+static void aes_add_round_key(uint32_t *q, const uint32_t *rk)
+{
+    for (size_t i = 0; i < AES_WORDS; i++)
+    {
+        q[i] ^= rk[i];
+    }
+}
+
+/*
+ * SubWord for the key schedule (using the same circuit).
+ */
+static uint32_t aes_sub_word(uint32_t x)
+{
+    uint32_t q[AES_WORDS] = {x};
+    aes_ortho(q);
+    aes_sub_bytes(q);
+    aes_ortho(q);
+    return q[0];
+}
+
+/*
+ * AES key expansion.
+ */
+void aes_bitslice_expandkey(const uint8_t *key, size_t keysize,
+    uint8_t *ekey)
+{
+    uint8_t key0[16];
+    size_t i = 0;
+    for (; i < 16 && i < keysize; i++)
+    {
+        key0[i] = key[i];
+    }
+    for (; i < 16; i++)
+    {
+        key0[i] = 0x0;
+    }
+
+    uint32_t w[4 * (AES_ROUNDS + 1)];
+    for (i = 0; i < 4; i++)
+    {
+        w[i] = aes_load32(key0 + 4 * i);
+    }
+    uint32_t rcon = 0x01;
+    for (; i < 4 * (AES_ROUNDS + 1); i++)
+    {
+        uint32_t temp = w[i - 1];
+        if (i % 4 == 0)
+        {
+            temp = aes_sub_word(AES_ROTR(temp, 8)) ^ rcon;
+            rcon = (rcon << 1) ^ (0x11B & -(rcon >> 7));
+        }
+        w[i] = w[i - 4] ^ temp;
+    }
+
+    // Bitslice each round key (the same for both blocks):
+    uint32_t *rk = (uint32_t *)ekey;
+    for (size_t r = 0; r <= AES_ROUNDS; r++)
+    {
+        uint32_t *q = rk + r * AES_WORDS;
+        for (size_t c = 0; c < 4; c++)
+        {
+            q[2 * c] = q[2 * c + 1] = w[4 * r + c];
+        }
+        aes_ortho(q);
+    }
+}
+
+/*
+ * Encrypt a bitsliced state.
+ */
+static void aes_encrypt_state(uint32_t *q, const uint32_t *rk)
+{
+    aes_add_round_key(q, rk);
+    for (size_t r = 1; r < AES_ROUNDS; r++)
+    {
+        aes_sub_bytes(q);
+        aes_shift_rows(q);
+        aes_mix_columns(q);
+        aes_add_round_key(q, rk + r * AES_WORDS);
+    }
+    aes_sub_bytes(q);
+    aes_shift_rows(q);
+    aes_add_round_key(q, rk + AES_ROUNDS * AES_WORDS);
+}
+
+/*
+ * AES encryption of two consecutive blocks v[0..31] into o[0..31].
+ */
+void aes_bitslice_encrypt2(const uint8_t *v, const uint32_t *rk, uint8_t *o)
+{
+    uint32_t q[AES_WORDS];
+    for (size_t c = 0; c < 4; c++)
+    {
+        q[2 * c]     = aes_load32(v + 4 * c);
+        q[2 * c + 1] = aes_load32(v + 16 + 4 * c);
+    }
+    aes_ortho(q);
+    aes_encrypt_state(q, rk);
+    aes_ortho(q);
+    for (size_t c = 0; c < 4; c++)
+    {
+        aes_store32(o + 4 * c, q[2 * c]);
+        aes_store32(o + 16 + 4 * c, q[2 * c + 1]);
+    }
+}
+
+/*
+ * AES encryption.
+ */
+void aes_bitslice_encrypt(const uint8_t *v, const uint32_t *rk, uint8_t *o)
+{
+    uint32_t q[AES_WORDS];
+    for (size_t c = 0; c < 4; c++)
+    {
+        q[2 * c]     = aes_load32(v + 4 * c);
+        q[2 * c + 1] = 0;
+    }
+    aes_ortho(q);
+    aes_encrypt_state(q, rk);
+    aes_ortho(q);
+    for (size_t c = 0; c < 4; c++)
+    {
+        aes_store32(o + 4 * c, q[2 * c]);
+    }
+}
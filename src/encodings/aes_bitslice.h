@@ -0,0 +1,36 @@
+/*
+ * aes_bitslice.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AES_BITSLICE_H
+#define __AES_BITSLICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+#define AES_BITSLICE_EKEY_SIZE  (8 * sizeof(uint32_t) * (AES_ROUNDS + 1))
+
+extern void aes_bitslice_expandkey(const uint8_t *key, size_t keysize,
+    uint8_t *ekey);
+extern void aes_bitslice_encrypt(const uint8_t *v, const uint32_t *rk,
+    uint8_t *o);
+extern void aes_bitslice_encrypt2(const uint8_t *v, const uint32_t *rk,
+    uint8_t *o);
+
+#endif      /* __AES_BITSLICE_H */
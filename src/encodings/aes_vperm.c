@@ -0,0 +1,302 @@
+/*
+ * aes_vperm.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * AES vector permute (SSSE3, constant-time) encryption.
+ *
+ * This is M. Hamburg's "Accelerating AES with Vector Permute Instructions"
+ * (CHES 2009).  SubBytes computes the GF(2^8) inverse in a GF(2^4) tower
+ * basis, where every step is a 16-entry table lookup on nibbles done with
+ * PSHUFB, i.e. a register permute.  MixColumns and ShiftRows are byte
+ * permutes too (ShiftRows is deferred to a single permute at the end).  The
+ * tables live in registers, so there are no key or data dependent memory
+ * accesses, and this does not leak through the cache.
+ *
+ * The state is kept in a transformed basis (see aes_vperm_ipt), so the
+ * round keys are transformed to match by aes_vperm_expandkey().  A single
+ * block is about as fast as the T-table code in aes.c; the latency of a
+ * round is long but it has little parallelism, so aes_vperm_encrypt2()
+ * interleaves two blocks (e.g. the MAC block and the next CTR block) for
+ * almost the cost of one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "aes_vperm.h"
+
+/*
+ * Beautification.
+ */
+typedef long long int int128_t __attribute__ ((vector_size (16)));
+
+#define permute(a, b)               \
+    ((int128_t)__builtin_ia32_pshufb128((a), (b)))
+#define rshift4(a)                  __builtin_ia32_psrlqi128((a), 4)
+
+#define cpuid(f, ax, bx, cx, dx)    \
+    __asm__ __volatile__ ("cpuid" : "=a" (ax), "=b" (bx), "=c" (cx), \
+        "=d" (dx) : "a" (f))
+
+#define AES_VPERM(lo, hi)           {(lo), (hi)}
+
+/*
+ * Nibble mask.
+ */
+static const int128_t aes_vperm_s0f =
+    AES_VPERM(0x0F0F0F0F0F0F0F0FLL, 0x0F0F0F0F0F0F0F0FLL);
+
+/*
+ * GF(2^4) inverse and the "a/k" helper table of the tower field inversion.
+ */
+static const int128_t aes_vperm_inv =
+    AES_VPERM(0x0E05060F0D080180LL, 0x040703090A0B0C02LL);
+static const int128_t aes_vperm_inva =
+    AES_VPERM(0x01040A060F0B0780LL, 0x030D0E0C02050809LL);
+
+/*
+ * Input transform (standard basis to the tower basis), low and high nibble.
+ */
+static const int128_t aes_vperm_ipt[2] =
+{
+    AES_VPERM(0xC2B2E8985A2A7000LL, 0xCABAE09052227808LL),
+    AES_VPERM(0x4C01307D317C4D00LL, 0xCD80B1FCB0FDCC81LL)
+};
+
+/*
+ * S-box outputs: sb1 = S (tower basis), sb2 = 2.S (tower basis),
+ * sbo = S (standard basis, last round).  All without the 0x63 constant,
+ * which is folded into the round keys.
+ */
+static const int128_t aes_vperm_sb1[2] =
+{
+    AES_VPERM(0xB19BE18FCB503E00LL, 0xA5DF7A6E142AF544LL),
+    AES_VPERM(0x3618D415FAE22300LL, 0x3BF7CCC10D2ED9EFLL)
+};
+static const int128_t aes_vperm_sb2[2] =
+{
+    AES_VPERM(0xE27A93C60B712400LL, 0x5EB7E955BC982FCDLL),
+    AES_VPERM(0x69EB88400AE12900LL, 0xC2A163C8AB82234ALL)
+};
+static const int128_t aes_vperm_sbo[2] =
+{
+    AES_VPERM(0xD0D26D176FBDC700LL, 0x15AABF7AC502A878LL),
+    AES_VPERM(0xCFE474A55FBB6A00LL, 0x8E1E90D1412B35FALL)
+};
+
+/*
+ * MixColumns rotations (combined with the deferred ShiftRows of each round
+ * mod 4), and the deferred ShiftRows permutations themselves.
+ */
+static const int128_t aes_vperm_mc_forward[4] =
+{
+    AES_VPERM(0x0407060500030201LL, 0x0C0F0E0D080B0A09LL),
+    AES_VPERM(0x080B0A0904070605LL, 0x000302010C0F0E0DLL),
+    AES_VPERM(0x0C0F0E0D080B0A09LL, 0x0407060500030201LL),
+    AES_VPERM(0x000302010C0F0E0DLL, 0x080B0A0904070605LL)
+};
+static const int128_t aes_vperm_mc_backward[4] =
+{
+    AES_VPERM(0x0605040702010003LL, 0x0E0D0C0F0A09080BLL),
+    AES_VPERM(0x020100030E0D0C0FLL, 0x0A09080B06050407LL),
+    AES_VPERM(0x0E0D0C0F0A09080BLL, 0x0605040702010003LL),
+    AES_VPERM(0x0A09080B06050407LL, 0x020100030E0D0C0FLL)
+};
+static const int128_t aes_vperm_sr[4] =
+{
+    AES_VPERM(0x0706050403020100LL, 0x0F0E0D0C0B0A0908LL),
+    AES_VPERM(0x030E09040F0A0500LL, 0x0B06010C07020D08LL),
+    AES_VPERM(0x0F060D040B020900LL, 0x070E050C030A0108LL),
+    AES_VPERM(0x0B0E0104070A0D00LL, 0x0306090C0F020508LL)
+};
+
+/*
+ * Prototypes.
+ */
+static int128_t aes_vperm_transform(int128_t x, const int128_t *table);
+static void aes_vperm_invert(int128_t x, int128_t *io, int128_t *jo);
+static uint32_t aes_vperm_sub_word(uint32_t x);
+
+/*
+ * AES vector permute test.
+ */
+extern bool aes_vperm_test(void)
+{
+    unsigned a, b, c, d;
+    cpuid(1, a, b, c, d);
+    return ((c & 0x00000200) != 0);
+}
+
+/*
+ * Apply a (nibble-wise) linear transform.
+ */
+static int128_t aes_vperm_transform(int128_t x, const int128_t *table)
+{
+    int128_t lo = x & aes_vperm_s0f;
+    int128_t hi = rshift4(x) & aes_vperm_s0f;
+    return permute(table[0], lo) ^ permute(table[1], hi);
+}
+
+/*
+ * GF(2^8) inversion (in the tower basis); returns the two halves (io, jo)
+ * that index the S-box output tables.
+ */
+static void aes_vperm_invert(int128_t x, int128_t *io, int128_t *jo)
+{
+    int128_t i = rshift4(x) & aes_vperm_s0f;
+    int128_t k = x & aes_vperm_s0f;
+    int128_t ak = permute(aes_vperm_inva, k);
+    int128_t j = k ^ i;
+    int128_t iak = permute(aes_vperm_inv, i) ^ ak;
+    int128_t jak = permute(aes_vperm_inv, j) ^ ak;
+    *io = permute(aes_vperm_inv, iak) ^ j;
+    *jo = permute(aes_vperm_inv, jak) ^ i;
+}
+
+/*
+ * SubWord for the key schedule (using the same tables).
+ */
+static uint32_t aes_vperm_sub_word(uint32_t x)
+{
+    int128_t v = {x, 0}, io, jo;
+    aes_vperm_invert(aes_vperm_transform(v, aes_vperm_ipt), &io, &jo);
+    v = permute(aes_vperm_sbo[0], io) ^ permute(aes_vperm_sbo[1], jo);
+    return (uint32_t)v[0] ^ 0x63636363;
+}
+
+/*
+ * AES key expansion.  The standard round keys are transformed to the basis
+ * and byte order of the state in each round, with the S-box constant added,
+ * and pre-multiplied by the inverse of the MixColumns rotations that they
+ * pass through (f + f^2 + f^3, which is its own inverse).
+ */
+extern void aes_vperm_expandkey(const uint8_t *key, size_t keysize,
+    uint8_t *ekey0)
+{
+    uint32_t w[4 * (AES_ROUNDS + 1)];
+    uint8_t *key0 = (uint8_t *)w;
+    size_t i;
+    for (i = 0; i < 16 && i < keysize; i++)
+    {
+        key0[i] = key[i];
+    }
+    for (; i < 16; i++)
+    {
+        key0[i] = 0x0;
+    }
+
+    // Standard (little-endian) key expansion:
+    uint32_t rcon = 0x01;
+    for (i = 4; i < 4 * (AES_ROUNDS + 1); i++)
+    {
+        uint32_t temp = w[i - 1];
+        if (i % 4 == 0)
+        {
+            temp = aes_vperm_sub_word((temp >> 8) | (temp << 24)) ^ rcon;
+            rcon = (rcon << 1) ^ (0x11B & -(rcon >> 7));
+        }
+        w[i] = w[i - 4] ^ temp;
+    }
+
+    int128_t *ekey = (int128_t *)ekey0;
+    const int128_t s63 =
+        AES_VPERM(0x6363636363636363LL, 0x6363636363636363LL);
+    for (size_t r = 0; r <= AES_ROUNDS; r++)
+    {
+        int128_t k;
+        __builtin_memcpy(&k, w + 4 * r, sizeof(k));
+        if (r == 0)
+        {
+            ekey[r] = aes_vperm_transform(k, aes_vperm_ipt);
+            continue;
+        }
+        int128_t sr = aes_vperm_sr[(4 - r % 4) % 4];
+        if (r == AES_ROUNDS)
+        {
+            ekey[r] = permute(k ^ s63, sr);
+            continue;
+        }
+        k = aes_vperm_transform(k ^ s63, aes_vperm_ipt);
+        int128_t f1 = permute(k, aes_vperm_mc_forward[0]);
+        int128_t f2 = permute(f1, aes_vperm_mc_forward[0]);
+        int128_t f3 = permute(f2, aes_vperm_mc_forward[0]);
+        ekey[r] = permute(f1 ^ f2 ^ f3, sr);
+    }
+}
+
+/*
+ * Encrypt n (1 or 2) interleaved blocks.
+ */
+#define AES_VPERM_ENCRYPT(n, v, rk)                                         \
+    do {                                                                    \
+        int128_t io[n], jo[n];                                              \
+        for (size_t b = 0; b < (n); b++)                                    \
+        {                                                                   \
+            (v)[b] = aes_vperm_transform((v)[b], aes_vperm_ipt) ^ (rk)[0];  \
+        }                                                                   \
+        for (size_t r = 1; r < AES_ROUNDS; r++)                             \
+        {                                                                   \
+            int128_t forward = aes_vperm_mc_forward[r % 4];                 \
+            int128_t backward = aes_vperm_mc_backward[r % 4];               \
+            for (size_t b = 0; b < (n); b++)                                \
+            {                                                               \
+                aes_vperm_invert((v)[b], io + b, jo + b);                   \
+                int128_t a = permute(aes_vperm_sb1[0], io[b]) ^             \
+                    permute(aes_vperm_sb1[1], jo[b]) ^ (rk)[r];             \
+                int128_t a2 = permute(aes_vperm_sb2[0], io[b]) ^            \
+                    permute(aes_vperm_sb2[1], jo[b]);                       \
+                int128_t x = permute(a, forward) ^ a2;                      \
+                int128_t y = permute(a, backward) ^ x;                      \
+                (v)[b] = permute(x, forward) ^ y;                           \
+            }                                                               \
+        }                                                                   \
+        for (size_t b = 0; b < (n); b++)                                    \
+        {                                                                   \
+            aes_vperm_invert((v)[b], io + b, jo + b);                       \
+            (v)[b] = permute(aes_vperm_sbo[0], io[b]) ^                     \
+                permute(aes_vperm_sbo[1], jo[b]) ^ (rk)[AES_ROUNDS];        \
+            (v)[b] = permute((v)[b], aes_vperm_sr[AES_ROUNDS % 4]);         \
+        }                                                                   \
+    } while (false)
+
+/*
+ * AES encryption of two consecutive blocks v[0..31] into o[0..31].
+ */
+extern void aes_vperm_encrypt2(const uint8_t *v0, const uint32_t *rk0,
+    uint8_t *o)
+{
+    const int128_t *rk = (const int128_t *)rk0;
+    int128_t v[2];
+    __builtin_memcpy(v, v0, sizeof(v));
+    AES_VPERM_ENCRYPT(2, v, rk);
+    __builtin_memcpy(o, v, sizeof(v));
+}
+
+/*
+ * AES encryption.
+ */
+extern void aes_vperm_encrypt(const uint8_t *v0, const uint32_t *rk0,
+    uint8_t *o)
+{
+    const int128_t *rk = (const int128_t *)rk0;
+    int128_t v[1];
+    __builtin_memcpy(v, v0, sizeof(v));
+    AES_VPERM_ENCRYPT(1, v, rk);
+    __builtin_memcpy(o, v, sizeof(v));
+}
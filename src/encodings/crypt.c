@@ -106,7 +106,9 @@
 #include "cktp_encoding.h"
 #include "cookie.h"
 #include "encodings/aes.h"
+#include "encodings/aes_bitslice.h"
 #include "encodings/aes_hardware.h"
+#include "encodings/aes_vperm.h"
 #include "encodings/crypt.h"
 
 #ifdef CLIENT
@@ -116,8 +118,11 @@
 #ifdef SERVER
 #include <gmp.h>
 
+#include "misc.h"
 #include "quota.h"
+#include "stats.h"
 #include "thread.h"
+#include "timer.h"
 #endif
 
 /*
@@ -130,7 +135,14 @@
 #define CRYPT_HASH_BASE64_SIZE          ((CRYPT_HASH_SIZE * 8 - 1) / 6 + 1)
 #define CRYPT_PUBLIC_KEY_BASE64_SIZE    \
     ((CRYPT_PUBLIC_KEY_SIZE * 8 - 1) / 6 + 1)
+#define CRYPT_PRIME_SIZE                (CRYPT_PUBLIC_KEY_SIZE / 2)
+#define CRYPT_PRIME_BASE64_SIZE         ((CRYPT_PRIME_SIZE * 8 - 1) / 6 + 1)
+#define CRYPT_CRT_PARAMS                5   // p, q, dP, dQ, qInv
 #define CRYPT_DH_GENERATOR              2
+#define CRYPT_DH_WINDOW                 4   // Bits per g table window
+#define CRYPT_DH_WINDOW_SIZE            (1 << CRYPT_DH_WINDOW)
+#define CRYPT_DH_WINDOWS                \
+    ((CRYPT_PUBLIC_KEY_SIZE * 8 - 1) / CRYPT_DH_WINDOW + 1)
 #define CRYPT_RSA_EXPONENT              0x00010001
 #define CRYPT_MIN_AKEY_SIZE             2
 #define CRYPT_MIN_ID_SIZE               5
@@ -151,10 +163,17 @@
 #define CRYPT_MIN_TIMEOUT               (5*60*1000)         // 5 minutes
 #define CRYPT_MAX_TIMEOUT               (24*60*60*1000)     // 1 day
 #define CRYPT_KEYS_FILENAME             PACKAGE_NAME ".crypt.keys"
-#define CRYPT_QUOTA_RK_TIMEMIN          4000                // 4 seconds
-#define CRYPT_QUOTA_RK_TIMEMAX          8000                // 8 seconds
+#define CRYPT_QUOTA_WINDOW              4000                // 4 seconds
+#define CRYPT_QUOTA_NUM_COUNTS          4096
+#define CRYPT_QUOTA_RC_RATE             32                  // 32 per second
 #define CRYPT_QUOTA_RK_RATE             8                   // 8 per second
-#define CRYPT_QUOTA_RK_NUM_BUCKETS      256
+#define CRYPT_KEYPOOL_TICK              100                 // 100 milliseconds
+#define CRYPT_CLUSTER_SECRET_MIN        16                  // 128 bits
+#define CRYPT_RELOAD_SEQ_GAP            0x01000000          // 2^24 seqs
+#define CRYPT_CLUSTER_EARLY             (CRYPT_TIMEOUT_BUFF / 2)
+#define CRYPT_CLUSTER_COOKIE_GEN        'C'
+#define CRYPT_CLUSTER_KEY_GEN           'K'
+#define CRYPT_CLUSTER_SEQ_KEY           'S'
 
 /*
  * Error codes.
@@ -176,6 +195,8 @@
 #define CRYPT_ERROR_REPEATED_URL_PARAMETER  (-113)
 #define CRYPT_ERROR_OUT_OF_MEMORY           (-114)
 #define CRYPT_ERROR_DOS                     (-115)
+#define CRYPT_ERROR_OVERLOAD                (-116)
+#define CRYPT_ERROR_CLUSTER_MISMATCH        (-117)
 
 /*
  * 1024-bit prime for DH key exchange (see RFC2412 Appendix E.2)
@@ -306,11 +327,27 @@ struct cipher_s
     size_t          ekeysize;           // Expanded key size
     expandkeyfunc_t expandkey;          // Optional expand key
     encryptfunc_t   encrypt;            // Encrypt
+    encryptfunc_t   encrypt2;           // Optional two block encrypt
     testfunc_t      test;               // Hardware cipher supported?
 };
 
 /*
- * List of available ciphers.
+ * CTR mode state.  For ciphers with encrypt2, the keystream block after the
+ * current one is computed alongside it (or alongside a MAC block) for free.
+ */
+struct ctr_s
+{
+    uint8_t block[CRYPT_BLOCK_SIZE];    // Next counter block
+    size_t  counter_offset;             // Counter offset in block
+    uint8_t next[CRYPT_BLOCK_SIZE];     // Precomputed keystream block
+    bool    ready;                      // next is valid?
+};
+
+/*
+ * List of available (software) ciphers, used when no hardware cipher of the
+ * same name is supported.  The software "aes" uses lookup tables, which
+ * may leak the key through cache timing; "aesct" is the same cipher computed
+ * in constant time (but slower).
  */
 struct cipher_s ciphers[] =
 {
@@ -319,6 +356,15 @@ struct cipher_s ciphers[] =
         CRYPT_KEY_SIZE*(AES_ROUNDS+1),
         (expandkeyfunc_t)aes_expandkey,
         (encryptfunc_t)aes_encrypt,
+        NULL,
+        NULL
+    },
+    {   // AES128 (constant-time)
+        "aesct",
+        AES_BITSLICE_EKEY_SIZE,
+        (expandkeyfunc_t)aes_bitslice_expandkey,
+        (encryptfunc_t)aes_bitslice_encrypt,
+        (encryptfunc_t)aes_bitslice_encrypt2,
         NULL
     },
     {   // XXTEA (128 block size)
@@ -326,12 +372,15 @@ struct cipher_s ciphers[] =
         CRYPT_KEY_SIZE,
         (expandkeyfunc_t)xxtea_expandkey,
         (encryptfunc_t)xxtea_encrypt,
+        NULL,
         NULL
     }
 };
 
 /*
- * List of hardware-accelerated ciphers.
+ * List of hardware-accelerated ciphers, in order of preference.  Both are
+ * constant-time: AES-NI, else SSSE3 vector permutes (which are faster than
+ * the software lookup tables).
  */
 struct cipher_s hardware_ciphers[] =
 {
@@ -340,8 +389,33 @@ struct cipher_s hardware_ciphers[] =
         CRYPT_KEY_SIZE*(AES_ROUNDS+1),
         (expandkeyfunc_t)aes_hardware_expandkey,
         (encryptfunc_t)aes_hardware_encrypt,
+        NULL,
         (testfunc_t)aes_hardware_test
-    }      
+    },
+    {   // AES128 (SSSE3)
+        "aes",
+        AES_VPERM_EKEY_SIZE,
+        (expandkeyfunc_t)aes_vperm_expandkey,
+        (encryptfunc_t)aes_vperm_encrypt,
+        (encryptfunc_t)aes_vperm_encrypt2,
+        (testfunc_t)aes_vperm_test
+    },
+    {   // AES128 (constant-time)
+        "aesct",
+        CRYPT_KEY_SIZE*(AES_ROUNDS+1),
+        (expandkeyfunc_t)aes_hardware_expandkey,
+        (encryptfunc_t)aes_hardware_encrypt,
+        NULL,
+        (testfunc_t)aes_hardware_test
+    },
+    {   // AES128 (constant-time, SSSE3)
+        "aesct",
+        AES_VPERM_EKEY_SIZE,
+        (expandkeyfunc_t)aes_vperm_expandkey,
+        (encryptfunc_t)aes_vperm_encrypt,
+        (encryptfunc_t)aes_vperm_encrypt2,
+        (testfunc_t)aes_vperm_test
+    }
 };
 
 /*
@@ -355,6 +429,19 @@ static int cipher_s_compare(const void *a, const void *b)
 }
 
 #ifdef SERVER
+/*
+ * Pool of pre-computed ephemeral DH key pairs (x, g^x mod p).
+ */
+struct crypt_key_pool_s
+{
+    mutex_t lock;                               // Lock
+    size_t depth;                               // Max pairs (0 = disabled)
+    unsigned rate;                              // Refill rate (per second)
+    size_t head;                                // Next pair to use
+    size_t count;                               // Pairs ready
+    mpz_t *keys;                                // Pairs (x, g^x)
+};
+
 struct crypt_global_state_s
 {
     uint8_t refcount;                           // Reference count
@@ -362,11 +449,38 @@ struct crypt_global_state_s
     uint32_t seq;                               // Sequence number
     uint8_t gen_idx;                            // Current generator index
     uint64_t gen_timeout;                       // Timeout for gen_idx
+    struct timer_s gen_timer;                   // Generator rotation timer
+    mutex_t gen_lock;                           // Generator rotation lock
     struct cookie_gen_s cookie_gen[2];          // Cookie generator
     struct cookie_gen_s key_gen[2];             // Key generator
-    quota_t quota;                              // Request Key quota
+    quota_t cookie_quota;                       // Request Cookie quota
+    quota_t key_quota;                          // Request Key quota
     mpz_t mp_certificate;                       // Certificate
     mpz_t mp_sign_key;                          // Sign key
+    bool crt;                                   // Have CRT sign key?
+    mpz_t mp_crt[CRYPT_CRT_PARAMS];             // CRT sign key
+    struct crypt_key_pool_s key_pool;           // DH key pair pool
+    bool cluster;                               // Cluster mode?
+    uint8_t cluster_key[CRYPT_HASH_SIZE];       // Cluster shared key
+    uint64_t cluster_epoch;                     // Newest installed epoch
+    bool restored_cluster;                      // Restored from a cluster?
+    volatile unsigned shed;                     // Overload shedding level
+};
+
+/*
+ * Global state handed over to a reloaded server, so that existing sessions
+ * (and cookies) remain valid.
+ */
+struct crypt_saved_state_s
+{
+    uint32_t version;                           // CRYPT_VERSION
+    uint32_t seq;                               // Sequence number
+    uint64_t seq_key;                           // Sequence key
+    uint64_t gen_timeout;                       // Timeout for gen_idx
+    uint8_t gen_idx;                            // Current generator index
+    uint8_t cluster;                            // Cluster mode?
+    struct cookie_gen_s cookie_gen[2];          // Cookie generator
+    struct cookie_gen_s key_gen[2];             // Key generator
 };
 #endif      /* SERVER */
 
@@ -396,6 +510,7 @@ struct crypt_state_s
 #ifdef SERVER
     uint8_t key[CRYPT_KEY_SIZE];                // Key
     uint8_t sign_key[CRYPT_PUBLIC_KEY_SIZE];    // Signing key
+    uint8_t defer;                              // Key request deferral
     struct crypt_global_state_s *gbl_state;     // Global state
 #endif      /* SERVER */
 };
@@ -408,6 +523,7 @@ static bool mp_init = false;
 static mpz_t p;                                 // DH prime (p0)
 static mpz_t p1;                                // DH prime less 1 (p - 1)
 static mpz_t g;                                 // DH generator
+static mpz_t *g_table;                          // g^(j*2^(w*i)) mod p
 #endif      /* SERVER */
 
 typedef struct crypt_state_s *crypt_state_t;
@@ -441,11 +557,18 @@ static void crypt(const struct cipher_s *cipher, const uint8_t *iv,
     size_t ivsize, const uint8_t *key, uint8_t *data, size_t datasize);
 static void hash(const struct cipher_s *cipher, uint8_t *data, size_t datasize,
     uint8_t *hashval);
+static void ctr_init(struct ctr_s *ctr, const uint8_t *iv, size_t ivsize,
+    uint32_t seq);
+static void ctr_keystream(const struct cipher_s *cipher, const uint8_t *ekey,
+    struct ctr_s *ctr, uint8_t *result);
+static void ctr_mac(const struct cipher_s *cipher, const uint8_t *ekey,
+    struct ctr_s *ctr, uint8_t *mac_block);
 static int crypt_init(const cktp_enc_lib_t lib, const char *protocol,
     const char *options, size_t options_size, state_t *stateptr);
 static struct cipher_s *crypt_cipher_search(const char *name);
 static void crypt_free(state_t state);
 static size_t crypt_overhead(state_t state);
+static size_t crypt_min_size(state_t state, size_t size);
 static const char *crypt_error_string(state_t state, int err);
 static size_t crypt_handshake_pad_length(state_t state, uint8_t *data,
     size_t size);
@@ -468,9 +591,34 @@ static int crypt_clone(state_t state, state_t *stateptr);
 static int crypt_server_decode(state_t state, uint32_t *source_addr,
     size_t source_size, uint8_t **dataptr, size_t *sizeptr,
     uint8_t **replyptr, size_t *replysizeptr);
+static int crypt_server_decode_packet(state_t state, uint32_t *source_addr,
+    size_t source_size, uint8_t **dataptr, size_t *sizeptr,
+    uint8_t **replyptr, size_t *replysizeptr);
+static void crypt_defer(state_t state, unsigned mode);
+static void crypt_quota(state_t state, unsigned cookie_rate,
+    unsigned key_rate);
+static bool crypt_keypool(state_t state, unsigned depth, unsigned rate);
+static bool crypt_cluster(state_t state, const uint8_t *secret,
+    size_t secret_size);
+static void crypt_shed(state_t state, unsigned level);
+static size_t crypt_save(state_t state, uint8_t *data, size_t size);
+static bool crypt_restore(state_t state, const uint8_t *data, size_t size);
+static void crypt_cluster_gen(state_t state, uint8_t label, uint64_t epoch,
+    void *gen, size_t gen_size);
+static void crypt_cluster_install(state_t state, uint64_t epoch);
 static bool crypt_server_init(state_t state, bool read_cert);
-static void *crypt_timeout_manager(void *state_ptr);
+static void crypt_timeout_manager(void *state_ptr);
+static void crypt_cluster_manager(void *state_ptr);
+static void *crypt_key_pool_manager(void *state_ptr);
+static bool crypt_key_pool_get(struct crypt_key_pool_s *pool, mpz_t x,
+    mpz_t gx);
 static bool crypt_read_certificate(state_t state);
+static void crypt_sign(struct crypt_global_state_s *gbl_state, mpz_t result,
+    const mpz_t message);
+static void crypt_dh_table_init(void);
+static void crypt_dh_powg(mpz_t result, const mpz_t exponent);
+static void crypt_dh_keypair(state_t state, cktp_enc_rng_t rng, mpz_t x,
+    mpz_t gx);
 static uint32_t crypt_cookie(state_t state, uint32_t *source_addr,
     size_t source_size);
 static void crypt_key(state_t state, uint32_t *source_addr, size_t source_size,
@@ -486,6 +634,7 @@ struct cktp_enc_info_s crypt_encoding =
     (encoding_init_t)crypt_init,
     (encoding_free_t)crypt_free,
     (encoding_overhead_t)crypt_overhead,
+    (encoding_min_size_t)crypt_min_size,
     (encoding_error_string_t)crypt_error_string,
 
 #ifdef CLIENT
@@ -500,7 +649,14 @@ struct cktp_enc_info_s crypt_encoding =
     (encoding_activate_t)crypt_activate,
     (encoding_clone_t)crypt_clone,
     (encoding_encode_t)crypt_encode,
-    (encoding_server_decode_t)crypt_server_decode
+    (encoding_server_decode_t)crypt_server_decode,
+    (encoding_defer_t)crypt_defer,
+    (encoding_quota_t)crypt_quota,
+    (encoding_keypool_t)crypt_keypool,
+    (encoding_cluster_t)crypt_cluster,
+    (encoding_shed_t)crypt_shed,
+    (encoding_save_t)crypt_save,
+    (encoding_restore_t)crypt_restore
 #endif      /* SERVER */
 };
 
@@ -642,6 +798,7 @@ static int crypt_init(const cktp_enc_lib_t lib, const char *protocol,
 #endif
 
 #ifdef SERVER
+    state->defer = CKTP_DEFER_NONE;
     if (!crypt_server_init(state, seen_cert))
     {
         free(state->ekey);
@@ -655,23 +812,25 @@ static int crypt_init(const cktp_enc_lib_t lib, const char *protocol,
 }
 
 /*
- * Search for a given cipher.
+ * Search for a given cipher (the first supported hardware cipher, else the
+ * software one).
  */
 static struct cipher_s *crypt_cipher_search(const char *name)
 {
-    struct cipher_s key;
-    key.name = name;
-    struct cipher_s *cipher = bsearch(&key, hardware_ciphers,
-        sizeof(hardware_ciphers) / sizeof(struct cipher_s),
-        sizeof(struct cipher_s), cipher_s_compare);
-    if (cipher != NULL &&
-        (cipher->test == NULL || cipher->test()))
+    for (size_t i = 0;
+            i < sizeof(hardware_ciphers) / sizeof(struct cipher_s); i++)
     {
-        return cipher;
+        struct cipher_s *cipher = hardware_ciphers + i;
+        if (strcmp(cipher->name, name) == 0 &&
+            (cipher->test == NULL || cipher->test()))
+        {
+            return cipher;
+        }
     }
-    cipher = bsearch(&key, ciphers, sizeof(ciphers) / sizeof(struct cipher_s),
+    struct cipher_s key;
+    key.name = name;
+    return bsearch(&key, ciphers, sizeof(ciphers) / sizeof(struct cipher_s),
         sizeof(struct cipher_s), cipher_s_compare);
-    return cipher;
 }
 
 /*
@@ -685,9 +844,21 @@ static void crypt_free(state_t state)
     state->gbl_state->refcount--;
     if (state->gbl_state->refcount == 0)
     {
-        quota_free(state->gbl_state->quota);
+        quota_free(state->gbl_state->cookie_quota);
+        quota_free(state->gbl_state->key_quota);
         mpz_clear(state->gbl_state->mp_certificate);
         mpz_clear(state->gbl_state->mp_sign_key);
+        for (size_t i = 0; state->gbl_state->crt && i < CRYPT_CRT_PARAMS;
+                i++)
+        {
+            mpz_clear(state->gbl_state->mp_crt[i]);
+        }
+        struct crypt_key_pool_s *pool = &state->gbl_state->key_pool;
+        for (size_t i = 0; i < 2 * pool->depth; i++)
+        {
+            mpz_clear(pool->keys[i]);
+        }
+        free(pool->keys);
         free(state->gbl_state);
     }
 #endif
@@ -703,6 +874,25 @@ static size_t crypt_overhead(state_t state)
         state->mac_size;
 }
 
+/*
+ * Query the minimum size of a received crypt packet.  This is either a data
+ * packet, or the smallest handshake message from the peer.
+ */
+static size_t crypt_min_size(state_t state, size_t size)
+{
+#ifdef CLIENT
+    size_t header_size = state->iv_size;
+    size_t handshake_size = sizeof(struct crypt_rep_cookie_s);
+#endif      /* CLIENT */
+#ifdef SERVER
+    size_t header_size = state->iv_size + state->id_size;
+    size_t handshake_size = sizeof(struct crypt_req_certificate_s);
+#endif      /* SERVER */
+    size_t data_size = sizeof(uint32_t) + state->mac_size + size;
+    return header_size +
+        (handshake_size < data_size? handshake_size: data_size);
+}
+
 /*
  * Convert error codes to strings.
  */
@@ -742,6 +932,10 @@ static const char *crypt_error_string(state_t state, int err)
             return "out of memory";
         case CRYPT_ERROR_DOS:
             return "dos packet";
+        case CRYPT_ERROR_OVERLOAD:
+            return "server overloaded";
+        case CRYPT_ERROR_CLUSTER_MISMATCH:
+            return "reloaded server was in cluster mode";
         default:
             return "generic error";
     }
@@ -1340,8 +1534,34 @@ static inline uint32_t crypt_next_seq(state_t state)
  */
 static int crypt_activate(state_t state)
 {
+    struct crypt_global_state_s *gbl_state = state->gbl_state;
+    if (gbl_state->restored_cluster && !gbl_state->cluster)
+    {
+        // Random generators would silently break the cluster:
+        return CRYPT_ERROR_CLUSTER_MISMATCH;
+    }
+    if (gbl_state->cluster)
+    {
+        crypt_cluster_manager((void *)state);
+    }
+    else
+    {
+        // Keep the timeout of restored generators (see crypt_restore()):
+        uint64_t currtime = state->lib->gettime();
+        uint64_t timeout = gbl_state->gen_timeout;
+        if (timeout <= currtime || timeout > currtime + CRYPT_TIMEOUT)
+        {
+            timeout = currtime + CRYPT_TIMEOUT;
+        }
+        gbl_state->gen_timeout = timeout;
+        timer_start(&gbl_state->gen_timer,
+            (timeout - currtime) * MILLISECONDS, crypt_timeout_manager,
+            (void *)state);
+    }
+
     thread_t thread;
-    if (thread_create(&thread, crypt_timeout_manager, (void *)state))
+    if (gbl_state->key_pool.depth != 0 &&
+        thread_create(&thread, crypt_key_pool_manager, (void *)state))
     {
         return CRYPT_ERROR_OUT_OF_MEMORY;
     }
@@ -1371,11 +1591,226 @@ static int crypt_clone(state_t state, state_t *stateptr)
 }
 
 /*
- * Server handle a packet.
+ * Set the key request deferral mode.
+ */
+static void crypt_defer(state_t state, unsigned mode)
+{
+    state->defer = (uint8_t)mode;
+}
+
+/*
+ * Set the per-source cookie and key request rates (0 = unlimited).
+ */
+static void crypt_quota(state_t state, unsigned cookie_rate,
+    unsigned key_rate)
+{
+    quota_set_rate(state->gbl_state->cookie_quota, cookie_rate);
+    quota_set_rate(state->gbl_state->key_quota, key_rate);
+}
+
+/*
+ * Enable the pool of pre-computed DH key pairs (filled at the given rate per
+ * second by crypt_key_pool_manager once activated).  A depth of 0 leaves
+ * the pool disabled.
+ */
+static bool crypt_keypool(state_t state, unsigned depth, unsigned rate)
+{
+    struct crypt_key_pool_s *pool = &state->gbl_state->key_pool;
+    if (depth == 0 || rate == 0 || pool->depth != 0)
+    {
+        return true;
+    }
+    pool->keys = (mpz_t *)malloc(2 * (size_t)depth * sizeof(mpz_t));
+    if (pool->keys == NULL)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < 2 * (size_t)depth; i++)
+    {
+        mpz_init(pool->keys[i]);
+    }
+    thread_lock_init(&pool->lock);
+    pool->rate  = rate;
+    pool->depth = depth;
+    return true;
+}
+
+/*
+ * Set the overload shedding level (CKTP_SHED_*).
+ */
+static void crypt_shed(state_t state, unsigned level)
+{
+    state->gbl_state->shed = level;
+}
+
+/*
+ * Save the generators and sequence state (for a server reload).
+ */
+static size_t crypt_save(state_t state, uint8_t *data, size_t size)
+{
+    struct crypt_global_state_s *gbl_state = state->gbl_state;
+    struct crypt_saved_state_s saved;
+    if (size < sizeof(saved))
+    {
+        return 0;
+    }
+    memset(&saved, 0x0, sizeof(saved));
+    saved.version     = CRYPT_VERSION;
+    saved.seq         = gbl_state->seq;
+    saved.seq_key     = gbl_state->seq_key;
+    saved.cluster     = gbl_state->cluster;
+    thread_lock(&gbl_state->gen_lock);
+    saved.gen_timeout = gbl_state->gen_timeout;
+    saved.gen_idx     = gbl_state->gen_idx;
+    memmove(saved.cookie_gen, gbl_state->cookie_gen,
+        sizeof(saved.cookie_gen));
+    memmove(saved.key_gen, gbl_state->key_gen, sizeof(saved.key_gen));
+    thread_unlock(&gbl_state->gen_lock);
+    memmove(data, &saved, sizeof(saved));
+    return sizeof(saved);
+}
+
+/*
+ * Restore state saved by crypt_save() in the old server.  The old server
+ * keeps running until the new one is ready, so skip ahead in the sequence
+ * numbers to avoid reusing any.
+ */
+static bool crypt_restore(state_t state, const uint8_t *data, size_t size)
+{
+    struct crypt_global_state_s *gbl_state = state->gbl_state;
+    struct crypt_saved_state_s saved;
+    if (size != sizeof(saved))
+    {
+        return false;
+    }
+    memmove(&saved, data, sizeof(saved));
+    if (saved.version != CRYPT_VERSION || saved.gen_idx > 1)
+    {
+        return false;
+    }
+    gbl_state->seq         = saved.seq + CRYPT_RELOAD_SEQ_GAP;
+    gbl_state->seq_key     = saved.seq_key;
+    gbl_state->gen_timeout = saved.gen_timeout;
+    gbl_state->gen_idx     = saved.gen_idx;
+    gbl_state->restored_cluster = (saved.cluster != 0);
+    memmove(gbl_state->cookie_gen, saved.cookie_gen,
+        sizeof(gbl_state->cookie_gen));
+    memmove(gbl_state->key_gen, saved.key_gen, sizeof(gbl_state->key_gen));
+    return true;
+}
+
+/*
+ * Enable cluster mode.  The cookie and key generators and the sequence key
+ * are derived from the shared secret and the epoch (the current
+ * CRYPT_TIMEOUT period since the Unix epoch) rather than chosen at random.
+ * Every server sharing the secret and certificate can then handle any
+ * client, provided their clocks agree to within CRYPT_CLUSTER_EARLY.
+ */
+static bool crypt_cluster(state_t state, const uint8_t *secret,
+    size_t secret_size)
+{
+    if (secret_size < CRYPT_CLUSTER_SECRET_MIN)
+    {
+        return false;
+    }
+    struct crypt_global_state_s *gbl_state = state->gbl_state;
+    uint8_t secret_copy[secret_size];
+    memmove(secret_copy, secret, secret_size);
+    hash(state->cipher, secret_copy, secret_size, gbl_state->cluster_key);
+    gbl_state->cluster = true;
+
+    crypt_cluster_gen(state, CRYPT_CLUSTER_SEQ_KEY, 0, &gbl_state->seq_key,
+        sizeof(gbl_state->seq_key));
+    uint64_t epoch = state->lib->gettime() / CRYPT_TIMEOUT;
+    crypt_cluster_install(state, epoch - 1);
+    crypt_cluster_install(state, epoch);
+    gbl_state->gen_idx = (uint8_t)(epoch % 2);
+    gbl_state->gen_timeout = (epoch + 1) * CRYPT_TIMEOUT;
+    return true;
+}
+
+/*
+ * Derive generator material for the given label and epoch:
+ * hash(cluster_key | label | counter | epoch).
+ */
+static void crypt_cluster_gen(state_t state, uint8_t label, uint64_t epoch,
+    void *gen, size_t gen_size)
+{
+    struct
+    {
+        uint8_t key[CRYPT_HASH_SIZE];
+        uint8_t label;
+        uint8_t counter;
+        uint64_t epoch;
+    } __attribute__((packed)) input;
+    memmove(input.key, state->gbl_state->cluster_key, sizeof(input.key));
+    input.label = label;
+    input.epoch = epoch;
+    uint8_t *out = (uint8_t *)gen;
+    for (size_t i = 0; i < gen_size; i += CRYPT_HASH_SIZE)
+    {
+        uint8_t hashval[CRYPT_HASH_SIZE];
+        input.counter = (uint8_t)(i / CRYPT_HASH_SIZE);
+        hash(state->cipher, (uint8_t *)&input, sizeof(input), hashval);
+        memmove(out + i, hashval, (gen_size - i < CRYPT_HASH_SIZE?
+            gen_size - i: CRYPT_HASH_SIZE));
+    }
+}
+
+/*
+ * Install the cookie and key generators for the given epoch.
+ */
+static void crypt_cluster_install(state_t state, uint64_t epoch)
+{
+    struct crypt_global_state_s *gbl_state = state->gbl_state;
+    crypt_cluster_gen(state, CRYPT_CLUSTER_COOKIE_GEN, epoch,
+        gbl_state->cookie_gen + epoch % 2, sizeof(struct cookie_gen_s));
+    crypt_cluster_gen(state, CRYPT_CLUSTER_KEY_GEN, epoch,
+        gbl_state->key_gen + epoch % 2, sizeof(struct cookie_gen_s));
+    gbl_state->cluster_epoch = epoch;
+}
+
+/*
+ * Server handle a packet (and count the result).
  */
 static int crypt_server_decode(state_t state, uint32_t *source_addr,
     size_t source_size, uint8_t **dataptr, size_t *sizeptr,
     uint8_t **replyptr, size_t *replysizeptr)
+{
+    int result = crypt_server_decode_packet(state, source_addr, source_size,
+        dataptr, sizeptr, replyptr, replysizeptr);
+    switch (result)
+    {
+        case 0: case CKTP_ENCODING_DEFER:
+            break;
+        case CRYPT_ERROR_BAD_MAC:
+            stats_add(STATS_CRYPT_BAD_MAC, 1);
+            break;
+        case CRYPT_ERROR_BAD_LENGTH:
+            stats_add(STATS_CRYPT_BAD_LENGTH, 1);
+            break;
+        case CRYPT_ERROR_BAD_COOKIE:
+            stats_add(STATS_CRYPT_BAD_COOKIE, 1);
+            break;
+        case CRYPT_ERROR_DOS:
+            stats_add(STATS_CRYPT_DOS, 1);
+            break;
+        case CRYPT_ERROR_OVERLOAD:
+            // Counted (by type) where shed.
+            break;
+        default:
+            stats_add(STATS_CRYPT_OTHER, 1);
+            break;
+    }
+    return result;
+}
+
+/*
+ * Server handle a packet.
+ */
+static int crypt_server_decode_packet(state_t state, uint32_t *source_addr,
+    size_t source_size, uint8_t **dataptr, size_t *sizeptr,
+    uint8_t **replyptr, size_t *replysizeptr)
 {
     uint8_t *data = *dataptr;
     size_t size = *sizeptr;
@@ -1432,6 +1867,18 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
             {
                 return CRYPT_ERROR_BAD_LENGTH;
             }
+            if (state->gbl_state->shed >= CKTP_SHED_COOKIE)
+            {
+                stats_add(STATS_SHED_COOKIE, 1);
+                return CRYPT_ERROR_OVERLOAD;
+            }
+            if (!quota_check(state->gbl_state->cookie_quota, source_addr,
+                    source_size))
+            {
+                // Packet is likely part of a DoS, ignore it:
+                stats_add(STATS_QUOTA_COOKIE, 1);
+                return CRYPT_ERROR_DOS;
+            }
             
             rep->reply.seq = req->request.seq;
             rep->reply.cookie = crypt_cookie(state, source_addr, source_size);
@@ -1442,6 +1889,7 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
                 crypt_handshake_pad_length(state, reply, sizeof(*rep));
             *dataptr = NULL;
             *sizeptr = 0;
+            stats_add(STATS_HANDSHAKE_COOKIE, 1);
             return 0;
         }
         case CRYPT_ID_REQ_CERTIFICATE:
@@ -1472,6 +1920,11 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
             {
                 return CRYPT_ERROR_BAD_LENGTH;
             }
+            if (state->gbl_state->shed >= CKTP_SHED_CERTIFICATE)
+            {
+                stats_add(STATS_SHED_CERTIFICATE, 1);
+                return CRYPT_ERROR_OVERLOAD;
+            }
             rep->reply.seq = req->request.seq;
             crypt(state->cipher, req->iv, sizeof(req->iv), state->cert_hash,
                 req->id, sizeof(req->id) + sizeof(req->request));
@@ -1489,6 +1942,7 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
                 crypt_handshake_pad_length(state, reply, sizeof(*rep));
             *dataptr = NULL;
             *sizeptr = 0;
+            stats_add(STATS_HANDSHAKE_CERTIFICATE, 1);
             return 0;
         }
         case CRYPT_ID_REQ_KEY:
@@ -1515,6 +1969,11 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
             {
                 return CRYPT_ERROR_BAD_LENGTH;
             }
+            if (state->gbl_state->shed >= CKTP_SHED_KEY)
+            {
+                stats_add(STATS_SHED_KEY, 1);
+                return CRYPT_ERROR_OVERLOAD;
+            }
             rep->reply.seq = req->request.seq;
             crypt(state->cipher, req->iv, sizeof(req->iv), state->cert_hash,
                 req->id, sizeof(req->id) + sizeof(req->request));
@@ -1524,15 +1983,34 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
                 return CRYPT_ERROR_BAD_COOKIE;
             }
 
-            // First determine if we should service this request:
+            // First determine if we should service this request.  This is
+            // checked before deferring, so one source cannot fill the shared
+            // handshake queue, and not again by the handshake worker.
             // Note: must come after cookie check.
-            if (!quota_check(state->gbl_state->quota, state->lib, state->rng,
-                    source_addr, source_size))
+            if (state->defer != CKTP_DEFER_WORKER &&
+                !quota_check(state->gbl_state->key_quota, source_addr,
+                    source_size))
             {
                 // Packet is likely part of a DoS, ignore it:
+                stats_add(STATS_QUOTA_KEY, 1);
                 return CRYPT_ERROR_DOS;
             }
 
+            // Servicing the request is expensive; if deferring, restore the
+            // packet (crypt() is an involution) so it can be decoded again.
+            if (state->defer == CKTP_DEFER_QUEUE)
+            {
+                crypt(state->cipher, req->iv, sizeof(req->iv),
+                    state->cert_hash, req->id, sizeof(req->id) +
+                    sizeof(req->request));
+                crypt(state->cipher, client_header->iv,
+                    sizeof(client_header->iv), state->cert_hash,
+                    client_header->id, sizeof(client_header->id) +
+                    sizeof(client_header->seq));
+                return CKTP_ENCODING_DEFER;
+            }
+            uint64_t start_time = stats_time();
+
             // Get the client's DH public key:
             mpz_t client_public_key;
             mpz_init(client_public_key);
@@ -1553,39 +2031,34 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
                 return CRYPT_ERROR_BAD_PARAMETER;
             }
 
-            // Make a DH private key:
+            // Get a DH key pair for the server (pre-computed if possible):
             uint8_t t[CRYPT_PUBLIC_KEY_SIZE];
-            mpz_t server_private_key;
+            mpz_t server_private_key, server_public_key;
             mpz_init(server_private_key);
-            do
+            mpz_init(server_public_key);
+            if (!crypt_key_pool_get(&state->gbl_state->key_pool,
+                    server_private_key, server_public_key))
             {
-                state->lib->random(state->rng, t, sizeof(t));
-                mpz_import(server_private_key, sizeof(t), -1, sizeof(uint8_t),
-                    0, 0, t);
-                // CHECK: x in {2, ..., p - 2}
+                crypt_dh_keypair(state, state->rng, server_private_key,
+                    server_public_key);
             }
-            while (mpz_cmp(server_private_key, p1) >= 0 ||
-                   mpz_cmp_ui(server_private_key, 1) <= 0);
 
             // Compute the DH shared secret key:
             mpz_t shared_key;
             mpz_init(shared_key);
             mpz_powm(shared_key, client_public_key, server_private_key, p);
             mpz_clear(client_public_key);
+            mpz_clear(server_private_key);
 
             // CHECK: g^xy != 1
             if (mpz_cmp_ui(shared_key, 1) == 0)
             {
-                mpz_clear(server_private_key);
+                mpz_clear(server_public_key);
                 mpz_clear(shared_key);
                 return CRYPT_ERROR_BAD_PARAMETER;
             }
 
-            // Compute the DH public ket for the server:
-            mpz_t server_public_key;
-            mpz_init(server_public_key);
-            mpz_powm(server_public_key, g, server_private_key, p);
-            mpz_clear(server_private_key);
+            // Send the DH public key for the server:
             mpz_export(rep->reply.public_key, NULL, -1, sizeof(uint8_t), 0, 0,
                 server_public_key);
             mpz_clear(server_public_key);
@@ -1653,8 +2126,7 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
                 sizeof(uint8_t), 0, 0, rep->reply.encrypted.signature);
             mpz_t sign_result;
             mpz_init(sign_result);
-            mpz_powm(sign_result, signature, state->gbl_state->mp_sign_key,
-                state->gbl_state->mp_certificate);
+            crypt_sign(state->gbl_state, sign_result, signature);
             mpz_clear(signature);
             mpz_export(rep->reply.encrypted.signature, NULL, -1,
                 sizeof(uint8_t), 0, 0, sign_result);
@@ -1677,6 +2149,8 @@ static int crypt_server_decode(state_t state, uint32_t *source_addr,
                 crypt_handshake_pad_length(state, reply, sizeof(*rep));
             *dataptr = NULL;
             *sizeptr = 0;
+            stats_add(STATS_HANDSHAKE_KEY, 1);
+            stats_hist_add(STATS_HIST_KEY, stats_time() - start_time);
 
             // All done:
             return 0;
@@ -1755,6 +2229,15 @@ static bool crypt_server_init(state_t state, bool read_cert)
         return false;
     }
     gbl_state->refcount = 1;
+    gbl_state->crt = false;
+    gbl_state->cluster = false;
+    gbl_state->gen_timer = (struct timer_s)TIMER_INIT;
+    gbl_state->restored_cluster = false;
+    if (thread_lock_init(&gbl_state->gen_lock) != 0)
+    {
+        return false;
+    }
+    gbl_state->shed = CKTP_SHED_NONE;
     state->gbl_state = gbl_state;
 
     if (!cookie_gen_init(gbl_state->cookie_gen) ||
@@ -1788,11 +2271,22 @@ static bool crypt_server_init(state_t state, bool read_cert)
         mpz_sub_ui(p1, p, 1);
         mpz_init(g);
         mpz_set_ui(g, CRYPT_DH_GENERATOR);
+        crypt_dh_table_init();
         mp_init = true;
     }
-    state->gbl_state->quota = quota_init(state->lib, CRYPT_QUOTA_RK_TIMEMIN,
-        CRYPT_QUOTA_RK_TIMEMAX, CRYPT_QUOTA_RK_NUM_BUCKETS,
-        CRYPT_QUOTA_RK_RATE);
+
+    // Pre-computed DH key pairs (disabled until crypt_keypool):
+    struct crypt_key_pool_s *pool = &gbl_state->key_pool;
+    pool->depth = 0;
+    pool->rate  = 0;
+    pool->head  = 0;
+    pool->count = 0;
+    pool->keys  = NULL;
+
+    state->gbl_state->cookie_quota = quota_init(CRYPT_QUOTA_WINDOW,
+        CRYPT_QUOTA_NUM_COUNTS, CRYPT_QUOTA_RC_RATE);
+    state->gbl_state->key_quota = quota_init(CRYPT_QUOTA_WINDOW,
+        CRYPT_QUOTA_NUM_COUNTS, CRYPT_QUOTA_RK_RATE);
     mpz_init(state->gbl_state->mp_certificate);
     mpz_import(state->gbl_state->mp_certificate, sizeof(state->certificate),
         -1, sizeof(uint8_t), 0, 0, state->certificate);
@@ -1800,34 +2294,170 @@ static bool crypt_server_init(state_t state, bool read_cert)
     mpz_import(state->gbl_state->mp_sign_key, sizeof(state->sign_key), -1,
         sizeof(uint8_t), 0, 0, state->sign_key);
 
+    // Discard a CRT key that does not match the certificate (n = p*q):
+    if (gbl_state->crt)
+    {
+        mpz_t n;
+        mpz_init(n);
+        mpz_mul(n, gbl_state->mp_crt[0], gbl_state->mp_crt[1]);
+        if (mpz_cmp(n, gbl_state->mp_certificate) != 0)
+        {
+            for (size_t i = 0; i < CRYPT_CRT_PARAMS; i++)
+            {
+                mpz_clear(gbl_state->mp_crt[i]);
+            }
+            gbl_state->crt = false;
+        }
+        mpz_clear(n);
+    }
+
     return true;
 }
 
 /*
- * Thread that handles timeouts.
+ * Generator timeout (timer callback): rotate the generators every
+ * CRYPT_TIMEOUT.
+ */
+static void crypt_timeout_manager(void *state_ptr)
+{
+    state_t state = (state_t)state_ptr;
+
+    // At this point no client should be using the old state, therefore
+    // we can safely just clobber it.
+    thread_lock(&state->gbl_state->gen_lock);
+    state->lib->random(state->rng, state->gbl_state->cookie_gen +
+        !state->gbl_state->gen_idx, sizeof(struct cookie_gen_s));
+    state->lib->random(state->rng, state->gbl_state->key_gen +
+        !state->gbl_state->gen_idx,
+        sizeof(struct cookie_gen_s));
+    state->gbl_state->gen_idx = !state->gbl_state->gen_idx;
+    state->gbl_state->gen_timeout = state->lib->gettime() + CRYPT_TIMEOUT;
+    thread_unlock(&state->gbl_state->gen_lock);
+    timer_start(&state->gbl_state->gen_timer, CRYPT_TIMEOUT * MILLISECONDS,
+        crypt_timeout_manager, state_ptr);
+}
+
+/*
+ * Generator timeout in cluster mode (timer callback).  Generators rotate at
+ * epoch boundaries so all servers agree on them.  The next epoch's
+ * generators are installed CRYPT_CLUSTER_EARLY before the boundary (the
+ * slot is no longer in use by then) so a server with a slightly slow clock
+ * still accepts sessions issued by a faster one.
+ */
+static void crypt_cluster_manager(void *state_ptr)
+{
+    state_t state = (state_t)state_ptr;
+    struct crypt_global_state_s *gbl_state = state->gbl_state;
+
+    // Switch to the current epoch (if not already):
+    thread_lock(&gbl_state->gen_lock);
+    uint64_t currtime = state->lib->gettime();
+    uint64_t epoch = currtime / CRYPT_TIMEOUT;
+    uint64_t boundary = (epoch + 1) * CRYPT_TIMEOUT;
+    if (gbl_state->gen_timeout != boundary)
+    {
+        if (gbl_state->cluster_epoch < epoch)
+        {
+            crypt_cluster_install(state, epoch);
+        }
+        gbl_state->gen_timeout = boundary;
+        gbl_state->gen_idx = (uint8_t)(epoch % 2);
+    }
+
+    // Install the next epoch early, then wait for the boundary:
+    uint64_t delay;
+    if (currtime + CRYPT_CLUSTER_EARLY >= boundary)
+    {
+        if (gbl_state->cluster_epoch != epoch + 1)
+        {
+            crypt_cluster_install(state, epoch + 1);
+        }
+        delay = boundary - currtime;
+    }
+    else
+    {
+        delay = boundary - CRYPT_CLUSTER_EARLY - currtime;
+    }
+    thread_unlock(&gbl_state->gen_lock);
+    timer_start(&gbl_state->gen_timer, delay * MILLISECONDS,
+        crypt_cluster_manager, state_ptr);
+}
+
+/*
+ * Thread that keeps the DH key pair pool topped up.  Pairs are generated at
+ * (at most) the configured rate, so an empty pool after a burst of key
+ * requests is refilled without competing with the handshake path.
  */
-static void *crypt_timeout_manager(void *state_ptr)
+static void *crypt_key_pool_manager(void *state_ptr)
 {
     state_t state = (state_t)state_ptr;
+    struct crypt_key_pool_s *pool = &state->gbl_state->key_pool;
+    cktp_enc_rng_t rng = state->lib->random_init();
+    const unsigned ticks = 1000 / CRYPT_KEYPOOL_TICK;
+    unsigned budget = 0;
+    mpz_t x, gx;
+    mpz_init(x);
+    mpz_init(gx);
 
     while (true)
     {
-        state->gbl_state->gen_timeout = state->lib->gettime() + CRYPT_TIMEOUT;
-        state->lib->sleeptime(CRYPT_TIMEOUT);
+        state->lib->sleeptime(CRYPT_KEYPOOL_TICK);
+        budget += pool->rate;
+        while (budget >= ticks)
+        {
+            thread_lock(&pool->lock);
+            bool full = (pool->count >= pool->depth);
+            thread_unlock(&pool->lock);
+            if (full)
+            {
+                budget = 0;
+                break;
+            }
+            budget -= ticks;
 
-        // At this point no client should be using the old state, therefore
-        // we can safely just clobber it.
-        state->lib->random(state->rng, state->gbl_state->cookie_gen +
-            !state->gbl_state->gen_idx, sizeof(struct cookie_gen_s));
-        state->lib->random(state->rng, state->gbl_state->key_gen +
-            !state->gbl_state->gen_idx,
-            sizeof(struct cookie_gen_s));
-        state->gbl_state->gen_idx = !state->gbl_state->gen_idx;
+            crypt_dh_keypair(state, rng, x, gx);
+
+            thread_lock(&pool->lock);
+            if (pool->count < pool->depth)
+            {
+                size_t idx = (pool->head + pool->count) % pool->depth;
+                mpz_swap(pool->keys[2 * idx], x);
+                mpz_swap(pool->keys[2 * idx + 1], gx);
+                pool->count++;
+            }
+            thread_unlock(&pool->lock);
+        }
     }
 
     return NULL;
 }
 
+/*
+ * Take a pre-computed DH key pair from the pool.  Each pair is handed out
+ * once.  Returns false if the pool is empty (or disabled).
+ */
+static bool crypt_key_pool_get(struct crypt_key_pool_s *pool, mpz_t x,
+    mpz_t gx)
+{
+    if (pool->depth == 0)
+    {
+        return false;
+    }
+    thread_lock(&pool->lock);
+    if (pool->count == 0)
+    {
+        thread_unlock(&pool->lock);
+        return false;
+    }
+    size_t idx = pool->head;
+    mpz_swap(pool->keys[2 * idx], x);
+    mpz_swap(pool->keys[2 * idx + 1], gx);
+    pool->head = (pool->head + 1) % pool->depth;
+    pool->count--;
+    thread_unlock(&pool->lock);
+    return true;
+}
+
 /*
  * Read a certificate from the key file.
  */
@@ -1881,14 +2511,37 @@ static bool crypt_read_certificate(state_t state)
         char cert_hash_str[CRYPT_HASH_BASE64_SIZE + 1];
         char cert_str[CRYPT_PUBLIC_KEY_BASE64_SIZE + 1];
         char key_str[CRYPT_PUBLIC_KEY_BASE64_SIZE + 1];
+        char crt_str[CRYPT_CRT_PARAMS][CRYPT_PRIME_BASE64_SIZE + 1];
 
         if (getc(file) != '\t' ||
             fgets(cert_hash_str, sizeof(cert_hash_str), file) == NULL ||
             getc(file) != ' ' ||
             fgets(cert_str, sizeof(cert_str), file) == NULL ||
             getc(file) != ' ' ||
-            fgets(key_str, sizeof(key_str), file) == NULL ||
-            getc(file) != '\n')
+            fgets(key_str, sizeof(key_str), file) == NULL)
+        {
+            fclose(file);
+            return false;
+        }
+
+        // Optional CRT sign key (older key files do not have it):
+        bool have_crt = false;
+        c = getc(file);
+        if (c == ' ')
+        {
+            for (i = 0; i < CRYPT_CRT_PARAMS; i++)
+            {
+                if ((i != 0 && getc(file) != ' ') ||
+                    fgets(crt_str[i], sizeof(crt_str[i]), file) == NULL)
+                {
+                    fclose(file);
+                    return false;
+                }
+            }
+            have_crt = true;
+            c = getc(file);
+        }
+        if (c != '\n')
         {
             fclose(file);
             return false;
@@ -1918,14 +2571,142 @@ static bool crypt_read_certificate(state_t state)
                 fclose(file);
                 return false;
             }
+            uint8_t crt[CRYPT_CRT_PARAMS][CRYPT_PRIME_SIZE+1];
+            for (i = 0; have_crt && i < CRYPT_CRT_PARAMS; i++)
+            {
+                if (state->lib->base64_decode(crt_str[i],
+                        sizeof(crt_str[i])-1, crt[i]) != sizeof(crt[i]))
+                {
+                    fclose(file);
+                    return false;
+                }
+            }
             fclose(file);
             memmove(state->certificate, cert, sizeof(state->certificate));
             memmove(state->sign_key, sign_key, sizeof(state->sign_key));
+            for (i = 0; have_crt && i < CRYPT_CRT_PARAMS; i++)
+            {
+                mpz_init(state->gbl_state->mp_crt[i]);
+                mpz_import(state->gbl_state->mp_crt[i], CRYPT_PRIME_SIZE, -1,
+                    sizeof(uint8_t), 0, 0, crt[i]);
+            }
+            state->gbl_state->crt = have_crt;
             return true;
         }
     }
 }
 
+/*
+ * RSA sign a message (< n).  Uses the CRT sign key if available (about 3x
+ * faster).  The CRT result is verified with the public exponent, since a
+ * faulty CRT signature reveals the factors of n; on failure (or without a
+ * CRT key) the plain private exponent is used.
+ */
+static void crypt_sign(struct crypt_global_state_s *gbl_state, mpz_t result,
+    const mpz_t message)
+{
+    if (gbl_state->crt)
+    {
+        mpz_t *crt = gbl_state->mp_crt;
+        mpz_t s1, s2, check;
+        mpz_init(s1);
+        mpz_init(s2);
+        mpz_init(check);
+        mpz_powm(s1, message, crt[2], crt[0]);      // s1 = m^dP mod p
+        mpz_powm(s2, message, crt[3], crt[1]);      // s2 = m^dQ mod q
+        mpz_sub(s1, s1, s2);
+        mpz_mul(s1, s1, crt[4]);
+        mpz_mod(s1, s1, crt[0]);                    // h = qInv(s1-s2) mod p
+        mpz_mul(s1, s1, crt[1]);
+        mpz_add(result, s2, s1);                    // s = s2 + hq
+        mpz_powm_ui(check, result, CRYPT_RSA_EXPONENT,
+            gbl_state->mp_certificate);
+        bool ok = (mpz_cmp(check, message) == 0);
+        mpz_clear(s1);
+        mpz_clear(s2);
+        mpz_clear(check);
+        if (ok)
+        {
+            return;
+        }
+    }
+    mpz_powm(result, message, gbl_state->mp_sign_key,
+        gbl_state->mp_certificate);
+}
+
+/*
+ * Pre-compute the fixed-base table for g: entry (i, j) is g^(j*2^(w*i)) mod p,
+ * so g^x is the product of one entry per w-bit digit of x (about 3x faster
+ * than mpz_powm for a 1024-bit x, for 512KB of table).
+ */
+static void crypt_dh_table_init(void)
+{
+    g_table = (mpz_t *)malloc(CRYPT_DH_WINDOWS * CRYPT_DH_WINDOW_SIZE *
+        sizeof(mpz_t));
+    if (g_table == NULL)
+    {
+        return;     // Fall back to mpz_powm.
+    }
+    mpz_t base;
+    mpz_init_set(base, g);
+    for (size_t i = 0; i < CRYPT_DH_WINDOWS; i++)
+    {
+        mpz_t *row = g_table + i * CRYPT_DH_WINDOW_SIZE;
+        mpz_init_set_ui(row[0], 1);
+        for (size_t j = 1; j < CRYPT_DH_WINDOW_SIZE; j++)
+        {
+            mpz_init(row[j]);
+            mpz_mul(row[j], row[j-1], base);
+            mpz_mod(row[j], row[j], p);
+        }
+        mpz_mul(base, row[CRYPT_DH_WINDOW_SIZE-1], base);
+        mpz_mod(base, base, p);
+    }
+    mpz_clear(base);
+}
+
+/*
+ * Compute g^exponent mod p using the fixed-base table.  Every window is
+ * multiplied in (including zero digits) so the cost does not depend on the
+ * exponent.
+ */
+static void crypt_dh_powg(mpz_t result, const mpz_t exponent)
+{
+    if (g_table == NULL)
+    {
+        mpz_powm(result, g, exponent, p);
+        return;
+    }
+    mpz_set_ui(result, 1);
+    for (size_t i = 0; i < CRYPT_DH_WINDOWS; i++)
+    {
+        unsigned digit = 0;
+        for (size_t j = 0; j < CRYPT_DH_WINDOW; j++)
+        {
+            digit |= mpz_tstbit(exponent, i * CRYPT_DH_WINDOW + j) << j;
+        }
+        mpz_mul(result, result, g_table[i * CRYPT_DH_WINDOW_SIZE + digit]);
+        mpz_mod(result, result, p);
+    }
+}
+
+/*
+ * Generate a DH key pair: a random private key x in {2, ..., p - 2} and
+ * the public key g^x mod p.
+ */
+static void crypt_dh_keypair(state_t state, cktp_enc_rng_t rng, mpz_t x,
+    mpz_t gx)
+{
+    uint8_t t[CRYPT_PUBLIC_KEY_SIZE];
+    do
+    {
+        state->lib->random(rng, t, sizeof(t));
+        mpz_import(x, sizeof(t), -1, sizeof(uint8_t), 0, 0, t);
+    }
+    while (mpz_cmp(x, p1) >= 0 || mpz_cmp_ui(x, 1) <= 0);
+    crypt_dh_powg(gx, x);
+}
+
 /*
  * Generate the initial handshake cookie.
  */
@@ -1968,7 +2749,9 @@ static void crypt_key(state_t state, uint32_t *source_addr, size_t source_size,
 
 #include <openssl/rsa.h>
 #include <sys/file.h>
+#define crypt       unistd_crypt        // Avoid clash with crypt(3)
 #include <unistd.h>
+#undef crypt
 
 #include "base64.h"
 #include "cfg.h"
@@ -1992,6 +2775,19 @@ void usage(void)
     fputs(") (gen|test)\n", stderr);
 }
 
+/*
+ * Reverse a byte string (big <-> little endian).
+ */
+static void crypt_reverse(uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size / 2; i++)
+    {
+        uint8_t tmp = data[size-i-1];
+        data[size-i-1] = data[i];
+        data[i] = tmp;
+    }
+}
+
 /*
  * Entry point for the crypt tool.
  */
@@ -2070,35 +2866,39 @@ int main(int argc, const char **argv)
 
         // Generate the RSA public/private keys:
         RSA *rsa = RSA_generate_key(1024, CRYPT_RSA_EXPONENT, NULL, NULL);
-        if (!RSA_check_key(rsa))
+        if (rsa == NULL || !RSA_check_key(rsa))
         {
             fprintf(stderr, "error: unable to verify generated RSA "
                 "parameters\n");
             return EXIT_FAILURE;
         }
+        const BIGNUM *n, *d, *crt_bn[CRYPT_CRT_PARAMS];
+        RSA_get0_key(rsa, &n, NULL, &d);
+        RSA_get0_factors(rsa, &crt_bn[0], &crt_bn[1]);
+        RSA_get0_crt_params(rsa, &crt_bn[2], &crt_bn[3], &crt_bn[4]);
         uint8_t certificate[CRYPT_PUBLIC_KEY_SIZE];
         uint8_t sign_key[CRYPT_PUBLIC_KEY_SIZE];
-        if (rsa == NULL ||
-            BN_bn2bin(rsa->n, certificate) == 0 ||
-            BN_bn2bin(rsa->d, sign_key) == 0)
+        uint8_t crt[CRYPT_CRT_PARAMS][CRYPT_PRIME_SIZE];
+        bool ok = (BN_bn2binpad(n, certificate, sizeof(certificate)) > 0 &&
+            BN_bn2binpad(d, sign_key, sizeof(sign_key)) > 0);
+        for (size_t i = 0; ok && i < CRYPT_CRT_PARAMS; i++)
+        {
+            ok = (BN_bn2binpad(crt_bn[i], crt[i], sizeof(crt[i])) > 0);
+        }
+        RSA_free(rsa);
+        if (!ok)
         {
             fprintf(stderr, "error: unable to create RSA big numbers: %s\n",
                 strerror(ENOMEM));
             return EXIT_FAILURE;
         }
-        RSA_free(rsa);
 
         // Correct endianess
-        for (size_t i = 0; i < CRYPT_PUBLIC_KEY_SIZE / 2; i++)
+        crypt_reverse(certificate, sizeof(certificate));
+        crypt_reverse(sign_key, sizeof(sign_key));
+        for (size_t i = 0; i < CRYPT_CRT_PARAMS; i++)
         {
-            uint8_t tmp;
-            tmp = certificate[sizeof(certificate)-i-1];
-            certificate[sizeof(certificate)-i-1] = certificate[i];
-            certificate[i] = tmp;
-
-            tmp = sign_key[sizeof(sign_key)-i-1];
-            sign_key[sizeof(sign_key)-i-1] = sign_key[i];
-            sign_key[i] = tmp;
+            crypt_reverse(crt[i], sizeof(crt[i]));
         }
         
         // Generate the certificate's hash value:
@@ -2119,6 +2919,13 @@ int main(int argc, const char **argv)
         end = base64_encode(sign_key, sizeof(sign_key), key_str);
         key_str[end] = '\0';
 
+        char crt_str[CRYPT_CRT_PARAMS][CRYPT_PRIME_BASE64_SIZE + 1];
+        for (size_t i = 0; i < CRYPT_CRT_PARAMS; i++)
+        {
+            end = base64_encode(crt[i], sizeof(crt[i]), crt_str[i]);
+            crt_str[i][end] = '\0';
+        }
+
         FILE *file = fopen(CRYPT_KEYS_FILENAME, "a");
         if (file == NULL)
         {
@@ -2127,8 +2934,9 @@ int main(int argc, const char **argv)
             return EXIT_FAILURE;
         }
         flock(fileno(file), LOCK_EX);
-        fprintf(file, "%s\t\t%s %s %s\n", cipher->name, cert_hash_str, cert_str,
-            key_str);
+        fprintf(file, "%s\t\t%s %s %s %s %s %s %s %s\n", cipher->name,
+            cert_hash_str, cert_str, key_str, crt_str[0], crt_str[1],
+            crt_str[2], crt_str[3], crt_str[4]);
         fflush(file);
         flock(fileno(file), LOCK_UN);
         fclose(file);
@@ -2187,6 +2995,67 @@ static size_t block_init(uint8_t *block, const uint8_t *iv, size_t ivsize,
     return CRYPT_BLOCK_SIZE - sizeof(uint16_t);
 }
 
+/*
+ * CTR mode initialiser.
+ */
+static void ctr_init(struct ctr_s *ctr, const uint8_t *iv, size_t ivsize,
+    uint32_t seq)
+{
+    ctr->counter_offset = block_init(ctr->block, iv, ivsize, seq);
+    ctr->ready = false;
+}
+
+/*
+ * Get the next keystream block.
+ */
+static void ctr_keystream(const struct cipher_s *cipher, const uint8_t *ekey,
+    struct ctr_s *ctr, uint8_t *result)
+{
+    if (ctr->ready)
+    {
+        memmove(result, ctr->next, CRYPT_BLOCK_SIZE);
+        ctr->ready = false;
+        return;
+    }
+    if (cipher->encrypt2 == NULL)
+    {
+        cipher->encrypt(ctr->block, ekey, result);
+        (*(uint16_t *)(ctr->block + ctr->counter_offset))++;
+        return;
+    }
+    uint8_t blocks[2 * CRYPT_BLOCK_SIZE];
+    memmove(blocks, ctr->block, CRYPT_BLOCK_SIZE);
+    (*(uint16_t *)(ctr->block + ctr->counter_offset))++;
+    memmove(blocks + CRYPT_BLOCK_SIZE, ctr->block, CRYPT_BLOCK_SIZE);
+    (*(uint16_t *)(ctr->block + ctr->counter_offset))++;
+    cipher->encrypt2(blocks, ekey, blocks);
+    memmove(result, blocks, CRYPT_BLOCK_SIZE);
+    memmove(ctr->next, blocks + CRYPT_BLOCK_SIZE, CRYPT_BLOCK_SIZE);
+    ctr->ready = true;
+}
+
+/*
+ * Encrypt a (full) MAC block, and with it the next keystream block if the
+ * cipher can do both at once.
+ */
+static void ctr_mac(const struct cipher_s *cipher, const uint8_t *ekey,
+    struct ctr_s *ctr, uint8_t *mac_block)
+{
+    if (cipher->encrypt2 == NULL || ctr->ready)
+    {
+        cipher->encrypt(mac_block, ekey, mac_block);
+        return;
+    }
+    uint8_t blocks[2 * CRYPT_BLOCK_SIZE];
+    memmove(blocks, mac_block, CRYPT_BLOCK_SIZE);
+    memmove(blocks + CRYPT_BLOCK_SIZE, ctr->block, CRYPT_BLOCK_SIZE);
+    (*(uint16_t *)(ctr->block + ctr->counter_offset))++;
+    cipher->encrypt2(blocks, ekey, blocks);
+    memmove(mac_block, blocks, CRYPT_BLOCK_SIZE);
+    memmove(ctr->next, blocks + CRYPT_BLOCK_SIZE, CRYPT_BLOCK_SIZE);
+    ctr->ready = true;
+}
+
 /*
  * Encrypt using the given cipher and return the MAC.
  */
@@ -2194,8 +3063,8 @@ static uint64_t encrypt(const struct cipher_s *cipher, const uint8_t *iv,
     size_t ivsize, uint32_t seq, const uint8_t *ekey, uint8_t *data,
     size_t datasize)
 {
-    uint8_t block[CRYPT_BLOCK_SIZE];
-    size_t counter_offset = block_init(block, iv, ivsize, seq);
+    struct ctr_s ctr;
+    ctr_init(&ctr, iv, ivsize, seq);
     uint8_t result[CRYPT_BLOCK_SIZE];
 
     uint8_t mac_block[CRYPT_BLOCK_SIZE];
@@ -2215,8 +3084,7 @@ static uint64_t encrypt(const struct cipher_s *cipher, const uint8_t *iv,
     {
         if (j == 0)
         {
-            cipher->encrypt(block, ekey, result);
-            (*(uint16_t *)(block + counter_offset))++;
+            ctr_keystream(cipher, ekey, &ctr, result);
             j = CRYPT_BLOCK_SIZE;
         }
         j--;
@@ -2224,7 +3092,7 @@ static uint64_t encrypt(const struct cipher_s *cipher, const uint8_t *iv,
         data[i] ^= result[j];
         if (m == CRYPT_BLOCK_SIZE)
         {
-            cipher->encrypt(mac_block, ekey, mac_block);
+            ctr_mac(cipher, ekey, &ctr, mac_block);
             m = 0;
         }
     }
@@ -2245,8 +3113,8 @@ static uint64_t decrypt(const struct cipher_s *cipher, const uint8_t *iv,
     size_t ivsize, uint32_t seq, const uint8_t *ekey, uint8_t *data,
     size_t datasize)
 {
-    uint8_t block[CRYPT_BLOCK_SIZE];
-    size_t counter_offset = block_init(block, iv, ivsize, seq);
+    struct ctr_s ctr;
+    ctr_init(&ctr, iv, ivsize, seq);
     uint8_t result[CRYPT_BLOCK_SIZE];
 
     uint8_t mac_block[CRYPT_BLOCK_SIZE];
@@ -2266,8 +3134,7 @@ static uint64_t decrypt(const struct cipher_s *cipher, const uint8_t *iv,
     {
         if (j == 0)
         {
-            cipher->encrypt(block, ekey, result);
-            (*(uint16_t *)(block + counter_offset))++;
+            ctr_keystream(cipher, ekey, &ctr, result);
             j = CRYPT_BLOCK_SIZE;
         }
         j--;
@@ -2275,7 +3142,7 @@ static uint64_t decrypt(const struct cipher_s *cipher, const uint8_t *iv,
         mac_block[m++] ^= data[i];
         if (m == CRYPT_BLOCK_SIZE)
         {
-            cipher->encrypt(mac_block, ekey, mac_block);
+            ctr_mac(cipher, ekey, &ctr, mac_block);
             m = 0;
         }
     }
@@ -2298,8 +3165,8 @@ static void crypt(const struct cipher_s *cipher, const uint8_t *iv,
     uint8_t ekey[cipher->ekeysize] __attribute__((aligned(16)));
     cipher->expandkey(key, CRYPT_KEY_SIZE, ekey);
 
-    uint8_t block[CRYPT_BLOCK_SIZE];
-    size_t counter_offset = block_init(block, iv, ivsize, CRYPT_HEADER_SEQ);
+    struct ctr_s ctr;
+    ctr_init(&ctr, iv, ivsize, CRYPT_HEADER_SEQ);
     uint8_t result[CRYPT_BLOCK_SIZE];
     
     // Encrypt the data and compute the MAC:
@@ -2307,8 +3174,7 @@ static void crypt(const struct cipher_s *cipher, const uint8_t *iv,
     {
         if (j == 0)
         {
-            cipher->encrypt(block, ekey, result);
-            (*(uint16_t *)(block + counter_offset))++;
+            ctr_keystream(cipher, ekey, &ctr, result);
             j = CRYPT_BLOCK_SIZE;
         }
         j--;
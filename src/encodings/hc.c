@@ -0,0 +1,876 @@
+/*
+ * hc.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "socket.h"
+
+#include "encodings/hc.h"
+
+#ifdef SERVER
+#include "stats.h"
+#include "thread.h"
+#endif
+
+/*
+ * HC ENCODING:
+ * Compresses the IPv4/TCP headers of tunneled packets (in the spirit of
+ * RFC 1144 and ROHC).  Only the client compresses; the server rebuilds the
+ * full headers before forwarding.  Everything else (CKTP messages, bundles,
+ * UDP, fragments, etc.) passes through unchanged.
+ *
+ * Each TCP flow is hashed to one of HC_CONTEXTS context ids.  The client
+ * first sends a refresh (IR) packet, which is the full packet prefixed by
+ * the context id, the client's (random) session id and the context's
+ * generation (incremented by every IR).  The server keeps the IPv4/TCP
+ * header as the flow's reference header, keyed by the client's address,
+ * session id and context id.  Subsequent packets of the flow are compressed
+ * (CO), i.e. their headers are sent as deltas against the reference header:
+ *
+ *  0                   1                   2                   3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |1|R|    CID    |           Session             |  Generation   |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |     Flags     |   TCP flags   |         TCP checksum          |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |  IP ID, etc.. |
+ * +-+-+-+-+-+-+-+-+
+ *
+ * (R is set for IR packets, which end after the generation.)  The flags
+ * select which of the IP ID, TCP sequence number, TCP acknowledgement
+ * number, TCP window and TCP urgent pointer follow, and their size.  Any
+ * TCP options follow verbatim.  All deltas are against the reference
+ * header (not the previous packet) so a lost CO packet never corrupts the
+ * context.  Deltas are in network byte order.
+ *
+ * A CO packet is only rebuilt if the server's context has the packet's
+ * generation, so it is never rebuilt against a stale (e.g. another flow's)
+ * reference header.  Otherwise (a lost IR packet, or an evicted context)
+ * the server drops it and replies with a context miss, i.e. the first
+ * (type 0x80) word of the CO header, and the client refreshes the context
+ * with its next packet.  The client also refreshes every 'refresh' packets,
+ * every HC_REFRESH_TIME milliseconds, on SYN/FIN/RST and on retransmissions
+ * (TCP payload that is not past the highest sequence number already sent),
+ * so a stalled flow recovers on its next (retransmitted) packet.
+ *
+ * The server's contexts are shared by all threads of the tunnel (a client's
+ * packets may be received by any of them, e.g. for the raw PING/IP
+ * transports).  The table is 4-way set associative; a new flow evicts the
+ * least recently used context of its set.
+ *
+ * The first byte of a CKTP payload is never >= 0x80, so IR/CO packets are
+ * unambiguous.  For this to hold, hc must be the last (innermost) encoding
+ * of the URL, e.g. udp://server:port?crypt=...+hc
+ */
+
+#define HC_CONTEXTS             64          // Client flows per tunnel
+#define HC_SERVER_CONTEXTS      4096        // Server flows per tunnel
+#define HC_SERVER_WAYS          4           // Server contexts per set
+#define HC_SERVER_SETS          (HC_SERVER_CONTEXTS / HC_SERVER_WAYS)
+#define HC_SERVER_LOCKS         64          // Server set lock stripes
+#define HC_MAX_SOURCE           4           // Max source address words
+#define HC_DEFAULT_REFRESH      16          // Packets between refreshes
+#define HC_REFRESH_TIME         1000        // Milliseconds between refreshes
+
+#define HC_TYPE_MASK            0xC0
+#define HC_TYPE_CO              0x80        // Compressed packet
+#define HC_TYPE_IR              0xC0        // Refresh (uncompressed) packet
+#define HC_TYPE_MISS            0x80        // (Server) Context miss
+#define HC_CID_MASK             0x3F
+
+#define HC_FLAG_ID8             0x01        // 8-bit IP ID delta
+#define HC_FLAG_ID16            0x02        // 16-bit IP ID delta
+#define HC_FLAG_SEQ16           0x04        // 16-bit TCP seq delta
+#define HC_FLAG_SEQ32           0x08        // 32-bit TCP seq delta
+#define HC_FLAG_ACK16           0x10        // 16-bit TCP ack delta
+#define HC_FLAG_ACK32           0x20        // 32-bit TCP ack delta
+#define HC_FLAG_WINDOW          0x40        // TCP window
+#define HC_FLAG_URGENT          0x80        // TCP urgent pointer
+
+#define HC_TCP_OFF_OFFSET       12          // TCP data offset byte
+#define HC_TCP_FLAGS_OFFSET     13          // TCP flags byte
+#define HC_TCP_FLAGS_IR         0x07        // FIN, SYN, RST: always refresh
+#define HC_IP_FRAG_MASK         0x3FFF      // MF + fragment offset
+
+/*
+ * IR/CO packet headers.
+ */
+struct hc_hdr_s
+{
+    uint8_t type;                   // HC_TYPE_* | context id
+    uint16_t session;               // Client's session id
+    uint8_t gen;                    // Context generation
+} __attribute__((__packed__));
+
+struct hc_co_hdr_s
+{
+    struct hc_hdr_s header;
+    uint8_t flags;                  // HC_FLAG_*
+    uint8_t tcp_flags;              // TCP flags byte
+    uint16_t tcp_check;             // TCP checksum (verbatim)
+} __attribute__((__packed__));
+
+#define HC_CO_MAX_FIELDS        (2 + 4 + 4 + 2 + 2)
+
+/*
+ * A reference header (IPv4 + TCP without options).
+ */
+struct hc_ref_s
+{
+    struct iphdr ip;
+    struct tcphdr tcp;
+};
+
+/*
+ * Decoding grows a CO packet by at most this much.  The overhead is half of
+ * this (decoding may grow a packet by twice the overhead), which also covers
+ * the IR packet prefix.
+ */
+#define HC_MAX_GROWTH           \
+    (sizeof(struct hc_ref_s) - sizeof(struct hc_co_hdr_s))
+#define HC_OVERHEAD             ((HC_MAX_GROWTH + 1) / 2)
+
+/*
+ * HC parameter index.
+ */
+#define HC_REFRESH  0
+struct cktp_enc_param_s hc_params[] =
+{
+    {"refresh", HC_REFRESH, CKTP_ENCODING_TYPE_UINT},
+};
+
+/*
+ * HC encoding errors.
+ */
+#define HC_ERROR_BAD_NAME                       (-100)
+#define HC_ERROR_BAD_URL_PARAMETER              (-101)
+#define HC_ERROR_REPEATED_URL_PARAMETER         (-102)
+#define HC_ERROR_OUT_OF_MEMORY                  (-103)
+#define HC_ERROR_BAD_LENGTH                     (-104)
+#define HC_ERROR_BAD_PACKET                     (-105)
+#define HC_ERROR_NO_CONTEXT                     (-106)
+#define HC_ERROR_CONTEXT_MISS                   (-107)
+
+/*
+ * (Client) flow context.
+ */
+struct hc_context_s
+{
+    bool valid;                     // Context in use?
+    bool miss;                      // Server reported a context miss?
+    uint8_t count;                  // Packets since the last refresh
+    uint8_t gen;                    // Generation of the last refresh
+    uint32_t seq_next;              // Highest TCP seq sent (+ payload size)
+    uint64_t time;                  // Time of the last refresh
+    struct hc_ref_s ref;            // Reference header
+};
+
+/*
+ * (Server) flow context.
+ */
+struct hc_server_context_s
+{
+    uint32_t source[HC_MAX_SOURCE]; // Client's address
+    uint16_t session;               // Client's session id
+    uint8_t cid;                    // Context id
+    uint8_t gen;                    // Generation of the last refresh
+    bool valid;                     // Context in use?
+    uint32_t used;                  // Last use (for eviction)
+    struct hc_ref_s ref;            // Reference header
+};
+typedef struct hc_server_context_s *hc_server_context_t;
+
+#ifdef SERVER
+/*
+ * (Server) Shared flow context table.
+ */
+struct hc_server_lock_s
+{
+    mutex_t lock;                   // Lock for this stripe's sets
+    uint32_t clock;                 // Use counter for this stripe's sets
+};
+struct hc_server_table_s
+{
+    struct hc_server_lock_s locks[HC_SERVER_LOCKS];
+    struct hc_server_context_s contexts[HC_SERVER_CONTEXTS];
+};
+typedef struct hc_server_table_s *hc_server_table_t;
+#endif      /* SERVER */
+
+/*
+ * HC encoding internal state.
+ */
+struct hc_state_s
+{
+    cktp_enc_lib_t lib;
+    uint8_t refresh;                // Packets between refreshes
+    uint16_t session;               // Session id
+    struct hc_context_s contexts[HC_CONTEXTS];
+#ifdef SERVER
+    hc_server_table_t server_table;
+#endif      /* SERVER */
+};
+typedef struct hc_state_s *hc_state_t;
+typedef hc_state_t state_t;
+
+/*
+ * Prototypes.
+ */
+static int hc_init(const cktp_enc_lib_t lib, const char *protocol,
+    const char *options, size_t options_size, state_t *stateptr);
+static void hc_free(state_t state);
+static size_t hc_overhead(state_t state);
+static const char *hc_error_string(state_t state, int err);
+static bool hc_compressible(const uint8_t *data, size_t size);
+#ifdef CLIENT
+static int hc_encode(state_t state, uint8_t **dataptr, size_t *sizeptr);
+static int hc_decode(state_t state, uint8_t **dataptr, size_t *sizeptr);
+static bool hc_context_match(const struct hc_context_s *context,
+    const struct iphdr *ip_header, const struct tcphdr *tcp_header);
+#endif      /* CLIENT */
+#ifdef SERVER
+static hc_server_context_t hc_server_context_find(
+    hc_server_context_t contexts, const uint32_t *source_addr,
+    size_t source_bytes, uint16_t session, uint8_t cid);
+static int hc_server_encode(state_t state, uint8_t **dataptr,
+    size_t *sizeptr);
+static int hc_server_decode(state_t state, uint32_t *source_addr,
+    size_t source_size, uint8_t **dataptr, size_t *sizeptr, uint8_t **replyptr,
+    size_t *replysizeptr);
+static int hc_server_miss(const struct hc_hdr_s *header, uint8_t **dataptr,
+    size_t *sizeptr, uint8_t **replyptr, size_t *replysizeptr);
+#endif      /* SERVER */
+
+/*
+ * HC encoding protocol:
+ */
+struct cktp_enc_info_s hc_encoding =
+{
+    "hc",
+    (encoding_init_t)hc_init,
+    (encoding_free_t)hc_free,
+    (encoding_overhead_t)hc_overhead,
+    NULL,
+    (encoding_error_string_t)hc_error_string,
+#ifdef CLIENT
+    NULL,
+    NULL,
+    NULL,
+    (encoding_encode_t)hc_encode,
+    (encoding_decode_t)hc_decode
+#endif      /* CLIENT */
+
+#ifdef SERVER
+    NULL,
+    NULL,
+    (encoding_encode_t)hc_server_encode,
+    (encoding_server_decode_t)hc_server_decode,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+#endif      /* SERVER */
+};
+
+/*
+ * Initialise the header compression state.
+ */
+static int hc_init(const cktp_enc_lib_t lib, const char *protocol,
+    const char *options, size_t options_size, state_t *stateptr)
+{
+    *stateptr = NULL;
+    if (strcmp(protocol, "hc") != 0)
+    {
+        return HC_ERROR_BAD_NAME;
+    }
+
+    uint8_t refresh = HC_DEFAULT_REFRESH;
+    bool seen_refresh = false;
+    for (size_t i = 0; i < options_size; i++)
+    {
+        struct cktp_enc_val_s val;
+        int result = lib->parse_param(hc_params,
+            sizeof(hc_params) / sizeof(struct cktp_enc_param_s),
+            options, &val);
+        if (result < 0)
+        {
+            return HC_ERROR_BAD_URL_PARAMETER;
+        }
+
+        switch (val.param->id)
+        {
+            case HC_REFRESH:
+                if (seen_refresh)
+                {
+                    return HC_ERROR_REPEATED_URL_PARAMETER;
+                }
+                if (val.val.uint_val == 0 || val.val.uint_val > UINT8_MAX)
+                {
+                    return HC_ERROR_BAD_URL_PARAMETER;
+                }
+                seen_refresh = true;
+                refresh = (uint8_t)val.val.uint_val;
+                break;
+            default:
+                return HC_ERROR_BAD_URL_PARAMETER;
+        }
+
+        options += strlen(options) + 1;
+    }
+
+    state_t state = (state_t)malloc(sizeof(struct hc_state_s));
+    if (state == NULL)
+    {
+        return HC_ERROR_OUT_OF_MEMORY;
+    }
+    memset(state, 0x0, sizeof(struct hc_state_s));
+    state->lib     = lib;
+    state->refresh = refresh;
+
+#ifdef CLIENT
+    cktp_enc_rng_t rng = lib->random_init();
+    lib->random(rng, &state->session, sizeof(state->session));
+    lib->random_free(rng);
+#endif      /* CLIENT */
+
+#ifdef SERVER
+    state->server_table = (hc_server_table_t)calloc(1,
+        sizeof(struct hc_server_table_s));
+    if (state->server_table == NULL)
+    {
+        free(state);
+        return HC_ERROR_OUT_OF_MEMORY;
+    }
+    for (size_t i = 0; i < HC_SERVER_LOCKS; i++)
+    {
+        thread_lock_init(&state->server_table->locks[i].lock);
+    }
+#endif      /* SERVER */
+
+    *stateptr = state;
+    return 0;
+}
+
+/*
+ * Free state.
+ */
+static void hc_free(state_t state)
+{
+#ifdef SERVER
+    for (size_t i = 0; i < HC_SERVER_LOCKS; i++)
+    {
+        thread_lock_free(&state->server_table->locks[i].lock);
+    }
+    free(state->server_table);
+#endif      /* SERVER */
+    free(state);
+}
+
+/*
+ * Query header compression overhead.
+ */
+static size_t hc_overhead(state_t state)
+{
+    return HC_OVERHEAD;
+}
+
+/*
+ * Error strings.
+ */
+static const char *hc_error_string(state_t state, int err)
+{
+    switch (err)
+    {
+        case HC_ERROR_BAD_NAME:
+            return "bad encoding name";
+        case HC_ERROR_BAD_URL_PARAMETER:
+            return "bad URL parameter";
+        case HC_ERROR_REPEATED_URL_PARAMETER:
+            return "repeated URL parameter";
+        case HC_ERROR_OUT_OF_MEMORY:
+            return "out of memory";
+        case HC_ERROR_BAD_LENGTH:
+            return "bad length";
+        case HC_ERROR_BAD_PACKET:
+            return "bad packet";
+        case HC_ERROR_NO_CONTEXT:
+            return "no context";
+        case HC_ERROR_CONTEXT_MISS:
+            return "context miss";
+        default:
+            return "generic error";
+    }
+}
+
+/*
+ * Test if a payload is an (unfragmented, option-less) IPv4/TCP packet.
+ */
+static bool hc_compressible(const uint8_t *data, size_t size)
+{
+    if (size < sizeof(struct hc_ref_s))
+    {
+        return false;
+    }
+    const struct iphdr *ip_header = (const struct iphdr *)data;
+    const struct tcphdr *tcp_header = (const struct tcphdr *)(ip_header + 1);
+    return (ip_header->version == 4 &&
+            ip_header->ihl == sizeof(struct iphdr) / sizeof(uint32_t) &&
+            ip_header->protocol == IPPROTO_TCP &&
+            ntohs(ip_header->tot_len) == size &&
+            (ntohs(ip_header->frag_off) & HC_IP_FRAG_MASK) == 0 &&
+            tcp_header->doff >= sizeof(struct tcphdr) / sizeof(uint32_t) &&
+            sizeof(struct iphdr) + tcp_header->doff*sizeof(uint32_t) <= size);
+}
+
+#ifdef CLIENT
+
+/*
+ * Test if a packet matches a context's (non-delta) header fields.
+ */
+static bool hc_context_match(const struct hc_context_s *context,
+    const struct iphdr *ip_header, const struct tcphdr *tcp_header)
+{
+    const struct hc_ref_s *ref = &context->ref;
+    return (context->valid &&
+            ip_header->saddr == ref->ip.saddr &&
+            ip_header->daddr == ref->ip.daddr &&
+            tcp_header->source == ref->tcp.source &&
+            tcp_header->dest == ref->tcp.dest &&
+            ip_header->tos == ref->ip.tos &&
+            ip_header->ttl == ref->ip.ttl &&
+            ip_header->frag_off == ref->ip.frag_off &&
+            ((const uint8_t *)tcp_header)[HC_TCP_OFF_OFFSET] ==
+                ((const uint8_t *)&ref->tcp)[HC_TCP_OFF_OFFSET]);
+}
+
+/*
+ * Compress the packet headers (if possible).
+ */
+static int hc_encode(state_t state, uint8_t **dataptr, size_t *sizeptr)
+{
+    uint8_t *data = *dataptr;
+    size_t size = *sizeptr;
+    if (!hc_compressible(data, size))
+    {
+        return 0;
+    }
+
+    struct iphdr *ip_header = (struct iphdr *)data;
+    struct tcphdr *tcp_header = (struct tcphdr *)(ip_header + 1);
+    uint32_t hash = (ip_header->daddr ^ ((uint32_t)tcp_header->source << 16) ^
+        (uint32_t)tcp_header->dest) * 0x9E3779B1;
+    uint8_t cid = (uint8_t)(hash >> 26);
+    struct hc_context_s *context = state->contexts + cid;
+
+    uint8_t tcp_flags = ((uint8_t *)tcp_header)[HC_TCP_FLAGS_OFFSET];
+    size_t payload_size = size - sizeof(struct iphdr) -
+        tcp_header->doff*sizeof(uint32_t);
+    uint32_t seq_end = ntohl(tcp_header->seq) + (uint32_t)payload_size;
+    uint64_t now = state->lib->gettime();
+    bool match = hc_context_match(context, ip_header, tcp_header);
+    bool retransmit = (match && payload_size != 0 &&
+        (int32_t)(seq_end - context->seq_next) <= 0);
+    if (!match || (int32_t)(seq_end - context->seq_next) > 0)
+    {
+        context->seq_next = seq_end;
+    }
+
+    if (!match || retransmit || context->miss ||
+        context->count >= state->refresh ||
+        now - context->time >= HC_REFRESH_TIME ||
+        (tcp_flags & HC_TCP_FLAGS_IR) != 0)
+    {
+        // Refresh; this packet becomes the reference header:
+        memmove(&context->ref, data, sizeof(context->ref));
+        context->valid = true;
+        context->miss  = false;
+        context->count = 1;
+        context->gen++;
+        context->time  = now;
+        data -= sizeof(struct hc_hdr_s);
+        size += sizeof(struct hc_hdr_s);
+        struct hc_hdr_s *header = (struct hc_hdr_s *)data;
+        header->type    = HC_TYPE_IR | cid;
+        header->session = state->session;
+        header->gen     = context->gen;
+        *dataptr = data;
+        *sizeptr = size;
+        return 0;
+    }
+    context->count++;
+
+    // Compress:
+    const struct hc_ref_s *ref = &context->ref;
+    uint8_t co[sizeof(struct hc_co_hdr_s) + HC_CO_MAX_FIELDS];
+    struct hc_co_hdr_s *co_header = (struct hc_co_hdr_s *)co;
+    co_header->header.type    = HC_TYPE_CO | cid;
+    co_header->header.session = state->session;
+    co_header->header.gen     = context->gen;
+    co_header->flags          = 0;
+    co_header->tcp_flags      = tcp_flags;
+    co_header->tcp_check      = tcp_header->check;
+    size_t co_size = sizeof(struct hc_co_hdr_s);
+
+    uint16_t id = ntohs(ip_header->id) - ntohs(ref->ip.id);
+    if (id > UINT8_MAX)
+    {
+        uint16_t id16 = htons(id);
+        co_header->flags |= HC_FLAG_ID16;
+        memmove(co + co_size, &id16, sizeof(uint16_t));
+        co_size += sizeof(uint16_t);
+    }
+    else if (id != 0)
+    {
+        co_header->flags |= HC_FLAG_ID8;
+        co[co_size++] = (uint8_t)id;
+    }
+    uint32_t seq = ntohl(tcp_header->seq) - ntohl(ref->tcp.seq);
+    if (seq > UINT16_MAX)
+    {
+        uint32_t seq32 = htonl(seq);
+        co_header->flags |= HC_FLAG_SEQ32;
+        memmove(co + co_size, &seq32, sizeof(uint32_t));
+        co_size += sizeof(uint32_t);
+    }
+    else if (seq != 0)
+    {
+        uint16_t seq16 = htons((uint16_t)seq);
+        co_header->flags |= HC_FLAG_SEQ16;
+        memmove(co + co_size, &seq16, sizeof(uint16_t));
+        co_size += sizeof(uint16_t);
+    }
+    uint32_t ack = ntohl(tcp_header->ack_seq) - ntohl(ref->tcp.ack_seq);
+    if (ack > UINT16_MAX)
+    {
+        uint32_t ack32 = htonl(ack);
+        co_header->flags |= HC_FLAG_ACK32;
+        memmove(co + co_size, &ack32, sizeof(uint32_t));
+        co_size += sizeof(uint32_t);
+    }
+    else if (ack != 0)
+    {
+        uint16_t ack16 = htons((uint16_t)ack);
+        co_header->flags |= HC_FLAG_ACK16;
+        memmove(co + co_size, &ack16, sizeof(uint16_t));
+        co_size += sizeof(uint16_t);
+    }
+    if (tcp_header->window != ref->tcp.window)
+    {
+        co_header->flags |= HC_FLAG_WINDOW;
+        memmove(co + co_size, &tcp_header->window, sizeof(uint16_t));
+        co_size += sizeof(uint16_t);
+    }
+    if (tcp_header->urg_ptr != 0)
+    {
+        co_header->flags |= HC_FLAG_URGENT;
+        memmove(co + co_size, &tcp_header->urg_ptr, sizeof(uint16_t));
+        co_size += sizeof(uint16_t);
+    }
+
+    // Replace the headers (the TCP options stay where they are):
+    data += sizeof(struct hc_ref_s) - co_size;
+    size -= sizeof(struct hc_ref_s) - co_size;
+    memmove(data, co, co_size);
+
+    *dataptr = data;
+    *sizeptr = size;
+    return 0;
+}
+
+/*
+ * The server never compresses, but may report a context miss (see
+ * hc_server_miss()); if so, refresh the context with its next packet.
+ */
+static int hc_decode(state_t state, uint8_t **dataptr, size_t *sizeptr)
+{
+    uint8_t *data = *dataptr;
+    size_t size = *sizeptr;
+    if (size == 0 || (data[0] & HC_TYPE_CO) == 0)
+    {
+        return 0;
+    }
+    const struct hc_hdr_s *header = (const struct hc_hdr_s *)data;
+    if (size != sizeof(struct hc_hdr_s) ||
+        (header->type & HC_TYPE_MASK) != HC_TYPE_MISS)
+    {
+        return HC_ERROR_BAD_LENGTH;
+    }
+    if (header->session != state->session)
+    {
+        return HC_ERROR_BAD_PACKET;
+    }
+
+    // Ignore misses for an older generation (already refreshed):
+    struct hc_context_s *context =
+        state->contexts + (header->type & HC_CID_MASK);
+    if (header->gen == context->gen)
+    {
+        context->miss = true;
+    }
+    return HC_ERROR_CONTEXT_MISS;
+}
+
+#endif      /* CLIENT */
+
+#ifdef SERVER
+
+/*
+ * (Server) Find a client's context in a set (with the set's lock held).
+ */
+static hc_server_context_t hc_server_context_find(
+    hc_server_context_t contexts, const uint32_t *source_addr,
+    size_t source_bytes, uint16_t session, uint8_t cid)
+{
+    for (size_t i = 0; i < HC_SERVER_WAYS; i++)
+    {
+        hc_server_context_t context = contexts + i;
+        if (context->valid && context->session == session &&
+            context->cid == cid &&
+            memcmp(context->source, source_addr, source_bytes) == 0)
+        {
+            return context;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * (Server) Drop a CO packet without a (current) context, and reply with a
+ * context miss so that the client refreshes the context.
+ */
+static int hc_server_miss(const struct hc_hdr_s *header, uint8_t **dataptr,
+    size_t *sizeptr, uint8_t **replyptr, size_t *replysizeptr)
+{
+    stats_add(STATS_HC_MISS, 1);
+    if (*replysizeptr < sizeof(struct hc_hdr_s))
+    {
+        return HC_ERROR_NO_CONTEXT;
+    }
+    struct hc_hdr_s *reply = (struct hc_hdr_s *)*replyptr;
+    reply->type    = HC_TYPE_MISS | (header->type & HC_CID_MASK);
+    reply->session = header->session;
+    reply->gen     = header->gen;
+    *replysizeptr = sizeof(struct hc_hdr_s);
+    *dataptr = NULL;
+    *sizeptr = 0;
+    return 0;
+}
+
+/*
+ * (Server) The server never compresses; nothing to do.
+ */
+static int hc_server_encode(state_t state, uint8_t **dataptr,
+    size_t *sizeptr)
+{
+    return 0;
+}
+
+/*
+ * (Server) Rebuild the packet headers.
+ */
+static int hc_server_decode(state_t state, uint32_t *source_addr,
+    size_t source_size, uint8_t **dataptr, size_t *sizeptr, uint8_t **replyptr,
+    size_t *replysizeptr)
+{
+    uint8_t *data = *dataptr;
+    size_t size = *sizeptr;
+    if (size == 0 || (data[0] & HC_TYPE_CO) == 0)
+    {
+        // Not an IR/CO packet:
+        return 0;
+    }
+    if (size < sizeof(struct hc_hdr_s) || source_size > HC_MAX_SOURCE)
+    {
+        return HC_ERROR_BAD_LENGTH;
+    }
+
+    // Find the context's set:
+    struct hc_hdr_s *header = (struct hc_hdr_s *)data;
+    uint8_t cid = header->type & HC_CID_MASK;
+    uint16_t session = header->session;
+    uint32_t hash = ((uint32_t)session << 6) | cid;
+    for (size_t i = 0; i < source_size; i++)
+    {
+        hash = (hash ^ source_addr[i]) * 0x9E3779B1;
+    }
+    size_t set = (hash >> 16) % HC_SERVER_SETS;
+    hc_server_table_t table = state->server_table;
+    hc_server_context_t contexts = table->contexts + set * HC_SERVER_WAYS;
+    struct hc_server_lock_s *lock = table->locks + set % HC_SERVER_LOCKS;
+    size_t source_bytes = source_size * sizeof(uint32_t);
+
+    if ((header->type & HC_TYPE_MASK) == HC_TYPE_IR)
+    {
+        // Refresh; the packet becomes the reference header:
+        data += sizeof(struct hc_hdr_s);
+        size -= sizeof(struct hc_hdr_s);
+        if (!hc_compressible(data, size))
+        {
+            return HC_ERROR_BAD_PACKET;
+        }
+        thread_lock(&lock->lock);
+        hc_server_context_t context =
+            hc_server_context_find(contexts, source_addr, source_bytes,
+                session, cid);
+        if (context == NULL)
+        {
+            // Use a free context, else evict the least recently used one:
+            context = contexts;
+            for (size_t i = 0; i < HC_SERVER_WAYS && context->valid; i++)
+            {
+                if (!contexts[i].valid ||
+                    (int32_t)(contexts[i].used - context->used) < 0)
+                {
+                    context = contexts + i;
+                }
+            }
+            if (context->valid)
+            {
+                stats_add(STATS_HC_EVICTED, 1);
+            }
+            memset(context->source, 0x0, sizeof(context->source));
+            memmove(context->source, source_addr, source_bytes);
+            context->session = session;
+            context->cid     = cid;
+            context->valid   = true;
+        }
+        context->gen  = header->gen;
+        context->used = lock->clock++;
+        memmove(&context->ref, data, sizeof(context->ref));
+        thread_unlock(&lock->lock);
+        *dataptr = data;
+        *sizeptr = size;
+        return 0;
+    }
+
+    if (size < sizeof(struct hc_co_hdr_s))
+    {
+        return HC_ERROR_BAD_LENGTH;
+    }
+    struct hc_ref_s hdr;
+    thread_lock(&lock->lock);
+    hc_server_context_t context = hc_server_context_find(contexts,
+        source_addr, source_bytes, session, cid);
+    if (context == NULL || context->gen != header->gen)
+    {
+        thread_unlock(&lock->lock);
+        return hc_server_miss(header, dataptr, sizeptr, replyptr,
+            replysizeptr);
+    }
+    context->used = lock->clock++;
+    memmove(&hdr, &context->ref, sizeof(hdr));
+    thread_unlock(&lock->lock);
+
+    // Rebuild the headers:
+    struct hc_co_hdr_s *co_header = (struct hc_co_hdr_s *)data;
+    uint8_t flags = co_header->flags;
+    size_t fields_size =
+        ((flags & HC_FLAG_ID8)? sizeof(uint8_t): 0) +
+        ((flags & HC_FLAG_ID16)? sizeof(uint16_t): 0) +
+        ((flags & HC_FLAG_SEQ16)? sizeof(uint16_t): 0) +
+        ((flags & HC_FLAG_SEQ32)? sizeof(uint32_t): 0) +
+        ((flags & HC_FLAG_ACK16)? sizeof(uint16_t): 0) +
+        ((flags & HC_FLAG_ACK32)? sizeof(uint32_t): 0) +
+        ((flags & HC_FLAG_WINDOW)? sizeof(uint16_t): 0) +
+        ((flags & HC_FLAG_URGENT)? sizeof(uint16_t): 0);
+    size_t co_size = sizeof(struct hc_co_hdr_s) + fields_size;
+    size_t options_size = hdr.tcp.doff*sizeof(uint32_t) -
+        sizeof(struct tcphdr);
+    if (size < co_size + options_size)
+    {
+        return HC_ERROR_BAD_LENGTH;
+    }
+    size_t new_size = size - co_size + sizeof(struct hc_ref_s);
+    if (new_size > UINT16_MAX)
+    {
+        return HC_ERROR_BAD_LENGTH;
+    }
+    uint8_t *field = data + sizeof(struct hc_co_hdr_s);
+    uint16_t val16;
+    uint32_t val32;
+    if (flags & HC_FLAG_ID8)
+    {
+        hdr.ip.id = htons(ntohs(hdr.ip.id) + *field);
+        field += sizeof(uint8_t);
+    }
+    if (flags & HC_FLAG_ID16)
+    {
+        memmove(&val16, field, sizeof(val16));
+        hdr.ip.id = htons(ntohs(hdr.ip.id) + ntohs(val16));
+        field += sizeof(uint16_t);
+    }
+    if (flags & HC_FLAG_SEQ16)
+    {
+        memmove(&val16, field, sizeof(val16));
+        hdr.tcp.seq = htonl(ntohl(hdr.tcp.seq) + ntohs(val16));
+        field += sizeof(uint16_t);
+    }
+    if (flags & HC_FLAG_SEQ32)
+    {
+        memmove(&val32, field, sizeof(val32));
+        hdr.tcp.seq = htonl(ntohl(hdr.tcp.seq) + ntohl(val32));
+        field += sizeof(uint32_t);
+    }
+    if (flags & HC_FLAG_ACK16)
+    {
+        memmove(&val16, field, sizeof(val16));
+        hdr.tcp.ack_seq = htonl(ntohl(hdr.tcp.ack_seq) + ntohs(val16));
+        field += sizeof(uint16_t);
+    }
+    if (flags & HC_FLAG_ACK32)
+    {
+        memmove(&val32, field, sizeof(val32));
+        hdr.tcp.ack_seq = htonl(ntohl(hdr.tcp.ack_seq) + ntohl(val32));
+        field += sizeof(uint32_t);
+    }
+    if (flags & HC_FLAG_WINDOW)
+    {
+        memmove(&hdr.tcp.window, field, sizeof(uint16_t));
+        field += sizeof(uint16_t);
+    }
+    hdr.tcp.urg_ptr = 0;
+    if (flags & HC_FLAG_URGENT)
+    {
+        memmove(&hdr.tcp.urg_ptr, field, sizeof(uint16_t));
+        field += sizeof(uint16_t);
+    }
+    ((uint8_t *)&hdr.tcp)[HC_TCP_FLAGS_OFFSET] = co_header->tcp_flags;
+    hdr.tcp.check = co_header->tcp_check;
+    hdr.ip.tot_len = htons((uint16_t)new_size);
+    hdr.ip.check = 0;
+    hdr.ip.check = ip_checksum(&hdr.ip);
+
+    // Make room for the headers (in place; the TCP options and payload
+    // move up), then copy them in:
+    memmove(data + sizeof(struct hc_ref_s), data + co_size, size - co_size);
+    memmove(data, &hdr, sizeof(hdr));
+    *sizeptr = new_size;
+    return 0;
+}
+
+#endif      /* SERVER */
@@ -83,6 +83,7 @@ static int pad_init(const cktp_enc_lib_t lib, const char *protocol,
     const char *options, size_t options_size, state_t *stateptr);
 static void pad_free(state_t state);
 static size_t pad_overhead(state_t state);
+static size_t pad_min_size(state_t state, size_t size);
 static const char *pad_error_string(state_t state, int err);
 static int pad_encode(state_t state, uint8_t **dataptr, size_t *sizeptr);
 static int pad_decode(state_t state, uint8_t **dataptr, size_t *sizeptr);
@@ -101,6 +102,7 @@ struct cktp_enc_info_s pad_encoding =
     (encoding_init_t)pad_init,
     (encoding_free_t)pad_free,
     (encoding_overhead_t)pad_overhead,
+    (encoding_min_size_t)pad_min_size,
     (encoding_error_string_t)pad_error_string,
 #ifdef CLIENT
     NULL,
@@ -114,7 +116,14 @@ struct cktp_enc_info_s pad_encoding =
     NULL,
     NULL,
     (encoding_encode_t)pad_encode,
-    (encoding_server_decode_t)pad_server_decode
+    (encoding_server_decode_t)pad_server_decode,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
 #endif      /* SERVER */
 };
 
@@ -259,6 +268,14 @@ static size_t pad_overhead(state_t state)
     return (state->fixed? (size_t)state->size: (size_t)state->max + 1);
 }
 
+/*
+ * Query the minimum padded size of a packet.
+ */
+static size_t pad_min_size(state_t state, size_t size)
+{
+    return size + (state->fixed? (size_t)state->size: (size_t)state->min + 1);
+}
+
 /*
  * Error strings.
  */
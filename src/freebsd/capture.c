@@ -36,9 +36,11 @@
 #include <sys/wait.h>
 
 #include "capture.h"
+#include "config.h"
 #include "log.h"
 #include "options.h"
 #include "socket.h"
+#include "thread.h"
 
 /*
  * Divert port
@@ -62,10 +64,14 @@ static const char *ipfw_divert_tcp =
 static const char *ipfw_divert_udp =
     "/sbin/ipfw 40406 add divert %d out proto udp dst-port 53";
 #endif      /* MACOSX */
+static const char *ipfw_divert_dns_reply =
+    "/sbin/ipfw 40408 add divert %d in proto udp src-port 53";
 static const char *ipfw_filter_icmp =
     "/sbin/ipfw 40407 add deny in icmptypes 11";
 static const char *ipfw_undo =
     "/sbin/ipfw delete 40405 40406 40407";
+static const char *ipfw_undo_dns_reply =
+    "/sbin/ipfw delete 40408";
 
 /*
  * Prototypes.
@@ -73,6 +79,7 @@ static const char *ipfw_undo =
 static void ipfw(const char *command);
 static void ipfw_undo_on_signal(int sig);
 static void ipfw_undo_flush(void);
+static void dns_reply_set(bool enable);
 
 /*
  * Global divert socket for capture/injection.
@@ -84,6 +91,13 @@ static int socket_divert;
  */
 static bool ipfw_clean = true;
 
+/*
+ * Inbound DNS replies are only captured when the DNS cache is enabled.
+ */
+static bool dns_reply_ready = false;
+static bool dns_reply_enabled = false;
+static mutex_t dns_reply_lock;
+
 /*
  * Initialise packet capturing.
  */
@@ -126,23 +140,72 @@ void init_capture(void)
     ipfw(ipfw_filter_icmp);
     ipfw_clean = false;
     atexit(ipfw_undo_flush);
+
+    // Capture DNS replies if the DNS cache is enabled.  The configuration
+    // is read after dns_reply_ready is set so that a concurrent change is
+    // never missed.
+    if (thread_lock_init(&dns_reply_lock) != 0)
+    {
+        error("unable to initialise DNS reply capture lock");
+    }
+    thread_lock(&dns_reply_lock);
+    dns_reply_ready = true;
+    struct config_s config;
+    config_get(&config);
+    dns_reply_set(config.dns_cache);
+    thread_unlock(&dns_reply_lock);
+}
+
+/*
+ * Start or stop capturing inbound DNS replies.
+ */
+void capture_dns_replies(bool enable)
+{
+    if (!dns_reply_ready)
+    {
+        return;         // init_capture() will read the configuration.
+    }
+    thread_lock(&dns_reply_lock);
+    dns_reply_set(enable);
+    thread_unlock(&dns_reply_lock);
+}
+
+/*
+ * Add or remove the DNS reply rule (dns_reply_lock must be held).
+ */
+static void dns_reply_set(bool enable)
+{
+    if (enable && !dns_reply_enabled)
+    {
+        ipfw(ipfw_divert_dns_reply);
+    }
+    else if (!enable && dns_reply_enabled)
+    {
+        ipfw(ipfw_undo_dns_reply);
+    }
+    dns_reply_enabled = enable;
 }
 
 /*
- * Get a captured packet.
+ * Get a captured packet.  Inbound packets (DNS replies) are only observed;
+ * they are re-injected immediately.
  */
-size_t get_packet(uint8_t *buff, size_t size)
+size_t get_packet(uint8_t *buff, size_t size, bool *inbound)
 {
+    *inbound = false;
     if (size <= sizeof(struct ethhdr))
     {
         return 0;
     }
 
     ssize_t result;
+    struct sockaddr_in from_addr;
+    socklen_t from_addr_len = sizeof(from_addr);
     do
     {
-        result = recv(socket_divert, buff + sizeof(struct ethhdr),
-            size - sizeof(struct ethhdr), 0);
+        result = recvfrom(socket_divert, buff + sizeof(struct ethhdr),
+            size - sizeof(struct ethhdr), 0, (struct sockaddr *)&from_addr,
+            &from_addr_len);
         if (result < 0)
         {
             warning("failed to read packet from netfilter socket");
@@ -151,6 +214,18 @@ size_t get_packet(uint8_t *buff, size_t size)
     }
     while (false);
 
+    // Divert sets the address for inbound packets (INADDR_ANY = outbound).
+    if (result > 0 && from_addr.sin_addr.s_addr != INADDR_ANY)
+    {
+        *inbound = true;
+        if (sendto(socket_divert, buff + sizeof(struct ethhdr), result, 0,
+                (struct sockaddr *)&from_addr, from_addr_len) < 0)
+        {
+            warning("unable to re-inject inbound packet of size %zd",
+                result);
+        }
+    }
+
     // Add fake ethhdr
     struct ethhdr *eth_header = (struct ethhdr *)buff;
     memset(&eth_header->h_dest, 0x0, ETH_ALEN);
@@ -183,6 +258,30 @@ void inject_packet(uint8_t *buff, size_t size)
     }
 }
 
+/*
+ * Inject a reply packet towards this host.
+ */
+void inject_reply(uint8_t *buff, size_t size)
+{
+    struct ethhdr *eth_header = (struct ethhdr *)buff;
+    struct iphdr *ip_header = (struct iphdr *)(eth_header + 1);
+    size -= sizeof(struct ethhdr);
+
+    // A non-INADDR_ANY address marks the packet as inbound.
+    struct sockaddr_in to_addr;
+    memset(&to_addr, 0x0, sizeof(to_addr));
+    to_addr.sin_family      = AF_INET;
+    to_addr.sin_port        = htons(DIVERT_PORT);
+    to_addr.sin_addr.s_addr = ip_header->daddr;
+
+    int n = sendto(socket_divert, ip_header, size, 0,
+        (struct sockaddr *)(&to_addr), sizeof(to_addr));
+    if (n < 0)
+    {
+        warning("unable to inject reply packet of size %zu", size);
+    }
+}
+
 /*
  * Execute an ipfw command.
  */
@@ -270,6 +369,10 @@ static void ipfw_undo_flush(void)
 {
     if (!ipfw_clean)
     {
+        if (dns_reply_enabled)
+        {
+            ipfw(ipfw_undo_dns_reply);
+        }
         ipfw(ipfw_undo);
         ipfw_clean = true;
     }
@@ -34,12 +34,18 @@
 #include "log.h"
 #include "misc.h"
 #include "socket.h"
+#include "thread.h"
 
 #define MAX_REQUEST_BUFF_SIZE   2048
 #define MAX_CONTENT_NAME        32
 #define MAX_MACRO_NAME          32
 #define MAX_VAR_LENGTH          32
 #define MAX_VAL_LENGTH          1024
+#define MAX_HTTP_THREADS        8
+#define HTTP_LISTEN_BACKLOG     16
+#define HTTP_POLL_TIMEOUT       (20*SECONDS)
+#define HTTP_POLL_RESERVED      2           // Threads never long-polling
+#define HTTP_POLL_MAX           (MAX_HTTP_THREADS-HTTP_POLL_RESERVED)
 
 #define HTTP_STATE_ERROR        0
 #define HTTP_STATE_START        1
@@ -52,6 +58,8 @@
 #define HTTP_STATE_CONTENT_VAR  8
 #define HTTP_STATE_CONTENT_VAL  9
 #define HTTP_STATE_FINAL        10
+#define HTTP_STATE_QUERY_VAR    11
+#define HTTP_STATE_QUERY_VAL    12
 
 #define HTTP_METHOD_GET         0
 #define HTTP_METHOD_POST        1
@@ -175,8 +183,38 @@ struct http_request_s
     uint8_t method;
     char name[MAX_CONTENT_NAME+1];
     struct http_user_vars_s vars;
+    struct http_user_vars_s query;
 };
 
+/*
+ * The listening socket and its request handler, shared by all server
+ * threads.
+ */
+struct http_listener_s
+{
+    socket_t s;
+    uint16_t port;
+    void (*callback)(struct http_user_vars_s *);
+};
+static mutex_t http_callback_lock;
+
+/*
+ * Long-polls in progress.  All but HTTP_POLL_RESERVED threads may poll at
+ * once (so other requests, e.g. configuration changes, always find a free
+ * thread); each waits on the condition of its own slot, and
+ * http_poll_notify() signals all of them.
+ */
+struct http_poll_s
+{
+    bool used;
+    cond_t cond;
+};
+static mutex_t http_poll_lock;
+static struct http_poll_s http_polls[HTTP_POLL_MAX];
+static unsigned http_polls_active = 0;
+static unsigned http_polls_max = 0;
+static volatile bool http_poll_ready = false;
+
 /*
  * HTTP request parser.
  */
@@ -194,11 +232,16 @@ struct http_parser_s
 /*
  * Prototypes.
  */
+static void *http_server_thread(void *arg);
+static void http_serve(struct http_listener_s *listener, socket_t s);
+static bool http_poll_begin(void);
+static void http_poll_end(void);
 static void http_parser_init(struct http_parser_s *parser);
+static void http_parser_free(struct http_parser_s *parser);
 static size_t http_parse_request(const char *request, size_t request_length,
     struct http_parser_s *parser);
-static size_t http_parse_request(const char *request, size_t request_length,
-    struct http_parser_s *parser);
+static http_buffer_t http_lookup_content(const char *name,
+    const struct http_request_s *request);
 static void http_handle_request(socket_t s,
     const struct http_request_s *request);
 static void http_error(socket_t s, unsigned http_code,
@@ -243,7 +286,7 @@ void http_server(uint16_t port, void (*callback)(struct http_user_vars_s *),
             "address localhost:%u", port);
     }
 
-    if (listen(s_listen, 1) != 0)
+    if (listen(s_listen, HTTP_LISTEN_BACKLOG) != 0)
     {
         error("unable to create configuation server; failed to listen to "
             "address localhost:%u", port);
@@ -255,17 +298,53 @@ void http_server(uint16_t port, void (*callback)(struct http_user_vars_s *),
         launch_ui(port);
     }
 
-    // Main server loop:
+    // Serve requests from several threads, so that long-polling UI clients
+    // do not block each other:
+    static struct http_listener_s listener;
+    listener.s        = s_listen;
+    listener.port     = port;
+    listener.callback = callback;
+    thread_lock_init(&http_callback_lock);
+    thread_lock_init(&http_poll_lock);
+    for (unsigned i = 0; i < HTTP_POLL_MAX; i++)
+    {
+        thread_cond_init(&http_polls[i].cond);
+    }
+    http_poll_ready = true;
+    for (unsigned i = 1; i < MAX_HTTP_THREADS; i++)
+    {
+        thread_t thread;
+        if (thread_create(&thread, http_server_thread, &listener) != 0)
+        {
+            warning("unable to create configuration server thread");
+            break;
+        }
+        if (i + 1 > HTTP_POLL_RESERVED)
+        {
+            thread_lock(&http_poll_lock);
+            http_polls_max = i + 1 - HTTP_POLL_RESERVED;
+            thread_unlock(&http_poll_lock);
+        }
+    }
+    http_server_thread(&listener);
+}
+
+/*
+ * Configuration server thread: accept and serve connections.
+ */
+static void *http_server_thread(void *arg)
+{
+    struct http_listener_s *listener = (struct http_listener_s *)arg;
     while (true)
     {
         struct sockaddr_in6 accept_addr;
         socklen_t accept_len = sizeof(accept_addr);
-        socket_t s = accept(s_listen, (struct sockaddr *)&accept_addr,
+        socket_t s = accept(listener->s, (struct sockaddr *)&accept_addr,
             &accept_len);
         if (s == INVALID_SOCKET)
         {
             warning("unable to accept incoming connection to configuration "
-                "server localhost:%u", port);
+                "server localhost:%u", listener->port);
             close_socket(s);
             continue;
         }
@@ -277,70 +356,185 @@ void http_server(uint16_t port, void (*callback)(struct http_user_vars_s *),
                 sizeof(in6addr_loopbackv4) - 3) != 0)
         {
             warning("unable to accept incoming connection to configuration "
-                "server localhost:%u from non-local address", port);
+                "server localhost:%u from non-local address", listener->port);
             close_socket(s);
             continue;
         }
-        char request[MAX_REQUEST_BUFF_SIZE];
-        struct http_parser_s parser;
-        http_parser_init(&parser);
-        do
+        http_serve(listener, s);
+    }
+    return NULL;
+}
+
+/*
+ * Read, handle and reply to one request, then close the connection.
+ */
+static void http_serve(struct http_listener_s *listener, socket_t s)
+{
+    char request[MAX_REQUEST_BUFF_SIZE];
+    struct http_parser_s parser;
+    http_parser_init(&parser);
+    while (true)
+    {
+        int n = recv(s, request, sizeof(request)-1, 0);
+        if (n <= 0)
         {
-            size_t n = recv(s, request, sizeof(request)-1, 0);
-            if (n <= 0)
-            {
-                http_user_vars_free(&parser.request.vars);
-                warning("unable to read request for configuration server "
-                    "localhost:%u", port);
-                close_socket(s);
-                break;
-            }
-            request[n] = '\0';
-            http_parse_request(request, n, &parser);
-            switch (parser.state)
-            {
-                case HTTP_STATE_FINAL:
-                    break;
-                case HTTP_STATE_ERROR:
-                    http_user_vars_free(&parser.request.vars);
-                    warning("unable to parse request to configuration server "
-                        "localhost:%u", port);
-                    close_socket(s);
-                    break;
-                default:
-                    continue;
-            }
-            http_callback_func_t generate;
-            if (parser.request.method == HTTP_METHOD_GET &&
-                (generate = http_lookup_callback(parser.request.name)) != NULL)
-            {
-                http_buffer_t content = http_buffer_open();
-                if (generate(content))
-                {
-                    bool success = http_send_response(s, 200, content,
-                        &parser.request);
-                    if (!success)
-                    {
-                        http_error(s, 500, &parser.request);
-                    }
-                }
-                else
-                {
-                    http_error(s, 404, &parser.request);
-                }
-                http_buffer_close(content);
-            }
-            else
-            {
-                callback(&parser.request.vars);
-                http_handle_request(s, &parser.request);
-            }
+            http_parser_free(&parser);
+            warning("unable to read request for configuration server "
+                "localhost:%u", listener->port);
+            close_socket(s);
+            return;
+        }
+        request[n] = '\0';
+        http_parse_request(request, n, &parser);
+        if (parser.state == HTTP_STATE_FINAL)
+        {
+            break;
+        }
+        if (parser.state == HTTP_STATE_ERROR)
+        {
+            http_parser_free(&parser);
+            warning("unable to parse request to configuration server "
+                "localhost:%u", listener->port);
+            close_socket(s);
+            return;
+        }
+    }
+
+    http_callback_func_t generate;
+    if (parser.request.method == HTTP_METHOD_GET &&
+        (generate = http_lookup_callback(parser.request.name)) != NULL)
+    {
+        bool poll = (http_user_var_lookup(&parser.request.query,
+            HTTP_POLL_VAR) != NULL);
+        if (poll && !http_poll_begin())
+        {
+            // Too many long-polls; the client retries later.
+            http_error(s, 503, &parser.request);
             shutdown(s, SHUT_RDWR);
-            http_user_vars_free(&parser.request.vars);
+            http_parser_free(&parser);
             close_socket(s);
-        } 
-        while (false);
+            return;
+        }
+        http_buffer_t content = http_buffer_open();
+        bool generated = generate(&parser.request.query, content);
+        if (poll)
+        {
+            http_poll_end();
+        }
+        if (generated)
+        {
+            bool success = http_send_response(s, 200, content,
+                &parser.request);
+            if (!success)
+            {
+                http_error(s, 500, &parser.request);
+            }
+        }
+        else
+        {
+            http_error(s, 404, &parser.request);
+        }
+        http_buffer_close(content);
+    }
+    else
+    {
+        // The callback reads and writes the configuration; one at a time.
+        thread_lock(&http_callback_lock);
+        listener->callback(&parser.request.vars);
+        thread_unlock(&http_callback_lock);
+        http_handle_request(s, &parser.request);
+    }
+    shutdown(s, SHUT_RDWR);
+    http_parser_free(&parser);
+    close_socket(s);
+}
+
+/*
+ * Admit a long-poll request, unless too many are already in progress.
+ */
+static bool http_poll_begin(void)
+{
+    thread_lock(&http_poll_lock);
+    bool admit = (http_polls_active < http_polls_max);
+    if (admit)
+    {
+        http_polls_active++;
+    }
+    thread_unlock(&http_poll_lock);
+    return admit;
+}
+
+/*
+ * A long-poll request is done.
+ */
+static void http_poll_end(void)
+{
+    thread_lock(&http_poll_lock);
+    http_polls_active--;
+    thread_unlock(&http_poll_lock);
+}
+
+/*
+ * Long-poll: if the query has a HTTP_POLL_VAR variable, store it in since
+ * and wait (up to HTTP_POLL_TIMEOUT) for seq to differ from it.  Returns
+ * false (without waiting) for a plain request.  Whoever changes seq must
+ * call http_poll_notify().
+ */
+bool http_poll(const struct http_user_vars_s *query, volatile unsigned *seq,
+    unsigned *since)
+{
+    if (!http_get_int_var(query, HTTP_POLL_VAR, 0, UINT32_MAX,
+            sizeof(uint32_t), since))
+    {
+        return false;
+    }
+    thread_lock(&http_poll_lock);
+    struct http_poll_s *poll = NULL;
+    for (unsigned i = 0; i < HTTP_POLL_MAX; i++)
+    {
+        if (!http_polls[i].used)
+        {
+            poll = http_polls + i;
+            poll->used = true;
+            break;
+        }
+    }
+    uint64_t deadline = gettime_monotonic() + HTTP_POLL_TIMEOUT;
+    while (poll != NULL && *seq == *since)
+    {
+        uint64_t now = gettime_monotonic();
+        if (now >= deadline)
+        {
+            break;
+        }
+        thread_cond_timedwait(&poll->cond, &http_poll_lock, deadline - now);
+    }
+    if (poll != NULL)
+    {
+        poll->used = false;
+    }
+    thread_unlock(&http_poll_lock);
+    return true;
+}
+
+/*
+ * Wake up all long-polls (to re-check their sequence numbers).
+ */
+void http_poll_notify(void)
+{
+    if (!http_poll_ready)
+    {
+        return;
+    }
+    thread_lock(&http_poll_lock);
+    for (unsigned i = 0; i < HTTP_POLL_MAX; i++)
+    {
+        if (http_polls[i].used)
+        {
+            thread_cond_signal(&http_polls[i].cond);
+        }
     }
+    thread_unlock(&http_poll_lock);
 }
 
 /*
@@ -547,6 +741,16 @@ void http_parser_init(struct http_parser_s *parser)
     parser->state_pos = 0;
     parser->body_used = 1;
     http_user_vars_init(&parser->request.vars);
+    http_user_vars_init(&parser->request.query);
+}
+
+/*
+ * Free all dynamic memory associated with a struct http_parser_s.
+ */
+static void http_parser_free(struct http_parser_s *parser)
+{
+    http_user_vars_free(&parser->request.vars);
+    http_user_vars_free(&parser->request.query);
 }
 
 /*
@@ -614,11 +818,12 @@ size_t http_parse_request(const char *request, size_t request_length,
             }
             case HTTP_STATE_URI:
             {
-                if (request[i] == ' ')
+                if (request[i] == ' ' || request[i] == '?')
                 {
                     parser->request.name[parser->state_pos] = '\0';
                     parser->state_pos = 0;
-                    parser->state = HTTP_STATE_VERSION;
+                    parser->state = (request[i] == ' '? HTTP_STATE_VERSION:
+                        HTTP_STATE_QUERY_VAR);
                 }
                 else if(parser->state_pos == MAX_CONTENT_NAME)
                 {
@@ -631,6 +836,44 @@ size_t http_parse_request(const char *request, size_t request_length,
                 }
                 break;
             }
+            case HTTP_STATE_QUERY_VAR:
+            case HTTP_STATE_QUERY_VAL:
+            {
+                // Query variables are plain var=val pairs (no escapes).
+                bool is_var = (parser->state == HTTP_STATE_QUERY_VAR);
+                char *query_buff = (is_var? parser->var_buff:
+                    parser->val_buff);
+                unsigned max_len = (is_var? MAX_VAR_LENGTH: MAX_VAL_LENGTH);
+                unsigned idx = (parser->state_pos > max_len? max_len:
+                    parser->state_pos);
+                if (is_var && request[i] == '=')
+                {
+                    parser->var_buff[idx] = '\0';
+                    parser->state_pos = 0;
+                    parser->state = HTTP_STATE_QUERY_VAL;
+                    break;
+                }
+                if (request[i] == '&' || request[i] == ' ')
+                {
+                    query_buff[idx] = '\0';
+                    if (is_var)
+                    {
+                        parser->val_buff[0] = '\0';
+                    }
+                    if (parser->var_buff[0] != '\0')
+                    {
+                        http_user_var_insert(&parser->request.query,
+                            parser->var_buff, parser->val_buff);
+                    }
+                    parser->state_pos = 0;
+                    parser->state = (request[i] == ' '? HTTP_STATE_VERSION:
+                        HTTP_STATE_QUERY_VAR);
+                    break;
+                }
+                query_buff[idx] = request[i];
+                parser->state_pos++;
+                break;
+            }
             case HTTP_STATE_VERSION:
             {
                 static const char version[] =
@@ -821,7 +1064,8 @@ size_t http_parse_request(const char *request, size_t request_length,
 /*
  * Given the name of some resource, return its content.
  */
-http_buffer_t http_lookup_content(const char *name)
+static http_buffer_t http_lookup_content(const char *name,
+    const struct http_request_s *request)
 {
     http_buffer_t buff = http_lookup_static_data(name);
     if (buff != NULL)
@@ -832,8 +1076,9 @@ http_buffer_t http_lookup_content(const char *name)
     http_callback_func_t callback = http_lookup_callback(name);
     if (callback != NULL)
     {
+        static const struct http_user_vars_s no_query = {0, true};
         buff = http_buffer_open();
-        if (callback(buff))
+        if (callback((request == NULL? &no_query: &request->query), buff))
         {
             return buff;
         }
@@ -848,7 +1093,7 @@ http_buffer_t http_lookup_content(const char *name)
  */
 void http_handle_request(socket_t s, const struct http_request_s *request)
 {
-    http_buffer_t content = http_lookup_content(request->name);
+    http_buffer_t content = http_lookup_content(request->name, request);
     if (content == NULL)
     {
         http_error(s, 404, request);
@@ -877,13 +1122,29 @@ void http_error(socket_t s, unsigned http_code,
         case 500:
             content_filename = "500.html";
             break;
+        case 503:
+        {
+            static const char http_busy[] =
+                "HTTP/1.1 503 Service Unavailable\r\n"
+                "Retry-After: 1\r\n"
+                "Connection: close\r\n"
+                "\r\n";
+            size_t http_busy_length = sizeof(http_busy)-1;
+            if (send(s, http_busy, http_busy_length, 0) != http_busy_length)
+            {
+                warning("unable to send HTTP 503 response of size "
+                    SIZE_T_FMT " bytes", http_busy_length);
+            }
+            return;
+        }
         default:
             panic("unsupported HTTP code %u", http_code);
     }
 
     if (http_type(request->name) == HTTP_TYPE_HTML)
     {
-        http_buffer_t content = http_lookup_content(content_filename);
+        http_buffer_t content = http_lookup_content(content_filename,
+            request);
         if (content != NULL)
         {
             if (http_send_response(s, http_code, content, request))
@@ -1144,7 +1405,7 @@ void http_expand_macro(const char *macro_name, const char *arg,
         {
             case MACRO_INCLUDE:
             {
-                http_buffer_t content = http_lookup_content(arg);
+                http_buffer_t content = http_lookup_content(arg, request);
                 if (content != NULL)
                 {
                     http_expand_content(content, request, buff);
@@ -1182,30 +1443,45 @@ void http_expand_macro(const char *macro_name, const char *arg,
 }
 
 /*
- * Write a character to the given buffer.
+ * Make room for len more bytes in the given buffer.  Returns the number of
+ * bytes that fit (less than len only for a non-dynamic buffer).
  */
-void http_buffer_putc(http_buffer_t buff, char c)
+static size_t http_buffer_reserve(http_buffer_t buff, size_t len)
 {
-    if (buff->put_pos >= buff->size)
+    if (buff->put_pos + len <= buff->size)
+    {
+        return len;
+    }
+    if (!buff->dynamic)
+    {
+        return buff->size - buff->put_pos;
+    }
+    if (buff->size == 0)
+    {
+        buff->size = 512;
+    }
+    while (buff->put_pos + len > buff->size)
     {
-        if (!buff->dynamic)
-        {
-            return;
-        }
-        if (buff->size == 0)
-        {
-            buff->size = 512;
-        }
         buff->size *= 2;
-        buff->buff = (char *)realloc(buff->buff, buff->size);
-        if (buff->buff == NULL)
-        {
-            error("unable to resize HTTP output buffer to new size of "
-                SIZE_T_FMT " bytes", buff->size);
-        }
     }
+    buff->buff = (char *)realloc(buff->buff, buff->size);
+    if (buff->buff == NULL)
+    {
+        error("unable to resize HTTP output buffer to new size of "
+            SIZE_T_FMT " bytes", buff->size);
+    }
+    return len;
+}
 
-    buff->buff[buff->put_pos++] = c;
+/*
+ * Write a character to the given buffer.
+ */
+void http_buffer_putc(http_buffer_t buff, char c)
+{
+    if (http_buffer_reserve(buff, 1) == 1)
+    {
+        buff->buff[buff->put_pos++] = c;
+    }
 }
 
 /*
@@ -1213,11 +1489,17 @@ void http_buffer_putc(http_buffer_t buff, char c)
  */
 void http_buffer_puts(http_buffer_t buff, const char *s)
 {
-    while (*s)
-    {
-        http_buffer_putc(buff, *s);
-        s++;
-    }
+    http_buffer_write(buff, s, strlen(s));
+}
+
+/*
+ * Write len bytes of data to the given buffer.
+ */
+void http_buffer_write(http_buffer_t buff, const char *data, size_t len)
+{
+    len = http_buffer_reserve(buff, len);
+    memcpy(buff->buff + buff->put_pos, data, len);
+    buff->put_pos += len;
 }
 
 /*
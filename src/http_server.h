@@ -66,11 +66,22 @@ struct http_buffer_s
 typedef struct http_buffer_s *http_buffer_t;
 
 /*
- * Callbacks for program generated content.
+ * Callbacks for program generated content.  The query holds the URI query
+ * string variables (e.g. "log-entry.txt?seq=12").
  */
-typedef bool (*http_callback_func_t)(http_buffer_t buff);
+typedef bool (*http_callback_func_t)(const struct http_user_vars_s *query,
+    http_buffer_t buff);
 void http_register_callback(const char *name, http_callback_func_t func);
 
+/*
+ * Long-poll support: wait for a sequence number to move past the query's
+ * "seq" variable.  http_poll_notify() must be called after each change.
+ */
+#define HTTP_POLL_VAR       "seq"
+bool http_poll(const struct http_user_vars_s *query, volatile unsigned *seq,
+    unsigned *since);
+void http_poll_notify(void);
+
 /*
  * Launch a http server that listens on the given port.
  */
@@ -102,6 +113,7 @@ http_buffer_t http_buffer_open(void);
 void http_buffer_close(http_buffer_t buff);
 void http_buffer_putc(http_buffer_t buff, char c);
 void http_buffer_puts(http_buffer_t buff, const char *s);
+void http_buffer_write(http_buffer_t buff, const char *data, size_t len);
 char http_buffer_getc(http_buffer_t buff);
 
 #endif      /* __HTTP_SERVER_H */
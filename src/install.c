@@ -22,10 +22,12 @@
 #include <string.h>
 
 #include "config.h"
+#include "domain.h"
 #include "encodings/crypt.h"
 #include "install.h"
 #include "log.h"
 #include "misc.h"
+#include "route.h"
 #include "tunnel.h"
 
 #ifdef WINDOWS
@@ -66,6 +68,28 @@ void install_files(void)
         fclose(file);
     }
 
+    file = fopen(DOMAINS_FILENAME, "r");
+    if (file == NULL && errno == ENOENT)
+    {
+        log("installing \"%s\"", DOMAINS_FILENAME);
+        install_file("install.domains", DOMAINS_FILENAME);
+    }
+    else if (file != NULL)
+    {
+        fclose(file);
+    }
+
+    file = fopen(ROUTES_FILENAME, "r");
+    if (file == NULL && errno == ENOENT)
+    {
+        log("installing \"%s\"", ROUTES_FILENAME);
+        install_file("install.routes", ROUTES_FILENAME);
+    }
+    else if (file != NULL)
+    {
+        fclose(file);
+    }
+
     file = fopen(CRYPT_CERT_CACHE_FILENAME, "r");
     if (file == NULL && errno == ENOENT)
     {
@@ -58,9 +58,11 @@
 #include <linux/netlink.h>
 
 #include "capture.h"
+#include "config.h"
 #include "log.h"
 #include "options.h"
 #include "socket.h"
+#include "thread.h"
 
 /*
  * NFQ configuration.
@@ -84,6 +86,10 @@ static const char *ip_tables_enable_tcp_queue =
 static const char *ip_tables_enable_udp_queue =
     "/sbin/iptables -I OUTPUT -p udp -m udp -m owner --uid-owner %d "
     "-m mark ! --mark %d -j NFQUEUE --dport 53 --queue-num %d";
+static const char *ip_tables_enable_dns_reply_queue =
+    "/sbin/iptables -I INPUT -p udp -m udp --sport 53 "
+    "-m mark ! --mark " make_string(MARK_NUMBER) " -j NFQUEUE "
+    "--queue-num " make_string(QUEUE_NUMBER) " --queue-bypass";
 static const char *ip_tables_enable_filter_icmp =
     "/sbin/iptables -I INPUT -p icmp --icmp-type ttl-zero-during-transit "
     "-j DROP";
@@ -93,6 +99,10 @@ static const char *ip_tables_disable_tcp_queue =
 static const char *ip_tables_disable_udp_queue =
     "/sbin/iptables -D OUTPUT -p udp -m udp -m owner --uid-owner %d "
     "-m mark ! --mark %d -j NFQUEUE --dport 53 --queue-num %d";
+static const char *ip_tables_disable_dns_reply_queue =
+    "/sbin/iptables -D INPUT -p udp -m udp --sport 53 "
+    "-m mark ! --mark " make_string(MARK_NUMBER) " -j NFQUEUE "
+    "--queue-num " make_string(QUEUE_NUMBER) " --queue-bypass";
 static const char *ip_tables_disable_filter_icmp =
     "/sbin/iptables -D INPUT -p icmp --icmp-type ttl-zero-during-transit "
     "-j DROP";
@@ -105,9 +115,11 @@ static bool netfilter_set_params(uint8_t mode, uint32_t range);
 static bool netfilter_set_queue_length(uint32_t qlen);
 static bool netfilter_send_message(uint16_t nl_type, int nfa_type,
     uint16_t res_id, bool ack, void *msg, size_t size);
-static int netfilter_get_packet(uint8_t *buff, size_t size);
+static int netfilter_get_packet(uint8_t *buff, size_t size, bool *inbound);
+static void dns_reply_set(bool enable);
 static void iptables(const char *command);
 static void iptables_undo_insert(const char *command);
+static void iptables_undo_remove(const char *command);
 static void iptables_undo_on_signal(int sig);
 static void iptables_undo_flush(void);
 
@@ -132,6 +144,13 @@ static const char *iptables_undo[MAX_IPTABLES_COMMANDS+1] = {NULL};
  */
 static bool iptables_clean = true;
 
+/*
+ * Inbound DNS replies are only captured when the DNS cache is enabled.
+ */
+static bool dns_reply_ready = false;
+static bool dns_reply_enabled = false;
+static mutex_t dns_reply_lock;
+
 /*
  * Initialise packet capturing.
  */
@@ -204,6 +223,20 @@ void init_capture(void)
     iptables_clean = false;
     atexit(iptables_undo_flush);
 
+    // Capture DNS replies if the DNS cache is enabled.  The configuration
+    // is read after dns_reply_ready is set so that a concurrent change is
+    // never missed.
+    if (thread_lock_init(&dns_reply_lock) != 0)
+    {
+        error("unable to initialise DNS reply capture lock");
+    }
+    thread_lock(&dns_reply_lock);
+    dns_reply_ready = true;
+    struct config_s config;
+    config_get(&config);
+    dns_reply_set(config.dns_cache);
+    thread_unlock(&dns_reply_lock);
+
     // Create a RAW socket for packet re-injection.
     trace("[" PLATFORM "] setting up raw socket for re-injection");
     socket_inject = socket(PF_INET, SOCK_RAW, IPPROTO_RAW);
@@ -222,6 +255,38 @@ void init_capture(void)
     }
 }
 
+/*
+ * Start or stop capturing inbound DNS replies.
+ */
+void capture_dns_replies(bool enable)
+{
+    if (!dns_reply_ready)
+    {
+        return;         // init_capture() will read the configuration.
+    }
+    thread_lock(&dns_reply_lock);
+    dns_reply_set(enable);
+    thread_unlock(&dns_reply_lock);
+}
+
+/*
+ * Add or remove the DNS reply rule (dns_reply_lock must be held).
+ */
+static void dns_reply_set(bool enable)
+{
+    if (enable && !dns_reply_enabled)
+    {
+        iptables_undo_insert(ip_tables_disable_dns_reply_queue);
+        iptables(ip_tables_enable_dns_reply_queue);
+    }
+    else if (!enable && dns_reply_enabled)
+    {
+        iptables_undo_remove(ip_tables_disable_dns_reply_queue);
+        iptables(ip_tables_disable_dns_reply_queue);
+    }
+    dns_reply_enabled = enable;
+}
+
 /*
  * Set a netfilter configuration option.
  */
@@ -332,9 +397,10 @@ static bool netfilter_send_message(uint16_t nl_type, int nfa_type,
 }
 
 /*
- * Get a packet from netfilter.
+ * Get a packet from netfilter.  Inbound packets (DNS replies) are only
+ * observed; they continue on their way.
  */
-static int netfilter_get_packet(uint8_t *buff, size_t size)
+static int netfilter_get_packet(uint8_t *buff, size_t size, bool *inbound)
 {
     // Read a message from netlink
     char nl_buff[ETH_DATA_LEN + sizeof(struct ethhdr) +
@@ -417,9 +483,10 @@ static int netfilter_get_packet(uint8_t *buff, size_t size)
         return -1;
     }
 
-    // Tell netlink to drop the packet
+    // Tell netlink to drop the packet (or accept it if inbound)
+    *inbound = (nl_pkt_hdr->hook == NF_INET_LOCAL_IN);
     struct nfqnl_msg_verdict_hdr nl_verdict;
-    nl_verdict.verdict = htonl(NF_DROP);
+    nl_verdict.verdict = htonl(*inbound? NF_ACCEPT: NF_DROP);
     nl_verdict.id = nl_pkt_hdr->packet_id;
     if (!netfilter_send_message(NFQNL_MSG_VERDICT, NFQA_VERDICT_HDR,
             QUEUE_NUMBER, false, &nl_verdict, sizeof(nl_verdict)))
@@ -443,12 +510,13 @@ static int netfilter_get_packet(uint8_t *buff, size_t size)
 /*
  * Get a captured packet.
  */
-size_t get_packet(uint8_t *buff, size_t size)
+size_t get_packet(uint8_t *buff, size_t size, bool *inbound)
 {
     int result;
+    *inbound = false;
     do
     {
-        result = netfilter_get_packet(buff, size);
+        result = netfilter_get_packet(buff, size, inbound);
         if (result < 0)
         {
             warning("failed to read packet from netfilter socket");
@@ -482,6 +550,15 @@ void inject_packet(uint8_t *buff, size_t size)
     }
 }
 
+/*
+ * Inject a reply packet towards this host.
+ */
+void inject_reply(uint8_t *buff, size_t size)
+{
+    // The RAW socket will loop a packet for a local address back to us.
+    inject_packet(buff, size);
+}
+
 /*
  * Execute an iptables command.
  */
@@ -570,6 +647,20 @@ static void iptables_undo_insert(const char *command)
     iptables_undo[i] = command;
 }
 
+/*
+ * Remove a command from the iptables_undo queue.
+ */
+static void iptables_undo_remove(const char *command)
+{
+    int i;
+    for (i = 0; i < MAX_IPTABLES_COMMANDS && iptables_undo[i] != command; i++)
+        ;
+    for (; i < MAX_IPTABLES_COMMANDS && iptables_undo[i] != NULL; i++)
+    {
+        iptables_undo[i] = iptables_undo[i+1];
+    }
+}
+
 /*
  * Execute all queued iptables undo commands on signal then exit.
  */
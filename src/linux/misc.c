@@ -148,6 +148,37 @@ uint64_t gettime(void)
     return tv.tv_sec*1000000 + tv.tv_usec;
 }
 
+/*
+ * Gets the current monotonic time in microseconds (for measuring intervals;
+ * unaffected by changes to the wall clock).
+ */
+uint64_t gettime_monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Gets a coarse monotonic time in microseconds.  The resolution is a clock
+ * tick (a few milliseconds), but it is much cheaper to read than
+ * gettime_monotonic(), so suits per-packet expiry checks.
+ */
+uint64_t gettime_coarse(void)
+{
+    struct timespec ts;
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#elif defined(CLOCK_MONOTONIC_FAST)
+    clock_gettime(CLOCK_MONOTONIC_FAST, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec / 1000;
+}
+
 /*
  * Sleep for the given number of microseconds.
  */
@@ -19,14 +19,34 @@
 #define __THREAD_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 typedef pthread_t thread_t;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+/*
+ * Threads are never joined, so they are created detached (their stacks are
+ * released on exit), and with a bounded stack rather than the (often
+ * multi-megabyte) platform default.
+ */
+#define THREAD_STACK_SIZE       (256 * 1024)
 
 static inline int thread_create(thread_t *thread, void *(*start)(void *),
     void *arg)
 {
-    return pthread_create(thread, NULL, start, arg);
+    pthread_attr_t attr;
+    int result = pthread_attr_init(&attr);
+    if (result != 0)
+    {
+        return result;
+    }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+    result = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    return result;
 }
 
 static inline int thread_lock_init(mutex_t *lock)
@@ -49,4 +69,53 @@ static inline int thread_unlock(mutex_t *lock)
     return pthread_mutex_unlock(lock);
 }
 
+/*
+ * Condition variables time out against the monotonic clock (where
+ * supported), so timed waits are unaffected by wall clock adjustments.
+ */
+static inline int thread_cond_init(cond_t *cond)
+{
+#ifdef MACOSX
+    return pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+    int result = pthread_condattr_init(&attr);
+    if (result != 0)
+    {
+        return result;
+    }
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    result = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return result;
+#endif
+}
+
+static inline int thread_cond_wait(cond_t *cond, mutex_t *lock)
+{
+    return pthread_cond_wait(cond, lock);
+}
+
+static inline int thread_cond_timedwait(cond_t *cond, mutex_t *lock,
+    uint64_t us)
+{
+    struct timespec ts;
+#ifdef MACOSX
+    ts.tv_sec  = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    return pthread_cond_timedwait_relative_np(cond, lock, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)ts.tv_nsec + (us % 1000000) * 1000;
+    ts.tv_sec  += us / 1000000 + ns / 1000000000;
+    ts.tv_nsec  = ns % 1000000000;
+    return pthread_cond_timedwait(cond, lock, &ts);
+#endif
+}
+
+static inline int thread_cond_signal(cond_t *cond)
+{
+    return pthread_cond_signal(cond);
+}
+
 #endif      /* __THREAD_H */
@@ -0,0 +1,434 @@
+/*
+ * txring.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/route.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "misc.h"
+#include "txring.h"
+
+#define TXRING_FRAME_SIZE       2048
+#define TXRING_BLOCK_SIZE       (64*1024)
+#define TXRING_FRAMES           512
+#define TXRING_DATA_OFFSET                                              \
+    (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+#define TXRING_ROUTES_MAX       64
+#define TXRING_ROUTES_TIMEOUT   (30*SECONDS)
+
+#define TXRING_NEIGH_SIZE       256         // Power of 2
+#define TXRING_NEIGH_TIMEOUT    (30*SECONDS)
+#define TXRING_NEIGH_RETRY      (1*SECONDS)
+
+/*
+ * An IPv4 route via the ring's interface (network byte order).
+ */
+struct txring_route_s
+{
+    uint32_t dst;                       // Destination
+    uint32_t mask;                      // Netmask
+    uint32_t gateway;                   // Gateway (or 0 if on-link)
+};
+
+/*
+ * A cached next-hop MAC address.
+ */
+struct txring_neigh_s
+{
+    uint32_t addr;                      // Next-hop address
+    bool valid;                         // MAC address is known
+    uint8_t mac[ETH_ALEN];              // MAC address
+    uint64_t expiry;                    // Time to re-resolve
+};
+
+/*
+ * A TX ring bound to one interface.  Not thread-safe; each listen thread
+ * opens its own.
+ */
+struct txring_s
+{
+    int fd;                             // AF_PACKET socket
+    int ifindex;                        // Interface index
+    char ifname[IFNAMSIZ];              // Interface name
+    uint8_t mac[ETH_ALEN];              // Interface MAC address
+    size_t mtu;                         // Interface MTU
+    uint8_t *frames;                    // Ring mapping
+    size_t size;                        // Ring mapping size
+    unsigned frame;                     // Next frame to fill
+    unsigned pending;                   // Frames queued since last flush
+    struct txring_route_s routes[TXRING_ROUTES_MAX];
+    unsigned num_routes;                // Number of routes
+    uint64_t routes_expiry;             // Time to reload routes
+    struct txring_neigh_s neighs[TXRING_NEIGH_SIZE];
+    uint64_t now;                       // Batch time (0 = not yet read)
+};
+
+/*
+ * Prototypes.
+ */
+static uint64_t txring_now(txring_t ring);
+static void txring_load_routes(txring_t ring);
+static bool txring_next_hop(txring_t ring, uint32_t daddr, uint32_t *addr);
+static bool txring_resolve(txring_t ring, uint32_t addr, uint8_t *mac);
+static bool txring_read_arp(txring_t ring, uint32_t addr, uint8_t *mac);
+
+/*
+ * Open a TX ring on the given Ethernet interface.  Requires CAP_NET_RAW.
+ * Returns NULL on error (errno is set).
+ */
+txring_t txring_open(const char *ifname)
+{
+    if (strlen(ifname) >= IFNAMSIZ)
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    txring_t ring = (txring_t)malloc(sizeof(struct txring_s));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    memset(ring, 0x0, sizeof(struct txring_s));
+    strcpy(ring->ifname, ifname);
+
+    // Protocol 0: the socket is for transmission only.
+    ring->fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if (ring->fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0x0, sizeof(ifr));
+    strcpy(ifr.ifr_name, ifname);
+    if (ioctl(ring->fd, SIOCGIFINDEX, &ifr) != 0)
+    {
+        goto txring_open_error;
+    }
+    ring->ifindex = ifr.ifr_ifindex;
+    if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) != 0)
+    {
+        goto txring_open_error;
+    }
+    if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+    {
+        errno = EINVAL;
+        goto txring_open_error;
+    }
+    memmove(ring->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    if (ioctl(ring->fd, SIOCGIFMTU, &ifr) != 0)
+    {
+        goto txring_open_error;
+    }
+    ring->mtu = (size_t)ifr.ifr_mtu;
+    if (ring->mtu > TXRING_FRAME_SIZE - TXRING_DATA_OFFSET - ETH_HLEN)
+    {
+        ring->mtu = TXRING_FRAME_SIZE - TXRING_DATA_OFFSET - ETH_HLEN;
+    }
+
+    int version = TPACKET_V2;
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version,
+            sizeof(version)) != 0)
+    {
+        goto txring_open_error;
+    }
+    struct tpacket_req req;
+    req.tp_block_size = TXRING_BLOCK_SIZE;
+    req.tp_frame_size = TXRING_FRAME_SIZE;
+    req.tp_frame_nr   = TXRING_FRAMES;
+    req.tp_block_nr   = TXRING_FRAMES /
+        (TXRING_BLOCK_SIZE / TXRING_FRAME_SIZE);
+    if (setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &req,
+            sizeof(req)) != 0)
+    {
+        goto txring_open_error;
+    }
+    ring->size = (size_t)req.tp_block_size * req.tp_block_nr;
+    ring->frames = (uint8_t *)mmap(NULL, ring->size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+    if (ring->frames == MAP_FAILED)
+    {
+        ring->frames = NULL;
+        goto txring_open_error;
+    }
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sll_family   = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex  = ring->ifindex;
+    if (bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        goto txring_open_error;
+    }
+
+    txring_load_routes(ring);
+    return ring;
+
+txring_open_error:
+    {
+        int saved_errno = errno;
+        txring_close(ring);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+/*
+ * Close a TX ring.
+ */
+void txring_close(txring_t ring)
+{
+    if (ring->frames != NULL)
+    {
+        munmap(ring->frames, ring->size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/*
+ * Queue an IPv4 packet for transmission.  Returns false if the packet
+ * cannot be sent via the ring (too big, not routed via the ring's
+ * interface, next-hop MAC not yet known, or ring full), in which case the
+ * caller should send it via the kernel stack instead.  Sending via the
+ * kernel also resolves the next-hop MAC for later packets.
+ */
+bool txring_send(txring_t ring, const uint8_t *packet, size_t size,
+    uint32_t daddr)
+{
+    if (size > ring->mtu)
+    {
+        return false;
+    }
+    uint32_t next_hop;
+    uint8_t mac[ETH_ALEN];
+    if (!txring_next_hop(ring, daddr, &next_hop) ||
+        !txring_resolve(ring, next_hop, mac))
+    {
+        return false;
+    }
+
+    uint8_t *frame = ring->frames + ring->frame*TXRING_FRAME_SIZE;
+    struct tpacket2_hdr *hdr = (struct tpacket2_hdr *)frame;
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) !=
+            TP_STATUS_AVAILABLE)
+    {
+        // Ring full; kick the kernel and let the caller fall back.
+        txring_flush(ring);
+        return false;
+    }
+
+    struct ether_header *eth_header =
+        (struct ether_header *)(frame + TXRING_DATA_OFFSET);
+    memmove(eth_header->ether_dhost, mac, ETH_ALEN);
+    memmove(eth_header->ether_shost, ring->mac, ETH_ALEN);
+    eth_header->ether_type = htons(ETHERTYPE_IP);
+    struct iphdr *ip_header = (struct iphdr *)(eth_header + 1);
+    memmove(ip_header, packet, size);
+
+    // The kernel fills in the checksum for IP_HDRINCL; we must do it here.
+    ip_header->check = 0;
+    ip_header->check = ip_checksum(ip_header);
+
+    hdr->tp_len = ETH_HLEN + size;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST,
+        __ATOMIC_RELEASE);
+    ring->frame = (ring->frame + 1) % TXRING_FRAMES;
+    ring->pending++;
+    return true;
+}
+
+/*
+ * Transmit all queued frames.  Call once per batch.
+ */
+void txring_flush(txring_t ring)
+{
+    ring->now = 0;
+    if (ring->pending == 0)
+    {
+        return;
+    }
+    ring->pending = 0;
+    send(ring->fd, NULL, 0, MSG_DONTWAIT);
+}
+
+/*
+ * The (coarse) time of the current batch.  The clock is read once per batch
+ * rather than per packet; expiries are in seconds, so this is ample.
+ */
+static uint64_t txring_now(txring_t ring)
+{
+    if (ring->now == 0)
+    {
+        ring->now = gettime_coarse();
+    }
+    return ring->now;
+}
+
+/*
+ * Load the IPv4 routes via the ring's interface from /proc/net/route.
+ */
+static void txring_load_routes(txring_t ring)
+{
+    ring->num_routes = 0;
+    ring->routes_expiry = gettime_coarse() + TXRING_ROUTES_TIMEOUT;
+    FILE *file = fopen("/proc/net/route", "r");
+    if (file == NULL)
+    {
+        return;
+    }
+    char line[256];
+    if (fgets(line, sizeof(line), file) == NULL)   // Skip header.
+    {
+        fclose(file);
+        return;
+    }
+    while (fgets(line, sizeof(line), file) != NULL &&
+           ring->num_routes < TXRING_ROUTES_MAX)
+    {
+        char ifname[IFNAMSIZ+1];
+        unsigned dst, gateway, flags, mask;
+        if (sscanf(line, "%16s %x %x %x %*d %*d %*d %x", ifname, &dst,
+                &gateway, &flags, &mask) != 5)
+        {
+            continue;
+        }
+        if (strcmp(ifname, ring->ifname) != 0 || (flags & RTF_UP) == 0)
+        {
+            continue;
+        }
+        // /proc/net/route prints raw (network byte order) words:
+        struct txring_route_s *route = ring->routes + ring->num_routes;
+        route->dst     = (uint32_t)dst;
+        route->mask    = (uint32_t)mask;
+        route->gateway = ((flags & RTF_GATEWAY) != 0? (uint32_t)gateway: 0);
+        ring->num_routes++;
+    }
+    fclose(file);
+}
+
+/*
+ * Find the next hop for the given destination (longest prefix match over
+ * the ring's interface routes).  Policy routing is not considered.
+ */
+static bool txring_next_hop(txring_t ring, uint32_t daddr, uint32_t *addr)
+{
+    if (txring_now(ring) >= ring->routes_expiry)
+    {
+        txring_load_routes(ring);
+    }
+    struct txring_route_s *best = NULL;
+    for (unsigned i = 0; i < ring->num_routes; i++)
+    {
+        struct txring_route_s *route = ring->routes + i;
+        if ((daddr & route->mask) == route->dst &&
+            (best == NULL || ntohl(route->mask) > ntohl(best->mask)))
+        {
+            best = route;
+        }
+    }
+    if (best == NULL)
+    {
+        return false;
+    }
+    *addr = (best->gateway != 0? best->gateway: daddr);
+    return true;
+}
+
+/*
+ * Resolve a next-hop MAC address via the cache.  Misses are looked up in
+ * the kernel's ARP table; unresolved addresses are retried after
+ * TXRING_NEIGH_RETRY.
+ */
+static bool txring_resolve(txring_t ring, uint32_t addr, uint8_t *mac)
+{
+    uint32_t hash = ntohl(addr) * 0x9E3779B1;
+    struct txring_neigh_s *neigh =
+        ring->neighs + (hash >> 24) % TXRING_NEIGH_SIZE;
+    uint64_t now = txring_now(ring);
+    if (neigh->addr != addr || now >= neigh->expiry)
+    {
+        neigh->addr  = addr;
+        neigh->valid = txring_read_arp(ring, addr, neigh->mac);
+        neigh->expiry = now + (neigh->valid? TXRING_NEIGH_TIMEOUT:
+            TXRING_NEIGH_RETRY);
+    }
+    if (!neigh->valid)
+    {
+        return false;
+    }
+    memmove(mac, neigh->mac, ETH_ALEN);
+    return true;
+}
+
+/*
+ * Look up a complete entry in /proc/net/arp for the ring's interface.
+ */
+static bool txring_read_arp(txring_t ring, uint32_t addr, uint8_t *mac)
+{
+    FILE *file = fopen("/proc/net/arp", "r");
+    if (file == NULL)
+    {
+        return false;
+    }
+    char line[256];
+    bool found = false;
+    if (fgets(line, sizeof(line), file) == NULL)   // Skip header.
+    {
+        fclose(file);
+        return false;
+    }
+    while (!found && fgets(line, sizeof(line), file) != NULL)
+    {
+        char ip[32], ifname[IFNAMSIZ+1];
+        unsigned flags, m[ETH_ALEN];
+        struct in_addr in;
+        if (sscanf(line, "%31s %*x %x %x:%x:%x:%x:%x:%x %*s %16s", ip,
+                &flags, m+0, m+1, m+2, m+3, m+4, m+5, ifname) != 9)
+        {
+            continue;
+        }
+        if ((flags & ATF_COM) == 0 || strcmp(ifname, ring->ifname) != 0 ||
+            inet_pton(AF_INET, ip, &in) != 1 || in.s_addr != addr)
+        {
+            continue;
+        }
+        for (unsigned i = 0; i < ETH_ALEN; i++)
+        {
+            mac[i] = (uint8_t)m[i];
+        }
+        found = true;
+    }
+    fclose(file);
+    return found;
+}
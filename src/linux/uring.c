@@ -0,0 +1,299 @@
+/*
+ * uring.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/*
+ * An io_uring instance with its mapped submission/completion rings.
+ */
+struct uring_s
+{
+    int fd;                             // io_uring file descriptor
+    unsigned sq_entries;                // SQ size
+    unsigned *sq_head;                  // SQ head (kernel)
+    unsigned *sq_tail;                  // SQ tail (user)
+    unsigned *sq_mask;                  // SQ mask
+    unsigned *sq_array;                 // SQ index array
+    unsigned sq_pending;                // SQEs not yet submitted
+    struct io_uring_sqe *sqes;          // SQEs
+    unsigned *cq_head;                  // CQ head (user)
+    unsigned *cq_tail;                  // CQ tail (kernel)
+    unsigned *cq_mask;                  // CQ mask
+    struct io_uring_cqe *cqes;          // CQEs
+    void *sq_ptr;                       // SQ ring mapping
+    size_t sq_size;
+    void *cq_ptr;                       // CQ ring mapping
+    size_t cq_size;
+    size_t sqes_size;                   // SQE array mapping size
+};
+
+/*
+ * A provided buffer ring.
+ */
+struct uring_buf_ring_s
+{
+    struct io_uring_buf_ring *br;       // Ring (shared with the kernel)
+    size_t size;                        // Ring mapping size
+    unsigned mask;                      // Entries - 1
+    uint16_t tail;                      // Local tail (uncommitted)
+};
+
+#define uring_load_acquire(ptr)                                         \
+    __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define uring_store_release(ptr, val)                                   \
+    __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+/*
+ * Create an io_uring with (at least) the given number of SQ entries.
+ * Returns NULL on error (errno is set).
+ */
+uring_t uring_init(unsigned entries)
+{
+    uring_t ring = (uring_t)malloc(sizeof(struct uring_s));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    memset(ring, 0x0, sizeof(struct uring_s));
+
+    struct io_uring_params params;
+    memset(&params, 0x0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes +
+        params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sq_size = (ring->cq_size > ring->sq_size? ring->cq_size:
+            ring->sq_size);
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        goto uring_init_error;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            ring->cq_ptr = NULL;
+            goto uring_init_error;
+        }
+    }
+    ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+        IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto uring_init_error;
+    }
+
+    uint8_t *sq = (uint8_t *)ring->sq_ptr, *cq = (uint8_t *)ring->cq_ptr;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+
+uring_init_error:
+    uring_free(ring);
+    return NULL;
+}
+
+/*
+ * Free an io_uring.
+ */
+void uring_free(uring_t ring)
+{
+    int errsave = errno;
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+    {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(ring->fd);
+    free(ring);
+    errno = errsave;
+}
+
+/*
+ * Get a (zeroed) SQE, or NULL if the SQ is full.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t ring)
+{
+    unsigned head = uring_load_acquire(ring->sq_head);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - head >= ring->sq_entries)
+    {
+        return NULL;
+    }
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = ring->sqes + idx;
+    memset(sqe, 0x0, sizeof(struct io_uring_sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_pending++;
+    return sqe;
+}
+
+/*
+ * Submit all pending SQEs and wait for at least 'wait' completions.
+ */
+int uring_submit(uring_t ring, unsigned wait)
+{
+    unsigned submit = ring->sq_pending;
+    uring_store_release(ring->sq_tail, *ring->sq_tail + submit);
+    ring->sq_pending = 0;
+    unsigned flags = (wait != 0? IORING_ENTER_GETEVENTS: 0);
+    int result;
+    do
+    {
+        result = (int)syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+            flags, NULL, 0);
+    }
+    while (result < 0 && errno == EINTR);
+    return result;
+}
+
+/*
+ * Get the next CQE (or NULL if none are ready).
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t ring)
+{
+    unsigned head = *ring->cq_head;
+    if (head == uring_load_acquire(ring->cq_tail))
+    {
+        return NULL;
+    }
+    return ring->cqes + (head & *ring->cq_mask);
+}
+
+/*
+ * Mark the CQE returned by uring_peek_cqe() as consumed.
+ */
+void uring_cqe_seen(uring_t ring)
+{
+    uring_store_release(ring->cq_head, *ring->cq_head + 1);
+}
+
+/*
+ * Register a provided buffer ring (entries must be a power of 2).
+ */
+uring_buf_ring_t uring_buf_ring_init(uring_t ring, uint16_t group,
+    unsigned entries)
+{
+    uring_buf_ring_t buf_ring =
+        (uring_buf_ring_t)malloc(sizeof(struct uring_buf_ring_s));
+    if (buf_ring == NULL)
+    {
+        return NULL;
+    }
+    buf_ring->size = entries*sizeof(struct io_uring_buf);
+    buf_ring->br = (struct io_uring_buf_ring *)mmap(NULL, buf_ring->size,
+        PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buf_ring->br == MAP_FAILED)
+    {
+        free(buf_ring);
+        return NULL;
+    }
+    buf_ring->mask = entries - 1;
+    buf_ring->tail = 0;
+    buf_ring->br->tail = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0x0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)buf_ring->br;
+    reg.ring_entries = entries;
+    reg.bgid         = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1) != 0)
+    {
+        int errsave = errno;
+        munmap(buf_ring->br, buf_ring->size);
+        free(buf_ring);
+        errno = errsave;
+        return NULL;
+    }
+    return buf_ring;
+}
+
+/*
+ * Add a buffer to a provided buffer ring.  The buffer is not visible to the
+ * kernel until uring_buf_ring_commit() is called.
+ */
+void uring_buf_ring_add(uring_buf_ring_t buf_ring, void *addr, uint32_t len,
+    uint16_t bid)
+{
+    struct io_uring_buf *buf =
+        buf_ring->br->bufs + (buf_ring->tail & buf_ring->mask);
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len  = len;
+    buf->bid  = bid;
+    buf_ring->tail++;
+}
+
+/*
+ * Make all added buffers visible to the kernel.
+ */
+void uring_buf_ring_commit(uring_buf_ring_t buf_ring)
+{
+    uring_store_release(&buf_ring->br->tail, buf_ring->tail);
+}
+
+/*
+ * Free a provided buffer ring.  The owning ring must already be freed.
+ */
+void uring_buf_ring_free(uring_buf_ring_t buf_ring)
+{
+    munmap(buf_ring->br, buf_ring->size);
+    free(buf_ring);
+}
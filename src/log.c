@@ -38,6 +38,7 @@
 struct log_message_s
 {
     struct log_message_s *next;
+    unsigned              seq;
     int8_t                message_type;
     uint16_t              message_size;
     char                 *message;
@@ -56,6 +57,7 @@ mutex_t               global_log_lock;
 struct log_message_s *global_log     = NULL;
 struct log_message_s *global_log_end = NULL;
 unsigned              global_log_len = 0;
+volatile unsigned     global_log_seq = 0;
 
 /*
  * Terminal colors (for unix)
@@ -136,14 +138,41 @@ static void print_log_message(struct log_message_s *msg)
 }
 
 /*
- * Writes the log message to the given buffer.
+ * Writes the log messages to the given buffer.  A long-poll request (with a
+ * HTTP_POLL_VAR query variable) waits for, and gets, only the messages newer
+ * than the given sequence number, preceded by the latest sequence number.
+ * The log lock is only taken once there is something new to copy.
  */
-bool log_html_message(http_buffer_t buff)
+bool log_html_message(const struct http_user_vars_s *query,
+    http_buffer_t buff)
 {
+    unsigned since = 0;
+    bool poll = http_poll(query, &global_log_seq, &since);
+    unsigned seq = global_log_seq;
+    if (poll)
+    {
+        char seq_buff[32];
+        snprintf(seq_buff, sizeof(seq_buff), "<!-- seq %u -->\n", seq);
+        http_buffer_puts(buff, seq_buff);
+        if (seq == since)
+        {
+            return true;
+        }
+        if ((int)(seq - since) < 0)
+        {
+            since = 0;      // From before a restart; send everything.
+        }
+    }
+
     thread_lock(&global_log_lock);
     struct log_message_s *msg = global_log;
-    while (msg != NULL)
+    for (; msg != NULL; msg = msg->next)
     {
+        if (poll && ((int)(msg->seq - since) <= 0 ||
+                (int)(msg->seq - seq) > 0))
+        {
+            continue;
+        }
         switch (msg->message_type)
         {
             case LOG_MESSAGE_ERROR:
@@ -168,7 +197,6 @@ bool log_html_message(http_buffer_t buff)
         }
         http_buffer_puts(buff, msg->message);
         http_buffer_puts(buff, "<br>\n");
-        msg = msg->next;
     }
     thread_unlock(&global_log_lock);
     return true;
@@ -250,6 +278,7 @@ void log_message(int8_t type, const char *message, ...)
 
     // Update the global log:
     thread_lock(&global_log_lock);
+    log_msg->seq = global_log_seq + 1;
     if (global_log_end == NULL)
     {
         global_log     = log_msg;
@@ -270,7 +299,9 @@ void log_message(int8_t type, const char *message, ...)
             free(log_msg);
         }
     }
+    global_log_seq++;
     thread_unlock(&global_log_lock);
+    http_poll_notify();
 
     if (type == LOG_MESSAGE_ERROR || type == LOG_MESSAGE_PANIC)
     {
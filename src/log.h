@@ -45,7 +45,8 @@ extern int __log_level;
 void log_init(void);
 void log_message(int8_t type, const char *message, ...)
     __attribute__ ((format (printf, 2, 3)));
-bool log_html_message(http_buffer_t buff);
+bool log_html_message(const struct http_user_vars_s *query,
+    http_buffer_t buff);
 
 #define log_get_level()                                                 \
     (__log_level)
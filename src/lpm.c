@@ -0,0 +1,294 @@
+/*
+ * lpm.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lpm.h"
+
+/*
+ * Prototypes.
+ */
+static bool lpm_parse_ipv4(const char *str, uint8_t *addr);
+static bool lpm_parse_ipv6(const char *str, uint8_t *addr);
+static uint32_t lpm_fill(lpm_t lpm, uint32_t *entry);
+static bool lpm_reserve(lpm_t lpm, size_t num);
+
+/*
+ * Parse a prefix <address>[/len], where <address> is an IPv4 or IPv6
+ * address.  The address (network byte order, host bits cleared) is written
+ * to addr, which must have room for LPM_IPV6_SIZE bytes.  Does not depend
+ * on inet_pton(), which older Windows versions lack.
+ */
+bool lpm_parse_prefix(char *str, uint8_t *addr, uint8_t *sizeptr,
+    uint8_t *lenptr)
+{
+    memset(addr, 0x0, LPM_IPV6_SIZE);
+    char *slash = strchr(str, '/');
+    if (slash != NULL)
+    {
+        *slash = '\0';
+    }
+    uint8_t size;
+    if (strchr(str, ':') != NULL)
+    {
+        size = LPM_IPV6_SIZE;
+        if (!lpm_parse_ipv6(str, addr))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        size = LPM_IPV4_SIZE;
+        if (!lpm_parse_ipv4(str, addr))
+        {
+            return false;
+        }
+    }
+    unsigned long len = 8 * size;
+    if (slash != NULL)
+    {
+        char *end;
+        len = strtoul(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || len > 8 * size)
+        {
+            return false;
+        }
+    }
+
+    // Clear the host bits:
+    for (unsigned i = 0; i < size; i++)
+    {
+        if (8 * (i + 1) > len)
+        {
+            addr[i] &= (8 * i >= len? 0: 0xFF << (8 - (len - 8 * i)));
+        }
+    }
+    *sizeptr = size;
+    *lenptr = (uint8_t)len;
+    return true;
+}
+
+/*
+ * Parse a dotted quad a.b.c.d.
+ */
+static bool lpm_parse_ipv4(const char *str, uint8_t *addr)
+{
+    for (unsigned i = 0; i < LPM_IPV4_SIZE; i++)
+    {
+        if (i != 0 && *str++ != '.')
+        {
+            return false;
+        }
+        unsigned val = 0, digits = 0;
+        for (; isdigit((unsigned char)*str); str++, digits++)
+        {
+            val = 10 * val + (*str - '0');
+            if (digits >= 3 || val > UINT8_MAX)
+            {
+                return false;
+            }
+        }
+        if (digits == 0)
+        {
+            return false;
+        }
+        addr[i] = (uint8_t)val;
+    }
+    return (*str == '\0');
+}
+
+/*
+ * Parse an IPv6 address, e.g. fe80::1 or ::ffff:1.2.3.4.
+ */
+static bool lpm_parse_ipv6(const char *str, uint8_t *addr)
+{
+    size_t n = 0, gap = LPM_IPV6_SIZE + 1;
+    if (str[0] == ':' && str[1] == ':')
+    {
+        gap = 0;
+        str += 2;
+    }
+    while (*str != '\0')
+    {
+        const char *end = str;
+        unsigned val = 0;
+        for (; isxdigit((unsigned char)*end); end++)
+        {
+            val = 16 * val + (isdigit((unsigned char)*end)? *end - '0':
+                tolower((unsigned char)*end) - 'a' + 10);
+        }
+        if (*end == '.')
+        {
+            // Trailing IPv4 address:
+            if (n + LPM_IPV4_SIZE > LPM_IPV6_SIZE ||
+                !lpm_parse_ipv4(str, addr + n))
+            {
+                return false;
+            }
+            n += LPM_IPV4_SIZE;
+            break;
+        }
+        if (end == str || end - str > 4 || n + 2 > LPM_IPV6_SIZE)
+        {
+            return false;
+        }
+        addr[n++] = (uint8_t)(val >> 8);
+        addr[n++] = (uint8_t)val;
+        str = end;
+        if (*str == '\0')
+        {
+            break;
+        }
+        if (*str++ != ':')
+        {
+            return false;
+        }
+        if (*str == ':')
+        {
+            if (gap <= LPM_IPV6_SIZE)
+            {
+                return false;
+            }
+            gap = n;
+            str++;
+        }
+        else if (*str == '\0')
+        {
+            return false;
+        }
+    }
+
+    if (gap > LPM_IPV6_SIZE)
+    {
+        return (n == LPM_IPV6_SIZE);
+    }
+    if (n == LPM_IPV6_SIZE)
+    {
+        return false;
+    }
+    size_t tail = n - gap;
+    memmove(addr + LPM_IPV6_SIZE - tail, addr + gap, tail);
+    memset(addr + gap, 0x0, LPM_IPV6_SIZE - tail - gap);
+    return true;
+}
+
+/*
+ * Point all addresses in a prefix at a value.  Returns false if out of
+ * memory.
+ */
+bool lpm_insert(lpm_t lpm, const uint8_t *addr, size_t size, unsigned len,
+    uint32_t value)
+{
+    size_t root = ((size_t)addr[0] << 8) | addr[1];
+    if (len <= LPM_ROOT_BITS)
+    {
+        size_t count = (size_t)1 << (LPM_ROOT_BITS - len);
+        for (size_t i = 0; i < count; i++)
+        {
+            lpm->root[root + i] = value;
+        }
+        return true;
+    }
+
+    // Descend into (or create) the chunk(s) for the prefix:
+    if (!lpm_reserve(lpm, size - LPM_ROOT_BITS / 8))
+    {
+        return false;
+    }
+    uint32_t *entry = lpm->root + root;
+    unsigned bits = LPM_ROOT_BITS;
+    for (size_t i = LPM_ROOT_BITS / 8; ; i++)
+    {
+        uint32_t chunk = lpm_fill(lpm, entry);
+        bits += LPM_CHUNK_BITS;
+        uint32_t *entries = lpm->chunks + (size_t)chunk * LPM_CHUNK_SIZE;
+        if (len <= bits)
+        {
+            size_t count = (size_t)1 << (bits - len);
+            for (size_t j = 0; j < count; j++)
+            {
+                entries[addr[i] + j] = value;
+            }
+            return true;
+        }
+        entry = entries + addr[i];
+    }
+}
+
+/*
+ * Free a table's chunks (the table itself is owned by the caller).
+ */
+void lpm_free(lpm_t lpm)
+{
+    free(lpm->chunks);
+    lpm->chunks = NULL;
+    lpm->num_chunks = 0;
+    lpm->max_chunks = 0;
+}
+
+/*
+ * Get the chunk an entry points to, creating it if necessary (space must
+ * have been reserved).  A new chunk inherits the entry's value.
+ */
+static uint32_t lpm_fill(lpm_t lpm, uint32_t *entry)
+{
+    if ((*entry & LPM_CHUNK) != 0)
+    {
+        return *entry & ~LPM_CHUNK;
+    }
+    uint32_t chunk = (uint32_t)lpm->num_chunks++;
+    uint32_t *entries = lpm->chunks + (size_t)chunk * LPM_CHUNK_SIZE;
+    for (size_t i = 0; i < LPM_CHUNK_SIZE; i++)
+    {
+        entries[i] = *entry;
+    }
+    *entry = chunk | LPM_CHUNK;
+    return chunk;
+}
+
+/*
+ * Make room for at least num more chunks.
+ */
+static bool lpm_reserve(lpm_t lpm, size_t num)
+{
+    if (lpm->num_chunks + num <= lpm->max_chunks)
+    {
+        return true;
+    }
+    size_t max_chunks = (lpm->max_chunks == 0? 16: 2 * lpm->max_chunks);
+    while (lpm->num_chunks + num > max_chunks)
+    {
+        max_chunks *= 2;
+    }
+    if (max_chunks > LPM_CHUNK)
+    {
+        return false;
+    }
+    uint32_t *chunks = (uint32_t *)realloc(lpm->chunks,
+        max_chunks * LPM_CHUNK_SIZE * sizeof(uint32_t));
+    if (chunks == NULL)
+    {
+        return false;
+    }
+    lpm->chunks = chunks;
+    lpm->max_chunks = max_chunks;
+    return true;
+}
@@ -0,0 +1,85 @@
+/*
+ * lpm.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LPM_H
+#define __LPM_H
+
+/*
+ * Longest-prefix-match tables (used by the client routes and the server
+ * egress policy).  Each table holds the prefixes of one address family as
+ * a 16-8-8-... multibit trie: a 2^16 entry root indexed by the first two
+ * address bytes, and 2^8 entry chunks for each following byte.  Each entry
+ * is either a value, or a chunk index (top bit set).  A lookup costs at most
+ * 3 (IPv4) or 15 (IPv6) table reads no matter how many prefixes are stored.
+ *
+ * Prefixes must be inserted in order of increasing length, so a longer
+ * prefix simply overwrites the entries of any shorter prefix that contains
+ * it.  Addresses matching no prefix map to 0.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LPM_IPV4_SIZE           4
+#define LPM_IPV6_SIZE           16
+#define LPM_ROOT_BITS           16
+#define LPM_ROOT_SIZE           (1 << LPM_ROOT_BITS)
+#define LPM_CHUNK_BITS          8
+#define LPM_CHUNK_SIZE          (1 << LPM_CHUNK_BITS)
+#define LPM_CHUNK               0x80000000      // Entry is a chunk index
+#define LPM_VALUE_MAX           (LPM_CHUNK - 1)
+
+/*
+ * A longest-prefix-match table.  A zeroed table is empty.
+ */
+struct lpm_s
+{
+    uint32_t root[LPM_ROOT_SIZE];           // Trie root
+    uint32_t *chunks;                       // Trie chunks
+    size_t num_chunks;                      // #Chunks
+    size_t max_chunks;                      // #Chunks allocated
+};
+typedef struct lpm_s *lpm_t;
+
+/*
+ * Prototypes.
+ */
+bool lpm_parse_prefix(char *str, uint8_t *addr, uint8_t *sizeptr,
+    uint8_t *lenptr);
+bool lpm_insert(lpm_t lpm, const uint8_t *addr, size_t size, unsigned len,
+    uint32_t value);
+void lpm_free(lpm_t lpm);
+
+/*
+ * Longest-prefix-match an address (network byte order) to a value.
+ */
+static inline uint32_t lpm_lookup(const struct lpm_s *lpm,
+    const uint8_t *addr, size_t size)
+{
+    uint32_t entry = lpm->root[((size_t)addr[0] << 8) | addr[1]];
+    for (size_t i = LPM_ROOT_BITS / 8; (entry & LPM_CHUNK) != 0 && i < size;
+            i++)
+    {
+        entry = lpm->chunks[(size_t)(entry & ~LPM_CHUNK) * LPM_CHUNK_SIZE +
+            addr[i]];
+    }
+    return entry;
+}
+
+#endif      /* __LPM_H */
@@ -33,6 +33,8 @@ void random_ext_init(uint8_t *ptr, size_t size);
 void chdir_home(void);
 void launch_ui(uint16_t port);
 uint64_t gettime(void);
+uint64_t gettime_monotonic(void);
+uint64_t gettime_coarse(void);
 void sleeptime(uint64_t us);
 void quit(int status) __attribute__((noreturn));
 
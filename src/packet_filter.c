@@ -21,7 +21,10 @@
 #include <string.h>
 
 #include "config.h"
+#include "domain.h"
 #include "packet_filter.h"
+#include "packet_protocol.h"
+#include "route.h"
 #include "socket.h"
 
 /*
@@ -57,6 +60,7 @@ bool packet_filter(struct config_s *config, const uint8_t *packet,
     struct iphdr *ip_header = (struct iphdr *)(packet + sizeof(struct ethhdr));
     struct tcphdr *tcp_header = NULL;
     struct udphdr *udp_header = NULL;
+    uint8_t route;
     switch (ip_header->version)
     {
         case 4:
@@ -64,32 +68,10 @@ bool packet_filter(struct config_s *config, const uint8_t *packet,
             {
                 return false;
             }
-            switch ((uint8_t)ip_header->daddr)
+            route = route_lookup_ipv4((const uint8_t *)&ip_header->daddr);
+            if (route == ROUTE_BYPASS)
             {
-                case 0:     // Current Network: RFC 1700
-                    return false;
-                case 10:    // Private Network: RFC 1918
-                    return false;
-                case 127:   // Loopback: RFC 3330
-                    return false;
-                case 172:
-                {
-                    uint8_t b = (uint8_t)(ip_header->daddr >> 8);
-                    if (b >= 16 && b <= 31) // Private Network: RFC 1918
-                    {
-                         return false;
-                    }
-                    break;
-                }
-                case 192:
-                {
-                    uint8_t b = (uint8_t)(ip_header->daddr >> 8);
-                    if (b == 168) // Private Network: RFC 1918
-                    {
-                        return false;
-                    }
-                    break;
-                }
+                return false;
             }
             if (ip_header->ihl*sizeof(uint32_t) < sizeof(struct iphdr))
             {
@@ -126,17 +108,8 @@ bool packet_filter(struct config_s *config, const uint8_t *packet,
             {
                 return false;
             }
-            // Check the IP address is a global address.  This is not yet as
-            // comprehensive as the IPv4 case:
-            static const struct in6_addr local_addr = IN6ADDR_LOOPBACK_INIT;
-            if (memcmp(&ip6_header->ip6_dst, &local_addr, 
-                sizeof(struct in6_addr)) == 0) // Loopback
-            {
-                return false;
-            }
-            if (ip6_header->ip6_dst.s6_addr[0] == 0xFC &&
-                (ip6_header->ip6_dst.s6_addr[1] == 0x00 ||
-                 ip6_header->ip6_dst.s6_addr[1] == 0x01)) // Local address.
+            route = route_lookup_ipv6(ip6_header->ip6_dst.s6_addr);
+            if (route == ROUTE_BYPASS)
             {
                 return false;
             }
@@ -206,6 +179,18 @@ bool packet_filter(struct config_s *config, const uint8_t *packet,
         should_tunnel = config->hide_udp;
     }
 
+    // Selective mode: only tunnel requests for listed domains (or routes).
+    if (should_tunnel && config->selective && route != ROUTE_TUNNEL)
+    {
+        const struct proto_s *protocol = protocol_get_def(
+            tcp_header != NULL? config->tcp_proto: config->udp_proto);
+        char name[DOMAIN_MAX_LENGTH];
+        size_t name_len;
+        should_tunnel =
+            protocol->domain((uint8_t *)ip_header, name, &name_len) &&
+            domain_match(name, name_len);
+    }
+
     return should_tunnel;
 }
 
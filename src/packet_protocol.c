@@ -21,40 +21,30 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "domain.h"
 #include "log.h"
 #include "packet.h"
 #include "packet_protocol.h"
 #include "random.h"
 
-/*
- * DNS structures.
- */
-struct dnshdr
-{
-    uint16_t id;
-    uint16_t option;
-    uint16_t qdcount;
-    uint16_t ancount;
-    uint16_t nscount;
-    uint16_t arcount;
-} __attribute__((__packed__));
-
 /*
  * Prototypes.
  */
 static bool http_url_match(uint8_t *packet, size_t *start, size_t *end);
 static void http_url_generate(uint8_t *packet, uint64_t hash);
+static bool http_url_domain(uint8_t *packet, char *name, size_t *name_len);
 static bool dns_match(uint8_t *packet, size_t *start, size_t *end);
 static void dns_generate(uint8_t *packet, uint64_t hash);
+static bool dns_domain(uint8_t *packet, char *name, size_t *name_len);
 
 /*
  * Global pre-defined protocols:
  */
 static const struct proto_s protocols[] =
 {
-    {"http_url", http_url_match, http_url_generate},
-    {"dns", dns_match, dns_generate},
-    {NULL, NULL, NULL}
+    {"http_url", http_url_match, http_url_generate, http_url_domain},
+    {"dns", dns_match, dns_generate, dns_domain},
+    {NULL, NULL, NULL, NULL}
 };
 
 /*
@@ -151,6 +141,36 @@ bool http_url_match(uint8_t *packet, size_t *start, size_t *end)
     return true;
 }
 
+/*
+ * Extract the domain name (the Host header without any port) from a HTTP
+ * packet.  The name buffer must hold DOMAIN_MAX_LENGTH bytes.
+ */
+static bool http_url_domain(uint8_t *packet, char *name, size_t *name_len)
+{
+    size_t start, end;
+    if (!http_url_match(packet, &start, &end))
+    {
+        return false;
+    }
+    uint8_t *data;
+    size_t data_len;
+    packet_init(packet, false, NULL, NULL, NULL, NULL, NULL, &data, NULL,
+        &data_len);
+
+    size_t len = 0;
+    for (size_t i = start; i < data_len && data[i] != '\r' &&
+            data[i] != ':' && data[i] != ' '; i++)
+    {
+        if (len >= DOMAIN_MAX_LENGTH)
+        {
+            return false;
+        }
+        name[len++] = (char)data[i];
+    }
+    *name_len = len;
+    return true;
+}
+
 /*
  * Generate a random HTTP requests.
  */
@@ -263,7 +283,8 @@ static void http_url_generate(uint8_t *packet, uint64_t hash)
 }
 
 /*
- * Match a DNS query.
+ * Match a DNS query.  The match is the QNAME in wire format (including the
+ * terminating zero label).
  */
 bool dns_match(uint8_t *packet, size_t *start, size_t *end)
 {
@@ -281,6 +302,56 @@ bool dns_match(uint8_t *packet, size_t *start, size_t *end)
         return false;
     }
 
+    // Find the extent of the QNAME labels (compression is not allowed here):
+    size_t i = sizeof(struct dnshdr);
+    while (i < data_len && data[i] != 0x0)
+    {
+        if ((data[i] & 0xC0) != 0)
+        {
+            return false;
+        }
+        i += data[i] + 1;
+    }
+    if (i >= data_len)
+    {
+        return false;
+    }
+    *start = sizeof(struct dnshdr);
+    *end = i + 1;
+    return true;
+}
+
+/*
+ * Extract the domain name (the QNAME in dotted form) from a DNS query.  The
+ * name buffer must hold DOMAIN_MAX_LENGTH bytes.
+ */
+static bool dns_domain(uint8_t *packet, char *name, size_t *name_len)
+{
+    size_t start, end;
+    if (!dns_match(packet, &start, &end))
+    {
+        return false;
+    }
+    uint8_t *data;
+    packet_init(packet, false, NULL, NULL, NULL, NULL, NULL, &data, NULL,
+        NULL);
+
+    size_t len = 0;
+    for (size_t i = start; data[i] != 0x0; i += data[i] + 1)
+    {
+        size_t label_len = data[i];
+        if (len + label_len + 1 > DOMAIN_MAX_LENGTH)
+        {
+            return false;
+        }
+        if (len != 0)
+        {
+            name[len++] = '.';
+        }
+        memcpy(name + len, data + i + 1, label_len);
+        len += label_len;
+    }
+    *name_len = len;
     return true;
 }
 
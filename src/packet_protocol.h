@@ -24,6 +24,20 @@
 typedef uint8_t proto_t;
 typedef bool (*proto_match_t)(uint8_t *packet, size_t *start, size_t *end);
 typedef void (*proto_gen_t)(uint8_t *packet, uint64_t hash);
+typedef bool (*proto_domain_t)(uint8_t *packet, char *name, size_t *name_len);
+
+/*
+ * DNS structures.
+ */
+struct dnshdr
+{
+    uint16_t id;
+    uint16_t option;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+} __attribute__((__packed__));
 
 #define PROTOCOL_TCP_DEFAULT    0
 #define PROTOCOL_UDP_DEFAULT    1
@@ -34,6 +48,7 @@ struct proto_s
     const char    *name; 
     proto_match_t  match;
     proto_gen_t    generate;
+    proto_domain_t domain;
 };
 
 proto_t protocol_get(const char *name);
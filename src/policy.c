@@ -0,0 +1,450 @@
+/*
+ * policy.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lpm.h"
+#include "policy.h"
+
+#define POLICY_NO_RULE          0               // Rule matching nothing
+#define POLICY_RULES_MAX        (1 << 24)
+#define POLICY_PORTS_MAX        8               // Port ranges per protocol
+#define POLICY_LINE_MAX         1024
+#define POLICY_SPACE            " \t\r\n"
+
+/*
+ * Allowed ports (ranges) for one protocol.
+ */
+struct policy_ports_s
+{
+    uint8_t count;                          // #Ranges
+    uint16_t lo[POLICY_PORTS_MAX];          // Range start
+    uint16_t hi[POLICY_PORTS_MAX];          // Range end (inclusive)
+};
+
+/*
+ * A policy rule.
+ */
+struct policy_rule_s
+{
+    uint8_t addr[LPM_IPV4_SIZE];            // Prefix (network byte order)
+    uint8_t len;                            // Prefix length
+    bool allow;                             // Allow or deny?
+    bool have_ports;                        // Ports set (or inherited)?
+    uint32_t parent;                        // Enclosing rule
+    uint32_t rate;                          // Packets/s cap (0 = none)
+    uint64_t window;                        // Second << 32 | count
+    struct policy_ports_s tcp;              // Allowed TCP ports
+    struct policy_ports_s udp;              // Allowed UDP ports
+};
+
+/*
+ * A compiled policy.
+ */
+struct policy_s
+{
+    struct lpm_s trie;                      // Prefix -> rule index
+    struct policy_rule_s *rules;            // Rules
+    size_t num_rules;                       // #Rules
+    size_t max_rules;                       // #Rules allocated
+};
+
+/*
+ * The built-in policy (file rules are added to it).
+ */
+static const char *policy_builtin[] =
+{
+    "allow 0.0.0.0/0 tcp 80 udp 53",
+    "deny 0.0.0.0/8",                       // Current Network: RFC 1700
+    "deny 10.0.0.0/8",                      // Private Network: RFC 1918
+    "deny 127.0.0.0/8",                     // Loopback: RFC 3330
+    "deny 172.16.0.0/12",                   // Private Network: RFC 1918
+    "deny 192.168.0.0/16",                  // Private Network: RFC 1918
+    "deny 255.255.255.255/32"               // Broadcast: RFC 919
+};
+
+/*
+ * Prototypes.
+ */
+static const char *policy_parse(policy_t policy, char *line);
+static bool policy_parse_ports(char *str, struct policy_ports_s *ports);
+static bool policy_add(policy_t policy, const struct policy_rule_s *rule);
+static bool policy_compile(policy_t policy);
+static int policy_compare(const void *a, const void *b);
+static bool policy_rate(struct policy_rule_s *rule);
+extern void error(const char *message, ...);
+
+/*
+ * Load and compile a policy.  If filename is NULL, only the built-in
+ * policy is used.
+ */
+policy_t policy_open(const char *filename)
+{
+    policy_t policy = (policy_t)calloc(1, sizeof(struct policy_s));
+    if (policy == NULL)
+    {
+        error("unable to allocate %zu bytes for egress policy",
+            sizeof(struct policy_s));
+        return NULL;
+    }
+    struct policy_rule_s no_rule;
+    memset(&no_rule, 0x0, sizeof(no_rule));
+    if (!policy_add(policy, &no_rule))
+    {
+        goto policy_open_error;
+    }
+
+    char line[POLICY_LINE_MAX];
+    for (size_t i = 0; i < sizeof(policy_builtin) / sizeof(policy_builtin[0]);
+            i++)
+    {
+        strcpy(line, policy_builtin[i]);
+        const char *err = policy_parse(policy, line);
+        if (err != NULL)
+        {
+            error("unable to parse built-in egress policy; %s", err);
+            goto policy_open_error;
+        }
+    }
+
+    if (filename != NULL)
+    {
+        FILE *file = fopen(filename, "r");
+        if (file == NULL)
+        {
+            error("unable to open egress policy file \"%s\"", filename);
+            goto policy_open_error;
+        }
+        unsigned lineno = 0;
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            lineno++;
+            const char *err = policy_parse(policy, line);
+            if (err != NULL)
+            {
+                error("unable to parse egress policy file \"%s\" at line %u; "
+                    "%s", filename, lineno, err);
+                fclose(file);
+                goto policy_open_error;
+            }
+        }
+        fclose(file);
+    }
+
+    if (!policy_compile(policy))
+    {
+        error("unable to allocate memory for egress policy");
+        goto policy_open_error;
+    }
+    return policy;
+
+policy_open_error:
+    policy_free(policy);
+    return NULL;
+}
+
+/*
+ * Free a policy.
+ */
+void policy_free(policy_t policy)
+{
+    if (policy == NULL)
+    {
+        return;
+    }
+    lpm_free(&policy->trie);
+    free(policy->rules);
+    free(policy);
+}
+
+/*
+ * Check if a packet to addr (network byte order) may be forwarded.  Returns
+ * a POLICY_* result.
+ */
+int policy_check(policy_t policy, uint32_t addr, uint8_t protocol,
+    uint16_t port)
+{
+    struct policy_rule_s *rule = policy->rules +
+        lpm_lookup(&policy->trie, (const uint8_t *)&addr, LPM_IPV4_SIZE);
+    if (!rule->allow)
+    {
+        return POLICY_DENY;
+    }
+    struct policy_ports_s *ports;
+    switch (protocol)
+    {
+        case IPPROTO_TCP:
+            ports = &rule->tcp;
+            break;
+        case IPPROTO_UDP:
+            ports = &rule->udp;
+            break;
+        default:
+            return POLICY_DENY;
+    }
+    unsigned i;
+    for (i = 0; i < ports->count; i++)
+    {
+        if (port >= ports->lo[i] && port <= ports->hi[i])
+        {
+            break;
+        }
+    }
+    if (i >= ports->count)
+    {
+        return POLICY_DENY;
+    }
+    if (rule->rate != 0 && !policy_rate(rule))
+    {
+        return POLICY_RATE;
+    }
+    return POLICY_ALLOW;
+}
+
+/*
+ * Parse a policy line.  Returns NULL on success, or a reason otherwise.
+ */
+static const char *policy_parse(policy_t policy, char *line)
+{
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+    {
+        *comment = '\0';
+    }
+    char *saveptr;
+    char *token = strtok_r(line, POLICY_SPACE, &saveptr);
+    if (token == NULL)
+    {
+        return NULL;                        // Blank line
+    }
+
+    struct policy_rule_s rule;
+    memset(&rule, 0x0, sizeof(rule));
+    if (strcmp(token, "allow") == 0)
+    {
+        rule.allow = true;
+    }
+    else if (strcmp(token, "deny") != 0)
+    {
+        return "expected `allow' or `deny'";
+    }
+    token = strtok_r(NULL, POLICY_SPACE, &saveptr);
+    uint8_t addr[LPM_IPV6_SIZE], size;
+    if (token == NULL || !lpm_parse_prefix(token, addr, &size, &rule.len) ||
+        size != LPM_IPV4_SIZE)
+    {
+        return "expected an address prefix";
+    }
+    memmove(rule.addr, addr, sizeof(rule.addr));
+
+    while ((token = strtok_r(NULL, POLICY_SPACE, &saveptr)) != NULL)
+    {
+        if (!rule.allow)
+        {
+            return "unexpected option for `deny' rule";
+        }
+        char *arg = strtok_r(NULL, POLICY_SPACE, &saveptr);
+        if (arg == NULL)
+        {
+            return "missing option value";
+        }
+        if (strcmp(token, "tcp") == 0 || strcmp(token, "udp") == 0)
+        {
+            if (!policy_parse_ports(arg, (token[0] == 't'? &rule.tcp:
+                    &rule.udp)))
+            {
+                return "expected a port list";
+            }
+            rule.have_ports = true;
+        }
+        else if (strcmp(token, "rate") == 0)
+        {
+            char *end;
+            unsigned long rate = strtoul(arg, &end, 10);
+            if (rate == 0 || rate > UINT32_MAX || end == arg ||
+                end[0] != '\0')
+            {
+                return "expected a rate";
+            }
+            rule.rate = (uint32_t)rate;
+        }
+        else
+        {
+            return "expected `tcp', `udp' or `rate'";
+        }
+    }
+
+    if (!policy_add(policy, &rule))
+    {
+        return "too many rules";
+    }
+    return NULL;
+}
+
+/*
+ * Parse a port list, e.g. 80,443,8000-8080.
+ */
+static bool policy_parse_ports(char *str, struct policy_ports_s *ports)
+{
+    ports->count = 0;
+    char *saveptr;
+    for (char *range = strtok_r(str, ",", &saveptr); range != NULL;
+            range = strtok_r(NULL, ",", &saveptr))
+    {
+        char *end;
+        unsigned long lo = strtoul(range, &end, 10), hi = lo;
+        if (end == range)
+        {
+            return false;
+        }
+        if (end[0] == '-')
+        {
+            char *hi_str = end+1;
+            hi = strtoul(hi_str, &end, 10);
+            if (end == hi_str)
+            {
+                return false;
+            }
+        }
+        if (end[0] != '\0' || lo > hi || hi > UINT16_MAX ||
+            ports->count >= POLICY_PORTS_MAX)
+        {
+            return false;
+        }
+        ports->lo[ports->count] = (uint16_t)lo;
+        ports->hi[ports->count] = (uint16_t)hi;
+        ports->count++;
+    }
+    return (ports->count != 0);
+}
+
+/*
+ * Add a (parsed) rule.
+ */
+static bool policy_add(policy_t policy, const struct policy_rule_s *rule)
+{
+    if (policy->num_rules >= policy->max_rules)
+    {
+        if (policy->num_rules >= POLICY_RULES_MAX)
+        {
+            return false;
+        }
+        size_t max_rules = (policy->max_rules == 0? 64:
+            2*policy->max_rules);
+        struct policy_rule_s *rules = (struct policy_rule_s *)realloc(
+            policy->rules, max_rules*sizeof(struct policy_rule_s));
+        if (rules == NULL)
+        {
+            return false;
+        }
+        policy->rules = rules;
+        policy->max_rules = max_rules;
+    }
+    memmove(policy->rules + policy->num_rules, rule,
+        sizeof(struct policy_rule_s));
+    policy->num_rules++;
+    return true;
+}
+
+/*
+ * Build the trie from the rules.  Rules are inserted shortest prefix first
+ * (and in file order for equal prefixes, so later rules win).  An allow
+ * rule without ports inherits them from the nearest enclosing allow rule
+ * with ports (which was inserted before it).
+ */
+static bool policy_compile(policy_t policy)
+{
+    size_t num_rules = policy->num_rules - 1;
+    uint64_t *order = (uint64_t *)malloc(num_rules*sizeof(uint64_t));
+    if (order == NULL)
+    {
+        return false;
+    }
+    struct policy_rule_s *rules = policy->rules;
+    for (size_t i = 0; i < num_rules; i++)
+    {
+        uint32_t idx = (uint32_t)(i + 1);
+        order[i] = ((uint64_t)rules[idx].len << 32) | idx;
+    }
+    qsort(order, num_rules, sizeof(uint64_t), policy_compare);
+
+    for (size_t i = 0; i < num_rules; i++)
+    {
+        uint32_t idx = (uint32_t)order[i];
+        struct policy_rule_s *rule = rules + idx;
+        rule->parent = lpm_lookup(&policy->trie, rule->addr, LPM_IPV4_SIZE);
+        if (rule->allow && !rule->have_ports)
+        {
+            uint32_t parent = rule->parent;
+            while (parent != POLICY_NO_RULE &&
+                    !(rules[parent].allow && rules[parent].have_ports))
+            {
+                parent = rules[parent].parent;
+            }
+            rule->tcp = rules[parent].tcp;
+            rule->udp = rules[parent].udp;
+            rule->have_ports = true;
+        }
+        if (!lpm_insert(&policy->trie, rule->addr, LPM_IPV4_SIZE, rule->len,
+                idx))
+        {
+            free(order);
+            return false;
+        }
+    }
+    free(order);
+    return true;
+}
+
+/*
+ * Order rules by (prefix length, rule index).
+ */
+static int policy_compare(const void *a, const void *b)
+{
+    uint64_t key_a = *(const uint64_t *)a, key_b = *(const uint64_t *)b;
+    return (key_a < key_b? -1: (key_a > key_b? 1: 0));
+}
+
+/*
+ * Count a packet against a rule's rate cap.  The window (current second
+ * and count) is shared by all threads and updated with compare-and-swap.
+ */
+static bool policy_rate(struct policy_rule_s *rule)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t second = (uint32_t)ts.tv_sec;
+    while (true)
+    {
+        uint64_t window = rule->window;
+        uint64_t count = ((window >> 32) == second? (uint32_t)window: 0);
+        if (count >= rule->rate)
+        {
+            return false;
+        }
+        if (__sync_bool_compare_and_swap(&rule->window, window,
+                (second << 32) | (count + 1)))
+        {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * policy.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __POLICY_H
+#define __POLICY_H
+
+/*
+ * Server egress policy.  Decides which destinations (prefix, protocol and
+ * port) a tunnel may forward packets to.  The rules are compiled into a
+ * 16-8-8 multibit trie, so a longest-prefix-match costs at most three
+ * table reads no matter how many prefixes are listed.
+ *
+ * Policy file format (one rule per line, `#' starts a comment):
+ *
+ *   allow <prefix> [tcp <ports>] [udp <ports>] [rate <packets/s>]
+ *   deny <prefix>
+ *
+ * where <prefix> is a.b.c.d[/len] and <ports> is a comma separated list of
+ * ports or port ranges (e.g. 80,443,8000-8080).  The most specific prefix
+ * wins.  An allow rule without ports inherits the ports of the enclosing
+ * allow rule.  A rate caps the packets/s forwarded to the whole prefix.
+ * File rules extend the built-in policy (tcp 80 and udp 53 to any public
+ * address); a rule for the same prefix replaces the built-in one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * policy_check() results.
+ */
+#define POLICY_ALLOW        0           // Forward the packet
+#define POLICY_DENY         1           // Destination/port not allowed
+#define POLICY_RATE         2           // Prefix rate cap exceeded
+
+struct policy_s;
+typedef struct policy_s *policy_t;
+
+/*
+ * Prototypes.
+ */
+policy_t policy_open(const char *filename);
+void policy_free(policy_t policy);
+int policy_check(policy_t policy, uint32_t addr, uint8_t protocol,
+    uint16_t port);
+
+#endif      /* __POLICY_H */
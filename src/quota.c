@@ -19,67 +19,92 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
 
 #include "cookie.h"
-#include "cktp_encoding.h"
+#include "misc.h"
 #include "quota.h"
-#include "thread.h"
+
+/*
+ * The quota is a count-min sketch of per-source request counts.  Each cell
+ * packs a 16-bit epoch (window number) and a 16-bit count, so a cell from a
+ * previous window reads as zero and no reset pass is needed.  Cells are
+ * updated with compare-and-swap, so concurrent threads never lock.  The
+ * sketch is shared by all threads; a per-thread shard would let a source
+ * that is spread over several SO_REUSEPORT sockets exceed its rate.
+ */
+#define QUOTA_ROWS              2               // Sketch depth
+#define QUOTA_COUNT_MAX         0xFFFF
+#define QUOTA_CELL(epoch, count)                                        \
+    ((((uint32_t)(epoch)) << 16) | (uint32_t)(count))
+#define QUOTA_CELL_EPOCH(cell)  ((uint16_t)((cell) >> 16))
+#define QUOTA_CELL_COUNT(cell)  ((uint16_t)(cell))
 
 /*
  * Quota structure:
  */
 struct quota_s
 {
-    struct cookie_gen_s salt;       // Salt for hashing
-    mutex_t  lock;                  // Lock for resets
-    uint32_t rps;                   // Requests-per-second
-    uint32_t timemin;               // Reset time min (ms)
-    uint32_t timemax;               // Reset time max (ms)
-    uint64_t starttime;             // Start time
-    uint64_t resettime;             // Reset time
-    uint16_t countssize;            // Counts size
-    uint16_t counts[];              // Counts
+    struct cookie_gen_s salt[QUOTA_ROWS];   // Salt for hashing (per row)
+    uint32_t window;                // Window length (ms)
+    uint32_t phase;                 // Random window phase (ms)
+    uint32_t limit;                 // Requests per window (0 = unlimited)
+    uint32_t countssize;            // Counts size (per row)
+    uint32_t counts[];              // Counts (QUOTA_ROWS rows)
 };
 
 /*
  * Prototypes.
  */
-static uint16_t quota_hash(quota_t quota, uint32_t *ip, size_t ipsize);
+static uint32_t quota_hash(quota_t quota, unsigned row, uint32_t *ip,
+    size_t ipsize);
 extern void error(const char *message, ...);
 
 /*
  * Create and initialise a quota_t.
  */
-quota_t quota_init(cktp_enc_lib_t lib, uint32_t timemin, uint32_t timemax,
-    uint16_t numcounts, uint32_t rps)
+quota_t quota_init(uint32_t window, uint32_t numcounts, uint32_t rps)
 {
-    size_t quota_size = sizeof(struct quota_s) + numcounts*sizeof(uint16_t);
-    quota_t quota = (quota_t)malloc(quota_size);
+    size_t quota_size = sizeof(struct quota_s) +
+        QUOTA_ROWS*numcounts*sizeof(uint32_t);
+    quota_t quota = (quota_t)calloc(1, quota_size);
     if (quota == NULL)
     {
         error("unable to allocation %zu bytes for quota tracker", quota_size);
         exit(EXIT_FAILURE);
     }
-    if (thread_lock_init(&quota->lock) != 0)
+    for (unsigned i = 0; i < QUOTA_ROWS; i++)
     {
-        error("unable to initialise lock for quota tracker");
-        exit(EXIT_FAILURE);
+        if (!cookie_gen_init(quota->salt + i))
+        {
+            error("unable to initialise salt for quota tracker");
+            exit(EXIT_FAILURE);
+        }
     }
-    quota->timemin = timemin;
-    quota->timemax = timemax;
+    quota->window = window;
+    quota->phase = (uint32_t)(quota->salt[0].r[0] % window);
     quota->countssize = numcounts;
-    quota->resettime = lib->gettime()-1;    // Ensure reset.
-    quota->rps = (rps * 1024) / 1000;       // Redefine second = 1024ms
+    quota_set_rate(quota, rps);
     return quota;
 }
 
+/*
+ * Set the requests-per-second allowed for each source (0 = unlimited).
+ */
+void quota_set_rate(quota_t quota, uint32_t rps)
+{
+    uint64_t limit = ((uint64_t)rps * quota->window) / 1000;
+    if (rps != 0 && limit == 0)
+    {
+        limit = 1;
+    }
+    quota->limit = (limit > QUOTA_COUNT_MAX? QUOTA_COUNT_MAX: limit);
+}
+
 /*
  * Free a quota_t.
  */
 void quota_free(quota_t quota)
 {
-    thread_lock_free(&quota->lock);
     free(quota);
 }
 
@@ -88,55 +113,61 @@ void quota_free(quota_t quota)
  * true = accept
  * false = reject
  */
-bool quota_check(quota_t quota, cktp_enc_lib_t lib, random_state_t rng,
-    uint32_t *ip, size_t ipsize)
+bool quota_check(quota_t quota, uint32_t *ip, size_t ipsize)
 {
-    uint64_t currtime = lib->gettime();
-    if (currtime > quota->resettime)
+    uint32_t limit = quota->limit;
+    if (limit == 0)
     {
-        // We only implement partial thread safety for speed.
-        // Worst case the wrong counter will be updated
-        uint64_t r64;
-        lib->random(rng, &r64, sizeof(r64));
-        thread_lock(&quota->lock);
-        quota->resettime = currtime + r64 % (quota->timemax - quota->timemin)
-            + quota->timemin;
-        quota->starttime = currtime;
-        thread_unlock(&quota->lock);
-        lib->random(rng, &quota->salt, sizeof(quota->salt));
-        memset(quota->counts, 0x0, quota->countssize*sizeof(uint16_t));
+        return true;
     }
+    uint16_t epoch = (uint16_t)((gettime_coarse() / MILLISECONDS +
+        quota->phase) / quota->window);
 
-    uint16_t hash = quota_hash(quota, ip, ipsize);
-    uint16_t count = quota->counts[hash];
-    if (count == 0)
+    // Estimate the source's count (the minimum over all rows):
+    uint32_t *cells[QUOTA_ROWS];
+    uint32_t count = QUOTA_COUNT_MAX;
+    for (unsigned i = 0; i < QUOTA_ROWS; i++)
     {
-        quota->counts[hash] = 1;
-        return true;
+        cells[i] = quota->counts + i*quota->countssize +
+            quota_hash(quota, i, ip, ipsize);
+        uint32_t cell = *(volatile uint32_t *)cells[i];
+        uint32_t cell_count =
+            (QUOTA_CELL_EPOCH(cell) == epoch? QUOTA_CELL_COUNT(cell): 0);
+        count = (cell_count < count? cell_count: count);
     }
-    else
+    if (count >= limit)
     {
-        uint64_t difftime = currtime - quota->starttime;
-        uint64_t totaltime = quota->resettime - quota->starttime;
-        uint64_t limit = ((quota->rps - 1) * difftime) / 1024 +
-            totaltime / 1024 + 1;
-        if (count <= limit)
-        {
-            quota->counts[hash]++;
-            return true;
-        }
-        else
+        return false;
+    }
+
+    // Conservative update: only increment the rows holding the minimum.
+    for (unsigned i = 0; i < QUOTA_ROWS; i++)
+    {
+        while (true)
         {
-            return false;
+            uint32_t cell = *(volatile uint32_t *)cells[i];
+            uint32_t cell_count =
+                (QUOTA_CELL_EPOCH(cell) == epoch? QUOTA_CELL_COUNT(cell): 0);
+            if (cell_count > count)
+            {
+                break;
+            }
+            if (__sync_bool_compare_and_swap(cells[i], cell,
+                    QUOTA_CELL(epoch, cell_count + 1)))
+            {
+                break;
+            }
         }
     }
+    return true;
 }
 
 /*
- * Compute the hash value.
+ * Compute the hash value for a sketch row.
  */
-static uint16_t quota_hash(quota_t quota, uint32_t *ip, size_t ipsize)
+static uint32_t quota_hash(quota_t quota, unsigned row, uint32_t *ip,
+    size_t ipsize)
 {
-    return generate_cookie16(&quota->salt, ip, sizeof(ip)) % quota->countssize;
+    return generate_cookie32(quota->salt + row, ip, ipsize) %
+        quota->countssize;
 }
-
@@ -0,0 +1,242 @@
+/*
+ * route.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "lpm.h"
+#include "route.h"
+
+#define ROUTE_LINE_MAX          256
+#define ROUTE_SPACE             " \t\r\n"
+
+/*
+ * A route rule.
+ */
+struct route_rule_s
+{
+    uint8_t addr[LPM_IPV6_SIZE];            // Prefix (network byte order)
+    uint8_t size;                           // Address size (4 or 16)
+    uint8_t len;                            // Prefix length
+    uint8_t action;                         // ROUTE_BYPASS or ROUTE_TUNNEL
+    uint32_t idx;                           // Rule order
+};
+
+/*
+ * The compiled routes.  Written once by route_init() before any worker
+ * thread starts; read-only afterwards.
+ */
+static struct lpm_s route_ipv4;
+static struct lpm_s route_ipv6;
+
+/*
+ * The built-in routes (file rules are added to them).
+ */
+static const char *route_builtin[] =
+{
+    "bypass 0.0.0.0/8",                     // Current Network: RFC 1700
+    "bypass 10.0.0.0/8",                    // Private Network: RFC 1918
+    "bypass 127.0.0.0/8",                   // Loopback: RFC 3330
+    "bypass 172.16.0.0/12",                 // Private Network: RFC 1918
+    "bypass 192.168.0.0/16",                // Private Network: RFC 1918
+    "bypass ::1/128",                       // Loopback: RFC 4291
+    "bypass fc00::/7",                      // Unique Local: RFC 4193
+    "bypass fe80::/10"                      // Link Local: RFC 4291
+};
+
+/*
+ * Prototypes.
+ */
+static const char *route_parse(char *line, struct route_rule_s *rule);
+static void route_add(struct route_rule_s **rules, size_t *num_rules,
+    size_t *max_rules, const struct route_rule_s *rule);
+static void route_compile(struct route_rule_s *rules, size_t num_rules);
+static int route_compare(const void *a, const void *b);
+
+/*
+ * Load and compile the routes.
+ */
+void route_init(void)
+{
+    struct route_rule_s *rules = NULL, rule;
+    size_t num_rules = 0, max_rules = 0;
+    char line[ROUTE_LINE_MAX];
+    for (size_t i = 0; i < sizeof(route_builtin) / sizeof(const char *); i++)
+    {
+        strcpy(line, route_builtin[i]);
+        if (route_parse(line, &rule) != NULL)
+        {
+            panic("invalid built-in route \"%s\"", route_builtin[i]);
+        }
+        route_add(&rules, &num_rules, &max_rules, &rule);
+    }
+
+    FILE *file = fopen(ROUTES_FILENAME, "r");
+    if (file == NULL)
+    {
+        warning("unable to open routes file \"%s\" for reading; using the "
+            "built-in routes only", ROUTES_FILENAME);
+    }
+    else
+    {
+        unsigned lineno = 0;
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            lineno++;
+            const char *err = route_parse(line, &rule);
+            if (err != NULL)
+            {
+                warning("unable to parse routes file \"%s\" line %u: %s; "
+                    "ignoring rule", ROUTES_FILENAME, lineno, err);
+                continue;
+            }
+            if (rule.size != 0)
+            {
+                route_add(&rules, &num_rules, &max_rules, &rule);
+            }
+        }
+        fclose(file);
+    }
+
+    route_compile(rules, num_rules);
+    free(rules);
+    log("loaded " SIZE_T_FMT " routes from \"%s\"",
+        num_rules - sizeof(route_builtin) / sizeof(const char *),
+        ROUTES_FILENAME);
+}
+
+/*
+ * Longest-prefix-match an IPv4 address (network byte order).
+ */
+uint8_t route_lookup_ipv4(const uint8_t *addr)
+{
+    return (uint8_t)lpm_lookup(&route_ipv4, addr, LPM_IPV4_SIZE);
+}
+
+/*
+ * Longest-prefix-match an IPv6 address (network byte order).
+ */
+uint8_t route_lookup_ipv6(const uint8_t *addr)
+{
+    return (uint8_t)lpm_lookup(&route_ipv6, addr, LPM_IPV6_SIZE);
+}
+
+/*
+ * Parse one routes file line.  Returns NULL on success (rule->size is 0 for
+ * blank lines), or an error message.
+ */
+static const char *route_parse(char *line, struct route_rule_s *rule)
+{
+    memset(rule, 0, sizeof(struct route_rule_s));
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+    {
+        *comment = '\0';
+    }
+    char *saveptr;
+    char *action = strtok_r(line, ROUTE_SPACE, &saveptr);
+    if (action == NULL)
+    {
+        return NULL;
+    }
+    if (strcmp(action, "bypass") == 0)
+    {
+        rule->action = ROUTE_BYPASS;
+    }
+    else if (strcmp(action, "tunnel") == 0)
+    {
+        rule->action = ROUTE_TUNNEL;
+    }
+    else
+    {
+        return "expected `bypass' or `tunnel'";
+    }
+    char *prefix = strtok_r(NULL, ROUTE_SPACE, &saveptr);
+    if (prefix == NULL)
+    {
+        return "expected a prefix";
+    }
+    if (strtok_r(NULL, ROUTE_SPACE, &saveptr) != NULL)
+    {
+        return "unexpected trailing text";
+    }
+
+    if (!lpm_parse_prefix(prefix, rule->addr, &rule->size, &rule->len))
+    {
+        return "invalid prefix";
+    }
+    return NULL;
+}
+
+/*
+ * Append a rule.
+ */
+static void route_add(struct route_rule_s **rules, size_t *num_rules,
+    size_t *max_rules, const struct route_rule_s *rule)
+{
+    if (*num_rules >= *max_rules)
+    {
+        size_t new_max = (*max_rules == 0? 64: 2 * *max_rules);
+        struct route_rule_s *new_rules = (struct route_rule_s *)realloc(
+            *rules, new_max * sizeof(struct route_rule_s));
+        if (new_rules == NULL)
+        {
+            error("unable to reallocate " SIZE_T_FMT " bytes for routes",
+                new_max * sizeof(struct route_rule_s));
+        }
+        *rules = new_rules;
+        *max_rules = new_max;
+    }
+    memmove(*rules + *num_rules, rule, sizeof(struct route_rule_s));
+    (*rules)[*num_rules].idx = (uint32_t)*num_rules;
+    (*num_rules)++;
+}
+
+/*
+ * Build the tries from the rules.  Rules are inserted shortest prefix first
+ * (and in file order for equal prefixes, so later rules win).
+ */
+static void route_compile(struct route_rule_s *rules, size_t num_rules)
+{
+    qsort(rules, num_rules, sizeof(struct route_rule_s), route_compare);
+    for (size_t i = 0; i < num_rules; i++)
+    {
+        if (!lpm_insert((rules[i].size == LPM_IPV4_SIZE? &route_ipv4:
+                &route_ipv6), rules[i].addr, rules[i].size, rules[i].len,
+                rules[i].action))
+        {
+            error("unable to allocate memory for routes");
+        }
+    }
+}
+
+/*
+ * Order rules by (prefix length, rule index).
+ */
+static int route_compare(const void *a, const void *b)
+{
+    const struct route_rule_s *rule_a = (const struct route_rule_s *)a;
+    const struct route_rule_s *rule_b = (const struct route_rule_s *)b;
+    if (rule_a->len != rule_b->len)
+    {
+        return (int)rule_a->len - (int)rule_b->len;
+    }
+    return (rule_a->idx < rule_b->idx? -1: (rule_a->idx > rule_b->idx? 1: 0));
+}
@@ -0,0 +1,58 @@
+/*
+ * route.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ROUTE_H
+#define __ROUTE_H
+
+/*
+ * Client destination routes.  Decides by destination prefix whether a packet
+ * bypasses the tunnel, is forced into the tunnel, or is left to the other
+ * filter rules.  The prefixes are compiled into a 16-8-8-... multibit trie
+ * (one per address family), so a longest-prefix-match costs at most 3 (IPv4)
+ * or 15 (IPv6) table reads no matter how many prefixes are listed.
+ *
+ * Routes file format (one rule per line, `#' starts a comment):
+ *
+ *   bypass <prefix>
+ *   tunnel <prefix>
+ *
+ * where <prefix> is an IPv4 or IPv6 address with an optional /len.  The most
+ * specific prefix wins.  File rules extend the built-in rules (bypass of the
+ * private, loopback and local ranges); a rule for the same prefix replaces
+ * the built-in one.  A tunnel rule also skips the selective domain check.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cfg.h"
+
+#define ROUTES_FILENAME         PROGRAM_NAME ".routes"
+
+/*
+ * route_lookup() results.
+ */
+#define ROUTE_DEFAULT           0       // No rule; apply the other filters
+#define ROUTE_BYPASS            1       // Never tunnel
+#define ROUTE_TUNNEL            2       // Tunnel (if the port/flags match)
+
+void route_init(void);
+uint8_t route_lookup_ipv4(const uint8_t *addr);
+uint8_t route_lookup_ipv6(const uint8_t *addr);
+
+#endif      /* __ROUTE_H */
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
 #include <net/if.h>
 #include <netinet/in.h>
@@ -33,6 +34,7 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -41,6 +43,8 @@
 #include "cktp_server.h"
 #include "cktp_url.h"
 #include "server_table.h"
+#include "stats.h"
+#include "timer.h"
 
 #define OPTION_NONE             0
 #define OPTION_ADD              1
@@ -50,26 +54,90 @@
 #define OPTION_LIST             5
 #define OPTION_REMOVE           6
 #define OPTION_THREADS          7
+#define OPTION_CPU              8
+#define OPTION_BUSY_POLL        9
+#define OPTION_IO_URING         10
+#define OPTION_TX_RING          11
+#define OPTION_HANDSHAKE_THREADS 12
+#define OPTION_HANDSHAKE_QUEUE  13
+#define OPTION_COOKIE_RATE      14
+#define OPTION_KEY_RATE         15
+#define OPTION_CLUSTER          16
+#define OPTION_STATS            17
+#define OPTION_POLICY           18
+#define OPTION_CONSOLIDATE      19
+#define OPTION_RELOAD           20
+#define OPTION_KEY_POOL         21
+#define OPTION_KEY_POOL_RATE    22
+#define NUM_OPTIONS             23
 
 #define COLOR_RED               31
 #define COLOR_GREEN             32
 #define COLOR_YELLOW            33
 
 #define THREADS_DEFAULT         3
+#define THREADS_MAX             64
+#define CPU_MAX                 1024    // CPU_SETSIZE
+#define HANDSHAKE_THREADS_DEFAULT 1
+#define HANDSHAKE_THREADS_MAX   16
+#define HANDSHAKE_QUEUE_DEFAULT 256
+#define HANDSHAKE_QUEUE_MAX     65536
+#define COOKIE_RATE_DEFAULT     32
+#define KEY_RATE_DEFAULT        8
+#define RATE_MAX                10000
+#define KEY_POOL_DEFAULT        64
+#define KEY_POOL_MAX            4096
+#define KEY_POOL_RATE_DEFAULT   50
+#define CLUSTER_SECRET_MIN      16
+#define CLUSTER_SECRET_MAX      1024
 
 #define MAX_ADDRS               8
+#define MAX_URLS                256
+#define RESPAWN_WAIT            100     // x 10ms
+
+#define STATS_SOCKET_FORMAT     PACKAGE_NAME ".%u.stats"
+#define STATS_SOCKET_MAX        64
+#define RELOAD_SOCKET_FORMAT    PACKAGE_NAME ".%u.reload"
+#define RELOAD_WAIT             500     // x 10ms
+#define OPTIONS_FILE_FORMAT     PACKAGE_NAME ".%u.opts"
+#define OPTIONS_FILE_MAX        8192
 
 /*
  * Prototypes.
  */
+static bool parse_options(int argc, char **argv, int *command,
+    bool *consolidate, struct cktp_listen_config_s *config, char **saved);
+static void save_option(char **saved, int option, const char *name,
+    const char *arg);
+static void free_options(char **saved);
+static void write_options(pid_t pid, char **saved);
+static bool read_options(pid_t pid, char **saved,
+    struct cktp_listen_config_s *config);
+static void delete_options(pid_t pid);
 static int add_servers(int argc, char **argv, int optind,
-    const uint32_t *addrs, unsigned threads);
+    const uint32_t *addrs, const struct cktp_listen_config_s *config,
+    char **saved, bool consolidate);
 static int remove_servers(int argc, char **argv, int optind,
-    const uint32_t *addrs);
+    const uint32_t *addrs, char **saved);
 static int list_servers(const uint32_t *addrs);
+static int stats_servers(const uint32_t *addrs);
 static int init_start_servers(const uint32_t *addrs);
 static int init_stop_servers(const uint32_t *addrs);
-static int start_server(const char *url, unsigned threads);
+static int reload_servers(int argc, char **argv, int optind,
+    const uint32_t *addrs, char **saved);
+static int start_servers(const char **urls, unsigned num_urls,
+    const struct cktp_listen_config_s *config);
+static pid_t takeover_server(pid_t pid, const char **urls, unsigned num_urls,
+    const struct cktp_listen_config_s *config);
+static int takeover_servers(const char *path, const char **urls,
+    unsigned num_urls, const struct cktp_listen_config_s *config);
+static int run_servers(cktp_tunnel_t *tunnels, unsigned num_tunnels,
+    const struct cktp_listen_config_s *config);
+static void respawn_servers(server_entry_t table, pid_t pid,
+    char **saved);
+static void init_config(struct cktp_listen_config_s *config);
+static bool read_cluster_secret(const char *filename,
+    struct cktp_listen_config_s *config);
 static void help(const char *progname);
 static void usage(const char *progname);
 void error(const char *message, ...);
@@ -98,6 +166,77 @@ int main(int argc, char **argv)
     openlog(PROGRAM_NAME, LOG_PID | LOG_NDELAY, LOG_USER);
 
     // Process command line arguments:
+    int command = OPTION_NONE;
+    bool consolidate = false;
+    struct cktp_listen_config_s config;
+    char *saved[NUM_OPTIONS] = {NULL};
+    init_config(&config);
+    if (!parse_options(argc, argv, &command, &consolidate, &config, saved))
+    {
+        return EXIT_FAILURE;
+    }
+    if (command == OPTION_HELP)
+    {
+        help(argv[0]);
+        return EXIT_SUCCESS;
+    }
+    if (optind > argc)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Check if we are root, bail otherwise
+    if (getuid() != 0)
+    {
+        error("unable to continue; you must be root to run %s", PROGRAM_NAME);
+        return EXIT_FAILURE;
+    }
+
+    // Change to working directory
+    if (chdir(PROGRAM_DIR) != 0)
+    {
+        error("unable to change to directory \"%s\"", PROGRAM_DIR);
+        return EXIT_FAILURE;
+    }
+
+    // Get IP addresses for publishing URLs
+    uint32_t addrs[MAX_ADDRS];
+    if (!get_ip_addrs(addrs, MAX_ADDRS))
+    {
+        error("unable to get IP addresses for this machine; will not echo "
+            "tunnel URLs");
+        addrs[0] = 0x0;
+    }
+
+    // Execute command:
+    switch (command)
+    {
+        case OPTION_ADD: default:
+            return add_servers(argc, argv, optind, addrs, &config, saved,
+                consolidate);
+        case OPTION_REMOVE:
+            return remove_servers(argc, argv, optind, addrs, saved);
+        case OPTION_RELOAD:
+            return reload_servers(argc, argv, optind, addrs, saved);
+        case OPTION_LIST:
+            return list_servers(addrs);
+        case OPTION_STATS:
+            return stats_servers(addrs);
+        case OPTION_INIT_START:
+            return init_start_servers(addrs);
+        case OPTION_INIT_STOP:
+            return init_stop_servers(addrs);
+    }
+}
+
+/*
+ * Parse the command line options into the command and server configuration.
+ * The server configuration options are also saved (see save_option()).
+ */
+static bool parse_options(int argc, char **argv, int *command,
+    bool *consolidate, struct cktp_listen_config_s *config, char **saved)
+{
     static struct option options[] =
     {
         {"add",         0,  NULL,   OPTION_ADD},
@@ -105,13 +244,26 @@ int main(int argc, char **argv)
         {"init-start",  0,  NULL,   OPTION_INIT_START},
         {"init-stop",   0,  NULL,   OPTION_INIT_STOP},
         {"list",        0,  NULL,   OPTION_LIST},
+        {"stats",       0,  NULL,   OPTION_STATS},
         {"remove",      0,  NULL,   OPTION_REMOVE},
+        {"reload",      0,  NULL,   OPTION_RELOAD},
         {"threads",     1,  NULL,   OPTION_THREADS},
+        {"cpu",         1,  NULL,   OPTION_CPU},
+        {"busy-poll",   1,  NULL,   OPTION_BUSY_POLL},
+        {"io-uring",    0,  NULL,   OPTION_IO_URING},
+        {"tx-ring",     1,  NULL,   OPTION_TX_RING},
+        {"handshake-threads", 1, NULL, OPTION_HANDSHAKE_THREADS},
+        {"handshake-queue", 1,  NULL,   OPTION_HANDSHAKE_QUEUE},
+        {"cookie-rate", 1,  NULL,   OPTION_COOKIE_RATE},
+        {"key-rate",    1,  NULL,   OPTION_KEY_RATE},
+        {"key-pool",    1,  NULL,   OPTION_KEY_POOL},
+        {"key-pool-rate", 1, NULL,  OPTION_KEY_POOL_RATE},
+        {"cluster",     1,  NULL,   OPTION_CLUSTER},
+        {"policy",      1,  NULL,   OPTION_POLICY},
+        {"consolidate", 0,  NULL,   OPTION_CONSOLIDATE},
         {NULL,          0,  NULL,   0}
     };
-    int command = OPTION_NONE;
-    unsigned threads = THREADS_DEFAULT;
-
+    optind = 0;         // Re-initialise getopt_long().
     while (true)
     {
         int option_idx = 0;
@@ -125,91 +277,344 @@ int main(int argc, char **argv)
         switch (option)
         {
             case OPTION_HELP:
-                help(argv[0]);
-                return EXIT_SUCCESS;
-            case OPTION_ADD: case OPTION_REMOVE: case OPTION_LIST:
-            case OPTION_INIT_START: case OPTION_INIT_STOP:
-                if (command != OPTION_NONE)
+                *command = OPTION_HELP;
+                return true;
+            case OPTION_ADD: case OPTION_REMOVE: case OPTION_RELOAD:
+            case OPTION_LIST: case OPTION_STATS: case OPTION_INIT_START:
+            case OPTION_INIT_STOP:
+                if (*command != OPTION_NONE)
                 {
                     error("unable to parse options; only one of `--add', "
-                        "`--remove', `--list', `--init-start', or "
-                        "`--init-stop' may be used at once; try `%s --help' "
-                        "for more information", argv[0]);
-                    return EXIT_FAILURE;
+                        "`--remove', `--reload', `--list', `--stats', "
+                        "`--init-start', or `--init-stop' may be used at "
+                        "once; try `%s --help' for more information",
+                        argv[0]);
+                    return false;
                 }
-                command = option;
+                *command = option;
                 break;
             case OPTION_THREADS:
             {
                 char *end;
-                threads = strtoul(optarg, &end, 10);
-                if (threads == 0 || end == NULL || end[0] != '\0')
+                config->threads = strtoul(optarg, &end, 10);
+                if (config->threads == 0 || config->threads > THREADS_MAX ||
+                    end == NULL || end[0] != '\0')
                 {
                     error("unable to parse value for `--threads' option; "
                         "try `%s --help' for more information", argv[0]);
-                    return EXIT_FAILURE;
+                    return false;
+                }
+                break;
+            }
+            case OPTION_CPU:
+            {
+                char *end;
+                unsigned long cpu = strtoul(optarg, &end, 10);
+                if (cpu >= CPU_MAX || end == optarg || end[0] != '\0')
+                {
+                    error("unable to parse value for `--cpu' option; "
+                        "try `%s --help' for more information", argv[0]);
+                    return false;
+                }
+                config->cpu = (int)cpu;
+                break;
+            }
+            case OPTION_BUSY_POLL:
+            {
+                char *end;
+                config->busy_poll = strtoul(optarg, &end, 10);
+                if (config->busy_poll == 0 || end == NULL || end[0] != '\0')
+                {
+                    error("unable to parse value for `--busy-poll' option; "
+                        "try `%s --help' for more information", argv[0]);
+                    return false;
+                }
+                break;
+            }
+            case OPTION_IO_URING:
+                config->engine = CKTP_LISTEN_ENGINE_URING;
+                break;
+            case OPTION_TX_RING:
+                config->tx_ring = optarg;
+                break;
+            case OPTION_HANDSHAKE_THREADS:
+            {
+                char *end;
+                unsigned long threads = strtoul(optarg, &end, 10);
+                if (threads > HANDSHAKE_THREADS_MAX || end == optarg ||
+                    end[0] != '\0')
+                {
+                    error("unable to parse value for `--handshake-threads' "
+                        "option; try `%s --help' for more information",
+                        argv[0]);
+                    return false;
+                }
+                config->handshake_threads = (unsigned)threads;
+                break;
+            }
+            case OPTION_HANDSHAKE_QUEUE:
+            {
+                char *end;
+                unsigned long depth = strtoul(optarg, &end, 10);
+                if (depth == 0 || depth > HANDSHAKE_QUEUE_MAX ||
+                    end == optarg || end[0] != '\0')
+                {
+                    error("unable to parse value for `--handshake-queue' "
+                        "option; try `%s --help' for more information",
+                        argv[0]);
+                    return false;
+                }
+                config->handshake_queue = (unsigned)depth;
+                break;
+            }
+            case OPTION_COOKIE_RATE: case OPTION_KEY_RATE:
+            {
+                char *end;
+                unsigned long rate = strtoul(optarg, &end, 10);
+                if (rate > RATE_MAX || end == optarg || end[0] != '\0')
+                {
+                    error("unable to parse value for `--%s' option; try "
+                        "`%s --help' for more information",
+                        options[option_idx].name, argv[0]);
+                    return false;
+                }
+                if (option == OPTION_COOKIE_RATE)
+                {
+                    config->cookie_rate = (unsigned)rate;
+                }
+                else
+                {
+                    config->key_rate = (unsigned)rate;
+                }
+                break;
+            }
+            case OPTION_KEY_POOL:
+            {
+                char *end;
+                unsigned long depth = strtoul(optarg, &end, 10);
+                if (depth > KEY_POOL_MAX || end == optarg || end[0] != '\0')
+                {
+                    error("unable to parse value for `--key-pool' option; "
+                        "try `%s --help' for more information", argv[0]);
+                    return false;
+                }
+                config->key_pool = (unsigned)depth;
+                break;
+            }
+            case OPTION_KEY_POOL_RATE:
+            {
+                char *end;
+                unsigned long rate = strtoul(optarg, &end, 10);
+                if (rate == 0 || rate > RATE_MAX || end == optarg ||
+                    end[0] != '\0')
+                {
+                    error("unable to parse value for `--key-pool-rate' "
+                        "option; try `%s --help' for more information",
+                        argv[0]);
+                    return false;
                 }
+                config->key_pool_rate = (unsigned)rate;
                 break;
             }
+            case OPTION_CLUSTER:
+                if (!read_cluster_secret(optarg, config))
+                {
+                    return false;
+                }
+                break;
+            case OPTION_POLICY:
+                policy_free(config->policy);
+                config->policy = policy_open(optarg);
+                if (config->policy == NULL)
+                {
+                    return false;
+                }
+                break;
+            case OPTION_CONSOLIDATE:
+                *consolidate = true;
+                break;
             default:
                 error("unable to parse options; try `%s --help' for more "
                     "information", argv[0]);
-                return EXIT_FAILURE;
+                return false;
+        }
+
+        // Remember the server configuration (for reloads and respawns):
+        switch (option)
+        {
+            case OPTION_ADD: case OPTION_REMOVE: case OPTION_RELOAD:
+            case OPTION_LIST: case OPTION_STATS: case OPTION_INIT_START:
+            case OPTION_INIT_STOP: case OPTION_CONSOLIDATE:
+                break;
+            default:
+                save_option(saved, option, options[option_idx].name,
+                    optarg);
+                break;
         }
     }
 
-    if (optind > argc)
+    // Thread i is pinned to CPU (cpu + i), so all of them must exist:
+    if (config->cpu >= 0)
     {
-        usage(argv[0]);
-        return EXIT_FAILURE;
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        unsigned long last = (unsigned long)config->cpu + config->threads;
+        if (last > CPU_MAX || (cpus > 0 && last > (unsigned long)cpus))
+        {
+            error("unable to pin %u threads to CPUs %d..%lu; this machine "
+                "has %ld CPUs", config->threads, config->cpu, last - 1, cpus);
+            return false;
+        }
     }
+    return true;
+}
 
-    // Check if we are root, bail otherwise
-    if (getuid() != 0)
+/*
+ * Save a server configuration option (as `--name[=arg]'), replacing any
+ * earlier value.  Files are saved as absolute paths, since the options are
+ * parsed again (in PROGRAM_DIR) when the server is reloaded or respawned.
+ */
+static void save_option(char **saved, int option, const char *name,
+    const char *arg)
+{
+    char path[PATH_MAX];
+    if ((option == OPTION_CLUSTER || option == OPTION_POLICY) &&
+        realpath(arg, path) != NULL)
     {
-        error("unable to continue; you must be root to run %s", PROGRAM_NAME);
-        return EXIT_FAILURE;
+        arg = path;
     }
+    size_t size = strlen(name) + (arg == NULL? 0: strlen(arg) + 1) + 3;
+    char *value = (char *)malloc(size);
+    if (value == NULL)
+    {
+        error("unable to allocate %zu bytes for option `--%s'", size, name);
+        return;
+    }
+    if (arg == NULL)
+    {
+        snprintf(value, size, "--%s", name);
+    }
+    else
+    {
+        snprintf(value, size, "--%s=%s", name, arg);
+    }
+    free(saved[option]);
+    saved[option] = value;
+}
 
-    // Change to working directory
-    if (chdir(PROGRAM_DIR) != 0)
+/*
+ * Free saved options.
+ */
+static void free_options(char **saved)
+{
+    for (unsigned i = 0; i < NUM_OPTIONS; i++)
     {
-        error("unable to change to directory \"%s\"", PROGRAM_DIR);
-        return EXIT_FAILURE;
+        free(saved[i]);
+        saved[i] = NULL;
     }
+}
 
-    // Get IP addresses for publishing URLs
-    uint32_t addrs[MAX_ADDRS];
-    if (!get_ip_addrs(addrs, MAX_ADDRS))
+/*
+ * Write the saved options of server process pid (each '\0' terminated), so
+ * that the server keeps its configuration when reloaded or respawned.
+ */
+static void write_options(pid_t pid, char **saved)
+{
+    char path[STATS_SOCKET_MAX];
+    snprintf(path, sizeof(path), OPTIONS_FILE_FORMAT, (unsigned)pid);
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
     {
-        error("unable to get IP addresses for this machine; will not echo "
-            "tunnel URLs");
-        addrs[0] = 0x0;
+        error("unable to open options file \"%s\" for writing", path);
+        return;
+    }
+    for (unsigned i = 0; i < NUM_OPTIONS; i++)
+    {
+        if (saved[i] != NULL)
+        {
+            fwrite(saved[i], sizeof(char), strlen(saved[i]) + 1, file);
+        }
     }
+    fclose(file);
+}
 
-    // Execute command:
-    switch (command)
+/*
+ * Get the configuration for a new server replacing server process pid: the
+ * options pid was started with, overridden by the given saved options.  On
+ * return, saved holds the combined options.
+ */
+static bool read_options(pid_t pid, char **saved,
+    struct cktp_listen_config_s *config)
+{
+    static char buff[OPTIONS_FILE_MAX];
+    char path[STATS_SOCKET_MAX];
+    snprintf(path, sizeof(path), OPTIONS_FILE_FORMAT, (unsigned)pid);
+    size_t size = 0;
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
     {
-        case OPTION_ADD: default:
-            return add_servers(argc, argv, optind, addrs, threads);
-        case OPTION_REMOVE:
-            return remove_servers(argc, argv, optind, addrs);
-        case OPTION_LIST:
-            return list_servers(addrs);
-        case OPTION_INIT_START:
-            return init_start_servers(addrs);
-        case OPTION_INIT_STOP:
-            return init_stop_servers(addrs);
+        size = fread(buff, sizeof(char), sizeof(buff) - 1, file);
+        fclose(file);
     }
+    if (size != 0 && buff[size-1] != '\0')
+    {
+        buff[size++] = '\0';
+    }
+
+    char *argv[2*NUM_OPTIONS + 2];
+    int argc = 0;
+    argv[argc++] = (char *)PROGRAM_NAME;
+    for (size_t i = 0; i < size && argc <= NUM_OPTIONS;
+            i += strlen(buff + i) + 1)
+    {
+        argv[argc++] = buff + i;
+    }
+    for (unsigned i = 0; i < NUM_OPTIONS; i++)
+    {
+        if (saved[i] != NULL)
+        {
+            argv[argc++] = saved[i];
+        }
+    }
+    argv[argc] = NULL;
+
+    char *combined[NUM_OPTIONS] = {NULL};
+    int command = OPTION_NONE;
+    bool consolidate = false;
+    init_config(config);
+    bool ok = parse_options(argc, argv, &command, &consolidate, config,
+        combined);
+    free_options(saved);
+    memmove(saved, combined, sizeof(combined));
+    if (!ok)
+    {
+        error("unable to parse the options of the server with PID %u",
+            (unsigned)pid);
+    }
+    return ok;
 }
 
 /*
- * Add servers.
+ * Delete the saved options of server process pid.
+ */
+static void delete_options(pid_t pid)
+{
+    char path[STATS_SOCKET_MAX];
+    snprintf(path, sizeof(path), OPTIONS_FILE_FORMAT, (unsigned)pid);
+    unlink(path);
+}
+
+/*
+ * Add servers.  If consolidate is set, all tunnel URLs are served by a single
+ * process (sharing one pool of listen threads), otherwise each URL gets its
+ * own process.
  */
 static int add_servers(int argc, char **argv, int optind, 
-    const uint32_t *addrs, unsigned threads)
+    const uint32_t *addrs, const struct cktp_listen_config_s *config,
+    char **saved, bool consolidate)
 {
     server_entry_t table = server_table_read();
+    const char *urls[MAX_URLS];
+    unsigned num_urls = 0;
     
     while (optind < argc)
     {
@@ -235,6 +640,19 @@ static int add_servers(int argc, char **argv, int optind,
             continue;
         }
 
+        if (consolidate)
+        {
+            if (num_urls >= MAX_URLS)
+            {
+                error("unable to start server for URL %s; a consolidated "
+                    "server has at most %d URLs", url, MAX_URLS);
+                continue;
+            }
+            print_urls("ADD", COLOR_GREEN, url, server_name, addrs);
+            urls[num_urls++] = url;
+            continue;
+        }
+
         // Print the URL + aliases:
         print_urls("ADD", COLOR_GREEN, url, server_name, addrs);
 
@@ -249,11 +667,36 @@ static int add_servers(int argc, char **argv, int optind,
         {
             // Child:
             server_table_free(table);
-            return start_server(url, threads);
+            return start_servers(&url, 1, config);
         }
 
         // Parent:
         server_table_insert(&table, pid, url);
+        write_options(pid, saved);
+    }
+
+    if (num_urls != 0)
+    {
+        // Spawn one server process for all URLs:
+        pid_t pid = fork();
+        if (pid == (pid_t)-1)
+        {
+            error("unable to fork consolidated server");
+            return EXIT_FAILURE;
+        }
+        if (pid == 0)
+        {
+            // Child:
+            server_table_free(table);
+            return start_servers(urls, num_urls, config);
+        }
+
+        // Parent:
+        for (unsigned i = 0; i < num_urls; i++)
+        {
+            server_table_insert(&table, pid, urls[i]);
+        }
+        write_options(pid, saved);
     }
 
     server_table_write(table);
@@ -261,40 +704,218 @@ static int add_servers(int argc, char **argv, int optind,
 }
 
 /*
- * Start a server instance.
+ * Reload servers (all running servers if no URLs are given).  The new server
+ * takes over the sockets and encoding state of the old one, so no clients
+ * need to reconnect.  It keeps the old server's options, except for those
+ * given again.
  */
-static int start_server(const char *url, unsigned threads)
+static int reload_servers(int argc, char **argv, int optind,
+    const uint32_t *addrs, char **saved)
 {
-    // Open the tunnel
-    cktp_tunnel_t tunnel = cktp_open_tunnel(url);
-    if (tunnel == NULL)
+    server_entry_t table = server_table_read();
+    pid_t reloaded[MAX_URLS];
+    unsigned num_reloaded = 0;
+
+    for (int i = optind; i < argc; i++)
     {
-        return EXIT_FAILURE;
+        server_entry_t entry = table;
+        while (entry != NULL && strcmp(entry->url, argv[i]) != 0)
+        {
+            entry = entry->next;
+        }
+        if (entry == NULL || entry->pid == SERVER_DEAD ||
+            entry->pid == SERVER_SUSPENDED)
+        {
+            error("unable to reload tunnel URL %s; tunnel URL is not "
+                "running", argv[i]);
+        }
     }
 
-    // Open RAW socket for packet forwarding:
-    int socket_out = socket(PF_INET, SOCK_RAW, IPPROTO_RAW);
-    if (socket_out < 0)
+    for (server_entry_t entry = table; entry != NULL; entry = entry->next)
     {
-        error("unable to create RAW socket for packet forwarding");
-        return EXIT_FAILURE;
+        if (entry->pid == SERVER_DEAD || entry->pid == SERVER_SUSPENDED)
+        {
+            continue;
+        }
+        bool selected = (optind >= argc);
+        for (int i = optind; !selected && i < argc; i++)
+        {
+            selected = (strcmp(argv[i], entry->url) == 0);
+        }
+        // A consolidated process serves several URLs; reload it only once:
+        for (unsigned i = 0; selected && i < num_reloaded; i++)
+        {
+            selected = (reloaded[i] != entry->pid);
+        }
+        if (!selected || num_reloaded >= MAX_URLS)
+        {
+            continue;
+        }
+        pid_t pid = entry->pid;
+        reloaded[num_reloaded++] = pid;
+
+        // Spawn the new server process:
+        char *options[NUM_OPTIONS];
+        for (unsigned i = 0; i < NUM_OPTIONS; i++)
+        {
+            options[i] = (saved[i] == NULL? NULL: strdup(saved[i]));
+        }
+        struct cktp_listen_config_s config;
+        pid_t new_pid = SERVER_DEAD;
+        if (read_options(pid, options, &config))
+        {
+            new_pid = takeover_server(pid, NULL, 0, &config);
+        }
+        if (new_pid == SERVER_DEAD)
+        {
+            error("unable to reload server with PID %u; the old server is "
+                "still running", (unsigned)pid);
+            free_options(options);
+            continue;
+        }
+        write_options(new_pid, options);
+        delete_options(pid);
+        free_options(options);
+        for (server_entry_t same = table; same != NULL; same = same->next)
+        {
+            char server_name[CKTP_MAX_URL_LENGTH+1];
+            if (same->pid != pid)
+            {
+                continue;
+            }
+            same->pid = new_pid;
+            if (cktp_parse_url(same->url, NULL, server_name, NULL, NULL))
+            {
+                print_urls("RELOAD", COLOR_GREEN, same->url, server_name,
+                    addrs);
+            }
+        }
     }
-    int on = 1;
-    if(setsockopt(socket_out, IPPROTO_IP, IP_HDRINCL, &on,
-       sizeof(on)) != 0)
+
+    server_table_write(table);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Start a server instance for one or more URLs.
+ */
+static int start_servers(const char **urls, unsigned num_urls,
+    const struct cktp_listen_config_s *config)
+{
+    // Open the tunnels
+    cktp_tunnel_t tunnels[MAX_URLS];
+    for (unsigned i = 0; i < num_urls; i++)
     {
-        error("unable to enable header inclusion RAW socket option for "
-            "packet forwarding");
-        return EXIT_FAILURE;
+        tunnels[i] = cktp_open_tunnel(urls[i]);
+        if (tunnels[i] == NULL)
+        {
+            return EXIT_FAILURE;
+        }
     }
+    return run_servers(tunnels, num_urls, config);
+}
 
-    // Open ICMP socket for packet reflection:
-    int socket_icmp = socket(PF_INET, SOCK_RAW, IPPROTO_ICMP);
-    if (socket_icmp < 0)
+/*
+ * Spawn a server process that takes over the running server process pid,
+ * for the given URLs (or all of them if urls is NULL).  The old server exits
+ * once the new one is listening.  Returns the new PID, or SERVER_DEAD if the
+ * old server is still running.
+ */
+static pid_t takeover_server(pid_t pid, const char **urls, unsigned num_urls,
+    const struct cktp_listen_config_s *config)
+{
+    char reload_path[STATS_SOCKET_MAX];
+    snprintf(reload_path, sizeof(reload_path), RELOAD_SOCKET_FORMAT,
+        (unsigned)pid);
+    pid_t new_pid = fork();
+    if (new_pid == (pid_t)-1)
+    {
+        error("unable to fork server to take over PID %u", (unsigned)pid);
+        return SERVER_DEAD;
+    }
+    if (new_pid == 0)
+    {
+        // Child:
+        exit(takeover_servers(reload_path, urls, num_urls, config));
+    }
+
+    // Parent: the old server exits once the new one is listening.
+    bool exited = false;
+    for (unsigned i = 0; i < RELOAD_WAIT && !exited && kill(pid, 0) == 0;
+            i++)
+    {
+        usleep(10000);
+        exited = (waitpid(new_pid, NULL, WNOHANG) == new_pid);
+    }
+    if (exited || kill(pid, 0) == 0)
+    {
+        if (!exited)
+        {
+            kill(new_pid, SIGTERM);
+        }
+        return SERVER_DEAD;
+    }
+    char stats_path[STATS_SOCKET_MAX];
+    snprintf(stats_path, sizeof(stats_path), STATS_SOCKET_FORMAT,
+        (unsigned)pid);
+    unlink(stats_path);
+    return new_pid;
+}
+
+/*
+ * Start a server instance that takes over a running server.
+ */
+static int takeover_servers(const char *path, const char **urls,
+    unsigned num_urls, const struct cktp_listen_config_s *config)
+{
+    unsigned num_tunnels;
+    cktp_tunnel_t *tunnels = cktp_takeover(path, urls, num_urls,
+        &num_tunnels);
+    if (tunnels == NULL)
     {
-        error("unable to create RAW ICMP socket for packet reflection");
         return EXIT_FAILURE;
     }
+    return run_servers(tunnels, num_tunnels, config);
+}
+
+/*
+ * Serve open tunnels (from a single process).
+ */
+static int run_servers(cktp_tunnel_t *tunnels, unsigned num_tunnels,
+    const struct cktp_listen_config_s *config)
+{
+    // Accept reloads (for `--reload'):
+    char reload_path[STATS_SOCKET_MAX];
+    snprintf(reload_path, sizeof(reload_path), RELOAD_SOCKET_FORMAT,
+        (unsigned)getpid());
+    struct cktp_listen_config_s server_config = *config;
+    server_config.handover = reload_path;
+
+    // Open the per-thread sockets (forwarding, reflection, etc.):
+    cktp_listener_t listener = NULL;
+    cktp_group_t group = NULL;
+    if (num_tunnels == 1)
+    {
+        listener = cktp_open_listener(tunnels[0], &server_config);
+        if (listener == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else
+    {
+        group = cktp_open_group(tunnels, num_tunnels, &server_config);
+        if (group == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Serve statistics (for `--stats'):
+    char stats_path[STATS_SOCKET_MAX];
+    snprintf(stats_path, sizeof(stats_path), STATS_SOCKET_FORMAT,
+        (unsigned)getpid());
+    stats_listen(stats_path);
 
     // Success -- become a daemon:
     if (!become_daemon())
@@ -316,19 +937,80 @@ static int start_server(const char *url, unsigned threads)
         return EXIT_FAILURE;
     }
 
+    // Start the timer service (after forking):
+    timer_init();
+
     // Start serving requests:
-    cktp_listen(tunnel, socket_out, socket_icmp, threads);
+    if (group != NULL)
+    {
+        cktp_listen_group(group);
+    }
+    else
+    {
+        cktp_listen(listener);
+    }
 
     return EXIT_SUCCESS;
 }
 
 /*
- * Remove servers.
+ * Default server configuration.
+ */
+static void init_config(struct cktp_listen_config_s *config)
+{
+    config->threads   = THREADS_DEFAULT;
+    config->cpu       = CKTP_LISTEN_NO_CPU;
+    config->busy_poll = 0;
+    config->engine    = CKTP_LISTEN_ENGINE_MMSG;
+    config->tx_ring   = NULL;
+    config->handshake_threads = HANDSHAKE_THREADS_DEFAULT;
+    config->handshake_queue   = HANDSHAKE_QUEUE_DEFAULT;
+    config->cookie_rate       = COOKIE_RATE_DEFAULT;
+    config->key_rate          = KEY_RATE_DEFAULT;
+    config->key_pool          = KEY_POOL_DEFAULT;
+    config->key_pool_rate     = KEY_POOL_RATE_DEFAULT;
+    config->cluster_secret    = NULL;
+    config->cluster_secret_size = 0;
+    config->policy            = NULL;
+    config->handover          = NULL;
+}
+
+/*
+ * Read the cluster shared secret from a file.
+ */
+static bool read_cluster_secret(const char *filename,
+    struct cktp_listen_config_s *config)
+{
+    static uint8_t secret[CLUSTER_SECRET_MAX];
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        error("unable to open cluster secret file \"%s\"", filename);
+        return false;
+    }
+    size_t size = fread(secret, sizeof(uint8_t), sizeof(secret), file);
+    fclose(file);
+    if (size < CLUSTER_SECRET_MIN)
+    {
+        error("unable to read cluster secret file \"%s\"; expected at "
+            "least %d bytes", filename, CLUSTER_SECRET_MIN);
+        return false;
+    }
+    config->cluster_secret      = secret;
+    config->cluster_secret_size = size;
+    return true;
+}
+
+/*
+ * Remove servers.  Removing a URL served by a consolidated process restarts
+ * the process for the remaining URLs.
  */
 static int remove_servers(int argc, char **argv, int optind,
-    const uint32_t *addrs)
+    const uint32_t *addrs, char **saved)
 {
     server_entry_t table = server_table_read();
+    pid_t removed[MAX_URLS];
+    unsigned num_removed = 0;
 
     while (optind < argc)
     {
@@ -342,6 +1024,11 @@ static int remove_servers(int argc, char **argv, int optind,
         }
 
         pid_t pid = server_table_delete(&table, url);
+        bool seen = false;
+        for (unsigned i = 0; !seen && i < num_removed; i++)
+        {
+            seen = (removed[i] == pid);
+        }
         switch (pid)
         {
             case SERVER_DEAD:
@@ -352,22 +1039,101 @@ static int remove_servers(int argc, char **argv, int optind,
                 print_urls("REMOVE", COLOR_RED, url, server_name, addrs);
                 break;
             default: 
-                if (kill(pid, SIGTERM) == 0)
-                {
-                    print_urls("REMOVE", COLOR_RED, url, server_name, addrs);
-                }
-                else
+                print_urls("REMOVE", COLOR_RED, url, server_name, addrs);
+                if (!seen && num_removed < MAX_URLS)
                 {
-                    error("unable to remove server URL %s", url);
+                    removed[num_removed++] = pid;
                 }
                 break;
         }
     }
 
+    // Stop the servers, or replace consolidated servers with servers for
+    // their remaining URLs:
+    for (unsigned i = 0; i < num_removed; i++)
+    {
+        respawn_servers(table, removed[i], saved);
+    }
+
     server_table_write(table);
     return EXIT_SUCCESS;
 }
 
+/*
+ * Replace server process pid, some of whose URLs were removed from the
+ * server table, with a server for its remaining URLs (or stop it if there
+ * are none).  The new server takes over the old one's sockets, encoding
+ * state and options, so the remaining URLs' clients need not reconnect.
+ */
+static void respawn_servers(server_entry_t table, pid_t pid, char **saved)
+{
+    const char *urls[MAX_URLS];
+    unsigned num_urls = 0;
+    for (server_entry_t entry = table; entry != NULL; entry = entry->next)
+    {
+        if (entry->pid == pid && num_urls < MAX_URLS)
+        {
+            urls[num_urls++] = entry->url;
+        }
+    }
+    if (num_urls == 0)
+    {
+        if (kill(pid, SIGTERM) != 0)
+        {
+            error("unable to stop server with PID %u", (unsigned)pid);
+        }
+        delete_options(pid);
+        return;
+    }
+
+    char *options[NUM_OPTIONS];
+    for (unsigned i = 0; i < NUM_OPTIONS; i++)
+    {
+        options[i] = (saved[i] == NULL? NULL: strdup(saved[i]));
+    }
+    struct cktp_listen_config_s config;
+    pid_t new_pid = SERVER_SUSPENDED;
+    if (read_options(pid, options, &config))
+    {
+        new_pid = takeover_server(pid, urls, num_urls, &config);
+    }
+    if (new_pid == SERVER_DEAD)
+    {
+        // The old server did not hand over; restart the URLs afresh:
+        error("unable to hand over the remaining URLs of PID %u; "
+            "restarting them", (unsigned)pid);
+        kill(pid, SIGTERM);
+        for (unsigned i = 0; i < RESPAWN_WAIT && kill(pid, 0) == 0; i++)
+        {
+            usleep(10000);
+        }
+        new_pid = fork();
+        if (new_pid == 0)
+        {
+            // Child:
+            exit(start_servers(urls, num_urls, &config));
+        }
+    }
+    if (new_pid == (pid_t)-1 || new_pid == SERVER_SUSPENDED)
+    {
+        error("unable to start server for the remaining URLs of PID %u",
+            (unsigned)pid);
+        kill(pid, SIGTERM);
+        new_pid = SERVER_SUSPENDED;
+    }
+    else
+    {
+        write_options(new_pid, options);
+    }
+    delete_options(pid);
+    free_options(options);
+
+    for (server_entry_t entry = table; entry != NULL; entry = entry->next)
+    {
+        entry->pid = (entry->pid == pid? new_pid: entry->pid);
+    }
+}
+
 /*
  * Start servers on bootup.
  */
@@ -414,7 +1180,10 @@ static int init_start_servers(const uint32_t *addrs)
             char url[strlen(entry->url)+1];
             strcpy(url, entry->url);
             server_table_free(table);
-            return start_server(url, THREADS_DEFAULT);
+            struct cktp_listen_config_s config;
+            init_config(&config);
+            const char *urls[1] = {url};
+            return start_servers(urls, 1, &config);
         }
 
         // Parent:
@@ -451,12 +1220,71 @@ static int list_servers(const uint32_t *addrs)
     return EXIT_SUCCESS;
 }
 
+/*
+ * Print statistics for all running servers.
+ */
+static int stats_servers(const uint32_t *addrs)
+{
+    server_entry_t table = server_table_read();
+
+    server_entry_t entry = table;
+    while (entry != NULL)
+    {
+        // Check that the url is valid:
+        char server_name[CKTP_MAX_URL_LENGTH+1];
+        if (entry->pid == SERVER_DEAD || entry->pid == SERVER_SUSPENDED ||
+            !cktp_parse_url(entry->url, NULL, server_name, NULL, NULL))
+        {
+            entry = entry->next;
+            continue;
+        }
+
+        // A consolidated process serves several URLs; query it only once:
+        bool seen = false;
+        for (server_entry_t prev = table; !seen && prev != entry;
+                prev = prev->next)
+        {
+            seen = (prev->pid == entry->pid);
+        }
+        if (seen)
+        {
+            entry = entry->next;
+            continue;
+        }
+        for (server_entry_t same = entry; same != NULL; same = same->next)
+        {
+            if (same->pid == entry->pid &&
+                cktp_parse_url(same->url, NULL, server_name, NULL, NULL))
+            {
+                print_urls("STATS", COLOR_GREEN, same->url, server_name,
+                    addrs);
+            }
+        }
+        fflush(stdout);
+        char stats_path[STATS_SOCKET_MAX];
+        snprintf(stats_path, sizeof(stats_path), STATS_SOCKET_FORMAT,
+            (unsigned)entry->pid);
+        if (!stats_query(stats_path, fileno(stdout)))
+        {
+            error("unable to query statistics for server URL %s (PID %u)",
+                entry->url, (unsigned)entry->pid);
+        }
+        putchar('\n');
+        entry = entry->next;
+    }
+
+    server_table_free(table);
+    return EXIT_SUCCESS;
+}
+
 /*
  * Stop servers for shutdown.
  */
 static int init_stop_servers(const uint32_t *addrs)
 {
     server_entry_t table = server_table_read();
+    pid_t killed[MAX_URLS];
+    unsigned num_killed = 0;
     
     server_entry_t entry = table;
     while (entry != NULL)
@@ -471,10 +1299,21 @@ static int init_stop_servers(const uint32_t *addrs)
                 continue;
             }
 
-            if (kill(entry->pid, SIGTERM) == 0)
+            // A consolidated process serves several URLs; kill it once:
+            bool dead = false;
+            for (unsigned i = 0; !dead && i < num_killed; i++)
+            {
+                dead = (killed[i] == entry->pid);
+            }
+            if (dead || kill(entry->pid, SIGTERM) == 0)
             {
                 print_urls("STOP", COLOR_YELLOW, entry->url, server_name,
                     addrs);
+                if (!dead && num_killed < MAX_URLS)
+                {
+                    killed[num_killed++] = entry->pid;
+                    delete_options(entry->pid);
+                }
             }
             else
             {
@@ -500,16 +1339,77 @@ static void help(const char *progname)
     puts("\t\tAdd the tunnel URLs. [default]");
     puts("\t--remove");
     puts("\t\tRemove the tunnel URLs.");
+    puts("\t--reload");
+    puts("\t\tRestart the servers for the tunnel URLs (or all servers) "
+        "with this\n\t\tbinary and OPTIONS.  The new server takes over "
+        "the old server's\n\t\tsockets and keys, so clients stay "
+        "connected.  The number of\n\t\tthreads is kept.");
     puts("\t--list");
     puts("\t\tList all tunnel URLs.");
+    puts("\t--stats");
+    puts("\t\tPrint packet, error and handshake statistics for all "
+        "running\n\t\ttunnels.");
     puts("\t--init-start, --init-stop");
     puts("\t\tUndocumented.  [used by init.d interface]\n");
     puts("OPTIONS are:");
     puts("\t--help");
     puts("\t\tPrint this helpful message.");
     puts("\t--threads <number>");
-    printf("\t\tNumber of threads per server (default is %d).\n",
-        THREADS_DEFAULT);
+    printf("\t\tNumber of threads per server (default is %d, maximum is "
+        "%d).\n", THREADS_DEFAULT, THREADS_MAX);
+    puts("\t--cpu <number>");
+    puts("\t\tPin the threads of each server to consecutive CPUs starting "
+        "at\n\t\tthe given CPU, and steer packets to the thread on the "
+        "receiving\n\t\tCPU.  Use with one thread per NIC RSS queue.");
+    puts("\t--busy-poll <microseconds>");
+    puts("\t\tBusy poll the tunnel sockets for low latency (SO_BUSY_POLL).");
+    puts("\t--io-uring");
+    puts("\t\tUse the io_uring I/O engine (falls back to recvmmsg() if "
+        "io_uring\n\t\tis not available).");
+    puts("\t--tx-ring <interface>");
+    puts("\t\tForward packets routed via the given Ethernet interface "
+        "through a\n\t\tPACKET_MMAP TX ring instead of a raw socket.");
+    puts("\t--handshake-threads <number>");
+    printf("\t\tNumber of threads per server for expensive handshakes "
+        "(default is\n\t\t%d, maximum is %d).  0 handles handshakes on "
+        "the listen threads.\n", HANDSHAKE_THREADS_DEFAULT,
+        HANDSHAKE_THREADS_MAX);
+    puts("\t--handshake-queue <number>");
+    printf("\t\tMaximum queued handshakes per server (default is %d, "
+        "maximum is\n\t\t%d).  Further handshakes are dropped.\n",
+        HANDSHAKE_QUEUE_DEFAULT, HANDSHAKE_QUEUE_MAX);
+    puts("\t--cookie-rate <number>");
+    printf("\t\tMaximum cookie requests per second from each client "
+        "address\n\t\t(default is %d, maximum is %d).  0 is unlimited.\n",
+        COOKIE_RATE_DEFAULT, RATE_MAX);
+    puts("\t--key-rate <number>");
+    printf("\t\tMaximum key requests per second from each client address\n"
+        "\t\t(default is %d, maximum is %d).  0 is unlimited.\n",
+        KEY_RATE_DEFAULT, RATE_MAX);
+    puts("\t--key-pool <number>");
+    printf("\t\tNumber of key exchange key pairs to pre-compute for new "
+        "clients\n\t\t(default is %d, maximum is %d).  0 disables the "
+        "pool.\n", KEY_POOL_DEFAULT, KEY_POOL_MAX);
+    puts("\t--key-pool-rate <number>");
+    printf("\t\tMaximum key pairs per second computed to refill the "
+        "pool\n\t\t(default is %d, maximum is %d).\n",
+        KEY_POOL_RATE_DEFAULT, RATE_MAX);
+    puts("\t--cluster <file>");
+    puts("\t\tRun as one node of a cluster of servers for the same URL.  "
+        "All\n\t\tnodes must have the same keys file, the same secret "
+        "file (at\n\t\tleast 16 random bytes) and synchronized clocks.");
+    puts("\t--policy <file>");
+    puts("\t\tAdd the rules in <file> to the egress policy (which by "
+        "default\n\t\tallows TCP port 80 and UDP port 53 to public "
+        "addresses).  Each\n\t\tline is `allow <prefix> [tcp <ports>] "
+        "[udp <ports>] [rate <n>]'\n\t\tor `deny <prefix>'; the most "
+        "specific prefix wins.");
+    puts("\t--consolidate");
+    puts("\t\tServe all the added tunnel URLs from a single process.  "
+        "The URLs\n\t\tshare the listen threads (which wait on all "
+        "tunnel sockets with\n\t\tepoll) and the handshake threads.  "
+        "Removing one URL restarts the\n\t\tprocess (with the default "
+        "options) for the remaining URLs.");
     putchar('\n');
 }
 
@@ -0,0 +1,327 @@
+/*
+ * stats.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "thread.h"
+
+#define STATS_THREADS_MAX       128
+#define STATS_LINE_MAX          4096
+
+/*
+ * Per-thread stats.
+ */
+static struct stats_s stats_table[STATS_THREADS_MAX];
+static unsigned stats_threads = 0;
+__thread stats_t stats_local = NULL;
+
+static const char *stats_counter_names[STATS_COUNTERS] =
+{
+    "packets_recv",
+    "bytes_recv",
+    "packets_reply",
+    "bytes_reply",
+    "packets_forward",
+    "bytes_forward",
+    "packets_reflect",
+    "packets_invalid",
+    "decode_errors",
+    "crypt_bad_mac",
+    "crypt_bad_length",
+    "crypt_bad_cookie",
+    "crypt_dos",
+    "crypt_other_errors",
+    "handshakes_cookie",
+    "handshakes_certificate",
+    "handshakes_key",
+    "quota_rejects_cookie",
+    "quota_rejects_key",
+    "handshakes_queued",
+    "handshakes_dropped",
+    "shed_cookie",
+    "shed_certificate",
+    "shed_key",
+    "overload_raised",
+    "overload_level",
+    "policy_denied",
+    "policy_rate_capped",
+    "packets_bundle",
+    "hc_evicted",
+    "hc_miss"
+};
+
+static const char *stats_hist_names[STATS_HISTOGRAMS] =
+{
+    "key_service_us",
+    "handshake_queue_us"
+};
+
+/*
+ * Prototypes.
+ */
+static void *stats_server(void *ptr);
+static void stats_report(int fd);
+static void stats_printf(int fd, const char *message, ...);
+extern void error(const char *message, ...);
+
+/*
+ * Register the calling thread (once).
+ */
+void stats_register(const char *name)
+{
+    if (stats_local != NULL)
+    {
+        return;
+    }
+    unsigned idx = __sync_fetch_and_add(&stats_threads, 1);
+    if (idx >= STATS_THREADS_MAX)
+    {
+        return;     // Not counted.
+    }
+    stats_table[idx].name = name;
+    stats_local = stats_table + idx;
+}
+
+/*
+ * Monotonic time in microseconds.
+ */
+uint64_t stats_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Add a sample to a histogram of the calling thread.  Bucket i counts
+ * samples < 2^i us (and >= 2^(i-1) us).
+ */
+void stats_hist_add(unsigned hist, uint64_t usecs)
+{
+    stats_t stats = stats_local;
+    if (stats == NULL)
+    {
+        return;
+    }
+    unsigned bucket = (usecs == 0? 0: 64 - __builtin_clzll(usecs));
+    bucket = (bucket >= STATS_HIST_BUCKETS? STATS_HIST_BUCKETS-1: bucket);
+    stats->hists[hist][bucket]++;
+}
+
+/*
+ * Open the stats socket and serve reports from a background thread.  Must
+ * be called before dropping privileges; only root may query the socket.
+ */
+bool stats_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        error("unable to open stats socket \"%s\"; path is too long", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+    {
+        error("unable to create stats socket");
+        return false;
+    }
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        chmod(path, S_IRUSR | S_IWUSR) != 0 ||
+        listen(s, 8) != 0)
+    {
+        error("unable to open stats socket \"%s\"", path);
+        close(s);
+        return false;
+    }
+    thread_t thread;
+    if (thread_create(&thread, stats_server, (void *)(intptr_t)s) != 0)
+    {
+        error("unable to create stats thread");
+        close(s);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Query a server's stats socket and copy the report to fd.
+ */
+bool stats_query(const char *path, int fd)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+    {
+        return false;
+    }
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(s);
+        return false;
+    }
+    char buff[STATS_LINE_MAX];
+    ssize_t size;
+    while ((size = read(s, buff, sizeof(buff))) > 0)
+    {
+        if (write(fd, buff, size) != size)
+        {
+            break;
+        }
+    }
+    close(s);
+    return true;
+}
+
+/*
+ * Stats server thread: one report per connection.
+ */
+static void *stats_server(void *ptr)
+{
+    int s = (int)(intptr_t)ptr;
+    while (true)
+    {
+        int fd = accept(s, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+        stats_report(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Write a report of all threads' stats.  Counters are read without
+ * synchronisation, so a report is a (very slightly) fuzzy snapshot.
+ */
+static void stats_report(int fd)
+{
+    unsigned threads = stats_threads;
+    threads = (threads > STATS_THREADS_MAX? STATS_THREADS_MAX: threads);
+
+    stats_printf(fd, "threads %u:", threads);
+    for (unsigned i = 0; i < threads; i++)
+    {
+        const char *name = stats_table[i].name;
+        stats_printf(fd, " %s", (name == NULL? "?": name));
+    }
+    stats_printf(fd, "\n");
+
+    for (unsigned i = 0; i < STATS_COUNTERS; i++)
+    {
+        char line[STATS_LINE_MAX];
+        size_t pos = 0;
+        uint64_t total = 0;
+        for (unsigned j = 0; j < threads; j++)
+        {
+            uint64_t count = stats_table[j].counters[i];
+            total += count;
+            if (pos < sizeof(line))
+            {
+                pos += snprintf(line + pos, sizeof(line) - pos, " %llu",
+                    (unsigned long long)count);
+            }
+        }
+        line[sizeof(line)-1] = '\0';
+        stats_printf(fd, "%-24s %12llu  [%s ]\n", stats_counter_names[i],
+            (unsigned long long)total, line);
+    }
+
+    for (unsigned i = 0; i < STATS_HISTOGRAMS; i++)
+    {
+        uint64_t buckets[STATS_HIST_BUCKETS], total = 0;
+        for (unsigned k = 0; k < STATS_HIST_BUCKETS; k++)
+        {
+            buckets[k] = 0;
+            for (unsigned j = 0; j < threads; j++)
+            {
+                buckets[k] += stats_table[j].hists[i][k];
+            }
+            total += buckets[k];
+        }
+        stats_printf(fd, "%-24s %12llu ", stats_hist_names[i],
+            (unsigned long long)total);
+        const unsigned percentiles[] = {50, 90, 99};
+        for (unsigned p = 0; total != 0 && p < 3; p++)
+        {
+            uint64_t target = (total * percentiles[p] + 99) / 100, sum = 0;
+            unsigned k;
+            for (k = 0; k < STATS_HIST_BUCKETS-1; k++)
+            {
+                sum += buckets[k];
+                if (sum >= target)
+                {
+                    break;
+                }
+            }
+            stats_printf(fd, " p%u%s%lluus", percentiles[p],
+                (k == STATS_HIST_BUCKETS-1? ">=": "<"),
+                (k == STATS_HIST_BUCKETS-1? 1ull << (k-1): 1ull << k));
+        }
+        stats_printf(fd, "\n");
+        for (unsigned k = 0; k < STATS_HIST_BUCKETS; k++)
+        {
+            if (buckets[k] != 0)
+            {
+                stats_printf(fd, "    %s%-10llu %12llu\n",
+                    (k == STATS_HIST_BUCKETS-1? ">=": "<"),
+                    (k == STATS_HIST_BUCKETS-1? 1ull << (k-1): 1ull << k),
+                    (unsigned long long)buckets[k]);
+            }
+        }
+    }
+}
+
+/*
+ * Formatted write to a stats connection (never raises SIGPIPE).
+ */
+static void stats_printf(int fd, const char *message, ...)
+{
+    char buff[STATS_LINE_MAX];
+    va_list args;
+    va_start(args, message);
+    int size = vsnprintf(buff, sizeof(buff), message, args);
+    va_end(args);
+    if (size <= 0)
+    {
+        return;
+    }
+    size = (size >= (int)sizeof(buff)? (int)sizeof(buff)-1: size);
+    send(fd, buff, size, MSG_NOSIGNAL);
+}
@@ -0,0 +1,122 @@
+/*
+ * stats.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+/*
+ * Server statistics.  Every server thread owns a block of counters and
+ * histograms that only it writes (so no locks or atomics are needed); the
+ * blocks are summed when a report is requested over the stats socket.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters.
+ */
+#define STATS_PACKETS_RECV          0   // Packets received
+#define STATS_BYTES_RECV            1   // Bytes received
+#define STATS_PACKETS_REPLY         2   // Replies sent
+#define STATS_BYTES_REPLY           3   // Reply bytes sent
+#define STATS_PACKETS_FORWARD       4   // Packets forwarded
+#define STATS_BYTES_FORWARD         5   // Bytes forwarded
+#define STATS_PACKETS_REFLECT       6   // Reflect packets
+#define STATS_PACKETS_INVALID       7   // Invalid destination/protocol
+#define STATS_DECODE_ERROR          8   // Decoding errors (any encoding)
+#define STATS_CRYPT_BAD_MAC         9   // crypt: bad MAC
+#define STATS_CRYPT_BAD_LENGTH      10  // crypt: bad length
+#define STATS_CRYPT_BAD_COOKIE      11  // crypt: bad cookie
+#define STATS_CRYPT_DOS             12  // crypt: quota rejections
+#define STATS_CRYPT_OTHER           13  // crypt: other errors
+#define STATS_HANDSHAKE_COOKIE      14  // crypt: GET_COOKIE served
+#define STATS_HANDSHAKE_CERTIFICATE 15  // crypt: GET_CERTIFICATE served
+#define STATS_HANDSHAKE_KEY         16  // crypt: GET_KEY served
+#define STATS_QUOTA_COOKIE          17  // crypt: GET_COOKIE quota rejections
+#define STATS_QUOTA_KEY             18  // crypt: GET_KEY quota rejections
+#define STATS_HANDSHAKE_QUEUED      19  // Handshakes queued for workers
+#define STATS_HANDSHAKE_DROPPED     20  // Handshakes dropped (queue full)
+#define STATS_SHED_COOKIE           21  // crypt: GET_COOKIE shed (overload)
+#define STATS_SHED_CERTIFICATE      22  // crypt: GET_CERTIFICATE shed
+#define STATS_SHED_KEY              23  // crypt: GET_KEY shed
+#define STATS_OVERLOAD_RAISED       24  // Overload level increases
+#define STATS_OVERLOAD_LEVEL        25  // Current overload level (gauge)
+#define STATS_POLICY_DENIED         26  // Egress policy: denied
+#define STATS_POLICY_RATE           27  // Egress policy: rate capped
+#define STATS_PACKETS_BUNDLE        28  // Bundles received
+#define STATS_HC_EVICTED            29  // hc: contexts evicted
+#define STATS_HC_MISS               30  // hc: context misses
+#define STATS_COUNTERS              31
+
+/*
+ * Histograms (microseconds, power-of-2 buckets).
+ */
+#define STATS_HIST_KEY              0   // GET_KEY service time
+#define STATS_HIST_QUEUE            1   // Handshake queue wait time
+#define STATS_HISTOGRAMS            2
+#define STATS_HIST_BUCKETS          24  // <1us, <2us, ..., >=4s
+
+struct stats_s
+{
+    const char *name;                               // Thread role
+    uint64_t counters[STATS_COUNTERS];
+    uint64_t hists[STATS_HISTOGRAMS][STATS_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+typedef struct stats_s *stats_t;
+
+/*
+ * The calling thread's stats (NULL if the thread is not registered).
+ */
+extern __thread stats_t stats_local;
+
+/*
+ * Prototypes.
+ */
+void stats_register(const char *name);
+uint64_t stats_time(void);
+void stats_hist_add(unsigned hist, uint64_t usecs);
+bool stats_listen(const char *path);
+bool stats_query(const char *path, int fd);
+
+/*
+ * Add to a counter of the calling thread.
+ */
+static inline void stats_add(unsigned counter, uint64_t n)
+{
+    stats_t stats = stats_local;
+    if (stats != NULL)
+    {
+        stats->counters[counter] += n;
+    }
+}
+
+/*
+ * Set a (gauge) counter of the calling thread.
+ */
+static inline void stats_set(unsigned counter, uint64_t n)
+{
+    stats_t stats = stats_local;
+    if (stats != NULL)
+    {
+        stats->counters[counter] = n;
+    }
+}
+
+#endif      /* __STATS_H */
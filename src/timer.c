@@ -0,0 +1,280 @@
+/*
+ * timer.c
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cfg.h"
+#include "log.h"
+#include "misc.h"
+#include "thread.h"
+#include "timer.h"
+
+/*
+ * Timers are kept in a hierarchical timing wheel: TIMER_LEVELS wheels of
+ * TIMER_SLOTS slots each, where a slot at level L spans TIMER_SLOTS^L ticks.
+ * Starting or cancelling a timer is O(1).  As time passes, the slot of each
+ * higher level wheel that has come due is cascaded (re-inserted) into the
+ * lower levels, until the timer reaches level 0 and expires at the exact
+ * tick.  Timers beyond the wheel's range are parked in the top level and
+ * re-cascaded until they come within range.
+ *
+ * The service thread sleeps until the next tick at which something happens
+ * (an expiry or a cascade), so an idle wheel costs nothing.
+ */
+#define TIMER_TICK              (1*MILLISECONDS)
+#define TIMER_BITS              6
+#define TIMER_SLOTS             (1 << TIMER_BITS)
+#define TIMER_MASK              (TIMER_SLOTS - 1)
+#define TIMER_LEVELS            4
+#define TIMER_RANGE             ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS))
+#define TIMER_NEVER             UINT64_MAX
+
+static mutex_t timer_lock;
+static cond_t timer_cond;
+static struct timer_s *timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t timer_tick = 0;             // Last processed tick
+static uint64_t timer_wake = 0;             // Tick the service thread awaits
+
+/*
+ * Prototypes.
+ */
+static uint64_t timer_now(void);
+static void timer_insert(struct timer_s *timer);
+static void timer_remove(struct timer_s *timer);
+static uint64_t timer_next(void);
+static void timer_cascade(unsigned level);
+static void *timer_manager(void *unused);
+
+/*
+ * Initialise the timer service.
+ */
+void timer_init(void)
+{
+    if (thread_lock_init(&timer_lock) != 0 ||
+        thread_cond_init(&timer_cond) != 0)
+    {
+        error("unable to initialise timer lock");
+        exit(EXIT_FAILURE);
+    }
+    timer_tick = timer_now();
+    thread_t thread;
+    if (thread_create(&thread, timer_manager, NULL) != 0)
+    {
+        error("unable to create timer thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Start (or restart) a timer to call func(arg) after (at least) the given
+ * number of microseconds.
+ */
+void timer_start(struct timer_s *timer, uint64_t delay, timer_func_t func,
+    void *arg)
+{
+    uint64_t ticks = (delay + TIMER_TICK - 1) / TIMER_TICK;
+    thread_lock(&timer_lock);
+    if (timer->pprev != NULL)
+    {
+        timer_remove(timer);
+    }
+    timer->func   = func;
+    timer->arg    = arg;
+    timer->expiry = timer_now() + ticks + 1;    // Round up partial tick
+    timer_insert(timer);
+    if (timer->expiry < timer_wake)
+    {
+        thread_cond_signal(&timer_cond);
+    }
+    thread_unlock(&timer_lock);
+}
+
+/*
+ * Cancel a timer (if pending).  Note that the callback may already be
+ * running on the service thread.
+ */
+void timer_cancel(struct timer_s *timer)
+{
+    thread_lock(&timer_lock);
+    if (timer->pprev != NULL)
+    {
+        timer_remove(timer);
+    }
+    thread_unlock(&timer_lock);
+}
+
+/*
+ * Test whether a timer is pending.
+ */
+bool timer_pending(struct timer_s *timer)
+{
+    thread_lock(&timer_lock);
+    bool result = (timer->pprev != NULL);
+    thread_unlock(&timer_lock);
+    return result;
+}
+
+/*
+ * The current time in ticks.
+ */
+static uint64_t timer_now(void)
+{
+    return gettime_monotonic() / TIMER_TICK;
+}
+
+/*
+ * Insert a timer into the slot for its expiry (relative to timer_tick).
+ */
+static void timer_insert(struct timer_s *timer)
+{
+    uint64_t expiry = timer->expiry;
+    uint64_t delta = (expiry > timer_tick? expiry - timer_tick: 0);
+    if (delta >= TIMER_RANGE)
+    {
+        expiry = timer_tick + TIMER_RANGE - 1;
+        delta  = TIMER_RANGE - 1;
+    }
+    unsigned level = 0;
+    while (level < TIMER_LEVELS - 1 &&
+            delta >= ((uint64_t)1 << (TIMER_BITS * (level + 1))))
+    {
+        level++;
+    }
+    size_t idx = (size_t)((expiry >> (TIMER_BITS * level)) & TIMER_MASK);
+    struct timer_s **slot = &timer_wheel[level][idx];
+    timer->next = *slot;
+    if (*slot != NULL)
+    {
+        (*slot)->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/*
+ * Remove a pending timer from the wheel.
+ */
+static void timer_remove(struct timer_s *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next  = NULL;
+    timer->pprev = NULL;
+}
+
+/*
+ * Find the next tick (after timer_tick) at which a timer expires or a slot
+ * must be cascaded.  Returns TIMER_NEVER if the wheel is empty.
+ */
+static uint64_t timer_next(void)
+{
+    uint64_t next = TIMER_NEVER;
+    for (unsigned level = 0; level < TIMER_LEVELS; level++)
+    {
+        unsigned shift = TIMER_BITS * level;
+        uint64_t base = timer_tick >> shift;
+        for (uint64_t i = 1; i <= TIMER_SLOTS; i++)
+        {
+            if (timer_wheel[level][(base + i) & TIMER_MASK] != NULL)
+            {
+                uint64_t tick = (base + i) << shift;
+                next = (tick < next? tick: next);
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+/*
+ * Re-insert the timers of the current slot of the given level, moving them
+ * to lower levels.
+ */
+static void timer_cascade(unsigned level)
+{
+    size_t idx = (size_t)((timer_tick >> (TIMER_BITS * level)) & TIMER_MASK);
+    struct timer_s *timer = timer_wheel[level][idx];
+    timer_wheel[level][idx] = NULL;
+    while (timer != NULL)
+    {
+        struct timer_s *next = timer->next;
+        timer_insert(timer);
+        timer = next;
+    }
+}
+
+/*
+ * Timer service thread.
+ */
+static void *timer_manager(void *unused)
+{
+    thread_lock(&timer_lock);
+    while (true)
+    {
+        uint64_t now = timer_now();
+        uint64_t next = timer_next();
+        if (next > now)
+        {
+            // Nothing to do until `next' (no slot is skipped):
+            timer_tick = (now > timer_tick? now: timer_tick);
+            timer_wake = next;
+            if (next == TIMER_NEVER)
+            {
+                thread_cond_wait(&timer_cond, &timer_lock);
+            }
+            else
+            {
+                thread_cond_timedwait(&timer_cond, &timer_lock,
+                    (next - now) * TIMER_TICK);
+            }
+            timer_wake = 0;
+            continue;
+        }
+
+        timer_tick = next;
+        for (unsigned level = TIMER_LEVELS - 1; level > 0; level--)
+        {
+            uint64_t mask = ((uint64_t)1 << (TIMER_BITS * level)) - 1;
+            if ((timer_tick & mask) == 0)
+            {
+                timer_cascade(level);
+            }
+        }
+
+        // Run expired timers.  The lock is released for each callback, so
+        // callbacks may start or cancel timers (including their own).
+        struct timer_s **slot = &timer_wheel[0][timer_tick & TIMER_MASK];
+        while (*slot != NULL)
+        {
+            struct timer_s *timer = *slot;
+            timer_remove(timer);
+            timer_func_t func = timer->func;
+            void *arg = timer->arg;
+            thread_unlock(&timer_lock);
+            func(arg);
+            thread_lock(&timer_lock);
+        }
+    }
+
+    return NULL;
+}
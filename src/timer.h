@@ -0,0 +1,53 @@
+/*
+ * timer.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TIMER_H
+#define __TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * One-shot timers, run by a single timer service thread.  A timer is owned
+ * (and usually embedded) by the caller and must stay valid while pending.
+ * Callbacks run on the service thread, so they must not block; anything
+ * slow should be handed off to another thread.
+ */
+typedef void (*timer_func_t)(void *arg);
+
+struct timer_s
+{
+    struct timer_s  *next;              // Next timer in slot
+    struct timer_s **pprev;             // Previous link (NULL = not pending)
+    uint64_t         expiry;            // Expiry (in ticks)
+    timer_func_t     func;              // Callback
+    void            *arg;               // Callback argument
+};
+
+#define TIMER_INIT          {NULL, NULL, 0, NULL, NULL}
+
+/*
+ * Prototypes.
+ */
+void timer_init(void);
+void timer_start(struct timer_s *timer, uint64_t delay, timer_func_t func,
+    void *arg);
+void timer_cancel(struct timer_s *timer);
+bool timer_pending(struct timer_s *timer);
+
+#endif      /* __TIMER_H */
@@ -17,6 +17,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +32,7 @@
 #include "random.h"
 #include "socket.h"
 #include "thread.h"
+#include "timer.h"
 #include "tunnel.h"
 
 #define TUNNELS_BAK_FILENAME        TUNNELS_FILENAME ".bak"
@@ -51,6 +53,8 @@ typedef uint8_t state_t;
 
 #define TUNNEL_NO_TIMEOUT           0
 
+#define TUNNEL_FLUSH_INTERVAL       (2*MILLISECONDS)    // Bundle window
+
 struct tunnel_s
 {
     cktp_tunnel_t    tunnel;            // Underlying CKTP tunnel
@@ -59,7 +63,18 @@ struct tunnel_s
     uint16_t         id;                // Tunnel's ID
     uint8_t          age;               // Tunnel's age
     double           weight;            // Tunnel's weight
-    char             url[CKTP_MAX_URL_LENGTH+1];
+    const char      *url;               // Tunnel's URL (interned)
+};
+
+/*
+ * An interned tunnel URL.  All instances of a tunnel (e.g. reconnected ones)
+ * share the same reference counted copy of the URL.
+ */
+struct tunnel_url_s
+{
+    struct tunnel_url_s *next;          // Next URL
+    unsigned             refs;          // Reference count
+    char                 url[];         // The URL
 };
 
 /*
@@ -93,30 +108,63 @@ static mutex_t tunnels_lock;
 static struct tunnel_set_s tunnels_cache = TUNNEL_SET_INIT;
 static struct tunnel_set_s tunnels_active = TUNNEL_SET_INIT;
 static random_state_t rng = NULL;
+static volatile unsigned tunnels_version = 0;
+
+/*
+ * Interned URLs.
+ */
+static mutex_t tunnel_urls_lock;
+static struct tunnel_url_s *tunnel_urls = NULL;
+
+/*
+ * Tunnel management timers.  tunnel_flush_armed is protected by
+ * tunnels_lock.
+ */
+static struct timer_s tunnel_activate_timer = TIMER_INIT;
+static struct timer_s tunnel_reconnect_timer = TIMER_INIT;
+static struct timer_s tunnel_flush_timer = TIMER_INIT;
+static bool tunnel_flush_armed = false;
 
 /*
  * Prototypes.
  */
-static bool tunnel_html(http_buffer_t buff, tunnel_set_t tunnel_set);
+static bool tunnel_html(const struct http_user_vars_s *query,
+    http_buffer_t buff, tunnel_set_t tunnel_set);
 static void tunnel_set_insert(tunnel_set_t tunnel_set, tunnel_t tunnel);
 static tunnel_t tunnel_set_replace(tunnel_set_t tunnel_set, tunnel_t tunnel);
 static tunnel_t tunnel_set_delete(tunnel_set_t tunnel_set, const char *url);
 static int tunnel_set_lookup(tunnel_set_t tunnel_set, const char *url);
+static const char *tunnel_url_intern(const char *url);
+static void tunnel_url_release(const char *url);
 static tunnel_t tunnel_create(const char *url, uint8_t age);
 static void tunnel_free(tunnel_t tunnel);
-static void *tunnel_activate_manager(void *unused);
+static void tunnel_activate_manager(void *unused);
 static void *tunnel_activate(void *tunnel_ptr);
 static bool tunnel_try_activate(tunnel_t tunnel);
 static tunnel_t tunnel_get(uint64_t hash, unsigned repeat);
-static void *tunnel_reconnect_manager(void *unused);
+static void tunnel_reconnect_manager(void *unused);
+static void tunnel_reconnect_schedule(uint64_t currtime);
 static void *tunnel_reconnect(void *tunnel_ptr);
+static void tunnel_flush_manager(void *unused);
 
 /*
- * Print all tunnels as HTML.
+ * Print all tunnels as HTML.  A long-poll request (with a HTTP_POLL_VAR query
+ * variable) waits for the tunnel sets to change, and is answered with the
+ * new version number first.
  */
-static bool tunnel_html(http_buffer_t buff, tunnel_set_t tunnel_set)
+static bool tunnel_html(const struct http_user_vars_s *query,
+    http_buffer_t buff, tunnel_set_t tunnel_set)
 {
+    unsigned since;
+    bool poll = http_poll(query, &tunnels_version, &since);
     thread_lock(&tunnels_lock);
+    if (poll)
+    {
+        char version_buff[32];
+        snprintf(version_buff, sizeof(version_buff), "<!-- seq %u -->\n",
+            tunnels_version);
+        http_buffer_puts(buff, version_buff);
+    }
     for (size_t i = 0; i < tunnel_set->length; i++)
     {
         http_buffer_puts(buff, "<option value=\"");
@@ -132,17 +180,61 @@ static bool tunnel_html(http_buffer_t buff, tunnel_set_t tunnel_set)
 /*
  * Print active tunnels as HTML.
  */
-bool tunnel_active_html(http_buffer_t buff)
+bool tunnel_active_html(const struct http_user_vars_s *query,
+    http_buffer_t buff)
 {
-    return tunnel_html(buff, &tunnels_active);
+    return tunnel_html(query, buff, &tunnels_active);
 }
 
 /*
  * Print all tunnels as HTML.
  */
-bool tunnel_all_html(http_buffer_t buff)
+bool tunnel_all_html(const struct http_user_vars_s *query,
+    http_buffer_t buff)
 {
-    return tunnel_html(buff, &tunnels_cache);
+    return tunnel_html(query, buff, &tunnels_cache);
+}
+
+/*
+ * Report the memory used by tunnels and by interned tunnel URLs.
+ */
+void tunnel_memory(size_t *num_tunnels, size_t *tunnel_bytes,
+    size_t *num_urls, size_t *url_bytes)
+{
+    *num_tunnels = 0;
+    *tunnel_bytes = 0;
+    thread_lock(&tunnels_lock);
+    tunnel_set_t tunnel_sets[] = {&tunnels_cache, &tunnels_active};
+    for (size_t i = 0; i < sizeof(tunnel_sets) / sizeof(tunnel_set_t); i++)
+    {
+        tunnel_set_t tunnel_set = tunnel_sets[i];
+        *tunnel_bytes += tunnel_set->size * sizeof(tunnel_t);
+        for (size_t j = 0; j < tunnel_set->length; j++)
+        {
+            tunnel_t tunnel = tunnel_set->tunnels[j];
+            int idx = (i == 0? -1:
+                tunnel_set_lookup(&tunnels_cache, tunnel->url));
+            if (idx >= 0 && tunnels_cache.tunnels[idx] == tunnel)
+            {
+                continue;       // Already counted.
+            }
+            (*num_tunnels)++;
+            *tunnel_bytes += sizeof(struct tunnel_s) +
+                cktp_tunnel_memory(tunnel->tunnel);
+        }
+    }
+    thread_unlock(&tunnels_lock);
+
+    *num_urls = 0;
+    *url_bytes = 0;
+    thread_lock(&tunnel_urls_lock);
+    for (struct tunnel_url_s *entry = tunnel_urls; entry != NULL;
+         entry = entry->next)
+    {
+        (*num_urls)++;
+        *url_bytes += sizeof(struct tunnel_url_s) + strlen(entry->url) + 1;
+    }
+    thread_unlock(&tunnel_urls_lock);
 }
 
 /*
@@ -164,6 +256,8 @@ static void tunnel_set_insert(tunnel_set_t tunnel_set, tunnel_t tunnel)
         }
     }
     tunnel_set->tunnels[tunnel_set->length++] = tunnel;
+    tunnels_version++;
+    http_poll_notify();
 }
 
 /*
@@ -199,6 +293,8 @@ static tunnel_t tunnel_set_delete(tunnel_set_t tunnel_set, const char *url)
                 tunnel_set->tunnels[i] = tunnel_set->tunnels[i+1];
             }
             tunnel_set->length--;
+            tunnels_version++;
+            http_poll_notify();
             return tunnel;
         }
     }
@@ -226,6 +322,7 @@ static int tunnel_set_lookup(tunnel_set_t tunnel_set, const char *url)
 void tunnel_init(void)
 {
     thread_lock_init(&tunnels_lock);
+    thread_lock_init(&tunnel_urls_lock);
     rng = random_init();
     http_register_callback("tunnels-active.html", tunnel_active_html);
     http_register_callback("tunnels-all.html", tunnel_all_html);
@@ -366,6 +463,66 @@ void tunnel_file_write(void)
     thread_unlock(&tunnels_lock);
 }
 
+/*
+ * Intern a URL.  Returns the shared copy (with an extra reference).
+ */
+static const char *tunnel_url_intern(const char *url)
+{
+    thread_lock(&tunnel_urls_lock);
+    struct tunnel_url_s *entry;
+    for (entry = tunnel_urls; entry != NULL; entry = entry->next)
+    {
+        if (entry->url == url || strcmp(entry->url, url) == 0)
+        {
+            break;
+        }
+    }
+    if (entry == NULL)
+    {
+        size_t url_len = strnlen(url, CKTP_MAX_URL_LENGTH);
+        size_t alloc_size = sizeof(struct tunnel_url_s) + url_len + 1;
+        entry = (struct tunnel_url_s *)malloc(alloc_size);
+        if (entry == NULL)
+        {
+            error("unable to allocate " SIZE_T_FMT " bytes for tunnel URL",
+                alloc_size);
+        }
+        entry->refs = 0;
+        memmove(entry->url, url, url_len);
+        entry->url[url_len] = '\0';
+        entry->next = tunnel_urls;
+        tunnel_urls = entry;
+    }
+    entry->refs++;
+    thread_unlock(&tunnel_urls_lock);
+    return entry->url;
+}
+
+/*
+ * Release a reference to an interned URL.
+ */
+static void tunnel_url_release(const char *url)
+{
+    thread_lock(&tunnel_urls_lock);
+    struct tunnel_url_s **prev = &tunnel_urls;
+    for (struct tunnel_url_s *entry = tunnel_urls; entry != NULL;
+         entry = entry->next)
+    {
+        if (entry->url == url)
+        {
+            entry->refs--;
+            if (entry->refs == 0)
+            {
+                *prev = entry->next;
+                free(entry);
+            }
+            break;
+        }
+        prev = &entry->next;
+    }
+    thread_unlock(&tunnel_urls_lock);
+}
+
 /*
  * Initialise a tunnel.
  */
@@ -385,8 +542,7 @@ static tunnel_t tunnel_create(const char *url, uint8_t age)
     tunnel->reconnect = false;
     tunnel->id        = id++;
     tunnel->weight    = 1.0;
-    strncpy(tunnel->url, url, CKTP_MAX_URL_LENGTH);
-    tunnel->url[CKTP_MAX_URL_LENGTH] = '\0';
+    tunnel->url       = tunnel_url_intern(url);
     return tunnel;
 }
 
@@ -406,6 +562,7 @@ static void tunnel_free(tunnel_t tunnel)
                 break;
             default:
                 cktp_close_tunnel(tunnel->tunnel);
+                tunnel_url_release(tunnel->url);
                 free(tunnel);
         }
     }
@@ -416,10 +573,7 @@ static void tunnel_free(tunnel_t tunnel)
  */
 void tunnel_open(void)
 {
-    thread_t thread1;
-    thread_create(&thread1, tunnel_activate_manager, NULL);
-    thread_t thread2;
-    thread_create(&thread2, tunnel_reconnect_manager, NULL);
+    timer_start(&tunnel_activate_timer, 0, tunnel_activate_manager, NULL);
 }
 
 /*
@@ -434,42 +588,43 @@ bool tunnel_ready(void)
 }
 
 /*
- * Tunnel activator thread.
+ * Tunnel activator (timer callback).  Runs until enough tunnels are open.
  */
 #define MAX_INIT_OPEN               8
-static void *tunnel_activate_manager(void *unused)
+static void tunnel_activate_manager(void *unused)
 {
-    do
+    // Attempt to open new tunnels.
+    thread_lock(&tunnels_lock);
+    if (tunnels_active.length >= MAX_INIT_OPEN)
     {
-        // Attempt to open new tunnels.
-        thread_lock(&tunnels_lock);
-        size_t max = MAX_INIT_OPEN - tunnels_active.length + 1;
-        size_t j = 0;
-        for (size_t i = 0; j < max && i < tunnels_cache.length; i++)
-        {
-            tunnel_t tunnel = tunnels_cache.tunnels[i];
-            if (tunnel->state == TUNNEL_STATE_CLOSED)
-            {
-                j++;
-                tunnel->state = TUNNEL_STATE_OPENING;
-                thread_t thread;
-                thread_create(&thread, tunnel_activate, (void *)tunnel);
-            }
-        }
-        uint64_t stagger = random_uint64(rng);
         thread_unlock(&tunnels_lock);
-
-        if (j == max)
+        return;
+    }
+    size_t max = MAX_INIT_OPEN - tunnels_active.length + 1;
+    size_t j = 0;
+    for (size_t i = 0; j < max && i < tunnels_cache.length; i++)
+    {
+        tunnel_t tunnel = tunnels_cache.tunnels[i];
+        if (tunnel->state == TUNNEL_STATE_CLOSED)
         {
-            break;
+            j++;
+            tunnel->state = TUNNEL_STATE_OPENING;
+            thread_t thread;
+            thread_create(&thread, tunnel_activate, (void *)tunnel);
         }
+    }
+    uint64_t stagger = random_uint64(rng);
+    thread_unlock(&tunnels_lock);
 
-        // Wait for some tunnels to open:
-        sleeptime(150*SECONDS + (stagger % 10000) * MILLISECONDS);
+    if (j == max)
+    {
+        return;
     }
-    while (tunnels_active.length < MAX_INIT_OPEN);
 
-    return NULL;
+    // Wait for some tunnels to open:
+    timer_start(&tunnel_activate_timer,
+        150*SECONDS + (stagger % 10000) * MILLISECONDS,
+        tunnel_activate_manager, NULL);
 }
 
 /*
@@ -499,6 +654,7 @@ static void *tunnel_activate(void *tunnel_ptr)
                 tunnel->state = TUNNEL_STATE_OPEN;
                 tunnel->age   = TUNNEL_INIT_AGE;
                 tunnel_set_insert(&tunnels_active, tunnel);
+                tunnel_reconnect_schedule(gettime());
             }
             else
             {
@@ -599,6 +755,14 @@ bool tunnel_packets(uint8_t *packet, uint8_t **packets, uint64_t hash,
         cktp_tunnel_packet(tunnel->tunnel, packets[i]);
     }
 
+    // Small packets may be held back in a bundle; make sure it is flushed:
+    if (!tunnel_flush_armed)
+    {
+        tunnel_flush_armed = true;
+        timer_start(&tunnel_flush_timer, TUNNEL_FLUSH_INTERVAL,
+            tunnel_flush_manager, NULL);
+    }
+
     thread_unlock(&tunnels_lock);
     return true;
 }
@@ -764,40 +928,72 @@ void tunnel_delete(const char *url)
 }
 
 /*
- * Reconnection manager.
+ * Reconnection manager (timer callback).  Fires when the earliest active
+ * tunnel times out.
  */
-static void *tunnel_reconnect_manager(void *unused)
+static void tunnel_reconnect_manager(void *unused)
 {
-    // This is the simplest possible algorithm: continiously poll each tunnel
-    // to see if it needs to reconnect.  We could implement something more
-    // sophisticated here -- however that's a lot of implementation effort for
-    // almost no benefit.  This loop will consume very little CPU time.
-    while (true)
+    thread_lock(&tunnels_lock);
+    uint64_t currtime = gettime();
+    for (size_t i = 0; i < tunnels_active.length; i++)
     {
-        thread_lock(&tunnels_lock);
-        uint64_t stagger = (random_uint32(rng) % 1000) * MILLISECONDS;
-        thread_unlock(&tunnels_lock);
-        sleeptime(1*SECONDS + stagger);
-        thread_lock(&tunnels_lock);
-        uint64_t currtime = gettime();
-        for (size_t i = 0; i < tunnels_active.length; i++)
-        {
-            tunnel_t tunnel = tunnels_active.tunnels[i];
-            
-            // tunnel->reconnect ensures we only try to reconnect once.
-            if (!tunnel->reconnect &&
-                cktp_tunnel_timeout(tunnel->tunnel, currtime))
-            {
-                tunnel->reconnect = true;
-                char *url = strdup(tunnel->url);
-                thread_t thread;
-                thread_create(&thread, tunnel_reconnect, (void *)url); 
-            }
+        tunnel_t tunnel = tunnels_active.tunnels[i];
+
+        // tunnel->reconnect ensures we only try to reconnect once.
+        if (!tunnel->reconnect &&
+            cktp_tunnel_deadline(tunnel->tunnel) <= currtime)
+        {
+            tunnel->reconnect = true;
+            const char *url = tunnel_url_intern(tunnel->url);
+            thread_t thread;
+            thread_create(&thread, tunnel_reconnect, (void *)url);
         }
-        thread_unlock(&tunnels_lock);
     }
+    tunnel_reconnect_schedule(currtime);
+    thread_unlock(&tunnels_lock);
+}
 
-    return NULL;
+/*
+ * (Re)arm the reconnection timer for the earliest active tunnel timeout.
+ * Assumes tunnels_lock is held.
+ */
+static void tunnel_reconnect_schedule(uint64_t currtime)
+{
+    uint64_t deadline = UINT64_MAX;
+    for (size_t i = 0; i < tunnels_active.length; i++)
+    {
+        tunnel_t tunnel = tunnels_active.tunnels[i];
+        if (!tunnel->reconnect)
+        {
+            uint64_t tunnel_deadline = cktp_tunnel_deadline(tunnel->tunnel);
+            deadline = (tunnel_deadline < deadline? tunnel_deadline:
+                deadline);
+        }
+    }
+    if (deadline == UINT64_MAX)
+    {
+        timer_cancel(&tunnel_reconnect_timer);
+        return;
+    }
+    timer_start(&tunnel_reconnect_timer,
+        (deadline > currtime? deadline - currtime: 0),
+        tunnel_reconnect_manager, NULL);
+}
+
+/*
+ * Bundle flush manager (timer callback).  Small tunneled packets are held
+ * back (bundled) for at most TUNNEL_FLUSH_INTERVAL in the hope that more
+ * will follow.
+ */
+static void tunnel_flush_manager(void *unused)
+{
+    thread_lock(&tunnels_lock);
+    tunnel_flush_armed = false;
+    for (size_t i = 0; i < tunnels_active.length; i++)
+    {
+        cktp_tunnel_flush(tunnels_active.tunnels[i]->tunnel);
+    }
+    thread_unlock(&tunnels_lock);
 }
 
 /*
@@ -809,9 +1005,9 @@ static void *tunnel_reconnect(void *url_ptr)
     // creating a completely new tunnel instance, and then replacing the
     // old instance.
 
-    char *url = (char *)url_ptr;
+    const char *url = (const char *)url_ptr;
     tunnel_t tunnel = tunnel_create(url, TUNNEL_INIT_AGE);
-    free(url);
+    tunnel_url_release(url);
 
     tunnel->state = TUNNEL_STATE_OPENING;
     bool result = tunnel_try_activate(tunnel);
@@ -826,6 +1022,7 @@ static void *tunnel_reconnect(void *url_ptr)
         {
             found = true;
             tunnel_free(replaced_active);
+            tunnel_reconnect_schedule(gettime());
         }
         else if (replaced_cache != NULL)
         {
@@ -855,7 +1052,8 @@ static void *tunnel_reconnect(void *url_ptr)
         // Failure, we could not (re)open the tunnel.  We assume the tunnel
         // is now dead, so deactivate it here.
         thread_lock(&tunnels_lock);
-        tunnel_t old_tunnel = tunnel_set_delete(&tunnels_active, url);
+        tunnel_t old_tunnel = tunnel_set_delete(&tunnels_active,
+            tunnel->url);
         if (old_tunnel != NULL)
         {
             cktp_close_tunnel(tunnel->tunnel);
@@ -20,6 +20,7 @@
 #define __TUNNEL_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "cfg.h"
@@ -39,8 +40,12 @@ bool tunnel_ready(void);
 void tunnel_open(void);
 bool tunnel_packets(uint8_t *packet, uint8_t **packets, uint64_t hash,
     unsigned repeat, uint16_t config_mtu);
-bool tunnel_active_html(http_buffer_t buff);
-bool tunnel_all_html(http_buffer_t buff);
+bool tunnel_active_html(const struct http_user_vars_s *query,
+    http_buffer_t buff);
+bool tunnel_all_html(const struct http_user_vars_s *query,
+    http_buffer_t buff);
+void tunnel_memory(size_t *num_tunnels, size_t *tunnel_bytes,
+    size_t *num_urls, size_t *url_bytes);
 void tunnel_add(const char *url);
 void tunnel_delete(const char *url);
 
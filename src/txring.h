@@ -0,0 +1,42 @@
+/*
+ * txring.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TXRING_H
+#define __TXRING_H
+
+/*
+ * PACKET_MMAP (TPACKET_V2) transmit ring for forwarding IPv4 packets
+ * directly out of an Ethernet interface (Linux only).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct txring_s *txring_t;
+
+/*
+ * Prototypes.
+ */
+txring_t txring_open(const char *ifname);
+void txring_close(txring_t ring);
+bool txring_send(txring_t ring, const uint8_t *packet, size_t size,
+    uint32_t daddr);
+void txring_flush(txring_t ring);
+
+#endif      /* __TXRING_H */
@@ -45,25 +45,46 @@ if (request == null)
     alert("unable to create request object");
 }
 
+var log_seq = 0;
+var log_max = 65536;
+
 function getLog()
 {
-    url = "log-entry.txt";
+    url = "log-entry.txt?seq=" + log_seq;
     request.open("GET", url, true);
     request.onreadystatechange = updateLog;
     request.send(null);
-    setTimeout("getLog()", 500);
 }
 
 function updateLog()
 {
-    if (request.readyState == 4 && request.status == 200)
+    if (request.readyState != 4)
+    {
+        return;
+    }
+    if (request.status != 200)
+    {
+        setTimeout("getLog()", 500);
+        return;
+    }
+    text = request.responseText;
+    match = /^<!-- seq (\d+) -->\n/.exec(text);
+    if (match)
+    {
+        log_seq = match[1];
+        text = text.substring(match[0].length);
+    }
+    log_div = document.getElementById("log");
+    if (log_div && text != "")
     {
-        log_div = document.getElementById("log");
-        if (log_div)
+        html = log_div.innerHTML + text;
+        if (html.length > log_max)
         {
-            log_div.innerHTML = request.responseText;
-            window.scrollBy(0, 9999999);
+            cut = html.indexOf("<br>", html.length - log_max);
+            html = html.substring(cut < 0? 0: cut + 4);
         }
+        log_div.innerHTML = html;
+        window.scrollBy(0, 9999999);
     }
+    setTimeout("getLog()", 0);
 }
-
@@ -45,13 +45,14 @@ if (!request)
     alert("unable to create request object");
 }
 
+var tunnels_seq = 0;
+
 function getTunnels()
 {
-    url = "tunnels-all.html";
+    url = "tunnels-all.html?seq=" + tunnels_seq;
     request.open("GET", url, true);
     request.onreadystatechange = updateAllTunnels;
     request.send(null);
-    setTimeout("getTunnels2()", 50);
 }
 
 function getTunnels2()
@@ -60,25 +61,42 @@ function getTunnels2()
     request.open("GET", url, true);
     request.onreadystatechange = updateActiveTunnels;
     request.send(null);
-    setTimeout("getTunnels()", 2000);
 }
 
 function updateAllTunnels()
 {
-    if (request.readyState == 4 && request.status == 200)
+    if (request.readyState != 4)
     {
-        tunnels_all_select = document.getElementById("tunnels_all_select");
-        if (tunnels_all_select)
-        {
-            tunnels_all_select.innerHTML = request.responseText;
-            reselectTunnel();
-        }
+        return;
+    }
+    if (request.status != 200)
+    {
+        setTimeout("getTunnels()", 2000);
+        return;
     }
+    text = request.responseText;
+    match = /^<!-- seq (\d+) -->\n/.exec(text);
+    if (match)
+    {
+        tunnels_seq = match[1];
+        text = text.substring(match[0].length);
+    }
+    tunnels_all_select = document.getElementById("tunnels_all_select");
+    if (tunnels_all_select)
+    {
+        tunnels_all_select.innerHTML = text;
+        reselectTunnel();
+    }
+    setTimeout("getTunnels2()", 0);
 }
 
 function updateActiveTunnels()
 {
-    if (request.readyState == 4 && request.status == 200)
+    if (request.readyState != 4)
+    {
+        return;
+    }
+    if (request.status == 200)
     {
         tunnels_select = document.getElementById("tunnels_select");
         if (tunnels_select)
@@ -87,6 +105,7 @@ function updateActiveTunnels()
             reselectTunnel();
         }
     }
+    setTimeout("getTunnels()", 0);
 }
 
 function selectActiveTunnel()
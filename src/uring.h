@@ -0,0 +1,49 @@
+/*
+ * uring.h
+ * (C) 2014, all rights reserved,
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __URING_H
+#define __URING_H
+
+/*
+ * Minimal io_uring interface (Linux only, no liburing dependency).
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+typedef struct uring_s *uring_t;
+typedef struct uring_buf_ring_s *uring_buf_ring_t;
+
+/*
+ * Prototypes.
+ */
+uring_t uring_init(unsigned entries);
+void uring_free(uring_t ring);
+struct io_uring_sqe *uring_get_sqe(uring_t ring);
+int uring_submit(uring_t ring, unsigned wait);
+struct io_uring_cqe *uring_peek_cqe(uring_t ring);
+void uring_cqe_seen(uring_t ring);
+uring_buf_ring_t uring_buf_ring_init(uring_t ring, uint16_t group,
+    unsigned entries);
+void uring_buf_ring_add(uring_buf_ring_t buf_ring, void *addr, uint32_t len,
+    uint16_t bid);
+void uring_buf_ring_commit(uring_buf_ring_t buf_ring);
+void uring_buf_ring_free(uring_buf_ring_t buf_ring);
+
+#endif      /* __URING_H */
@@ -20,8 +20,10 @@
 
 #include "capture.h"
 #include "cfg.h"
+#include "config.h"
 #include "log.h"
 #include "socket.h"
+#include "thread.h"
 
 #define UINT8   unsigned char
 #define UINT16  unsigned short
@@ -40,32 +42,94 @@ struct pethhdr_s
     uint16_t proto;             // ETH_P_IP
 } __attribute__((__packed__));
 
+/*
+ * Divert filters, with and without inbound DNS replies.
+ */
+#define CAPTURE_FILTER(inbound)                                              \
+    "ip and "                                                                \
+    "(outbound and (tcp.DstPort == 80 or udp.DstPort == 53) or"              \
+    " inbound and (icmp.Type == 11 and icmp.Code == 0" inbound ")) and "     \
+    "ip.DstAddr != 127.0.0.1"
+static const char *capture_filter = CAPTURE_FILTER("");
+static const char *capture_filter_dns_reply =
+    CAPTURE_FILTER(" or udp.SrcPort == 53");
+
+/*
+ * Prototypes.
+ */
+static HANDLE capture_open(bool dns_replies);
+
 /*
  * Divert device handle.
  */
 HANDLE handle = INVALID_HANDLE_VALUE;
 
 /*
- * Initialises the packet capture device.
+ * Inbound DNS replies are only captured when the DNS cache is enabled.
+ */
+static bool dns_reply_ready = false;
+static bool dns_reply_enabled = false;
+static mutex_t dns_reply_lock;
+
+/*
+ * Initialises the packet capture device.  The configuration is read after
+ * dns_reply_ready is set so that a concurrent change is never missed.
  */
 void init_capture(void)
 {
-    handle = WinDivertOpen(
-        "ip and "
-        "(outbound and (tcp.DstPort == 80 or udp.DstPort == 53) or"
-        " inbound and icmp.Type == 11 and icmp.Code == 0) and "
-        "ip.DstAddr != 127.0.0.1",
+    if (thread_lock_init(&dns_reply_lock) != 0)
+    {
+        error("unable to initialise DNS reply capture lock");
+    }
+    thread_lock(&dns_reply_lock);
+    dns_reply_ready = true;
+    struct config_s config;
+    config_get(&config);
+    dns_reply_enabled = config.dns_cache;
+    handle = capture_open(dns_reply_enabled);
+    thread_unlock(&dns_reply_lock);
+}
+
+/*
+ * Start or stop capturing inbound DNS replies.  A divert filter cannot be
+ * changed, so the handle is replaced.
+ */
+void capture_dns_replies(bool enable)
+{
+    if (!dns_reply_ready)
+    {
+        return;         // init_capture() will read the configuration.
+    }
+    thread_lock(&dns_reply_lock);
+    if (enable != dns_reply_enabled)
+    {
+        HANDLE old_handle = handle;
+        handle = capture_open(enable);
+        WinDivertClose(old_handle);
+        dns_reply_enabled = enable;
+    }
+    thread_unlock(&dns_reply_lock);
+}
+
+/*
+ * Open a divert packet capture handle.
+ */
+static HANDLE capture_open(bool dns_replies)
+{
+    HANDLE new_handle = WinDivertOpen(
+        (dns_replies? capture_filter_dns_reply: capture_filter),
         WINDIVERT_LAYER_NETWORK, -501, 0);
-    if (handle == INVALID_HANDLE_VALUE)
+    if (new_handle == INVALID_HANDLE_VALUE)
     {
         error("unable to open divert packet capture handle");
     }
+    return new_handle;
 }
 
 /*
  * Get a captured packet.
  */
-size_t get_packet(uint8_t *buff, size_t len)
+size_t get_packet(uint8_t *buff, size_t len, bool *inbound)
 {
     UINT offset = sizeof(struct pethhdr_s);
     if (len <= offset)
@@ -74,16 +138,40 @@ size_t get_packet(uint8_t *buff, size_t len)
     }
     UINT read_len;
     WINDIVERT_ADDRESS addr;
-    do
+    while (true)
     {
-        if (!WinDivertRecv(handle, (PVOID)(buff+offset), (UINT)(len-offset),
-            &addr, &read_len))
+        HANDLE recv_handle = handle;
+        if (!WinDivertRecv(recv_handle, (PVOID)(buff+offset),
+            (UINT)(len-offset), &addr, &read_len))
+        {
+            if (recv_handle == handle)
+            {
+                warning("unable to read packet from divert packet capture "
+                    "handle");
+            }
+            continue;       // Else the handle was replaced.
+        }
+        if (addr.Direction != WINDIVERT_DIRECTION_INBOUND)
+        {
+            break;
+        }
+        struct iphdr *ip_header = (struct iphdr *)(buff+offset);
+        if (ip_header->protocol != IPPROTO_UDP)
         {
-            warning("unable to read packet from divert packet capture handle");
-            continue;
+            continue;                                       // Drop icmp.
         }
+
+        // Inbound DNS replies are only observed; pass them on.
+        UINT write_len;
+        if (!WinDivertSend(handle, (PVOID)(buff+offset), read_len, &addr,
+                &write_len))
+        {
+            warning("unable to re-inject inbound packet to divert packet "
+                "capture handle");
+        }
+        break;
     }
-    while (addr.Direction == WINDIVERT_DIRECTION_INBOUND);  // Drop icmp.
+    *inbound = (addr.Direction == WINDIVERT_DIRECTION_INBOUND);
     struct pethhdr_s *peth_header = (struct pethhdr_s *)buff;
     peth_header->direction  = addr.Direction;
     peth_header->if_idx     = addr.IfIdx;
@@ -123,3 +211,13 @@ void inject_packet(uint8_t *buff, size_t len)
     }
 }
 
+/*
+ * Inject a reply packet towards this host.
+ */
+void inject_reply(uint8_t *buff, size_t len)
+{
+    struct pethhdr_s *peth_header = (struct pethhdr_s *)buff;
+    peth_header->direction = WINDIVERT_DIRECTION_INBOUND;
+    inject_packet(buff, len);
+}
+
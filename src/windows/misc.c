@@ -269,6 +269,32 @@ uint64_t gettime(void)
     return lint.QuadPart / 10;
 }
 
+/*
+ * Gets the current monotonic time in microseconds.
+ */
+uint64_t gettime_monotonic(void)
+{
+    static LARGE_INTEGER freq;
+    if (freq.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * SECONDS +
+        (uint64_t)(count.QuadPart % freq.QuadPart) * SECONDS /
+            freq.QuadPart;
+}
+
+/*
+ * Gets a coarse monotonic time in microseconds.  (GetTickCount64() is not
+ * available on XP, and GetTickCount() wraps, so this is not any cheaper.)
+ */
+uint64_t gettime_coarse(void)
+{
+    return gettime_monotonic();
+}
+
 /*
  * Sleep for the given number of microseconds.
  */
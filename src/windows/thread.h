@@ -18,16 +18,24 @@
 #ifndef __THREAD_H
 #define __THREAD_H
 
+#include <stdint.h>
 #include <windows.h>
 
 typedef HANDLE thread_t;
 typedef HANDLE mutex_t;
+typedef HANDLE cond_t;
+
+/*
+ * Bounded thread stack (reserved) size.
+ */
+#define THREAD_STACK_SIZE       (256 * 1024)
 
 static inline int thread_create(thread_t *thread, void *(*start)(void *),
     void *arg)
 {
-    *thread = CreateThread(NULL, 1, (LPTHREAD_START_ROUTINE)start, (LPVOID)arg,
-        0, NULL);
+    *thread = CreateThread(NULL, THREAD_STACK_SIZE,
+        (LPTHREAD_START_ROUTINE)start, (LPVOID)arg,
+        STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
     return (*thread == NULL? -1: 0);
 }
 
@@ -53,4 +61,36 @@ static inline int thread_unlock(mutex_t *lock)
     return (ReleaseMutex(*lock)? 0: -1);
 }
 
+/*
+ * Condition variables are auto-reset events.  A signal with no waiter is
+ * remembered, so (as with pthreads) waiters must re-check their condition.
+ */
+static inline int thread_cond_init(cond_t *cond)
+{
+    *cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return (*cond == NULL? -1: 0);
+}
+
+static inline int thread_cond_timedwait(cond_t *cond, mutex_t *lock,
+    uint64_t us)
+{
+    ReleaseMutex(*lock);
+    DWORD result = WaitForSingleObject(*cond, (DWORD)(us / 1000));
+    WaitForSingleObject(*lock, INFINITE);
+    return (result == WAIT_OBJECT_0? 0: -1);
+}
+
+static inline int thread_cond_wait(cond_t *cond, mutex_t *lock)
+{
+    ReleaseMutex(*lock);
+    DWORD result = WaitForSingleObject(*cond, INFINITE);
+    WaitForSingleObject(*lock, INFINITE);
+    return (result == WAIT_OBJECT_0? 0: -1);
+}
+
+static inline int thread_cond_signal(cond_t *cond)
+{
+    return (SetEvent(*cond)? 0: -1);
+}
+
 #endif          /* __THREAD_H */